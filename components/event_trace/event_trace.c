@@ -0,0 +1,90 @@
+/*
+ * event_trace.c
+ *
+ * Per-core ring buffers for the binary event tracer.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "event_trace.h"
+
+#if CONFIG_EVENT_TRACE_ENABLE
+
+#define TRACE_RECORDS   CONFIG_EVENT_TRACE_BUF_RECORDS
+
+typedef struct {
+    uint32_t head;      /* Total number of records written, wraps */
+    event_trace_record_t records[TRACE_RECORDS];
+} trace_ring_t;
+
+static trace_ring_t s_rings[portNUM_PROCESSORS];
+static volatile bool s_paused;
+
+static const char *const s_event_names[EVENT_TRACE_ID_MAX] = {
+    [EVENT_TRACE_ID_DHT_FETCH] = "dht_fetch",
+    [EVENT_TRACE_ID_MATTER_UPDATE] = "matter_update",
+    [EVENT_TRACE_ID_WORK_QUEUE] = "work_queue",
+    [EVENT_TRACE_ID_MDNS_ACTION] = "mdns_action",
+    [EVENT_TRACE_ID_INSIGHTS_SEND] = "insights_send",
+};
+
+/* In IRAM for ISRs running with the flash cache disabled. esp_timer_get_time() and the atomic
+ * helpers are placed in IRAM by IDF and the rings are in DRAM.
+ */
+void IRAM_ATTR event_trace_record(uint16_t id, uint32_t arg0, uint32_t arg1)
+{
+    if (s_paused) {
+        return;
+    }
+    trace_ring_t *ring = &s_rings[xPortGetCoreID()];
+    /* Only tasks and ISRs of this core write to this ring, reserving the slot
+     * atomically is enough to keep preempting writers apart.
+     */
+    uint32_t idx = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    event_trace_record_t *rec = &ring->records[idx % TRACE_RECORDS];
+    rec->ts = (uint32_t)esp_timer_get_time();
+    rec->id = id;
+    rec->reserved = 0;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+}
+
+void event_trace_dump(void)
+{
+    int i;
+    uint32_t n;
+    s_paused = true;
+    printf("ETR:V1 %d %d\n", portNUM_PROCESSORS, TRACE_RECORDS);
+    for (i = 1; i < EVENT_TRACE_ID_MAX; i++) {
+        printf("ETR:N %d %s\n", i, s_event_names[i]);
+    }
+    for (i = 0; i < portNUM_PROCESSORS; i++) {
+        trace_ring_t *ring = &s_rings[i];
+        uint32_t head = ring->head;
+        uint32_t count = head < TRACE_RECORDS ? head : TRACE_RECORDS;
+        for (n = head - count; n != head; n++) {
+            const event_trace_record_t *rec = &ring->records[n % TRACE_RECORDS];
+            /* One record per line: core, ts, id, arg0, arg1 in hex */
+            printf("ETR:R %d %08" PRIx32 " %04x %08" PRIx32 " %08" PRIx32 "\n",
+                   i, rec->ts, rec->id, rec->arg0, rec->arg1);
+        }
+    }
+    printf("ETR:E\n");
+    s_paused = false;
+}
+
+void event_trace_clear(void)
+{
+    s_paused = true;
+    memset(s_rings, 0, sizeof(s_rings));
+    s_paused = false;
+}
+
+#endif /* CONFIG_EVENT_TRACE_ENABLE */
@@ -0,0 +1,93 @@
+/*
+ * event_trace.h
+ *
+ * Lightweight binary event tracer.
+ *
+ * Every trace point writes one fixed size record (timestamp, event id, two arguments) into the
+ * ring buffer of the current core. Records are dumped on the console with event_trace_dump() and
+ * converted to Chrome trace JSON on the host with tools/event_trace_decode.py.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <esp_err.h>
+#include <sdkconfig.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Trace event ids, keep in sync with the names in event_trace.c
+ */
+typedef enum {
+    EVENT_TRACE_ID_DHT_FETCH = 1,       /*!< DHT22 bit capture, arg0: result */
+    EVENT_TRACE_ID_MATTER_UPDATE,       /*!< Matter attribute update, arg0: temperature, arg1: humidity */
+    EVENT_TRACE_ID_WORK_QUEUE,          /*!< RainMaker work queue item, arg0: work function */
+    EVENT_TRACE_ID_MDNS_ACTION,         /*!< mDNS action, arg0: action type */
+    EVENT_TRACE_ID_INSIGHTS_SEND,       /*!< Insights data send, arg0: length, arg1: message id */
+    EVENT_TRACE_ID_MAX,
+} event_trace_id_t;
+
+/**
+ * Phase of the event, stored in the upper bits of the record id
+ */
+#define EVENT_TRACE_PHASE_BEGIN     0x4000
+#define EVENT_TRACE_PHASE_END       0x8000
+#define EVENT_TRACE_PHASE_INSTANT   0xC000
+#define EVENT_TRACE_PHASE_MASK      0xC000
+
+/**
+ * Binary trace record
+ */
+typedef struct {
+    uint32_t ts;        /*!< Lower 32 bits of esp_timer_get_time() */
+    uint16_t id;        /*!< Event id ORed with the phase */
+    uint16_t reserved;
+    uint32_t arg0;
+    uint32_t arg1;
+} event_trace_record_t;
+
+#if CONFIG_EVENT_TRACE_ENABLE
+
+/**
+ * @brief Record an event into the ring buffer of the current core
+ *
+ * Lock free and safe to call from tasks and ISRs, also while the flash cache is disabled.
+ *
+ * @param[in] id   Event id ORed with the phase
+ * @param[in] arg0 First argument
+ * @param[in] arg1 Second argument
+ */
+void event_trace_record(uint16_t id, uint32_t arg0, uint32_t arg1);
+
+/**
+ * @brief Dump the recorded events on the console
+ *
+ * Recording is paused during the dump. Lines are prefixed with "ETR:" so that the host decoder
+ * can pick them out of the console log.
+ */
+void event_trace_dump(void);
+
+/**
+ * @brief Discard all the recorded events
+ */
+void event_trace_clear(void);
+
+#define EVENT_TRACE_BEGIN(id, a0, a1)   event_trace_record((id) | EVENT_TRACE_PHASE_BEGIN, (uint32_t)(a0), (uint32_t)(a1))
+#define EVENT_TRACE_END(id, a0, a1)     event_trace_record((id) | EVENT_TRACE_PHASE_END, (uint32_t)(a0), (uint32_t)(a1))
+#define EVENT_TRACE_INSTANT(id, a0, a1) event_trace_record((id) | EVENT_TRACE_PHASE_INSTANT, (uint32_t)(a0), (uint32_t)(a1))
+
+#else
+
+/* Components with trace points include this header unconditionally, they rely on these no-ops */
+#define EVENT_TRACE_BEGIN(id, a0, a1)
+#define EVENT_TRACE_END(id, a0, a1)
+#define EVENT_TRACE_INSTANT(id, a0, a1)
+
+#endif /* CONFIG_EVENT_TRACE_ENABLE */
+
+#ifdef __cplusplus
+}
+#endif
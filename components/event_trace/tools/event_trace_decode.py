@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""
+Convert the console output of event_trace_dump() to Chrome trace JSON.
+
+Usage:
+    event_trace_decode.py console.log > trace.json
+
+Open the output in chrome://tracing or https://ui.perfetto.dev.
+Each core is shown as a process and each event id as a thread, so that
+preempted begin/end pairs of different events never have to nest.
+"""
+
+import argparse
+import json
+import sys
+
+PHASE_BEGIN = 0x4000
+PHASE_END = 0x8000
+PHASE_INSTANT = 0xC000
+PHASE_MASK = 0xC000
+
+
+def parse(lines):
+    names = {}
+    records = []
+    for line in lines:
+        pos = line.find('ETR:')
+        if pos < 0:
+            continue
+        fields = line[pos + 4:].split()
+        if not fields:
+            continue
+        if fields[0] == 'V1':
+            # New dump, drop anything decoded from an earlier one
+            names = {}
+            records = []
+        elif fields[0] == 'N' and len(fields) == 3:
+            names[int(fields[1])] = fields[2]
+        elif fields[0] == 'R' and len(fields) == 6:
+            core = int(fields[1])
+            ts, eid, arg0, arg1 = (int(f, 16) for f in fields[2:])
+            records.append((core, ts, eid, arg0, arg1))
+    return names, records
+
+
+def unwrap(records):
+    """Timestamps are 32 bit microseconds, unwrap them per core"""
+    last = {}
+    high = {}
+    for core, ts, eid, arg0, arg1 in records:
+        if core in last and ts < last[core]:
+            high[core] = high.get(core, 0) + (1 << 32)
+        last[core] = ts
+        yield core, ts + high.get(core, 0), eid, arg0, arg1
+
+
+def to_chrome(names, records):
+    events = []
+    for core, ts, eid, arg0, arg1 in unwrap(records):
+        phase = eid & PHASE_MASK
+        event_id = eid & ~PHASE_MASK
+        name = names.get(event_id, 'event_%d' % event_id)
+        ev = {
+            'name': name,
+            'pid': core,
+            'tid': event_id,
+            'ts': ts,
+            'args': {'arg0': '0x%08x' % arg0, 'arg1': '0x%08x' % arg1},
+        }
+        if phase == PHASE_BEGIN:
+            ev['ph'] = 'B'
+        elif phase == PHASE_END:
+            ev['ph'] = 'E'
+        else:
+            ev['ph'] = 'i'
+            ev['s'] = 't'
+        events.append(ev)
+    for event_id, name in names.items():
+        for core in {r[0] for r in records}:
+            events.append({'name': 'thread_name', 'ph': 'M', 'pid': core, 'tid': event_id,
+                           'args': {'name': name}})
+    return {'traceEvents': events, 'displayTimeUnit': 'ms'}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('log', nargs='?', type=argparse.FileType('r'), default=sys.stdin,
+                        help='console log containing the event_trace_dump() output')
+    parser.add_argument('-o', '--output', type=argparse.FileType('w'), default=sys.stdout)
+    args = parser.parse_args()
+
+    names, records = parse(args.log)
+    if not records:
+        sys.exit('No trace records found')
+    json.dump(to_chrome(names, records), args.output, indent=1)
+
+
+if __name__ == '__main__':
+    main()
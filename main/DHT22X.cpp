@@ -4,18 +4,21 @@
 #define LOG_LOCAL_LEVEL ESP_LOG_VERBOSE
 
 #include <stdio.h>
+#include <string.h>
 #include "esp_log.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
+#include "esp_diagnostics_metrics.h"
 
 #include "DHT22X.h"
+#include "dht22_frame.h"
+#include "event_trace.h"
 
 // DHT timer precision in microseconds
 #define DHT_TIMER_INTERVAL 2
-#define DHT_DATA_BITS 40
-#define DHT_DATA_BYTES (DHT_DATA_BITS / 8)
 
 // == global defines =============================================
 
@@ -28,6 +31,158 @@ static portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
 #define PORT_ENTER_CRITICAL() portENTER_CRITICAL(&mux)
 #define PORT_EXIT_CRITICAL() portEXIT_CRITICAL(&mux)
 
+// == sensor metrics =============================================
+
+#define DHT_METRICS_TAG "dht"
+#define DHT_METRICS_PATH "Sensor.DHT22"
+#define DHT_METRICS_FLUSH_INTERVAL_US (CONFIG_ESP_INSIGHTS_CLOUD_POST_MIN_INTERVAL_SEC * 1000000LL)
+
+/* Metric keys, timeouts are split by the protocol phase they happened in */
+static const char *const dht_timeout_keys[DHT_PHASE_MAX] = {
+    "dht_to_start",
+    "dht_to_resp",
+    "dht_to_bit_low",
+    "dht_to_bit_high",
+};
+
+/* Counters aggregated between two flushes */
+static struct
+{
+    uint32_t reads;
+    uint32_t timeouts[DHT_PHASE_MAX];
+    uint32_t crc_errors;
+    uint32_t retries;
+    uint32_t duration_max_us;
+    uint64_t duration_sum_us;
+    int64_t last_flush_us;
+    bool registered;
+} dht_metrics;
+
+#if CONFIG_DIAG_ENABLE_METRICS
+/* Handles of the registered metrics, not reset on flush like the counters above */
+static struct
+{
+    esp_diag_metrics_handle_t reads;
+    esp_diag_metrics_handle_t timeouts[DHT_PHASE_MAX];
+    esp_diag_metrics_handle_t crc_errors;
+    esp_diag_metrics_handle_t retries;
+    esp_diag_metrics_handle_t read_avg_us;
+    esp_diag_metrics_handle_t read_max_us;
+} dht_metrics_handles;
+
+static void dht_metrics_unregister()
+{
+    esp_diag_metrics_unregister("dht_reads");
+    for (int i = 0; i < DHT_PHASE_MAX; i++)
+    {
+        esp_diag_metrics_unregister(dht_timeout_keys[i]);
+    }
+    esp_diag_metrics_unregister("dht_crc_err");
+    esp_diag_metrics_unregister("dht_retries");
+    esp_diag_metrics_unregister("dht_read_avg_us");
+    esp_diag_metrics_unregister("dht_read_max_us");
+}
+
+static void dht_metrics_register()
+{
+    esp_err_t err = esp_diag_metrics_register_h(DHT_METRICS_TAG, "dht_reads", "Reads attempted", DHT_METRICS_PATH, ESP_DIAG_DATA_TYPE_UINT, &dht_metrics_handles.reads);
+    if (err == ESP_ERR_INVALID_STATE)
+    {
+        // Metrics are not initialized yet, keep aggregating and try again on the next flush
+        return;
+    }
+    for (int i = 0; i < DHT_PHASE_MAX && err == ESP_OK; i++)
+    {
+        err = esp_diag_metrics_register_h(DHT_METRICS_TAG, dht_timeout_keys[i], "Timeouts", DHT_METRICS_PATH, ESP_DIAG_DATA_TYPE_UINT, &dht_metrics_handles.timeouts[i]);
+    }
+    if (err == ESP_OK)
+    {
+        err = esp_diag_metrics_register_h(DHT_METRICS_TAG, "dht_crc_err", "Checksum failures", DHT_METRICS_PATH, ESP_DIAG_DATA_TYPE_UINT, &dht_metrics_handles.crc_errors);
+    }
+    if (err == ESP_OK)
+    {
+        err = esp_diag_metrics_register_h(DHT_METRICS_TAG, "dht_retries", "Read retries", DHT_METRICS_PATH, ESP_DIAG_DATA_TYPE_UINT, &dht_metrics_handles.retries);
+    }
+    if (err == ESP_OK)
+    {
+        err = esp_diag_metrics_register_h(DHT_METRICS_TAG, "dht_read_avg_us", "Average read duration (us)", DHT_METRICS_PATH, ESP_DIAG_DATA_TYPE_UINT, &dht_metrics_handles.read_avg_us);
+    }
+    if (err == ESP_OK)
+    {
+        err = esp_diag_metrics_register_h(DHT_METRICS_TAG, "dht_read_max_us", "Maximum read duration (us)", DHT_METRICS_PATH, ESP_DIAG_DATA_TYPE_UINT, &dht_metrics_handles.read_max_us);
+    }
+    if (err != ESP_OK)
+    {
+        // Drop the ones that made it so that all of them are registered again on the next flush
+        ESP_LOGW(TAG, "Failed to register DHT metrics: %s", esp_err_to_name(err));
+        dht_metrics_unregister();
+        return;
+    }
+    dht_metrics.registered = true;
+}
+#endif /* CONFIG_DIAG_ENABLE_METRICS */
+
+void dht_metrics_record_retry()
+{
+    dht_metrics.retries++;
+}
+
+esp_err_t dht_metrics_flush()
+{
+#if CONFIG_DIAG_ENABLE_METRICS
+    if (!dht_metrics.registered)
+    {
+        dht_metrics_register();
+        if (!dht_metrics.registered)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+    }
+    if (dht_metrics.reads == 0)
+    {
+        dht_metrics.last_flush_us = esp_timer_get_time();
+        return ESP_OK;
+    }
+
+    esp_err_t err = esp_diag_metrics_add_uint_h(dht_metrics_handles.reads, dht_metrics.reads);
+    if (err == ESP_ERR_NOT_FOUND || err == ESP_ERR_INVALID_STATE)
+    {
+        // Metrics were re-initialized, register again on the next flush
+        dht_metrics.registered = false;
+        return err;
+    }
+    for (int i = 0; i < DHT_PHASE_MAX; i++)
+    {
+        esp_diag_metrics_add_uint_h(dht_metrics_handles.timeouts[i], dht_metrics.timeouts[i]);
+    }
+    esp_diag_metrics_add_uint_h(dht_metrics_handles.crc_errors, dht_metrics.crc_errors);
+    esp_diag_metrics_add_uint_h(dht_metrics_handles.retries, dht_metrics.retries);
+    esp_diag_metrics_add_uint_h(dht_metrics_handles.read_avg_us, (uint32_t)(dht_metrics.duration_sum_us / dht_metrics.reads));
+    esp_diag_metrics_add_uint_h(dht_metrics_handles.read_max_us, dht_metrics.duration_max_us);
+
+    bool registered = dht_metrics.registered;
+    memset(&dht_metrics, 0, sizeof(dht_metrics));
+    dht_metrics.registered = registered;
+    dht_metrics.last_flush_us = esp_timer_get_time();
+    return ESP_OK;
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif /* CONFIG_DIAG_ENABLE_METRICS */
+}
+
+void dht_metrics_flush_if_due()
+{
+    int64_t now = esp_timer_get_time();
+    if (now - dht_metrics.last_flush_us >= DHT_METRICS_FLUSH_INTERVAL_US)
+    {
+        if (dht_metrics_flush() != ESP_OK)
+        {
+            // Nowhere to report to, retry on the next interval
+            dht_metrics.last_flush_us = now;
+        }
+    }
+}
+
 // == get temp & hum =============================================
 
 /**
@@ -49,7 +204,8 @@ float getTemperature()
 // == error handler ===============================================
 
 /**
- * Error handler
+ * Error handler, failures are counted in the read metrics and only logged at debug level
+ * so the diagnostics log hook does not store a record for each of them
  * @param response
  */
 void errorHandler(int response)
@@ -57,19 +213,19 @@ void errorHandler(int response)
     switch (response)
     {
 
-    case DHT_TIMEOUT_ERROR:
-        printf("Sensor Timeout\n");
+    case ESP_ERR_TIMEOUT:
+        ESP_LOGD(TAG, "Sensor Timeout");
         break;
 
-    case DHT_CHECKSUM_ERROR:
-        printf("CheckSum error\n");
+    case ESP_ERR_INVALID_CRC:
+        ESP_LOGD(TAG, "CheckSum error");
         break;
 
-    case DHT_OK:
+    case ESP_OK:
         break;
 
     default:
-        printf("Unknown error\n");
+        ESP_LOGD(TAG, "Unknown error %d", response);
     }
 }
 
@@ -95,23 +251,6 @@ int getSignalLevel(int usTimeOut, bool state)
 }
 
 ///////////////////////////////////////////////
-/**
- * Pack two data bytes into single value and take into account sign bit.
- */
-
-static inline int16_t dht_convert_data(uint8_t msb, uint8_t lsb)
-{
-    int16_t data;
-    data = msb & 0x7F;
-    data <<= 8;
-    data |= lsb;
-
-    if (msb & BIT(7))
-        data = -data; // convert it to negative
-
-    return data;
-}
-
 /**
  * Wait specified time for pin to go to a specified state.
  * If timeout is reached and pin doesn't go to a requested state
@@ -142,7 +281,11 @@ static esp_err_t dht_await_pin_state(uint32_t timeout, int expected_pin_state, u
     return ESP_ERR_TIMEOUT;
 }
 
-static inline esp_err_t dht_fetch_data(uint8_t data[DHT_DATA_BYTES])
+/**
+ * Fetch the 40 data bits. On timeout, the protocol phase in which the sensor
+ * stopped responding is returned in 'phase'.
+ */
+static inline esp_err_t dht_fetch_data(uint8_t data[DHT_DATA_BYTES], dht_phase_t *phase)
 {
     int uSec = 0;
     uint8_t byteInx = 0;
@@ -161,23 +304,27 @@ static inline esp_err_t dht_fetch_data(uint8_t data[DHT_DATA_BYTES])
     gpio_set_direction(DHT_GPIO, GPIO_MODE_INPUT);
 
     // Step through Phase 'B', 40us
+    *phase = DHT_PHASE_START;
     uSec = getSignalLevel(85, 0);
     if (uSec < 0)
-        return ESP_FAIL;
+        return ESP_ERR_TIMEOUT;
 
+    *phase = DHT_PHASE_RESPONSE;
     uSec = getSignalLevel(85, 1);
     if (uSec < 0)
-        return ESP_FAIL;
+        return ESP_ERR_TIMEOUT;
 
     for (int k = 0; k < DHT_DATA_BITS; k++)
     {
+        *phase = DHT_PHASE_BIT_LOW;
         uSec = getSignalLevel(56, 0);
         if (uSec < 0)
-            return ESP_FAIL;
+            return ESP_ERR_TIMEOUT;
 
+        *phase = DHT_PHASE_BIT_HIGH;
         uSec = getSignalLevel(75, 1);
         if (uSec < 0)
-            return ESP_FAIL;
+            return ESP_ERR_TIMEOUT;
 
         if (uSec > 40)
         {
@@ -193,20 +340,24 @@ static inline esp_err_t dht_fetch_data(uint8_t data[DHT_DATA_BYTES])
             bitInx--;
     }
 
-    if (data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF))
+    if (dht_checksum_ok(data))
         return ESP_OK;
     else
-        return ESP_FAIL;
+        return ESP_ERR_INVALID_CRC;
 }
 
 esp_err_t dht_read_data()
 {
     uint8_t data[DHT_DATA_BYTES] = {0};
+    dht_phase_t phase = DHT_PHASE_START;
+    int64_t start_us = esp_timer_get_time();
 
     gpio_set_direction(DHT_GPIO, GPIO_MODE_OUTPUT_OD);
     gpio_set_level(DHT_GPIO, 1);
 
-    esp_err_t result = dht_fetch_data(data);
+    EVENT_TRACE_BEGIN(EVENT_TRACE_ID_DHT_FETCH, 0, 0);
+    esp_err_t result = dht_fetch_data(data, &phase);
+    EVENT_TRACE_END(EVENT_TRACE_ID_DHT_FETCH, result, phase);
 
     if (result == ESP_OK)
     {
@@ -219,21 +370,29 @@ esp_err_t dht_read_data()
 
     gpio_set_level(DHT_GPIO, 1);
 
-    if (result != ESP_OK)
+    uint32_t duration_us = (uint32_t)(esp_timer_get_time() - start_us);
+    dht_metrics.reads++;
+    dht_metrics.duration_sum_us += duration_us;
+    if (duration_us > dht_metrics.duration_max_us)
     {
-        printf("==== dht_read_data - ESP_NOT_OK ====\n");
-        return result;
+        dht_metrics.duration_max_us = duration_us;
     }
 
-    if (data[4] != ((data[0] + data[1] + data[2] + data[3]) & 0xFF))
+    if (result == ESP_ERR_TIMEOUT)
     {
-        ESP_LOGE(TAG, "Checksum failed, invalid data received from sensor");
+        dht_metrics.timeouts[phase]++;
+        ESP_LOGD(TAG, "Sensor timeout in phase %d", phase);
+        return result;
+    }
 
-        return ESP_ERR_INVALID_CRC;
+    if (result == ESP_ERR_INVALID_CRC)
+    {
+        dht_metrics.crc_errors++;
+        ESP_LOGD(TAG, "Checksum failed, invalid data received from sensor");
+        return result;
     }
 
-    humidity = dht_convert_data(data[0], data[1]) / 10;
-    temperature = dht_convert_data(data[2], data[3]) / 10;
+    dht_decode_frame(data, &humidity, &temperature);
 
     ESP_LOGI(TAG, "Sensor data: humidity=%f, temp=%f", humidity, temperature);
 
@@ -12,22 +12,49 @@
 
 #define DHT_GPIO GPIO_NUM_3 // GPIO pin connected to the DHT22
 
-#define DHT_OK 0
-#define DHT_CHECKSUM_ERROR -1
-#define DHT_TIMEOUT_ERROR -2
+/**
+ * Protocol phase of a read, used to classify timeouts
+ */
+typedef enum
+{
+    DHT_PHASE_START = 0, // Sensor pulling the line low after the start signal
+    DHT_PHASE_RESPONSE,  // Sensor releasing the line before the first bit
+    DHT_PHASE_BIT_LOW,   // Low period preceding each data bit
+    DHT_PHASE_BIT_HIGH,  // High period encoding each data bit
+    DHT_PHASE_MAX,
+} dht_phase_t;
 
 /**
  * Starts DHT22 sensor task
- * @return DHT_OK if successful, otherwise error code
  */
 void DHT22_task_start(void);
 
 /**
- * Stops DHT22 sensor task
- * @return DHT_OK if successful, otherwise error code
+ * Logs a failed read
+ * @param response Error code returned by dht_read_data()
  */
 void errorHandler(int response);
 
+/**
+ * Counts a read that is retried after a failure
+ */
+void dht_metrics_record_retry();
+
+/**
+ * @brief Report the sensor metrics aggregated since the last flush
+ *
+ * Metrics are registered on the first flush after diagnostics metrics are initialized,
+ * until then the counters keep aggregating.
+ *
+ * @return `ESP_OK` on success
+ */
+esp_err_t dht_metrics_flush();
+
+/**
+ * Flush the sensor metrics once per Insights reporting interval
+ */
+void dht_metrics_flush_if_due();
+
 /**
  * Get the humidity
  * @return humidity
@@ -58,7 +85,8 @@ int getSignalLevel(int usTimeOut, bool state);
  * @param pin GPIO pin connected to sensor OUT
  * @param[out] humidity Humidity, percents * 10, nullable
  * @param[out] temperature Temperature, degrees Celsius * 10, nullable
- * @return `ESP_OK` on success
+ * @return `ESP_OK` on success, `ESP_ERR_TIMEOUT` if the sensor did not respond,
+ *         `ESP_ERR_INVALID_CRC` on checksum mismatch
  */
 esp_err_t dht_read_data();
 
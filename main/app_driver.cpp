@@ -22,6 +22,9 @@
 
 #include <esp_matter.h>
 #include <DHT22X.h>
+#include <dht22_driver.h>
+#include <sensor_pipeline.h>
+#include <event_trace.h>
 
 /* Constants -----------------------------------------------------------------*/
 using namespace chip::app::Clusters;
@@ -34,22 +37,71 @@ extern uint16_t temperature_sensor_endpoint_id;
 extern uint16_t humidity_sensor_endpoint_id;
 
 /**
- * Update Matter values with temperature and humidity
+ * Convert readings to the 0.01 units of the measurement clusters, scaled before rounding to keep
+ * the 0.1 resolution of the sensor
  */
-void updateMatterWithValues()
+static int16_t toMatterTemperature(float celsius)
+{
+    return (int16_t)std::lround(celsius * 100);
+}
+
+static uint16_t toMatterHumidity(float percent)
 {
+    long value = std::lround(percent * 100);
+    return (uint16_t)(value < 0 ? 0 : (value > 10000 ? 10000 : value));
+}
+
+/**
+ * Update Matter attributes, values are in 0.01 units as defined by the measurement clusters
+ */
+static void updateMatter(int16_t temperature, uint16_t humidity)
+{
+    EVENT_TRACE_BEGIN(EVENT_TRACE_ID_MATTER_UPDATE, 0, 0);
+
     // Update temperature values
     esp_matter_attr_val_t temperature_value;
     temperature_value = esp_matter_invalid(NULL);
     temperature_value.type = esp_matter_val_type_t::ESP_MATTER_VAL_TYPE_INT16;
-    temperature_value.val.i16 = app_driver_read_temperature(temperature_sensor_endpoint_id);
+    temperature_value.val.i16 = temperature;
     esp_matter::attribute::update(temperature_sensor_endpoint_id, TemperatureMeasurement::Id, TemperatureMeasurement::Attributes::MeasuredValue::Id, &temperature_value);
 
     // Update humidity values
     esp_matter_attr_val_t humidity_value;
     humidity_value = esp_matter_invalid(NULL);
     humidity_value.type = esp_matter_val_type_t::ESP_MATTER_VAL_TYPE_UINT16;
-    humidity_value.val.u16 = app_driver_read_humidity(humidity_sensor_endpoint_id);
+    humidity_value.val.u16 = humidity;
+    esp_matter::attribute::update(humidity_sensor_endpoint_id, RelativeHumidityMeasurement::Id, RelativeHumidityMeasurement::Attributes::MeasuredValue::Id, &humidity_value);
+
+    EVENT_TRACE_END(EVENT_TRACE_ID_MATTER_UPDATE, temperature_value.val.i16, humidity_value.val.u16);
+}
+
+/**
+ * Update Matter values with temperature and humidity
+ */
+void updateMatterWithValues()
+{
+    updateMatter(app_driver_read_temperature(temperature_sensor_endpoint_id),
+                 app_driver_read_humidity(humidity_sensor_endpoint_id));
+}
+
+/**
+ * Publish a reading of the sensor pipeline
+ */
+static void updateMatterWithReading(const Dht22Driver::reading_t &reading)
+{
+    updateMatter(toMatterTemperature(reading.values[Dht22Driver::TEMPERATURE]),
+                 toMatterHumidity(reading.values[Dht22Driver::HUMIDITY]));
+}
+
+/**
+ * Mark temperature and humidity as unknown, readings are older than the staleness budget
+ */
+static void updateMatterWithStaleValues()
+{
+    esp_matter_attr_val_t temperature_value = esp_matter_nullable_int16(nullable<int16_t>());
+    esp_matter::attribute::update(temperature_sensor_endpoint_id, TemperatureMeasurement::Id, TemperatureMeasurement::Attributes::MeasuredValue::Id, &temperature_value);
+
+    esp_matter_attr_val_t humidity_value = esp_matter_nullable_uint16(nullable<uint16_t>());
     esp_matter::attribute::update(humidity_sensor_endpoint_id, RelativeHumidityMeasurement::Id, RelativeHumidityMeasurement::Attributes::MeasuredValue::Id, &humidity_value);
 }
 
@@ -66,12 +118,12 @@ static void app_driver_button_toggle_cb(void *arg, void *data)
 
 int16_t app_driver_read_temperature(uint16_t endpoint_id)
 {
-    return (u_int16_t)getTemperature() * 100;
+    return toMatterTemperature(getTemperature());
 }
 
 uint16_t app_driver_read_humidity(uint16_t endpoint_id)
 {
-    return (u_int16_t)getHumidity() * 100;
+    return toMatterHumidity(getHumidity());
 }
 
 // Example callback for temperature attribute change
@@ -124,15 +176,20 @@ static void DHT22_task(void *pvParameter)
     // setDHTgpio(DHT_GPIO);
     ESP_LOGI(TAG, "Starting DHT task\n\n");
 
+    static Dht22Driver driver;
+    static const SensorPolicy policy = {
+        .max_attempts = SENSOR_READ_MAX_ATTEMPTS,
+        .retry_jitter = SENSOR_RETRY_JITTER,
+        .staleness_budget = SENSOR_STALENESS_BUDGET,
+    };
+    SensorPipeline<Dht22Driver> pipeline(driver, policy, updateMatterWithReading, updateMatterWithStaleValues);
+
     for (;;)
     {
         ESP_LOGI(TAG, "=== Reading DHT ===\n");
-        int ret = dht_read_float_data();
-
-        errorHandler(ret);
+        pipeline.sample();
 
-        // Update Matter values
-        updateMatterWithValues();
+        dht_metrics_flush_if_due();
 
         // Wait at least 30 seconds before reading again
         // The interval of the whole process must be more than 30 seconds
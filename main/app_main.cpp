@@ -4,6 +4,8 @@
 
 /* Includes */
 #include <esp_err.h>
+#include <string.h>
+#include <algorithm>
 #include <esp_log.h>
 #include <nvs_flash.h>
 
@@ -37,6 +39,10 @@
 #include <app/server/CommissioningWindowManager.h>
 #include <app/server/Server.h>
 
+#include <esp_diagnostics.h>
+#include <esp_diagnostics_system_metrics.h>
+#include <event_trace.h>
+
 /* Constants */
 static const char *TAG = "app_main";
 uint16_t temperature_sensor_endpoint_id = 0;
@@ -157,6 +163,80 @@ static esp_err_t app_attribute_update_cb(attribute::callback_type_t type, uint16
     return err;
 }
 
+#if CONFIG_ENABLE_CHIP_SHELL && CONFIG_DIAG_ENABLE_STACK_METRICS
+static esp_err_t stack_report_handler(int argc, char **argv)
+{
+    esp_diag_stack_metrics_dump();
+    return esp_diag_stack_metrics_report();
+}
+
+static void stack_register_commands()
+{
+    static const esp_matter::console::command_t command = {
+        .name = "stack",
+        .description = "Print task stack usage and recommended stack sizes",
+        .handler = stack_report_handler,
+    };
+    esp_matter::console::add_commands(&command, 1);
+}
+#endif
+
+#if CONFIG_ENABLE_CHIP_SHELL && CONFIG_DIAG_ENABLE_CPU_METRICS
+static esp_err_t cpu_report_handler(int argc, char **argv)
+{
+    /* Shows the last completed window, closing the window here would also export it */
+    uint32_t task_count = uxTaskGetNumberOfTasks();
+    esp_diag_task_info_t *tasks = (esp_diag_task_info_t *)calloc(task_count, sizeof(esp_diag_task_info_t));
+    if (!tasks)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    uint32_t count = esp_diag_task_snapshot_get(tasks, task_count);
+    std::sort(tasks, tasks + count, [](const esp_diag_task_info_t &a, const esp_diag_task_info_t &b) {
+        return a.cpu_percent > b.cpu_percent;
+    });
+    for (uint32_t i = 0; i < count && tasks[i].cpu_percent >= 0; i++)
+    {
+        ESP_LOGI(TAG, "%-16s cpu:%5.1f%%", tasks[i].name, tasks[i].cpu_percent);
+    }
+    free(tasks);
+    return ESP_OK;
+}
+
+static void cpu_register_commands()
+{
+    static const esp_matter::console::command_t command = {
+        .name = "cpu",
+        .description = "Print the CPU usage of tasks in the last CPU metrics window",
+        .handler = cpu_report_handler,
+    };
+    esp_matter::console::add_commands(&command, 1);
+}
+#endif
+
+#if CONFIG_ENABLE_CHIP_SHELL && CONFIG_EVENT_TRACE_ENABLE
+static esp_err_t trace_handler(int argc, char **argv)
+{
+    if (argc == 1 && strcmp(argv[0], "clear") == 0)
+    {
+        event_trace_clear();
+        return ESP_OK;
+    }
+    event_trace_dump();
+    return ESP_OK;
+}
+
+static void trace_register_commands()
+{
+    static const esp_matter::console::command_t command = {
+        .name = "trace",
+        .description = "Dump the event trace buffers. Usage: matter esp trace [clear]",
+        .handler = trace_handler,
+    };
+    esp_matter::console::add_commands(&command, 1);
+}
+#endif
+
 /**
  * Main function that initializes Matter
  */
@@ -167,6 +247,14 @@ extern "C" void app_main()
     /* Initialize the ESP NVS layer */
     nvs_flash_init();
 
+#if CONFIG_DIAG_ENABLE_STACK_METRICS
+    /* Track stack usage from the start, lifetime minima are retained across soft resets */
+    esp_diag_stack_metrics_init();
+#endif
+#if CONFIG_DIAG_ENABLE_CPU_METRICS
+    esp_diag_cpu_metrics_init();
+#endif
+
     /* Initialize driver */
     app_driver_handle_t temperature_sensor_handle = app_driver_DHT_sensor_init();
     // app_driver_handle_t humidity_sensor_handle = app_driver_DHT_sensor_init();
@@ -248,6 +336,15 @@ extern "C" void app_main()
 #if CONFIG_ENABLE_CHIP_SHELL
     esp_matter::console::diagnostics_register_commands();
     esp_matter::console::wifi_register_commands();
+#if CONFIG_DIAG_ENABLE_STACK_METRICS
+    stack_register_commands();
+#endif
+#if CONFIG_DIAG_ENABLE_CPU_METRICS
+    cpu_register_commands();
+#endif
+#if CONFIG_EVENT_TRACE_ENABLE
+    trace_register_commands();
+#endif
     esp_matter::console::init();
 #endif
 }
@@ -18,6 +18,12 @@
 
 #define DEFAULT_MEASURE_INTERVAL 20000
 
+// Retry policy for failed reads, all times in milliseconds.
+// Backoff starts at the minimum read interval of the sensor, see Dht22Traits.
+#define SENSOR_READ_MAX_ATTEMPTS 3      // Attempts per measurement, including the first one
+#define SENSOR_RETRY_JITTER 500         // Random extra delay added to each backoff
+#define SENSOR_STALENESS_BUDGET 60000   // Published value is marked stale when older than this
+
 typedef void *app_driver_handle_t;
 
 /** Initialize the temperature and humidity drivers
@@ -0,0 +1,38 @@
+/*
+ * dht22_driver.h
+ *
+ * DHT22 implementation of the SensorDriver interface.
+ */
+
+#pragma once
+
+#include "sensor_driver.h"
+#include "dht22_frame.h"
+#include "DHT22X.h"
+
+class Dht22Driver : public SensorDriver<Dht22Driver, Dht22Traits>
+{
+public:
+    static constexpr size_t TEMPERATURE = Dht22Traits::TEMPERATURE;
+    static constexpr size_t HUMIDITY = Dht22Traits::HUMIDITY;
+
+private:
+    friend class SensorDriver<Dht22Driver, Dht22Traits>;
+
+    esp_err_t read_impl(reading_t &reading)
+    {
+        esp_err_t ret = dht_read_float_data();
+        errorHandler(ret);
+        if (ret == ESP_OK)
+        {
+            reading.values[TEMPERATURE] = getTemperature();
+            reading.values[HUMIDITY] = getHumidity();
+        }
+        return ret;
+    }
+
+    void on_retry_impl()
+    {
+        dht_metrics_record_retry();
+    }
+};
@@ -0,0 +1,60 @@
+/*
+ * dht22_frame.h
+ *
+ * DHT22 traits and decoding of the 40 bit frame. Free of driver dependencies
+ * so that host tests can feed raw frames through the same conversion.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sensor_driver.h"
+
+#define DHT_DATA_BITS 40
+#define DHT_DATA_BYTES (DHT_DATA_BITS / 8)
+
+struct Dht22Traits
+{
+    static constexpr size_t channels = 2;
+    static constexpr std::array<SensorUnit, channels> units = {SensorUnit::Celsius, SensorUnit::RelativeHumidity};
+    static constexpr uint32_t min_interval_ms = 2000;
+    static constexpr std::array<float, channels> resolution = {0.1f, 0.1f};
+
+    // Channel indices of a reading
+    static constexpr size_t TEMPERATURE = 0;
+    static constexpr size_t HUMIDITY = 1;
+};
+
+/**
+ * Pack two data bytes into single value and take into account sign bit.
+ */
+static inline int16_t dht_convert_data(uint8_t msb, uint8_t lsb)
+{
+    int16_t data;
+    data = msb & 0x7F;
+    data <<= 8;
+    data |= lsb;
+
+    if (msb & 0x80)
+        data = -data; // convert it to negative
+
+    return data;
+}
+
+/**
+ * Last byte of the frame is the sum of the four data bytes
+ */
+static inline bool dht_checksum_ok(const uint8_t data[DHT_DATA_BYTES])
+{
+    return data[4] == ((data[0] + data[1] + data[2] + data[3]) & 0xFF);
+}
+
+/**
+ * Convert a frame to percents and degrees Celsius, the sensor sends both in 0.1 units
+ */
+static inline void dht_decode_frame(const uint8_t data[DHT_DATA_BYTES], float *humidity, float *temperature)
+{
+    *humidity = dht_convert_data(data[0], data[1]) / 10.0f;
+    *temperature = dht_convert_data(data[2], data[3]) / 10.0f;
+}
@@ -0,0 +1,84 @@
+/*
+ * test_sensor_mock.cpp
+ *
+ * Host test of the DHT22 frame decoding through the sensor mocks.
+ */
+
+#include <cstdlib>
+#include <unity.h>
+
+#include "sensor_mock.h"
+
+using Dht22Mock = MockDht22Driver<5>;
+
+static void test_dht22_frames_are_decoded_in_tenths(void)
+{
+    // Humidity and temperature bytes, then their checksum
+    Dht22Mock driver({{
+        {ESP_OK, {0x02, 0x8C, 0x01, 0x5F, 0xEE}}, // 65.2 %, 35.1 C
+        {ESP_OK, {0x03, 0xE8, 0x80, 0x65, 0xD0}}, // 100.0 %, -10.1 C
+        {ESP_OK, {0x00, 0x01, 0x00, 0x05, 0x06}}, // 0.1 %, 0.5 C
+        {ESP_OK, {0x01, 0xC2, 0x00, 0xF7, 0xBA}}, // 45.0 %, 24.7 C
+        {ESP_OK, {0x01, 0xC2, 0x00, 0xF7, 0xBA}},
+    }});
+    const float expected[][2] = {{65.2f, 35.1f}, {100.0f, -10.1f}, {0.1f, 0.5f}, {45.0f, 24.7f}};
+    Dht22Mock::reading_t reading;
+
+    for (const auto &values : expected)
+    {
+        TEST_ASSERT_EQUAL(ESP_OK, driver.read(reading));
+        TEST_ASSERT_FLOAT_WITHIN(0.001f, values[0], reading.values[Dht22Traits::HUMIDITY]);
+        TEST_ASSERT_FLOAT_WITHIN(0.001f, values[1], reading.values[Dht22Traits::TEMPERATURE]);
+    }
+}
+
+static void test_dht22_failed_frames_are_reported(void)
+{
+    Dht22Mock driver({{
+        {ESP_OK, {0x02, 0x8C, 0x01, 0x5F, 0xEF}}, // checksum off by one
+        {ESP_ERR_TIMEOUT, {}},
+        {ESP_OK, {0x02, 0x8C, 0x01, 0x5F, 0xEE}},
+        {ESP_ERR_TIMEOUT, {}},
+        {ESP_OK, {0x02, 0x8D, 0x01, 0x5F, 0xEF}},
+    }});
+    Dht22Mock::reading_t reading;
+
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_CRC, driver.read(reading));
+    TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, driver.read(reading));
+    TEST_ASSERT_EQUAL(ESP_OK, driver.read(reading));
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 65.2f, reading.values[Dht22Traits::HUMIDITY]);
+    TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, driver.read(reading));
+
+    // Last entry is repeated once the script is exhausted
+    for (int i = 0; i < 2; i++)
+    {
+        TEST_ASSERT_EQUAL(ESP_OK, driver.read(reading));
+        TEST_ASSERT_FLOAT_WITHIN(0.001f, 65.3f, reading.values[Dht22Traits::HUMIDITY]);
+    }
+    TEST_ASSERT_EQUAL(6, driver.reads());
+}
+
+static void test_scripted_driver_counts_retries(void)
+{
+    using Mock = MockSensorDriver<Dht22Traits, 2>;
+    Mock::reading_t good;
+    good.values = {21.5f, 40.0f};
+    Mock driver({{{ESP_ERR_TIMEOUT, {}}, {ESP_OK, good}}});
+    Mock::reading_t reading;
+
+    TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, driver.read(reading));
+    driver.on_retry();
+    TEST_ASSERT_EQUAL(ESP_OK, driver.read(reading));
+    TEST_ASSERT_EQUAL_FLOAT(21.5f, reading.values[Dht22Traits::TEMPERATURE]);
+    TEST_ASSERT_EQUAL(1, driver.retries());
+    TEST_ASSERT_EQUAL(2, driver.reads());
+}
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_dht22_frames_are_decoded_in_tenths);
+    RUN_TEST(test_dht22_failed_frames_are_reported);
+    RUN_TEST(test_scripted_driver_counts_retries);
+    exit(UNITY_END());
+}
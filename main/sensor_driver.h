@@ -0,0 +1,84 @@
+/*
+ * sensor_driver.h
+ *
+ * Compile-time sensor driver interface.
+ *
+ * A driver derives from SensorDriver<Derived, Traits> (CRTP) and implements
+ * read_impl(). Capabilities are described by a traits struct of constexpr
+ * members, so the pipeline is specialized per sensor family without virtual
+ * dispatch.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <esp_err.h>
+
+/**
+ * Physical unit of a sensor channel
+ */
+enum class SensorUnit : uint8_t
+{
+    Celsius,
+    RelativeHumidity, // Percent
+    Hectopascal,
+};
+
+/**
+ * One sample of all the channels of a sensor
+ */
+template <size_t Channels>
+struct SensorReading
+{
+    std::array<float, Channels> values{};
+};
+
+/**
+ * Traits every sensor has to provide, e.g.:
+ *
+ *     struct MyTraits
+ *     {
+ *         static constexpr size_t channels = 2;
+ *         static constexpr std::array<SensorUnit, channels> units = {SensorUnit::Celsius, SensorUnit::RelativeHumidity};
+ *         static constexpr uint32_t min_interval_ms = 2000; // Minimum time between two reads
+ *         static constexpr std::array<float, channels> resolution = {0.1f, 0.1f};
+ *     };
+ */
+template <typename Derived, typename Traits>
+class SensorDriver
+{
+public:
+    using traits = Traits;
+    using reading_t = SensorReading<Traits::channels>;
+
+    static_assert(Traits::channels > 0, "Sensor needs at least one channel");
+    static_assert(Traits::units.size() == Traits::channels, "One unit per channel");
+    static_assert(Traits::resolution.size() == Traits::channels, "One resolution per channel");
+
+    /**
+     * Read all channels
+     * @param[out] reading Values, only valid when ESP_OK is returned
+     * @return ESP_OK on success, otherwise error code of the driver
+     */
+    esp_err_t read(reading_t &reading)
+    {
+        return derived().read_impl(reading);
+    }
+
+    /**
+     * Called by the pipeline before a failed read is retried
+     */
+    void on_retry()
+    {
+        derived().on_retry_impl();
+    }
+
+protected:
+    // Default hook, drivers without retry accounting do not need to implement it
+    void on_retry_impl() {}
+
+private:
+    Derived &derived() { return static_cast<Derived &>(*this); }
+};
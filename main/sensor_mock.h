@@ -0,0 +1,103 @@
+/*
+ * sensor_mock.h
+ *
+ * Scripted SensorDriver implementations for host tests of the sensor pipeline
+ * and of the DHT22 frame decoding.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "sensor_driver.h"
+#include "dht22_frame.h"
+
+/**
+ * Replays a fixed script of results. Once the script is exhausted the last entry is repeated.
+ */
+template <typename Traits, size_t Steps>
+class MockSensorDriver : public SensorDriver<MockSensorDriver<Traits, Steps>, Traits>
+{
+public:
+    using base_t = SensorDriver<MockSensorDriver<Traits, Steps>, Traits>;
+    using reading_t = typename base_t::reading_t;
+
+    struct Step
+    {
+        esp_err_t result;
+        reading_t reading;
+    };
+
+    explicit MockSensorDriver(const std::array<Step, Steps> &script) : m_script(script) {}
+
+    size_t reads() const { return m_reads; }
+    size_t retries() const { return m_retries; }
+
+private:
+    friend base_t;
+
+    esp_err_t read_impl(reading_t &reading)
+    {
+        const Step &step = m_script[m_reads < Steps ? m_reads : Steps - 1];
+        m_reads++;
+        if (step.result == ESP_OK)
+        {
+            reading = step.reading;
+        }
+        return step.result;
+    }
+
+    void on_retry_impl()
+    {
+        m_retries++;
+    }
+
+    const std::array<Step, Steps> m_script;
+    size_t m_reads = 0;
+    size_t m_retries = 0;
+};
+
+/**
+ * Replays raw DHT22 frames through the decoding of the real driver. A frame with a bad
+ * checksum fails like the sensor does. Once the script is exhausted the last entry is repeated.
+ */
+template <size_t Steps>
+class MockDht22Driver : public SensorDriver<MockDht22Driver<Steps>, Dht22Traits>
+{
+public:
+    using base_t = SensorDriver<MockDht22Driver<Steps>, Dht22Traits>;
+    using reading_t = typename base_t::reading_t;
+
+    struct Step
+    {
+        esp_err_t result; // Result of the bit capture, the frame is only used on ESP_OK
+        uint8_t frame[DHT_DATA_BYTES];
+    };
+
+    explicit MockDht22Driver(const std::array<Step, Steps> &script) : m_script(script) {}
+
+    size_t reads() const { return m_reads; }
+
+private:
+    friend base_t;
+
+    esp_err_t read_impl(reading_t &reading)
+    {
+        const Step &step = m_script[m_reads < Steps ? m_reads : Steps - 1];
+        m_reads++;
+        if (step.result != ESP_OK)
+        {
+            return step.result;
+        }
+        if (!dht_checksum_ok(step.frame))
+        {
+            return ESP_ERR_INVALID_CRC;
+        }
+        dht_decode_frame(step.frame, &reading.values[Dht22Traits::HUMIDITY],
+                         &reading.values[Dht22Traits::TEMPERATURE]);
+        return ESP_OK;
+    }
+
+    const std::array<Step, Steps> m_script;
+    size_t m_reads = 0;
+};
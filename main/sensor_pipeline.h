@@ -0,0 +1,124 @@
+/*
+ * sensor_pipeline.h
+ *
+ * Generic sampling, filtering and publishing pipeline for SensorDriver implementations.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "sensor_driver.h"
+
+/**
+ * Default filter, publishes the values as read
+ */
+struct PassThroughFilter
+{
+    template <typename Reading>
+    void apply(Reading &) {}
+};
+
+/**
+ * Retry and staleness policy, all times in milliseconds
+ */
+struct SensorPolicy
+{
+    int max_attempts;          // Attempts per measurement, including the first one
+    uint32_t retry_jitter;     // Random extra delay added to each backoff
+    uint32_t staleness_budget; // Published value is marked stale when older than this
+};
+
+template <typename Driver, typename Filter = PassThroughFilter>
+class SensorPipeline
+{
+public:
+    using traits = typename Driver::traits;
+    using reading_t = typename Driver::reading_t;
+    using publish_fn_t = void (*)(const reading_t &reading);
+    using publish_stale_fn_t = void (*)();
+
+    SensorPipeline(Driver &driver, const SensorPolicy &policy, publish_fn_t publish, publish_stale_fn_t publish_stale)
+        : m_driver(driver), m_policy(policy), m_publish(publish), m_publish_stale(publish_stale),
+          m_last_good_us(esp_timer_get_time())
+    {
+    }
+
+    /**
+     * Run one measurement: read with retries, filter and publish.
+     * @return Result of the last read attempt
+     */
+    esp_err_t sample()
+    {
+        reading_t reading;
+        esp_err_t ret = read_with_retry(reading);
+        int64_t now_us = esp_timer_get_time();
+
+        if (ret == ESP_OK)
+        {
+            m_last_good_us = now_us;
+            m_stale = false;
+            m_filter.apply(reading);
+            m_publish(reading);
+        }
+        else if (!m_stale && (now_us - m_last_good_us) / 1000 > m_policy.staleness_budget)
+        {
+            // Keep publishing the last value until the budget runs out, then report it as unknown
+            ESP_LOGW(TAG, "No valid reading for %" PRId64 " ms, marking values stale", (now_us - m_last_good_us) / 1000);
+            m_stale = true;
+            m_publish_stale();
+        }
+        return ret;
+    }
+
+    /**
+     * Age of the last published reading in milliseconds
+     */
+    uint32_t age_ms() const
+    {
+        return (uint32_t)((esp_timer_get_time() - m_last_good_us) / 1000);
+    }
+
+private:
+    static constexpr const char *TAG = "sensor_pipeline";
+
+    /**
+     * Retry failed reads with a jittered exponential backoff that never goes
+     * below the minimum read interval of the sensor.
+     */
+    esp_err_t read_with_retry(reading_t &reading)
+    {
+        esp_err_t ret = ESP_FAIL;
+        uint32_t backoff = traits::min_interval_ms;
+
+        for (int attempt = 1; attempt <= m_policy.max_attempts; attempt++)
+        {
+            ret = m_driver.read(reading);
+            if (ret == ESP_OK || attempt == m_policy.max_attempts)
+            {
+                break;
+            }
+
+            uint32_t delay = backoff + esp_random() % (m_policy.retry_jitter + 1);
+            ESP_LOGW(TAG, "Read attempt %d failed, retrying in %" PRIu32 " ms", attempt, delay);
+            m_driver.on_retry();
+            vTaskDelay(delay / portTICK_PERIOD_MS);
+            backoff <<= 1;
+        }
+        return ret;
+    }
+
+    Driver &m_driver;
+    Filter m_filter;
+    const SensorPolicy m_policy;
+    const publish_fn_t m_publish;
+    const publish_stale_fn_t m_publish_stale;
+    int64_t m_last_good_us;
+    bool m_stale = false;
+};
@@ -30,6 +30,14 @@ typedef enum {
     ESP_DIAG_DATA_STORE_EVENT_NON_CRITICAL_DATA_LOW_MEM,
 } esp_diag_data_store_events_t;
 
+/**
+ * @brief Contiguous part of the data in the diagnostics data store
+ */
+typedef struct {
+    const uint8_t *data;    /*!< Start of the data */
+    size_t len;             /*!< Length of the data */
+} esp_diag_data_store_span_t;
+
 /**
  * @brief Write critical data to the diagnostics data store
  *
@@ -71,6 +79,33 @@ int esp_diag_data_store_critical_read(uint8_t *buf, size_t size);
  */
 int esp_diag_data_store_non_critical_read(uint8_t *buf, size_t size);
 
+/**
+ * @brief Get critical data from the diagnostics data store in place, without copying it
+ *
+ * Data wrapped around the end of the store comes in two spans and a record can continue
+ * from the first span into the second one. Spans stay valid until the next release,
+ * releasing 0 bytes gives them up without freeing any data.
+ * With the flash overflow, peeks and releases stay on the tier (flash or RTC memory) of the
+ * peeked data until a release ends the peek.
+ *
+ * @param[out] spans Two spans, the second one is empty if the data is not wrapped
+ *
+ * @return int total bytes in the spans, 0 if there is no data, -1 on error
+ */
+int esp_diag_data_store_critical_peek(esp_diag_data_store_span_t spans[2]);
+
+/**
+ * @brief Get non_critical data from the diagnostics data store in place, without copying it
+ *
+ * Same as \ref esp_diag_data_store_critical_peek, non_critical data is not overwritten
+ * while it is peeked.
+ *
+ * @param[out] spans Two spans, the second one is empty if the data is not wrapped
+ *
+ * @return int total bytes in the spans, 0 if there is no data, -1 on error
+ */
+int esp_diag_data_store_non_critical_peek(esp_diag_data_store_span_t spans[2]);
+
 /**
  * @brief Release the size bytes of critical data from diagnostics data store
  *
@@ -82,6 +117,19 @@ int esp_diag_data_store_non_critical_read(uint8_t *buf, size_t size);
  */
 esp_err_t esp_diag_data_store_critical_release(size_t size);
 
+/**
+ * @brief Release the size bytes of peeked critical data and keep the rest of it peeked
+ *
+ * For peeked data sent in several messages that are acknowledged in order. The data left
+ * stays in place and a later peek returns it again from its start, followed by newer data.
+ * \ref esp_diag_data_store_critical_release ends the peek.
+ *
+ * @param[in] size Number of bytes to free.
+ *
+ * @return ESP_OK on success, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_data_store_critical_release_partial(size_t size);
+
 /**
  * @brief Release the size bytes of non_critical data from diagnostics data store
  *
@@ -5,10 +5,19 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <esp_err.h>
 #include <esp_diag_data_store.h>
 #include <rtc_store.h>
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+#include <stdio.h>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "flash_store.h"
+#endif
 
 ESP_EVENT_DEFINE_BASE(ESP_DIAG_DATA_STORE_EVENT);
 
@@ -22,6 +31,8 @@ typedef esp_err_t (*write_cb_t) (void *data, size_t len);
 typedef esp_err_t (*nc_write_cb_t) (const char *dg, void *data, size_t len);
 /* Callback type to read data */
 typedef int (*read_cb_t) (uint8_t *buf, size_t size);
+/* Callback type to get the data in place */
+typedef int (*peek_cb_t) (esp_diag_data_store_span_t spans[2]);
 /* Callback type to release the data */
 typedef esp_err_t (*release_cb_t) (size_t size);
 /* Callback type to get CRC of data store configuration.
@@ -37,7 +48,10 @@ typedef struct {
     nc_write_cb_t non_critical_write;
     read_cb_t critical_read;
     read_cb_t non_critical_read;
+    peek_cb_t critical_peek;
+    peek_cb_t non_critical_peek;
     release_cb_t critical_release;
+    release_cb_t critical_release_partial;
     release_cb_t non_critical_release;
     crc_cb_t data_store_crc;
     discard_data_cb_t discard_data;
@@ -46,6 +60,14 @@ typedef struct {
 typedef struct {
     bool init;
     data_store_cbs_t cbs;
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    bool overflow;                                  // flash overflow tier is usable
+    SemaphoreHandle_t lock;                         // serializes reads, releases and spills
+    TaskHandle_t spill_task;                        // writes to flash, notified with the classes to spill
+    bool flash_read[FLASH_STORE_CLASS_MAX];         // last read of the class came from flash
+    uint8_t *peek_buf[FLASH_STORE_CLASS_MAX];       // flash data handed out by peek, only while flash has data
+    bool peek_held[FLASH_STORE_CLASS_MAX];          // peeked data is not released yet, peeks and releases stay on its tier
+#endif
 } priv_data_t;
 
 static priv_data_t s_priv_data;
@@ -65,7 +87,10 @@ static void set_diag_store_cbs(void)
     s_priv_data.cbs.non_critical_write = rtc_store_non_critical_data_write;
     s_priv_data.cbs.critical_read = rtc_store_critical_data_read;
     s_priv_data.cbs.non_critical_read = rtc_store_non_critical_data_read;
+    s_priv_data.cbs.critical_peek = rtc_store_critical_data_peek;
+    s_priv_data.cbs.non_critical_peek = rtc_store_non_critical_data_peek;
     s_priv_data.cbs.critical_release = rtc_store_critical_data_release;
+    s_priv_data.cbs.critical_release_partial = rtc_store_critical_data_release_partial;
     s_priv_data.cbs.non_critical_release = rtc_store_non_critical_data_release;
     s_priv_data.cbs.data_store_crc = rtc_store_get_crc;
     s_priv_data.cbs.discard_data = rtc_store_discard_data;
@@ -79,12 +104,201 @@ static void unset_diag_store_cbs(void)
     s_priv_data.cbs.non_critical_write = NULL;
     s_priv_data.cbs.critical_read = NULL;
     s_priv_data.cbs.non_critical_read = NULL;
+    s_priv_data.cbs.critical_peek = NULL;
+    s_priv_data.cbs.non_critical_peek = NULL;
     s_priv_data.cbs.critical_release = NULL;
+    s_priv_data.cbs.critical_release_partial = NULL;
     s_priv_data.cbs.non_critical_release = NULL;
     s_priv_data.cbs.data_store_crc = NULL;
     s_priv_data.cbs.discard_data = NULL;
 }
 
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+#define TAG                     "DIAG_DATA_STORE"
+#define OVERFLOW_PEEK_BUF_SIZE  1024
+#define SPILL_TASK_STACK        3072
+#define SPILL_TASK_PRIORITY     1
+
+/* Flash pages are read first, oldest first, and RTC once flash is empty. A release goes to the tier
+ * of the last read. RTC data is read only when flash has no page of the class, so RTC data spilled
+ * after it was read becomes the oldest page and its release lands there.
+ */
+static esp_err_t overflow_spill_cb(const uint8_t *data, size_t len, const uint8_t *data2, size_t len2, void *priv)
+{
+    flash_store_class_t cls = (flash_store_class_t) (intptr_t) priv;
+    return flash_store_spill(cls, data, len, data2, len2);
+}
+
+static void overflow_spill(flash_store_class_t cls)
+{
+    esp_err_t err;
+    xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+    if (cls == FLASH_STORE_CRITICAL) {
+        err = rtc_store_critical_data_spill(overflow_spill_cb, (void *) (intptr_t) cls);
+    } else {
+        err = rtc_store_non_critical_data_spill(overflow_spill_cb, (void *) (intptr_t) cls);
+    }
+    if (err == ESP_OK) {
+        s_priv_data.flash_read[cls] = true;
+    }
+    xSemaphoreGive(s_priv_data.lock);
+}
+
+static int overflow_read(flash_store_class_t cls, read_cb_t rtc_read, uint8_t *buf, size_t size)
+{
+    xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+    int len = flash_store_read(cls, buf, size);
+    s_priv_data.flash_read[cls] = (len > 0);
+    if (len <= 0) {
+        len = rtc_read(buf, size);
+    }
+    xSemaphoreGive(s_priv_data.lock);
+    return len;
+}
+
+/* Flash pages are not memory mapped, their data is peeked through a buffer of the class.
+ * Peeked data may be sent in several messages, until it is released peeks and releases stay
+ * on its tier. Both tiers keep peeked data in place, RTC data is not spilled and a flash page
+ * is not overwritten.
+ */
+static int overflow_peek(flash_store_class_t cls, peek_cb_t rtc_peek, esp_diag_data_store_span_t spans[2])
+{
+    xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+    int len = 0;
+    bool held = s_priv_data.peek_held[cls];
+    if (!held || s_priv_data.flash_read[cls]) {
+        if (!s_priv_data.peek_buf[cls]) {
+            s_priv_data.peek_buf[cls] = malloc(OVERFLOW_PEEK_BUF_SIZE);
+        }
+        if (s_priv_data.peek_buf[cls]) {
+            len = flash_store_peek(cls, s_priv_data.peek_buf[cls], OVERFLOW_PEEK_BUF_SIZE);
+        }
+        if (len > 0) {
+            spans[0].data = s_priv_data.peek_buf[cls];
+            spans[0].len = len;
+            spans[1].data = NULL;
+            spans[1].len = 0;
+        } else {
+            free(s_priv_data.peek_buf[cls]);
+            s_priv_data.peek_buf[cls] = NULL;
+        }
+    }
+    if (!held) {
+        s_priv_data.flash_read[cls] = (len > 0);
+    }
+    if (!s_priv_data.flash_read[cls]) {
+        len = rtc_peek(spans);
+    }
+    if (len > 0) {
+        s_priv_data.peek_held[cls] = true;
+    }
+    xSemaphoreGive(s_priv_data.lock);
+    return len;
+}
+
+static esp_err_t overflow_release(flash_store_class_t cls, release_cb_t rtc_release, size_t size, bool keep_peek)
+{
+    esp_err_t err;
+    xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+    if (s_priv_data.flash_read[cls]) {
+        err = flash_store_release(cls, size, keep_peek);
+    } else {
+        err = rtc_release(size);
+    }
+    s_priv_data.peek_held[cls] = keep_peek;
+    xSemaphoreGive(s_priv_data.lock);
+    return err;
+}
+
+/* Erasing and writing flash takes tens of milliseconds, it is done in a task of its own
+ * and not in the default event loop, which Wi-Fi, IP and Matter events go through.
+ */
+static void overflow_spill_task(void *arg)
+{
+    uint32_t classes;
+    while (true) {
+        xTaskNotifyWait(0, UINT32_MAX, &classes, portMAX_DELAY);
+        for (int i = 0; i < FLASH_STORE_CLASS_MAX; i++) {
+            if (classes & (1 << i)) {
+                overflow_spill((flash_store_class_t) i);
+            }
+        }
+    }
+}
+
+static void overflow_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    switch (event_id) {
+        case ESP_DIAG_DATA_STORE_EVENT_CRITICAL_DATA_LOW_MEM:
+        case ESP_DIAG_DATA_STORE_EVENT_CRITICAL_DATA_WRITE_FAIL:
+            xTaskNotify(s_priv_data.spill_task, 1 << FLASH_STORE_CRITICAL, eSetBits);
+            break;
+        case ESP_DIAG_DATA_STORE_EVENT_NON_CRITICAL_DATA_LOW_MEM:
+        case ESP_DIAG_DATA_STORE_EVENT_NON_CRITICAL_DATA_WRITE_FAIL:
+            xTaskNotify(s_priv_data.spill_task, 1 << FLASH_STORE_NON_CRITICAL, eSetBits);
+            break;
+        default:
+            break;
+    }
+}
+
+static void overflow_init(void)
+{
+    esp_err_t err;
+    s_priv_data.lock = xSemaphoreCreateMutex();
+    if (!s_priv_data.lock) {
+        return;
+    }
+    /* Without the partition the store keeps working from RTC memory only */
+    if (flash_store_init() != ESP_OK) {
+        goto error;
+    }
+    if (xTaskCreate(overflow_spill_task, "diag_spill", SPILL_TASK_STACK, NULL, SPILL_TASK_PRIORITY,
+                    &s_priv_data.spill_task) != pdPASS) {
+        printf("%s: failed to create spill task\n", TAG);
+        goto error;
+    }
+    err = esp_event_handler_register(ESP_DIAG_DATA_STORE_EVENT, ESP_EVENT_ANY_ID, overflow_event_handler, NULL);
+    if (err != ESP_OK) {
+        /* Usually the default event loop is not created yet */
+        printf("%s: failed to register for store events, flash overflow disabled, err:0x%x\n", TAG, err);
+        goto error;
+    }
+    s_priv_data.overflow = true;
+    return;
+
+error:
+    if (s_priv_data.spill_task) {
+        vTaskDelete(s_priv_data.spill_task);
+        s_priv_data.spill_task = NULL;
+    }
+    flash_store_deinit();
+    vSemaphoreDelete(s_priv_data.lock);
+    s_priv_data.lock = NULL;
+}
+
+static void overflow_deinit(void)
+{
+    if (!s_priv_data.overflow) {
+        return;
+    }
+    esp_event_handler_unregister(ESP_DIAG_DATA_STORE_EVENT, ESP_EVENT_ANY_ID, overflow_event_handler);
+    /* Not in the middle of a spill while the lock is held */
+    xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+    vTaskDelete(s_priv_data.spill_task);
+    s_priv_data.spill_task = NULL;
+    xSemaphoreGive(s_priv_data.lock);
+    flash_store_deinit();
+    for (int i = 0; i < FLASH_STORE_CLASS_MAX; i++) {
+        free(s_priv_data.peek_buf[i]);
+        s_priv_data.peek_buf[i] = NULL;
+    }
+    vSemaphoreDelete(s_priv_data.lock);
+    s_priv_data.lock = NULL;
+    s_priv_data.overflow = false;
+}
+#endif /* CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW */
+
 esp_err_t esp_diag_data_store_critical_write(void *data, size_t len)
 {
     CHECK_STORE_INIT(ESP_ERR_INVALID_STATE);
@@ -100,24 +314,77 @@ esp_err_t esp_diag_data_store_non_critical_write(const char *dg, void *data, siz
 int esp_diag_data_store_critical_read(uint8_t *buf, size_t size)
 {
     CHECK_STORE_INIT(-1);
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    if (s_priv_data.overflow) {
+        return overflow_read(FLASH_STORE_CRITICAL, s_priv_data.cbs.critical_read, buf, size);
+    }
+#endif
     return s_priv_data.cbs.critical_read(buf, size);
 }
 
 int esp_diag_data_store_non_critical_read(uint8_t *buf, size_t size)
 {
     CHECK_STORE_INIT(-1);
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    if (s_priv_data.overflow) {
+        return overflow_read(FLASH_STORE_NON_CRITICAL, s_priv_data.cbs.non_critical_read, buf, size);
+    }
+#endif
     return s_priv_data.cbs.non_critical_read(buf, size);
 }
 
+int esp_diag_data_store_critical_peek(esp_diag_data_store_span_t spans[2])
+{
+    CHECK_STORE_INIT(-1);
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    if (s_priv_data.overflow) {
+        return overflow_peek(FLASH_STORE_CRITICAL, s_priv_data.cbs.critical_peek, spans);
+    }
+#endif
+    return s_priv_data.cbs.critical_peek(spans);
+}
+
+int esp_diag_data_store_non_critical_peek(esp_diag_data_store_span_t spans[2])
+{
+    CHECK_STORE_INIT(-1);
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    if (s_priv_data.overflow) {
+        return overflow_peek(FLASH_STORE_NON_CRITICAL, s_priv_data.cbs.non_critical_peek, spans);
+    }
+#endif
+    return s_priv_data.cbs.non_critical_peek(spans);
+}
+
 esp_err_t esp_diag_data_store_critical_release(size_t size)
 {
     CHECK_STORE_INIT(ESP_ERR_INVALID_STATE);
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    if (s_priv_data.overflow) {
+        return overflow_release(FLASH_STORE_CRITICAL, s_priv_data.cbs.critical_release, size, false);
+    }
+#endif
     return s_priv_data.cbs.critical_release(size);
 }
 
+esp_err_t esp_diag_data_store_critical_release_partial(size_t size)
+{
+    CHECK_STORE_INIT(ESP_ERR_INVALID_STATE);
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    if (s_priv_data.overflow) {
+        return overflow_release(FLASH_STORE_CRITICAL, s_priv_data.cbs.critical_release_partial, size, true);
+    }
+#endif
+    return s_priv_data.cbs.critical_release_partial(size);
+}
+
 esp_err_t esp_diag_data_store_non_critical_release(size_t size)
 {
     CHECK_STORE_INIT(ESP_ERR_INVALID_STATE);
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    if (s_priv_data.overflow) {
+        return overflow_release(FLASH_STORE_NON_CRITICAL, s_priv_data.cbs.non_critical_release, size, false);
+    }
+#endif
     return s_priv_data.cbs.non_critical_release(size);
 }
 
@@ -128,6 +395,9 @@ esp_err_t esp_diag_data_store_init(void)
     if (err != ESP_OK) {
         return err;
     }
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    overflow_init();
+#endif
     s_priv_data.init = true;
     return ESP_OK;
 }
@@ -135,6 +405,9 @@ esp_err_t esp_diag_data_store_init(void)
 void esp_diag_data_store_deinit(void)
 {
     CHECK_STORE_INIT();
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    overflow_deinit();
+#endif
     s_priv_data.cbs.deinit();
     unset_diag_store_cbs();
     s_priv_data.init = false;
@@ -149,5 +422,12 @@ uint32_t esp_diag_data_store_get_crc(void)
 esp_err_t esp_diag_data_discard_data(void)
 {
     CHECK_STORE_INIT(ESP_ERR_INVALID_STATE);
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+    if (s_priv_data.overflow) {
+        xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+        flash_store_discard_data();
+        xSemaphoreGive(s_priv_data.lock);
+    }
+#endif
     return s_priv_data.cbs.discard_data();
 }
\ No newline at end of file
@@ -0,0 +1,387 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <esp_partition.h>
+#include <esp_crc.h>
+
+#include "flash_store.h"
+
+/**
+ * @brief Overflow tier of the RTC store, kept in the diagnostics data partition
+ *
+ * The partition is an append only ring of pages. Each page starts at a sector boundary, holds the
+ * data of one class spilled from RTC memory and spans as many sectors as needed. Sectors are erased
+ * right before a page is written to them, so every sector is erased once per round of the ring.
+ * The page header is written after its data, a page without a valid header is never read.
+ *
+ * @attention Same as in RTC store, only prints are used here and not logs. All the APIs are called
+ *    with the data store lock held.
+ */
+
+#if CONFIG_ESP_INSIGHTS_DEBUG_ENABLED
+#define FLASH_STORE_DBG_PRINTS 1
+#endif
+
+#define TAG "FLASH_STORE"
+
+#define FLASH_STORE_SECTOR_SIZE     0x1000
+#define FLASH_STORE_PAGE_MAGIC      0x46535031 /* "FSP1" */
+#define FLASH_STORE_PAGE_UNREAD     0xFFFFFFFF /* State of an erased word */
+#define FLASH_STORE_PAGE_READ       0x00000000 /* Programmed over the erased word, no erase needed */
+#define FLASH_STORE_CRC_CHUNK       64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;               // increases with every page written
+    uint16_t len;               // length of the data following the header
+    uint8_t cls;                // flash_store_class_t
+    uint8_t reserved;
+    uint32_t crc;               // crc32 of the data
+    uint32_t state;             // FLASH_STORE_PAGE_UNREAD until all data is released
+} flash_store_page_hdr_t;
+
+/* RAM copy of a page header, indexed by the sector the page starts at. seq 0 is no page */
+typedef struct {
+    uint32_t seq;
+    uint32_t crc;
+    uint16_t len;
+    uint16_t offset;            // bytes released, a page read partially before reset is read again
+    uint8_t cls;
+    bool unread;
+    bool verified;
+} page_info_t;
+
+typedef struct {
+    bool init;
+    const esp_partition_t *part;
+    uint32_t sectors;
+    uint32_t next_sector;       // where the next page starts
+    uint32_t next_seq;
+    int32_t current[FLASH_STORE_CLASS_MAX]; // page being read for each class, -1 if none
+    bool held[FLASH_STORE_CLASS_MAX];       // current page is peeked and must not be overwritten
+    uint32_t dropped;           // unread pages overwritten since boot
+    page_info_t *pages;
+} flash_store_priv_data_t;
+
+static flash_store_priv_data_t s_priv_data;
+
+static inline uint32_t page_sectors(size_t len)
+{
+    return (sizeof(flash_store_page_hdr_t) + len + FLASH_STORE_SECTOR_SIZE - 1) / FLASH_STORE_SECTOR_SIZE;
+}
+
+static inline size_t page_addr(uint32_t sector)
+{
+    return sector * FLASH_STORE_SECTOR_SIZE;
+}
+
+static bool page_overlaps(uint32_t sector, uint32_t start, uint32_t count)
+{
+    uint32_t end = sector + page_sectors(s_priv_data.pages[sector].len);
+    return sector < start + count && start < end;
+}
+
+static void page_mark_read(uint32_t sector)
+{
+    page_info_t *page = &s_priv_data.pages[sector];
+    uint32_t state = FLASH_STORE_PAGE_READ;
+
+    esp_partition_write(s_priv_data.part, page_addr(sector) + offsetof(flash_store_page_hdr_t, state),
+                        &state, sizeof(state));
+    page->unread = false;
+    for (int i = 0; i < FLASH_STORE_CLASS_MAX; i++) {
+        if (s_priv_data.current[i] == (int32_t) sector) {
+            s_priv_data.current[i] = -1;
+            s_priv_data.held[i] = false;
+        }
+    }
+}
+
+static bool page_verify(uint32_t sector)
+{
+    page_info_t *page = &s_priv_data.pages[sector];
+    uint8_t chunk[FLASH_STORE_CRC_CHUNK];
+    uint32_t crc = 0;
+    size_t done, len;
+
+    if (page->verified) {
+        return true;
+    }
+    for (done = 0; done < page->len; done += len) {
+        len = page->len - done;
+        if (len > sizeof(chunk)) {
+            len = sizeof(chunk);
+        }
+        if (esp_partition_read(s_priv_data.part, page_addr(sector) + sizeof(flash_store_page_hdr_t) + done,
+                               chunk, len) != ESP_OK) {
+            return false;
+        }
+        crc = esp_crc32_le(crc, chunk, len);
+    }
+    page->verified = (crc == page->crc);
+    return page->verified;
+}
+
+/* Page being read if any, oldest unread page of the class otherwise */
+static int32_t page_get_current(flash_store_class_t cls)
+{
+    while (s_priv_data.current[cls] < 0) {
+        int32_t oldest = -1;
+        for (uint32_t i = 0; i < s_priv_data.sectors; i++) {
+            page_info_t *page = &s_priv_data.pages[i];
+            if (page->seq && page->unread && page->cls == cls &&
+                    (oldest < 0 || page->seq < s_priv_data.pages[oldest].seq)) {
+                oldest = i;
+            }
+        }
+        if (oldest < 0) {
+            return -1;
+        }
+        if (!page_verify(oldest)) {
+            printf("%s: crc mismatch, dropping page %" PRIu32 "\n", TAG, s_priv_data.pages[oldest].seq);
+            page_mark_read(oldest);
+            continue;
+        }
+        s_priv_data.current[cls] = oldest;
+    }
+    return s_priv_data.current[cls];
+}
+
+esp_err_t flash_store_spill(flash_store_class_t cls, const uint8_t *data, size_t len,
+                            const uint8_t *data2, size_t len2)
+{
+    if (!s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (cls >= FLASH_STORE_CLASS_MAX || !data || !len || (len2 && !data2)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t total = len + len2;
+    uint32_t count = page_sectors(total);
+    if (total > UINT16_MAX || count > s_priv_data.sectors) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint32_t start = s_priv_data.next_sector;
+    if (start + count > s_priv_data.sectors) {
+        start = 0;
+    }
+
+    /* Peeked data may be in flight, its releases must land on it */
+    for (int j = 0; j < FLASH_STORE_CLASS_MAX; j++) {
+        if (s_priv_data.held[j] && page_overlaps(s_priv_data.current[j], start, count)) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    /* Pages in the way are overwritten, they are the oldest ones in the ring */
+    for (uint32_t i = 0; i < s_priv_data.sectors; i++) {
+        page_info_t *page = &s_priv_data.pages[i];
+        if (!page->seq || !page_overlaps(i, start, count)) {
+            continue;
+        }
+        if (page->unread) {
+            s_priv_data.dropped++;
+            printf("%s: dropping unread page %" PRIu32 ", dropped %" PRIu32 "\n", TAG, page->seq, s_priv_data.dropped);
+        }
+        for (int j = 0; j < FLASH_STORE_CLASS_MAX; j++) {
+            if (s_priv_data.current[j] == (int32_t) i) {
+                s_priv_data.current[j] = -1;
+            }
+        }
+        memset(page, 0, sizeof(page_info_t));
+    }
+
+    esp_err_t err = esp_partition_erase_range(s_priv_data.part, page_addr(start), count * FLASH_STORE_SECTOR_SIZE);
+    if (err != ESP_OK) {
+        return err;
+    }
+    size_t addr = page_addr(start) + sizeof(flash_store_page_hdr_t);
+    err = esp_partition_write(s_priv_data.part, addr, data, len);
+    if (err == ESP_OK && len2) {
+        err = esp_partition_write(s_priv_data.part, addr + len, data2, len2);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    uint32_t crc = esp_crc32_le(0, data, len);
+    if (len2) {
+        crc = esp_crc32_le(crc, data2, len2);
+    }
+    flash_store_page_hdr_t hdr = {
+        .magic = FLASH_STORE_PAGE_MAGIC,
+        .seq = s_priv_data.next_seq,
+        .len = total,
+        .cls = cls,
+        .reserved = 0xff,
+        .crc = crc,
+        .state = FLASH_STORE_PAGE_UNREAD,
+    };
+    err = esp_partition_write(s_priv_data.part, page_addr(start), &hdr, sizeof(hdr));
+    if (err != ESP_OK) {
+        return err;
+    }
+    s_priv_data.pages[start] = (page_info_t) {
+        .seq = hdr.seq,
+        .crc = hdr.crc,
+        .len = hdr.len,
+        .cls = cls,
+        .unread = true,
+        .verified = true,
+    };
+    s_priv_data.next_sector = (start + count) % s_priv_data.sectors;
+    s_priv_data.next_seq++;
+#if FLASH_STORE_DBG_PRINTS
+    printf("%s: page %" PRIu32 " of class %d, %u bytes at sector %" PRIu32 "\n", TAG, hdr.seq, cls, total, start);
+#endif
+    return ESP_OK;
+}
+
+/* Reads from the page being read, a held page is kept until the next release */
+static int page_read(flash_store_class_t cls, uint8_t *buf, size_t size, bool hold)
+{
+    if (!s_priv_data.init || cls >= FLASH_STORE_CLASS_MAX || !buf || !size) {
+        return -1;
+    }
+    int32_t sector = page_get_current(cls);
+    if (sector < 0) {
+        return 0;
+    }
+    page_info_t *page = &s_priv_data.pages[sector];
+    if (size > page->len - page->offset) {
+        size = page->len - page->offset;
+    }
+    if (esp_partition_read(s_priv_data.part, page_addr(sector) + sizeof(flash_store_page_hdr_t) + page->offset,
+                           buf, size) != ESP_OK) {
+        return -1;
+    }
+    if (hold) {
+        s_priv_data.held[cls] = true;
+    }
+    return size;
+}
+
+int flash_store_read(flash_store_class_t cls, uint8_t *buf, size_t size)
+{
+    return page_read(cls, buf, size, false);
+}
+
+int flash_store_peek(flash_store_class_t cls, uint8_t *buf, size_t size)
+{
+    return page_read(cls, buf, size, true);
+}
+
+esp_err_t flash_store_release(flash_store_class_t cls, size_t size, bool keep_peek)
+{
+    if (!s_priv_data.init || cls >= FLASH_STORE_CLASS_MAX) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    int32_t sector = page_get_current(cls);
+    if (sector < 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    page_info_t *page = &s_priv_data.pages[sector];
+    if (size > page->len - page->offset) {
+        return ESP_FAIL;
+    }
+    page->offset += size;
+    s_priv_data.held[cls] = keep_peek;
+    if (page->offset == page->len) {
+        page_mark_read(sector);
+    }
+    return ESP_OK;
+}
+
+esp_err_t flash_store_discard_data(void)
+{
+    if (!s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (uint32_t i = 0; i < s_priv_data.sectors; i++) {
+        if (s_priv_data.pages[i].seq && s_priv_data.pages[i].unread) {
+            page_mark_read(i);
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t flash_store_init(void)
+{
+    flash_store_page_hdr_t hdr;
+    uint32_t i, j, last_seq = 0;
+
+    if (s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_priv_data.part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                CONFIG_FLASH_STORE_PARTITION_LABEL);
+    if (!s_priv_data.part) {
+        printf("%s: partition %s not found\n", TAG, CONFIG_FLASH_STORE_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+    s_priv_data.sectors = s_priv_data.part->size / FLASH_STORE_SECTOR_SIZE;
+    if (s_priv_data.sectors < 2) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    s_priv_data.pages = calloc(s_priv_data.sectors, sizeof(page_info_t));
+    if (!s_priv_data.pages) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    s_priv_data.next_sector = 0;
+    for (i = 0; i < s_priv_data.sectors; i++) {
+        if (esp_partition_read(s_priv_data.part, page_addr(i), &hdr, sizeof(hdr)) != ESP_OK) {
+            continue;
+        }
+        if (hdr.magic != FLASH_STORE_PAGE_MAGIC || !hdr.seq || !hdr.len || hdr.cls >= FLASH_STORE_CLASS_MAX ||
+                i + page_sectors(hdr.len) > s_priv_data.sectors) {
+            continue;
+        }
+        s_priv_data.pages[i] = (page_info_t) {
+            .seq = hdr.seq,
+            .crc = hdr.crc,
+            .len = hdr.len,
+            .cls = hdr.cls,
+            .unread = hdr.state == FLASH_STORE_PAGE_UNREAD,
+        };
+        if (hdr.seq > last_seq) {
+            last_seq = hdr.seq;
+            s_priv_data.next_sector = (i + page_sectors(hdr.len)) % s_priv_data.sectors;
+        }
+    }
+    /* A page whose tail was overwritten by a newer page is gone */
+    for (i = 0; i < s_priv_data.sectors; i++) {
+        if (!s_priv_data.pages[i].unread) {
+            continue;
+        }
+        for (j = i + 1; j < i + page_sectors(s_priv_data.pages[i].len); j++) {
+            if (s_priv_data.pages[j].seq > s_priv_data.pages[i].seq) {
+                s_priv_data.pages[i].unread = false;
+                break;
+            }
+        }
+    }
+    s_priv_data.next_seq = last_seq + 1;
+    for (i = 0; i < FLASH_STORE_CLASS_MAX; i++) {
+        s_priv_data.current[i] = -1;
+    }
+    s_priv_data.dropped = 0;
+    s_priv_data.init = true;
+    return ESP_OK;
+}
+
+void flash_store_deinit(void)
+{
+    if (!s_priv_data.init) {
+        return;
+    }
+    free(s_priv_data.pages);
+    memset(&s_priv_data, 0, sizeof(s_priv_data));
+}
@@ -0,0 +1,99 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    FLASH_STORE_CRITICAL,
+    FLASH_STORE_NON_CRITICAL,
+    FLASH_STORE_CLASS_MAX,
+} flash_store_class_t;
+
+/**
+ * @brief Initializes the flash overflow store
+ *
+ * Scans the diagnostics data partition and picks up the pages left by previous boots.
+ *
+ * @return ESP_OK on success, appropriate error code otherwise.
+ */
+esp_err_t flash_store_init(void);
+
+/**
+ * @brief Deinitializes the flash overflow store, data in flash is kept
+ */
+void flash_store_deinit(void);
+
+/**
+ * @brief Append data of a class as one page, data may come in two parts
+ *
+ * Pages start at a sector boundary, sectors are erased right before they are written.
+ * Unread pages in the way are dropped, the oldest ones go first. A held page is never dropped.
+ *
+ * @param[in] cls         Class of the data
+ * @param[in] data        First part of the data
+ * @param[in] len         Length of the first part
+ * @param[in] data2       Second part of the data, can be NULL
+ * @param[in] len2        Length of the second part
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if a held page is in the way, appropriate error code otherwise.
+ */
+esp_err_t flash_store_spill(flash_store_class_t cls, const uint8_t *data, size_t len,
+                            const uint8_t *data2, size_t len2);
+
+/**
+ * @brief Read data of a class, oldest page first
+ *
+ * @param[in] cls  Class of the data
+ * @param[in] buf  Buffer to hold the data
+ * @param[in] size Size of the buffer
+ *
+ * @return Bytes read, 0 if there is no data, -1 on error
+ */
+int flash_store_read(flash_store_class_t cls, uint8_t *buf, size_t size);
+
+/**
+ * @brief Same as \ref flash_store_read, the page stays held until the next release
+ *
+ * A held page is not overwritten, spills that would drop it fail instead.
+ *
+ * @param[in] cls  Class of the data
+ * @param[in] buf  Buffer to hold the data
+ * @param[in] size Size of the buffer
+ *
+ * @return Bytes read, 0 if there is no data, -1 on error
+ */
+int flash_store_peek(flash_store_class_t cls, uint8_t *buf, size_t size);
+
+/**
+ * @brief Release bytes of the page being read, oldest page first. The page is marked read once all of it is released
+ *
+ * @param[in] cls       Class of the data
+ * @param[in] size      Number of bytes to release
+ * @param[in] keep_peek Keep the rest of the page held
+ *
+ * @return ESP_OK on success, appropriate error code otherwise.
+ */
+esp_err_t flash_store_release(flash_store_class_t cls, size_t size, bool keep_peek);
+
+/**
+ * @brief Mark all pages read
+ *
+ * @return ESP_OK on success, appropriate error code otherwise.
+ */
+esp_err_t flash_store_discard_data(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <soc/soc_memory_layout.h>
 #include <freertos/FreeRTOS.h>
@@ -64,18 +65,32 @@
 
 /* When buffer is filled beyond configured capacity then we post an event.
  * In case of failure in sending data over the network, new critical data is dropped and
- * non-critical data is overwritten.
+ * non-critical data is dropped, overwritten or downsampled as configured.
  */
 
-/* When current free size of buffer drops below (100 - reporting_watermark)% then we post an event */
-#define DIAG_CRITICAL_DATA_REPORTING_WATERMARK \
-    ((DIAG_CRITICAL_BUF_SIZE * (100 - CONFIG_DIAG_DATA_STORE_REPORTING_WATERMARK_PERCENT)) / 100)
-#define DIAG_NON_CRITICAL_DATA_REPORTING_WATERMARK \
-    ((DIAG_NON_CRITICAL_BUF_SIZE * (100 - CONFIG_DIAG_DATA_STORE_REPORTING_WATERMARK_PERCENT)) / 100)
+/* Both buffers share one arena. The configured sizes are quotas, an idle buffer lends the space
+ * above its floor to the other one. Critical data never lends below its quota.
+ */
+#define DIAG_ARENA_SIZE                (DIAG_CRITICAL_BUF_SIZE + DIAG_NON_CRITICAL_BUF_SIZE)
+#define DIAG_CRITICAL_FLOOR            DIAG_CRITICAL_BUF_SIZE
+#define DIAG_NON_CRITICAL_FLOOR \
+    (DIAG_NON_CRITICAL_BUF_SIZE - (DIAG_NON_CRITICAL_BUF_SIZE * CONFIG_RTC_STORE_NON_CRITICAL_LEND_PERCENT) / 100)
+
+#if CONFIG_RTC_STORE_PAGE_CRC
+/* Buffers are checked in pages, a buffer keeps its pages when it borrows space */
+#define RTC_STORE_PAGE_SIZE            256
+#define RTC_STORE_MAX_PAGES            ((DIAG_ARENA_SIZE + RTC_STORE_PAGE_SIZE - 1) / RTC_STORE_PAGE_SIZE)
+#define RTC_STORE_LEND_ALIGN           RTC_STORE_PAGE_SIZE
+_Static_assert(RTC_STORE_MAX_PAGES <= 32, "page bitmaps are 32 bit");
+#else
+#define RTC_STORE_LEND_ALIGN           4
+#endif
 
 /* non critical data is stored in Length - Value format */
 #define SIZE_OF_DATA_LEN    sizeof(size_t)
 
+#define RTC_STORE_MAX_PENDING_WRITES  CONFIG_RTC_STORE_MAX_PENDING_WRITES
+
 // Assumption is RTC memory size will never exeed UINT16_MAX
 typedef union {
     struct {
@@ -92,9 +107,70 @@ typedef struct {
 } data_store_t;
 
 typedef struct {
-    SemaphoreHandle_t lock;     // critical lock
+    uint16_t len;
+    bool committed;
+} pending_write_t;
+
+#if CONFIG_RTC_STORE_PAGE_CRC
+typedef struct {
+    uint16_t crc;               // CRC of the page from its start up to the data written since the page was reused
+    uint8_t first;              // offset of the first record starting in the page
+    uint8_t last;               // offset of the last record starting in the page
+} rtc_store_page_t;
+
+/* Kept in RTC memory next to the buffer, bit n of the bitmaps is for page n */
+typedef struct {
+    uint32_t dirty;             // pages with reserved data being written
+    uint32_t has_rec;           // pages where a record starts
+    rtc_store_page_t page[RTC_STORE_MAX_PAGES];
+} rtc_store_pages_t;
+#endif
+
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+/* Smallest non critical record: meta index, header and one byte of data */
+#define NON_CRITICAL_INDEX_SIZE \
+    (DIAG_NON_CRITICAL_BUF_SIZE / (1 + sizeof(rtc_store_non_critical_data_hdr_t) + 1) + 1)
+
+/* End positions of the records in the buffer, oldest first, in the order they were reserved.
+ * Positions count bytes modulo 2^16 and the buffer is smaller than that, so an end position
+ * relative to `read_pos` is its distance from the read offset.
+ */
+typedef struct {
+    uint16_t *ends;
+    uint16_t size;
+    uint16_t first;
+    uint16_t count;
+    uint16_t read_pos;          // position of the read offset
+    uint16_t write_pos;         // position following the last reserved record
+} rtc_store_index_t;
+#endif
+
+/* Writers reserve space under the spinlock, copy their record without holding any lock
+ * and commit it under the spinlock again. Records are added to `filled` in the order they
+ * were reserved, once all the records before them are committed, readers only see those.
+ */
+typedef struct {
+    SemaphoreHandle_t lock;     // serializes readers
+    portMUX_TYPE spinlock;      // guards offsets and reservations, never held while copying
     data_store_t *store;        // pointer to rtc data store
     size_t wrap_cnt;            // keep track of no. of times wrapping happened
+    uint16_t reserved;          // bytes reserved after the filled ones, being written
+    bool reading;               // reader is copying filled data, it must not be overwritten
+    bool peeked;                // filled data handed out in place, kept until the next release
+    size_t quota;               // configured size
+    size_t floor;               // size below which the buffer does not lend space
+#if CONFIG_RTC_STORE_NON_CRITICAL_DOWNSAMPLE
+    uint16_t sample_cnt;        // records offered since the buffer went past the watermark
+#endif
+    uint8_t pending_first;
+    uint8_t pending_count;
+    pending_write_t pending[RTC_STORE_MAX_PENDING_WRITES];
+#if CONFIG_RTC_STORE_PAGE_CRC
+    rtc_store_pages_t *pages;   // page CRCs and record starts, in RTC memory
+#endif
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+    rtc_store_index_t *index;   // record boundaries, NULL if not tracked
+#endif
 } rbuf_data_t;
 
 typedef struct {
@@ -107,19 +183,17 @@ typedef struct {
 
 // have a strategy to invalidate data beyond this
 //
-#define RTC_STORE_MAX_META_RECORDS  (10) // Max master records possible
-
 // each data record must have an identifier to point a meta
 
 typedef struct {
-    struct {
-        data_store_t store;
-        uint8_t buf[DIAG_CRITICAL_BUF_SIZE];
-    } critical;
-    struct {
-        data_store_t store;
-        uint8_t buf[DIAG_NON_CRITICAL_BUF_SIZE];
-    } non_critical;
+    data_store_t critical;
+    data_store_t non_critical;
+    uint16_t boundary;          // size of the critical part of the arena
+    uint8_t arena[DIAG_ARENA_SIZE];
+#if CONFIG_RTC_STORE_PAGE_CRC
+    rtc_store_pages_t critical_pages;
+    rtc_store_pages_t non_critical_pages;
+#endif
     rtc_store_meta_header_t meta[RTC_STORE_MAX_META_RECORDS];
     uint8_t meta_hdr_idx;
 } rtc_store_t;
@@ -130,24 +204,70 @@ typedef struct {
     rtc_store_t *rtc_store;
     size_t critical_buf_size;
     size_t non_critical_buf_size;
+    size_t meta_hdr_size;
 } rtc_store_meta_info_t;
 
+_Static_assert(sizeof(rtc_store_t) <= RTC_STORE_RTC_MEM_SIZE, "RTC_STORE_RTC_MEM_SIZE is below the store size");
+
 static rtc_store_priv_data_t s_priv_data;
 RTC_NOINIT_ATTR static rtc_store_t s_rtc_store;
 
-static inline size_t data_store_get_size(data_store_t *store)
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+static uint16_t s_non_critical_ends[NON_CRITICAL_INDEX_SIZE];
+static rtc_store_index_t s_non_critical_index = {
+    .ends = s_non_critical_ends,
+    .size = NON_CRITICAL_INDEX_SIZE,
+};
+
+static void rtc_store_index_reset(rtc_store_index_t *index)
 {
-    return store->size;
+    index->first = 0;
+    index->count = 0;
+    index->read_pos = 0;
+    index->write_pos = 0;
 }
 
-static inline size_t data_store_get_free_at_end(data_store_t *store)
+static inline uint16_t rtc_store_index_end(rtc_store_index_t *index, uint16_t i)
 {
-    data_store_info_t *info = (data_store_info_t *) &store->info;
-    size_t free_at_end = 0;
-    if (info->read_offset + info->filled < store->size) {
-        free_at_end = store->size - (info->filled + info->read_offset);
+    return (uint16_t) (index->ends[(index->first + i) % index->size] - index->read_pos);
+}
+
+/* Number of records that end within len bytes from the read offset, called with spinlock held */
+static uint16_t rtc_store_index_count_within(rtc_store_index_t *index, size_t len)
+{
+    uint16_t lo = 0, hi = index->count;
+    while (lo < hi) {
+        uint16_t mid = lo + (hi - lo) / 2;
+        if (rtc_store_index_end(index, mid) <= len) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    return free_at_end;
+    return lo;
+}
+
+/* Called with spinlock held */
+static void rtc_store_index_push(rtc_store_index_t *index, size_t len)
+{
+    index->write_pos += len;
+    index->ends[(index->first + index->count) % index->size] = index->write_pos;
+    index->count++;
+}
+
+/* Drops the records released by moving the read offset by len, called with spinlock held */
+static void rtc_store_index_release(rtc_store_index_t *index, size_t len)
+{
+    uint16_t done = rtc_store_index_count_within(index, len);
+    index->first = (index->first + done) % index->size;
+    index->count -= done;
+    index->read_pos += len;
+}
+#endif
+
+static inline size_t data_store_get_size(data_store_t *store)
+{
+    return store->size;
 }
 
 static inline size_t data_store_get_free(data_store_t *store)
@@ -162,14 +282,12 @@ static inline size_t data_store_get_filled(data_store_t *store)
     return info->filled;
 }
 
+/* Called with spinlock held */
 static void rtc_store_read_complete(rbuf_data_t *rbuf_data, size_t len)
 {
     data_store_info_t info =  {
         .value = rbuf_data->store->info.value,
     };
-#if RTC_STORE_DBG_PRINTS
-    ESP_LOGI(TAG, "to free %u, size %u", len, rbuf_data->store->size);
-#endif
     // modify new pointers
     info.filled -= len;
     info.read_offset += len;
@@ -181,58 +299,228 @@ static void rtc_store_read_complete(rbuf_data_t *rbuf_data, size_t len)
 
     // commit modifications
     rbuf_data->store->info.value = info.value;
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+    if (rbuf_data->index) {
+        rtc_store_index_release(rbuf_data->index, len);
+    }
+#endif
 }
 
+/* Called with spinlock held */
 static void rtc_store_write_complete(rbuf_data_t *rbuf_data, size_t len)
 {
     data_store_info_t *info = (data_store_info_t *) &rbuf_data->store->info;
-#if RTC_STORE_DBG_PRINTS
-    ESP_LOGI(TAG, "before write_complete, filled %" PRIu16 ", size %u, read_offset %" PRIu16 ", len %u",
-             info->filled, rbuf_data->store->size, info->read_offset, len);
+    info->filled += len;
+}
+
+/* Offset following the filled data, called with spinlock held */
+static inline size_t rtc_store_get_write_offset(rbuf_data_t *rbuf_data)
+{
+    data_store_info_t *info = (data_store_info_t *) &rbuf_data->store->info;
+    return (info->read_offset + info->filled) % rbuf_data->store->size;
+}
+
+#if CONFIG_RTC_STORE_PAGE_CRC
+static inline size_t rtc_store_page_count(data_store_t *store)
+{
+    return (store->size + RTC_STORE_PAGE_SIZE - 1) / RTC_STORE_PAGE_SIZE;
+}
+
+static inline size_t rtc_store_page_end(data_store_t *store, size_t page)
+{
+    size_t end = (page + 1) * RTC_STORE_PAGE_SIZE;
+    return end < store->size ? end : store->size;
+}
+
+/* Bitmap of the pages holding len bytes from offset */
+static uint32_t rtc_store_pages_span(data_store_t *store, size_t offset, size_t len)
+{
+    size_t count = rtc_store_page_count(store);
+    if (!len) {
+        return 0;
+    }
+    if (len + RTC_STORE_PAGE_SIZE > store->size) {
+        return (count == 32) ? UINT32_MAX : ((1U << count) - 1);
+    }
+    size_t page = (offset % store->size) / RTC_STORE_PAGE_SIZE;
+    size_t last = ((offset + len - 1) % store->size) / RTC_STORE_PAGE_SIZE;
+    uint32_t span = 1U << page;
+    while (page != last) {
+        page = (page + 1) % count;
+        span |= 1U << page;
+    }
+    return span;
+}
+
+/* Extends the CRCs of the pages with a record published at offset, pages restart when they are reused.
+ * Called with spinlock held, records are published in order.
+ */
+static void rtc_store_pages_publish(data_store_t *store, rtc_store_pages_t *pages, size_t offset, size_t len)
+{
+    bool start = true;
+    while (len) {
+        size_t page = offset / RTC_STORE_PAGE_SIZE;
+        size_t in_page = offset % RTC_STORE_PAGE_SIZE;
+        size_t n = rtc_store_page_end(store, page) - offset;
+        rtc_store_page_t *pg = &pages->page[page];
+        if (n > len) {
+            n = len;
+        }
+        if (in_page == 0) {
+            pg->crc = 0;
+            pages->has_rec &= ~(1U << page);
+        }
+        if (start) {
+            if (!(pages->has_rec & (1U << page))) {
+                pg->first = in_page;
+                pages->has_rec |= 1U << page;
+            }
+            pg->last = in_page;
+            start = false;
+        }
+        pg->crc = esp_crc16_le(pg->crc, store->buf + offset, n);
+        offset += n;
+        len -= n;
+        if (offset == store->size) {
+            offset = 0;
+        }
+    }
+}
+
+/* A buffer growing at its start moves its pages up, called with spinlock held */
+static void rtc_store_pages_shift(rtc_store_pages_t *pages, size_t count, size_t by)
+{
+    memmove(&pages->page[by], &pages->page[0], (count - by) * sizeof(pages->page[0]));
+    pages->has_rec <<= by;
+    pages->dirty <<= by;
+}
 #endif
 
-    info->filled += len;
+/* Free space not taken by filled or reserved data, called with spinlock held */
+static inline size_t rtc_store_get_free(rbuf_data_t *rbuf_data)
+{
+    return data_store_get_free(rbuf_data->store) - rbuf_data->reserved;
+}
 
-#if RTC_STORE_DBG_PRINTS
-    ESP_LOGI(TAG, "after write_complete, filled %" PRIu16 ", size %u, read_offset %" PRIu16 ", len %u",
-             info->filled, rbuf_data->store->size, info->read_offset, len);
+/* When free space drops below (100 - reporting_watermark)% of the current size then we post an event,
+ * called with spinlock held
+ */
+static inline size_t rtc_store_get_watermark(rbuf_data_t *rbuf_data)
+{
+    return (data_store_get_size(rbuf_data->store) * (100 - CONFIG_DIAG_DATA_STORE_REPORTING_WATERMARK_PERCENT)) / 100;
+}
+
+/* Moves the boundary between the buffers so that the taker gets the space the other buffer has above
+ * its floor. The lender must be idle, it restarts empty. The taker keeps its data in place, so it must
+ * not wrap around and no one may be copying it. Takes both spinlocks, critical first.
+ */
+static bool rtc_store_borrow(rbuf_data_t *taker)
+{
+    rbuf_data_t *critical = &s_priv_data.critical;
+    rbuf_data_t *non_critical = &s_priv_data.non_critical;
+    rbuf_data_t *lender = (taker == critical) ? non_critical : critical;
+    data_store_t *t = taker->store;
+    data_store_t *l = lender->store;
+    bool borrowed = false;
+
+    portENTER_CRITICAL_SAFE(&critical->spinlock);
+    portENTER_CRITICAL_SAFE(&non_critical->spinlock);
+    // keep the lent size a multiple of 4 or of the page size, sizes stay as unaligned as configured
+    size_t lend = (l->size > lender->floor) ? ((l->size - lender->floor) & ~(RTC_STORE_LEND_ALIGN - 1)) : 0;
+    if (lend && !l->info.filled && !lender->reserved && !lender->reading && !lender->peeked
+            && !taker->reserved && !taker->reading) {
+        if (!t->info.filled) {
+            t->info.value = 0;
+        }
+        if (t->info.read_offset + t->info.filled <= t->size) {
+            l->info.value = 0;
+            l->size -= lend;
+            t->size += lend;
+            if (taker == critical) {
+                l->buf += lend;
+            } else {
+                t->buf -= lend;
+                t->info.read_offset += lend;
+#if CONFIG_RTC_STORE_PAGE_CRC
+                rtc_store_pages_shift(taker->pages, RTC_STORE_MAX_PAGES, lend / RTC_STORE_PAGE_SIZE);
 #endif
+            }
+#if CONFIG_RTC_STORE_PAGE_CRC
+            lender->pages->dirty = 0;
+            lender->pages->has_rec = 0;
+#endif
+            s_rtc_store.boundary = critical->store->size;
+            borrowed = true;
+        }
+    }
+    portEXIT_CRITICAL_SAFE(&non_critical->spinlock);
+    portEXIT_CRITICAL_SAFE(&critical->spinlock);
+    return borrowed;
 }
 
-// Caller has made sure that enough memory is free...
-static size_t rtc_store_write_at_offset(rbuf_data_t *rbuf_data, void *data, size_t len, size_t offset)
+/* Reserves len bytes after the filled and reserved ones, called with spinlock held */
+static esp_err_t rtc_store_reserve(rbuf_data_t *rbuf_data, size_t len, uint16_t *offset, uint8_t *slot)
 {
     data_store_info_t *info = (data_store_info_t *) &rbuf_data->store->info;
-#if RTC_STORE_DBG_PRINTS
-    ESP_LOGI(TAG, "(write_at_offset): size %u, available: %u, filled %u, read_ptr %" PRIu16 ", to_write %u",
-             rbuf_data->store->size, data_store_get_free(rbuf_data->store),
-             data_store_get_filled(rbuf_data->store), info->read_offset, len);
+    if (rtc_store_get_free(rbuf_data) < len || rbuf_data->pending_count >= RTC_STORE_MAX_PENDING_WRITES) {
+        return ESP_ERR_NO_MEM;
+    }
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+    if (rbuf_data->index) {
+        if (rbuf_data->index->count >= rbuf_data->index->size) {
+            return ESP_ERR_NO_MEM;
+        }
+        rtc_store_index_push(rbuf_data->index, len);
+    }
 #endif
-
-    uint16_t write_offset = info->filled + info->read_offset;
-    if (write_offset >= rbuf_data->store->size) { // wrap around
+    size_t write_offset = info->read_offset + info->filled + rbuf_data->reserved;
+    while (write_offset >= rbuf_data->store->size) { // wrap around
         write_offset -= rbuf_data->store->size;
     }
+    *offset = write_offset;
+#if CONFIG_RTC_STORE_PAGE_CRC
+    rbuf_data->pages->dirty |= rtc_store_pages_span(rbuf_data->store, write_offset, len);
+#endif
+    *slot = (rbuf_data->pending_first + rbuf_data->pending_count) % RTC_STORE_MAX_PENDING_WRITES;
+    rbuf_data->pending[*slot].len = len;
+    rbuf_data->pending[*slot].committed = false;
+    rbuf_data->pending_count++;
+    rbuf_data->reserved += len;
+    return ESP_OK;
+}
 
-    size_t free_at_end = data_store_get_free_at_end(rbuf_data->store);
-    if (free_at_end && (free_at_end < offset)) {
-        offset -= free_at_end;
-        memcpy(rbuf_data->store->buf + offset, data, len);
-    } else if (free_at_end && (free_at_end < offset + len)) {
-        free_at_end -= offset;
-        uint8_t *write_ptr = (uint8_t *) (rbuf_data->store->buf + write_offset + offset);
-        memcpy(write_ptr, data, free_at_end);
-        memcpy(rbuf_data->store->buf, data + free_at_end, len - free_at_end);
-    } else {
-        uint8_t *write_ptr = (uint8_t *) (rbuf_data->store->buf + write_offset + offset);
-        memcpy(write_ptr, data, len);
+/* Marks the record written and publishes all committed records at the front, called with spinlock held */
+static void rtc_store_commit(rbuf_data_t *rbuf_data, uint8_t slot)
+{
+    rbuf_data->pending[slot].committed = true;
+    while (rbuf_data->pending_count && rbuf_data->pending[rbuf_data->pending_first].committed) {
+        uint16_t len = rbuf_data->pending[rbuf_data->pending_first].len;
+        rbuf_data->reserved -= len;
+#if CONFIG_RTC_STORE_PAGE_CRC
+        rtc_store_pages_publish(rbuf_data->store, rbuf_data->pages, rtc_store_get_write_offset(rbuf_data), len);
+#endif
+        rtc_store_write_complete(rbuf_data, len);
+        rbuf_data->pending_first = (rbuf_data->pending_first + 1) % RTC_STORE_MAX_PENDING_WRITES;
+        rbuf_data->pending_count--;
     }
-    return len;
+#if CONFIG_RTC_STORE_PAGE_CRC
+    rbuf_data->pages->dirty = rtc_store_pages_span(rbuf_data->store, rtc_store_get_write_offset(rbuf_data),
+                                                   rbuf_data->reserved);
+#endif
 }
 
-static size_t rtc_store_write(rbuf_data_t *rbuf_data, void *data, size_t len)
+/* Copies to the reserved space at offset, returns the offset following the copied data */
+static uint16_t rtc_store_copy(rbuf_data_t *rbuf_data, uint16_t offset, const void *data, size_t len)
 {
-    return rtc_store_write_at_offset(rbuf_data, data, len, 0);
+    size_t free_at_end = rbuf_data->store->size - offset;
+    if (free_at_end < len) {
+        memcpy(rbuf_data->store->buf + offset, data, free_at_end);
+        memcpy(rbuf_data->store->buf, (const uint8_t *) data + free_at_end, len - free_at_end);
+        return len - free_at_end;
+    }
+    memcpy(rbuf_data->store->buf + offset, data, len);
+    offset += len;
+    return offset == rbuf_data->store->size ? 0 : offset;
 }
 
 esp_err_t rtc_store_critical_data_write(void *data, size_t len)
@@ -253,33 +541,45 @@ esp_err_t rtc_store_critical_data_write(void *data, size_t len)
                 len_real, DIAG_CRITICAL_BUF_SIZE);
         return ESP_FAIL;
     }
-    xSemaphoreTake(s_priv_data.critical.lock, portMAX_DELAY);
+    rbuf_data_t *rbuf_data = &s_priv_data.critical;
+    uint16_t offset;
+    uint8_t slot;
+
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+    size_t curr_free = rtc_store_get_free(rbuf_data);
+    ret = rtc_store_reserve(rbuf_data, len_real, &offset, &slot);
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+
+    if (ret != ESP_OK && rtc_store_borrow(rbuf_data)) {
+        portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+        ret = rtc_store_reserve(rbuf_data, len_real, &offset, &slot);
+        portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+    }
 
-    size_t curr_free = data_store_get_free(s_priv_data.critical.store);
-    // size_t free_at_end = data_store_get_free_at_end(s_priv_data.critical.store);
     // If no space available... Raise write fail event
-    if (curr_free < len_real) {
+    if (ret != ESP_OK) {
         esp_event_post(ESP_DIAG_DATA_STORE_EVENT, ESP_DIAG_DATA_STORE_EVENT_CRITICAL_DATA_WRITE_FAIL, data, len_real, 0);
 #if RTC_STORE_DBG_PRINTS
         printf("%s, curr_free %d, req_free %d\n", TAG, curr_free, len_real);
 #endif
-        ret = ESP_ERR_NO_MEM;
-    } else { // we have enough space of (len + 1)
-        rtc_store_write(&s_priv_data.critical, &s_rtc_store.meta_hdr_idx, 1);
-        rtc_store_write_at_offset(&s_priv_data.critical, data, len, 1);
-        rtc_store_write_complete(&s_priv_data.critical, len + 1);
-        curr_free = data_store_get_free(s_priv_data.critical.store);
+        return ret;
     }
-    xSemaphoreGive(s_priv_data.critical.lock);
+    // we have reserved space of (len + 1)
+    offset = rtc_store_copy(rbuf_data, offset, &s_rtc_store.meta_hdr_idx, 1);
+    rtc_store_copy(rbuf_data, offset, data, len);
 
-    if (curr_free < DIAG_CRITICAL_DATA_REPORTING_WATERMARK) {
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+    rtc_store_commit(rbuf_data, slot);
+    curr_free = rtc_store_get_free(rbuf_data);
+    size_t watermark = rtc_store_get_watermark(rbuf_data);
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+
+    if (curr_free < watermark) {
         esp_event_post(ESP_DIAG_DATA_STORE_EVENT, ESP_DIAG_DATA_STORE_EVENT_CRITICAL_DATA_LOW_MEM, NULL, 0, 0);
     }
     return ret;
 }
 
-static int rtc_store_data_read_unsafe(rbuf_data_t *rbuf_data, uint8_t *buf, size_t size);
-
 esp_err_t rtc_store_non_critical_data_write(const char *dg, void *data, size_t len)
 {
     if (!dg || !len || !data) {
@@ -294,7 +594,11 @@ esp_err_t rtc_store_non_critical_data_write(const char *dg, void *data, size_t l
     }
     rtc_store_non_critical_data_hdr_t header;
     size_t req_free = sizeof(header) + len + 1; // 1 byte for meta index
-    size_t curr_free;
+    size_t curr_free, watermark;
+    rbuf_data_t *rbuf_data = &s_priv_data.non_critical;
+    uint16_t offset;
+    uint8_t slot;
+    esp_err_t ret;
 
     if (req_free > DIAG_NON_CRITICAL_BUF_SIZE) {
         printf("rtc_store_non_critical_data_write: len too large %d, size %d\n",
@@ -302,42 +606,65 @@ esp_err_t rtc_store_non_critical_data_write(const char *dg, void *data, size_t l
         return ESP_FAIL;
     }
 
-    if (xSemaphoreTake(s_priv_data.non_critical.lock, 0) == pdFALSE) {
-        return ESP_FAIL;
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+#if CONFIG_RTC_STORE_NON_CRITICAL_DOWNSAMPLE
+    /* Past the watermark only every n-th record is kept */
+    if (rtc_store_get_free(rbuf_data) >= rtc_store_get_watermark(rbuf_data)) {
+        rbuf_data->sample_cnt = 0;
+    } else if (rbuf_data->sample_cnt++ % CONFIG_RTC_STORE_NON_CRITICAL_DOWNSAMPLE_RATIO) {
+        portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+        return ESP_OK;
     }
+#endif
+    ret = rtc_store_reserve(rbuf_data, req_free, &offset, &slot);
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
 
+    if (ret != ESP_OK && rtc_store_borrow(rbuf_data)) {
+        portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+        ret = rtc_store_reserve(rbuf_data, req_free, &offset, &slot);
+        portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+    }
 #if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
-    /* Make enough room for the item */
-    while (data_store_get_free(s_priv_data.non_critical.store) < req_free) {
-        uint8_t tmp_buf[sizeof(header) + 1];
-        rtc_store_data_read_unsafe(&s_priv_data.non_critical, tmp_buf, sizeof(tmp_buf));
-        memcpy(&header, tmp_buf + 1, sizeof(header)); // because 1 byte is meta_hdr idx
-        size_t to_free = sizeof(tmp_buf) + header.len;
-        rtc_store_read_complete(&s_priv_data.non_critical, to_free);
-    }
-#else // just check if we have enough space to write the item
-    curr_free = data_store_get_free(s_priv_data.non_critical.store);
-    if (curr_free < req_free) {
-        xSemaphoreGive(s_priv_data.non_critical.lock);
-        esp_event_post(ESP_DIAG_DATA_STORE_EVENT, ESP_DIAG_DATA_STORE_EVENT_NON_CRITICAL_DATA_LOW_MEM, NULL, 0, 0);
-        return ESP_ERR_NO_MEM;
+    if (ret != ESP_OK) {
+        /* Make enough room for the item by dropping the oldest records up to the first boundary that
+         * frees enough, only committed data can be dropped and not while it is being read
+         */
+        portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+        curr_free = rtc_store_get_free(rbuf_data);
+        if (curr_free < req_free && !rbuf_data->reading && !rbuf_data->peeked) {
+            rtc_store_index_t *index = rbuf_data->index;
+            size_t filled = data_store_get_filled(rbuf_data->store);
+            uint16_t i = rtc_store_index_count_within(index, req_free - curr_free - 1);
+            if (i < index->count && rtc_store_index_end(index, i) <= filled) {
+                rtc_store_read_complete(rbuf_data, rtc_store_index_end(index, i));
+            }
+        }
+        ret = rtc_store_reserve(rbuf_data, req_free, &offset, &slot);
+        portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
     }
 #endif
+    if (ret != ESP_OK) {
+        esp_event_post(ESP_DIAG_DATA_STORE_EVENT, ESP_DIAG_DATA_STORE_EVENT_NON_CRITICAL_DATA_LOW_MEM, NULL, 0, 0);
+        return ret;
+    }
+
     memset(&header, 0, sizeof(header));
     header.dg = dg;
     header.len = len;
 
-    // we have made sure of free size at this point, write index byte, data header and then actual data
-    rtc_store_write(&s_priv_data.non_critical, &s_rtc_store.meta_hdr_idx, 1);
-    rtc_store_write_at_offset(&s_priv_data.non_critical, &header, sizeof(header), 1);
-    rtc_store_write_at_offset(&s_priv_data.non_critical, data, len, 1 + sizeof(header));
-    rtc_store_write_complete(&s_priv_data.non_critical, req_free);
+    // we have reserved the space at this point, write index byte, data header and then actual data
+    offset = rtc_store_copy(rbuf_data, offset, &s_rtc_store.meta_hdr_idx, 1);
+    offset = rtc_store_copy(rbuf_data, offset, &header, sizeof(header));
+    rtc_store_copy(rbuf_data, offset, data, len);
 
-    curr_free = data_store_get_free(s_priv_data.non_critical.store);
-    xSemaphoreGive(s_priv_data.non_critical.lock);
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+    rtc_store_commit(rbuf_data, slot);
+    curr_free = rtc_store_get_free(rbuf_data);
+    watermark = rtc_store_get_watermark(rbuf_data);
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
 
     // Post low memory event even if data overwrite is enabled.
-    if (curr_free < DIAG_NON_CRITICAL_DATA_REPORTING_WATERMARK) {
+    if (curr_free < watermark) {
         esp_event_post(ESP_DIAG_DATA_STORE_EVENT, ESP_DIAG_DATA_STORE_EVENT_NON_CRITICAL_DATA_LOW_MEM, NULL, 0, 0);
     }
     return ESP_OK;
@@ -372,26 +699,74 @@ static int rtc_store_data_read(rbuf_data_t *rbuf_data, uint8_t *buf, size_t size
         return -1;
     }
 
+    /* Writers only add data after the filled one, it is copied without holding the spinlock */
     xSemaphoreTake(rbuf_data->lock, portMAX_DELAY);
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+    rbuf_data->reading = true;
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
     size = rtc_store_data_read_unsafe(rbuf_data, buf, size);
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+    rbuf_data->reading = false;
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
     xSemaphoreGive(rbuf_data->lock);
     return size;
 }
 
-static esp_err_t rtc_store_data_release(rbuf_data_t *rbuf_data, size_t size)
+static int rtc_store_data_peek(rbuf_data_t *rbuf_data, esp_diag_data_store_span_t spans[2])
+{
+    if (!spans || !s_priv_data.init) {
+        return -1;
+    }
+    xSemaphoreTake(rbuf_data->lock, portMAX_DELAY);
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+    data_store_info_t info = {
+        .value = rbuf_data->store->info.value,
+    };
+    if (info.filled) {
+        rbuf_data->peeked = true;
+    }
+    /* The buffer may move when its neighbour lends it space, take its place under the spinlock */
+    size_t read_offset = info.read_offset;
+    if (read_offset == rbuf_data->store->size) {
+        read_offset = 0;
+    }
+    size_t data_at_end = rbuf_data->store->size - read_offset;
+    spans[0].data = rbuf_data->store->buf + read_offset;
+    spans[0].len = info.filled < data_at_end ? info.filled : data_at_end;
+    spans[1].data = rbuf_data->store->buf;
+    spans[1].len = info.filled - spans[0].len;
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+    xSemaphoreGive(rbuf_data->lock);
+    return info.filled;
+}
+
+/* Releases size bytes from the start of the data, the rest stays peeked if keep_peek is set */
+static esp_err_t rtc_store_data_release(rbuf_data_t *rbuf_data, size_t size, bool keep_peek)
 {
     if (!s_priv_data.init) {
         return ESP_ERR_INVALID_STATE;
     }
+#if RTC_STORE_DBG_PRINTS
+    ESP_LOGI(TAG, "to free %u, size %u", size, rbuf_data->store->size);
+#endif
+    esp_err_t ret = ESP_OK;
     xSemaphoreTake(rbuf_data->lock, portMAX_DELAY);
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
     data_store_info_t *info = (data_store_info_t *) &rbuf_data->store->info;
     if (info->filled < size) {
-        xSemaphoreGive(rbuf_data->lock);
-        return ESP_FAIL;
+        ret = ESP_FAIL;
+    } else {
+        rtc_store_read_complete(rbuf_data, size);
+    }
+    rbuf_data->peeked = keep_peek && info->filled;
+    // lent space is taken back once drained, data would wrap around and keep it from growing later
+    bool reclaim = !info->filled && rbuf_data->store->size < rbuf_data->quota;
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+    if (reclaim) {
+        rtc_store_borrow(rbuf_data);
     }
-    rtc_store_read_complete(rbuf_data, size);
     xSemaphoreGive(rbuf_data->lock);
-    return ESP_OK;
+    return ret;
 }
 
 int rtc_store_critical_data_read(uint8_t *buf, size_t size)
@@ -399,11 +774,16 @@ int rtc_store_critical_data_read(uint8_t *buf, size_t size)
     return rtc_store_data_read(&s_priv_data.critical, buf, size);
 }
 
+int rtc_store_critical_data_peek(esp_diag_data_store_span_t spans[2])
+{
+    return rtc_store_data_peek(&s_priv_data.critical, spans);
+}
+
 int rtc_store_critical_data_read_and_release(uint8_t *buf, size_t size)
 {
     int data_read = rtc_store_data_read(&s_priv_data.critical, buf, size);
     if (data_read > 0) {
-        rtc_store_data_release(&s_priv_data.critical, size);
+        rtc_store_data_release(&s_priv_data.critical, size, false);
     }
     return data_read;
 }
@@ -413,31 +793,98 @@ int rtc_store_non_critical_data_read(uint8_t *buf, size_t size)
     return rtc_store_data_read(&s_priv_data.non_critical, buf, size);
 }
 
+int rtc_store_non_critical_data_peek(esp_diag_data_store_span_t spans[2])
+{
+    return rtc_store_data_peek(&s_priv_data.non_critical, spans);
+}
+
 int rtc_store_non_critical_data_read_and_release(uint8_t *buf, size_t size)
 {
     int data_read = rtc_store_data_read(&s_priv_data.non_critical, buf, size);
     if (data_read > 0) {
-        rtc_store_data_release(&s_priv_data.non_critical, data_read);
+        rtc_store_data_release(&s_priv_data.non_critical, data_read, false);
     }
     return data_read;
 }
 
 esp_err_t rtc_store_critical_data_release(size_t size)
 {
-    return rtc_store_data_release(&s_priv_data.critical, size);
+    return rtc_store_data_release(&s_priv_data.critical, size, false);
+}
+
+esp_err_t rtc_store_critical_data_release_partial(size_t size)
+{
+    return rtc_store_data_release(&s_priv_data.critical, size, true);
 }
 
 esp_err_t rtc_store_non_critical_data_release(size_t size)
 {
-    return rtc_store_data_release(&s_priv_data.non_critical, size);
+    return rtc_store_data_release(&s_priv_data.non_critical, size, false);
+}
+
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+static esp_err_t rtc_store_data_spill(rbuf_data_t *rbuf_data, rtc_store_spill_cb_t cb, void *priv)
+{
+    if (!s_priv_data.init || !cb) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(rbuf_data->lock, portMAX_DELAY);
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+    data_store_info_t info = {
+        .value = rbuf_data->store->info.value,
+    };
+    /* Peeked data is being encoded in place, it stays until released */
+    bool spill = info.filled && !rbuf_data->peeked &&
+                 info.filled >= (rbuf_data->store->size * CONFIG_DIAG_DATA_STORE_FLASH_SPILL_PERCENT) / 100;
+    if (spill) {
+        rbuf_data->reading = true;
+    }
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+
+    if (spill) {
+        /* Only committed data is handed over, it holds whole records */
+        size_t data_at_end = rbuf_data->store->size - info.read_offset;
+        if (data_at_end < info.filled) {
+            ret = cb(rbuf_data->store->buf + info.read_offset, data_at_end,
+                     rbuf_data->store->buf, info.filled - data_at_end, priv);
+        } else {
+            ret = cb(rbuf_data->store->buf + info.read_offset, info.filled, NULL, 0, priv);
+        }
+        portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+        if (ret == ESP_OK) {
+            rtc_store_read_complete(rbuf_data, info.filled);
+        }
+        rbuf_data->reading = false;
+        portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+    }
+    xSemaphoreGive(rbuf_data->lock);
+    return ret;
+}
+
+esp_err_t rtc_store_critical_data_spill(rtc_store_spill_cb_t cb, void *priv)
+{
+    return rtc_store_data_spill(&s_priv_data.critical, cb, priv);
 }
 
+esp_err_t rtc_store_non_critical_data_spill(rtc_store_spill_cb_t cb, void *priv)
+{
+    return rtc_store_data_spill(&s_priv_data.non_critical, cb, priv);
+}
+#endif /* CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW */
+
 static void rtc_store_rbuf_deinit(rbuf_data_t *rbuf_data)
 {
     if (rbuf_data->lock) {
         vSemaphoreDelete(rbuf_data->lock);
         rbuf_data->lock = NULL;
     }
+    rbuf_data->reserved = 0;
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+    rbuf_data->index = NULL;
+#endif
+    rbuf_data->pending_first = 0;
+    rbuf_data->pending_count = 0;
 }
 
 void rtc_store_deinit(void)
@@ -447,6 +894,21 @@ void rtc_store_deinit(void)
     s_priv_data.init = false;
 }
 
+/* RTC memory does not hold valid data after these resets. It is usually kept through a brownout,
+ * with page CRCs the data is checked and salvaged instead.
+ */
+static bool rtc_store_is_data_lost(esp_reset_reason_t reset_reason)
+{
+    if (reset_reason == ESP_RST_UNKNOWN || reset_reason == ESP_RST_POWERON) {
+        return true;
+    }
+#if CONFIG_RTC_STORE_PAGE_CRC
+    return false;
+#else
+    return reset_reason == ESP_RST_BROWNOUT;
+#endif
+}
+
 static bool rtc_store_integrity_check(data_store_t *store)
 {
     data_store_info_t *info = (data_store_info_t *) &store->info;
@@ -457,13 +919,195 @@ static bool rtc_store_integrity_check(data_store_t *store)
     return true;
 }
 
+#if CONFIG_RTC_STORE_PAGE_CRC
+/* Converts an offset in the buffer to its position from the read offset */
+static inline size_t rtc_store_rel(data_store_t *store, size_t offset)
+{
+    return (offset + store->size - store->info.read_offset % store->size) % store->size;
+}
+
+/* Position of the last known record start at or before pos, records in between are not known */
+static size_t rtc_store_record_before(data_store_t *store, rtc_store_pages_t *pages, size_t pos)
+{
+    size_t count = rtc_store_page_count(store);
+    size_t offset = (store->info.read_offset + pos) % store->size;
+    size_t page = offset / RTC_STORE_PAGE_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        if (pages->has_rec & (1U << page)) {
+            size_t base = page * RTC_STORE_PAGE_SIZE;
+            size_t last = rtc_store_rel(store, base + pages->page[page].last);
+            size_t first = rtc_store_rel(store, base + pages->page[page].first);
+            if (last <= pos) {
+                return last;
+            }
+            if (first <= pos) {
+                return first;
+            }
+        }
+        page = (page + count - 1) % count;
+    }
+    return 0;
+}
+
+/* Position of the first known record start at or after pos, the end of the data if there is none */
+static size_t rtc_store_record_after(data_store_t *store, rtc_store_pages_t *pages, size_t pos)
+{
+    size_t filled = store->info.filled;
+    size_t count = rtc_store_page_count(store);
+    size_t offset = (store->info.read_offset + pos) % store->size;
+    size_t page = offset / RTC_STORE_PAGE_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        if (pages->has_rec & (1U << page)) {
+            size_t base = page * RTC_STORE_PAGE_SIZE;
+            size_t first = rtc_store_rel(store, base + pages->page[page].first);
+            size_t last = rtc_store_rel(store, base + pages->page[page].last);
+            if (first >= pos && first < filled) {
+                return first;
+            }
+            if (last >= pos && last < filled) {
+                return last;
+            }
+        }
+        page = (page + 1) % count;
+    }
+    return filled;
+}
+
+/* Checks the pages holding data, records touching a damaged page are dropped and the rest is moved
+ * to the start of the buffer. Data written to a page before it was reused is not covered by its CRC,
+ * which only happens to the page holding the oldest data.
+ */
+static void rtc_store_salvage(rbuf_data_t *rbuf_data, bool all_pages)
+{
+    data_store_t *store = rbuf_data->store;
+    rtc_store_pages_t *pages = rbuf_data->pages;
+    size_t filled = store->info.filled;
+    size_t read_offset = store->info.read_offset % store->size;
+    size_t write_offset = (read_offset + filled) % store->size;
+    uint32_t live = rtc_store_pages_span(store, read_offset, filled);
+    uint32_t check = all_pages ? live : (pages->dirty & live);
+    uint32_t bad = 0;
+
+    for (size_t page = 0; page < rtc_store_page_count(store); page++) {
+        if (!(check & (1U << page))) {
+            continue;
+        }
+        size_t base = page * RTC_STORE_PAGE_SIZE;
+        size_t end = rtc_store_page_end(store, page);
+        rtc_store_page_t *pg = &pages->page[page];
+        if ((pages->has_rec & (1U << page)) &&
+                (pg->first > pg->last || base + pg->last >= end)) {
+            bad |= 1U << page;
+            continue;
+        }
+        if (write_offset > base && write_offset < end) {
+            end = write_offset;
+        } else if (write_offset == base && (pages->dirty & (1U << page))) {
+            continue; // data from before the page is reused, partly overwritten by the write in progress
+        }
+        if (esp_crc16_le(0, store->buf + base, end - base) != pg->crc) {
+            bad |= 1U << page;
+        }
+    }
+    pages->dirty = 0;
+    if (!bad) {
+        return;
+    }
+
+    /* Keep the data between the records that touch damaged pages */
+    uint8_t *tmp = malloc(filled);
+    if (!tmp) {
+        printf("%s: no memory to salvage data, discarding old data...\n", TAG);
+        store->info.value = 0;
+        pages->has_rec = 0;
+        return;
+    }
+    // record starts of the kept data: one per kept range and up to two per page
+    uint16_t starts[3 * RTC_STORE_MAX_PAGES + 1];
+    size_t max_starts = sizeof(starts) / sizeof(starts[0]);
+    size_t n_starts = 0;
+    size_t kept = 0;
+    size_t pos = 0;
+    while (pos < filled) {
+        /* find the next damaged page from pos */
+        size_t drop_from = filled, drop_to = filled;
+        for (size_t p = pos; p < filled; ) {
+            size_t offset = (read_offset + p) % store->size;
+            size_t page = offset / RTC_STORE_PAGE_SIZE;
+            size_t in_page = rtc_store_page_end(store, page) - offset;
+            if (bad & (1U << page)) {
+                drop_from = rtc_store_record_before(store, pages, p);
+                drop_to = rtc_store_record_after(store, pages, p + in_page);
+                break;
+            }
+            p += in_page;
+        }
+        if (drop_from < pos) {
+            drop_from = pos;
+        }
+        if (drop_from == pos) {
+            pos = drop_to;
+            continue;
+        }
+        /* keep [pos, drop_from), note the record starts in it */
+        starts[n_starts++] = kept;
+        for (size_t page = 0; page < rtc_store_page_count(store); page++) {
+            if (!(pages->has_rec & (1U << page))) {
+                continue;
+            }
+            size_t base = page * RTC_STORE_PAGE_SIZE;
+            size_t rec[2] = {
+                rtc_store_rel(store, base + pages->page[page].first),
+                rtc_store_rel(store, base + pages->page[page].last)
+            };
+            for (int i = 0; i < 2 && n_starts < max_starts; i++) {
+                if (rec[i] > pos && rec[i] < drop_from && (i == 0 || rec[1] != rec[0])) {
+                    starts[n_starts++] = kept + rec[i] - pos;
+                }
+            }
+        }
+        for (size_t p = pos; p < drop_from; p++) {
+            tmp[kept++] = store->buf[(read_offset + p) % store->size];
+        }
+        pos = drop_to;
+    }
+    printf("%s: %u bytes of damaged data dropped\n", TAG, (unsigned) (filled - kept));
+
+    /* Move the data to the start of the buffer and rebuild its pages */
+    memcpy(store->buf, tmp, kept);
+    free(tmp);
+    store->info.read_offset = 0;
+    store->info.filled = kept;
+    pages->has_rec = 0;
+    for (size_t i = 1; i < n_starts; i++) { // sort the record starts
+        uint16_t v = starts[i];
+        size_t j = i;
+        for (; j > 0 && starts[j - 1] > v; j--) {
+            starts[j] = starts[j - 1];
+        }
+        starts[j] = v;
+    }
+    for (size_t i = 0; i < n_starts; i++) {
+        size_t end = (i + 1 < n_starts) ? starts[i + 1] : kept;
+        if (end > starts[i]) {
+            rtc_store_pages_publish(store, pages, starts[i], end - starts[i]);
+        }
+    }
+}
+#endif
+
 static esp_err_t rtc_store_rbuf_init(rbuf_data_t *rbuf_data,
                                      data_store_t *rtc_store,
                                      uint8_t *rtc_buf,
-                                     size_t rtc_buf_size)
+                                     size_t rtc_buf_size,
+                                     size_t quota,
+                                     size_t floor)
 {
     esp_reset_reason_t reset_reason = esp_reset_reason();
 
+    rbuf_data->quota = quota;
+    rbuf_data->floor = floor;
+    portMUX_INITIALIZE(&rbuf_data->spinlock);
     rbuf_data->lock = xSemaphoreCreateMutex();
     if (!rbuf_data->lock) {
 #if RTC_STORE_DBG_PRINTS
@@ -473,9 +1117,7 @@ static esp_err_t rtc_store_rbuf_init(rbuf_data_t *rbuf_data,
     }
 
     /* Check for stale data */
-    if (reset_reason == ESP_RST_UNKNOWN ||
-            reset_reason == ESP_RST_POWERON ||
-            reset_reason == ESP_RST_BROWNOUT) {
+    if (rtc_store_is_data_lost(reset_reason)) {
         // TODO: also check if hash is changed
         rtc_store->info.value = 0;
     }
@@ -490,9 +1132,52 @@ static esp_err_t rtc_store_rbuf_init(rbuf_data_t *rbuf_data,
         printf("%s: intergrity_check failed, discarding old data...\n", TAG);
         rtc_store->info.value = 0;
     }
+#if CONFIG_RTC_STORE_PAGE_CRC
+    if (!rtc_store->info.filled) {
+        rtc_store->info.value = 0;
+        rbuf_data->pages->dirty = 0;
+        rbuf_data->pages->has_rec = 0;
+    } else {
+        /* After a brownout any page may be damaged, otherwise only the ones being written */
+        rtc_store_salvage(rbuf_data, reset_reason == ESP_RST_BROWNOUT);
+    }
+#endif
     return ESP_OK;
 }
 
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+/* Walks the records left by the previous boot, the data is discarded if they do not add up */
+static void rtc_store_index_rebuild(rbuf_data_t *rbuf_data, rtc_store_index_t *index)
+{
+    data_store_t *store = rbuf_data->store;
+    size_t filled = data_store_get_filled(store);
+    size_t off = 0;
+
+    rtc_store_index_reset(index);
+    while (off < filled) {
+        rtc_store_non_critical_data_hdr_t header;
+        uint8_t *dst = (uint8_t *) &header;
+        if (filled - off < 1 + sizeof(header) || index->count >= index->size) {
+            break;
+        }
+        for (size_t i = 0; i < sizeof(header); i++) {
+            dst[i] = store->buf[(store->info.read_offset + off + 1 + i) % store->size];
+        }
+        if (!header.len || header.len > filled - off - 1 - sizeof(header)) {
+            break;
+        }
+        rtc_store_index_push(index, 1 + sizeof(header) + header.len);
+        off += 1 + sizeof(header) + header.len;
+    }
+    if (off != filled) {
+        printf("%s: non critical records are corrupted, discarding old data...\n", TAG);
+        store->info.value = 0;
+        rtc_store_index_reset(index);
+    }
+    rbuf_data->index = index;
+}
+#endif
+
 rtc_store_meta_header_t *rtc_store_get_meta_record_by_index(uint8_t idx)
 {
     if (idx >= RTC_STORE_MAX_META_RECORDS) {
@@ -573,33 +1258,42 @@ skip_nvs_read_write:
 
     s_priv_data.meta_hdr->gen_id = gen_id;
     s_priv_data.meta_hdr->boot_cnt = boot_cnt;
+    s_priv_data.meta_hdr->ts_offset = 0;
 
     return ESP_OK;
 }
 
+static void rtc_store_rbuf_discard(rbuf_data_t *rbuf_data)
+{
+    xSemaphoreTake(rbuf_data->lock, portMAX_DELAY);
+    portENTER_CRITICAL_SAFE(&rbuf_data->spinlock);
+    /* Records being written stay reserved, they continue right after the discarded data */
+    rtc_store_read_complete(rbuf_data, data_store_get_filled(rbuf_data->store));
+    rbuf_data->peeked = false;
+    portEXIT_CRITICAL_SAFE(&rbuf_data->spinlock);
+    xSemaphoreGive(rbuf_data->lock);
+}
+
 esp_err_t rtc_store_discard_data(void)
 {
     if (!s_priv_data.init) {
         ESP_LOGW(TAG, "RTC Store not initialized yet. Cannot discard data.");
         return ESP_ERR_INVALID_STATE;
     }
-    xSemaphoreTake(s_priv_data.critical.lock, portMAX_DELAY);
-    s_rtc_store.critical.store.info.value = 0;
-    xSemaphoreGive(s_priv_data.critical.lock);
-    xSemaphoreTake(s_priv_data.non_critical.lock, portMAX_DELAY);
-    s_rtc_store.non_critical.store.info.value = 0;
-    xSemaphoreGive(s_priv_data.non_critical.lock);
+    rtc_store_rbuf_discard(&s_priv_data.critical);
+    rtc_store_rbuf_discard(&s_priv_data.non_critical);
     return ESP_OK;
 }
 
 uint32_t rtc_store_get_crc()
 {
     rtc_store_meta_info_t rtc_meta_info = {
-        .critical_buf = s_rtc_store.critical.buf,
-        .non_critical_buf = s_rtc_store.non_critical.buf,
+        .critical_buf = s_rtc_store.arena,
+        .non_critical_buf = s_rtc_store.arena + DIAG_CRITICAL_BUF_SIZE,
         .rtc_store = &s_rtc_store,
         .critical_buf_size = DIAG_CRITICAL_BUF_SIZE,
-        .non_critical_buf_size = DIAG_NON_CRITICAL_BUF_SIZE
+        .non_critical_buf_size = DIAG_NON_CRITICAL_BUF_SIZE,
+        .meta_hdr_size = sizeof(rtc_store_meta_header_t)
     };
     uint32_t crc = 0;
     crc = esp_crc32_le(crc, (const unsigned char *)&rtc_meta_info, sizeof(rtc_meta_info));
@@ -612,11 +1306,29 @@ esp_err_t rtc_store_init(void)
     if (s_priv_data.init) {
         return ESP_ERR_INVALID_STATE;
     }
+    esp_reset_reason_t reset_reason = esp_reset_reason();
+
+    /* Buffers keep the space they borrowed across resets, as long as their data is kept */
+    if (rtc_store_is_data_lost(reset_reason) ||
+            s_rtc_store.boundary < DIAG_CRITICAL_FLOOR ||
+            s_rtc_store.boundary > DIAG_ARENA_SIZE - DIAG_NON_CRITICAL_FLOOR) {
+        if (s_rtc_store.boundary != DIAG_CRITICAL_BUF_SIZE) {
+            s_rtc_store.critical.info.value = 0;
+            s_rtc_store.non_critical.info.value = 0;
+        }
+        s_rtc_store.boundary = DIAG_CRITICAL_BUF_SIZE;
+    }
+#if CONFIG_RTC_STORE_PAGE_CRC
+    s_priv_data.critical.pages = &s_rtc_store.critical_pages;
+    s_priv_data.non_critical.pages = &s_rtc_store.non_critical_pages;
+#endif
     /* Initialize critical RTC rbuf */
     err = rtc_store_rbuf_init(&s_priv_data.critical,
-                              &s_rtc_store.critical.store,
-                              s_rtc_store.critical.buf,
-                              DIAG_CRITICAL_BUF_SIZE);
+                              &s_rtc_store.critical,
+                              s_rtc_store.arena,
+                              s_rtc_store.boundary,
+                              DIAG_CRITICAL_BUF_SIZE,
+                              DIAG_CRITICAL_FLOOR);
     if (err != ESP_OK) {
 #if RTC_STORE_DBG_PRINTS
         printf("rtc_store_rbuf_init(critical) failed\n");
@@ -625,9 +1337,11 @@ esp_err_t rtc_store_init(void)
     }
     /* Initialize non critical RTC rbuf */
     err = rtc_store_rbuf_init(&s_priv_data.non_critical,
-                              &s_rtc_store.non_critical.store,
-                              s_rtc_store.non_critical.buf,
-                              DIAG_NON_CRITICAL_BUF_SIZE);
+                              &s_rtc_store.non_critical,
+                              s_rtc_store.arena + s_rtc_store.boundary,
+                              DIAG_ARENA_SIZE - s_rtc_store.boundary,
+                              DIAG_NON_CRITICAL_BUF_SIZE,
+                              DIAG_NON_CRITICAL_FLOOR);
     if (err != ESP_OK) {
 #if RTC_STORE_DBG_PRINTS
         printf("rtc_store_rbuf_init(non_critical) failed\n");
@@ -635,12 +1349,11 @@ esp_err_t rtc_store_init(void)
         rtc_store_rbuf_deinit(&s_priv_data.critical);
         return err;
     }
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+    rtc_store_index_rebuild(&s_priv_data.non_critical, &s_non_critical_index);
+#endif
 
-    esp_reset_reason_t reset_reason = esp_reset_reason();
-
-    if (reset_reason == ESP_RST_UNKNOWN ||
-            reset_reason == ESP_RST_POWERON ||
-            reset_reason == ESP_RST_BROWNOUT) {
+    if (rtc_store_is_data_lost(reset_reason)) {
         // TODO: also check if hash is changed
         s_rtc_store.meta_hdr_idx = -1;
     }
@@ -15,6 +15,7 @@
 #pragma once
 #include <esp_err.h>
 #include <esp_event.h>
+#include <esp_diag_data_store.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,8 +31,26 @@ typedef struct {
     uint8_t boot_cnt;           // updated on each soft reboot
     char sha_sum[SHA_SIZE];     // elf shasum
     bool valid;                 //
+    int64_t ts_offset;          // latest timestamp offset, compact data point timestamps are relative to it
 } rtc_store_meta_header_t;
 
+#define RTC_STORE_MAX_META_RECORDS  (10) // Max master records possible
+
+#if CONFIG_RTC_STORE_PAGE_CRC
+/* Page bitmaps and a CRC entry per 256 byte page, for both buffers */
+#define RTC_STORE_PAGES_RTC_SIZE    (2 * (8 + 4 * ((CONFIG_RTC_STORE_DATA_SIZE + 1 + 255) / 256)))
+#else
+#define RTC_STORE_PAGES_RTC_SIZE    0
+#endif
+
+/* Upper bound of the RTC memory taken by the store: the data arena, the page CRCs,
+ * the meta records and 48 bytes for the buffer offsets and padding.
+ * Other users of RTC memory check their size against it, see esp_insights.c.
+ */
+#define RTC_STORE_RTC_MEM_SIZE \
+    (CONFIG_RTC_STORE_DATA_SIZE + 1 + RTC_STORE_PAGES_RTC_SIZE \
+     + RTC_STORE_MAX_META_RECORDS * sizeof(rtc_store_meta_header_t) + 48)
+
 /**
  * @brief   get meta header for idx
  *
@@ -58,6 +77,8 @@ typedef struct {
 /**
  * @brief Write critical data to the RTC storage
  *
+ * Does not block, can be called from multiple tasks and cores at the same time.
+ *
  * @param[in] data Pointer to the data
  * @param[in] len Length of data
  *
@@ -75,6 +96,15 @@ esp_err_t rtc_store_critical_data_write(void *data, size_t len);
  */
 int rtc_store_critical_data_read(uint8_t *buf, size_t size);
 
+/**
+ * @brief Get critical data in place, valid until the next release
+ *
+ * @param[out] spans Data up to the end of the buffer and the data wrapped to its start
+ *
+ * @return Total bytes in the spans or -1 on error
+ */
+int rtc_store_critical_data_peek(esp_diag_data_store_span_t spans[2]);
+
 /**
  * @brief Release the size bytes critical data from RTC storage
  *
@@ -86,6 +116,15 @@ int rtc_store_critical_data_read(uint8_t *buf, size_t size);
  */
 esp_err_t rtc_store_critical_data_release(size_t size);
 
+/**
+ * @brief Release the size bytes of critical data from RTC storage, the rest of the data stays peeked
+ *
+ * @param[in] size Number of bytes to free.
+ *
+ * @return ESP_OK on success, appropriate error code otherwise.
+ */
+esp_err_t rtc_store_critical_data_release_partial(size_t size);
+
 /**
  * @brief Read critical data from the RTC storage and release that data
  *
@@ -99,7 +138,8 @@ int rtc_store_critical_data_read_and_release(uint8_t *buf, size_t size);
 /**
  * @brief Write non critical data to the RTC storage
  *
- * This API overwrites the data if non critical storage is full
+ * This API overwrites the data if non critical storage is full.
+ * Does not block, can be called from multiple tasks and cores at the same time.
  *
  * @param[in] dg Data group of data eg: heap, wifi, ip(Must be the string stored in RODATA)
  * @param[in] data Pointer to non critical data
@@ -124,6 +164,15 @@ esp_err_t rtc_store_non_critical_data_write(const char *dg, void *data, size_t l
  */
 int rtc_store_non_critical_data_read(uint8_t *buf, size_t size);
 
+/**
+ * @brief Get non critical data in place, it is not overwritten until the next release
+ *
+ * @param[out] spans Data up to the end of the buffer and the data wrapped to its start
+ *
+ * @return Total bytes in the spans or -1 on error
+ */
+int rtc_store_non_critical_data_peek(esp_diag_data_store_span_t spans[2]);
+
 /**
  * @brief Release the size bytes non critical data from RTC storage
  *
@@ -143,6 +192,43 @@ esp_err_t rtc_store_non_critical_data_release(size_t size);
  */
 int rtc_store_non_critical_data_read_and_release(uint8_t *buf, size_t size);
 
+/**
+ * @brief Callback receiving the data to spill, wrapped data comes in two parts
+ *
+ * @param[in] data  First part of the data
+ * @param[in] len   Length of the first part
+ * @param[in] data2 Second part of the data, NULL if not wrapped
+ * @param[in] len2  Length of the second part
+ * @param[in] priv  Private data passed to the spill API
+ *
+ * @return ESP_OK if the data was stored elsewhere and can be released
+ */
+typedef esp_err_t (*rtc_store_spill_cb_t)(const uint8_t *data, size_t len, const uint8_t *data2, size_t len2, void *priv);
+
+/**
+ * @brief Hand over all critical data to cb and release it, if the buffer is filled beyond the spill level
+ *
+ * Data is passed in place, cb is called with the reader lock held.
+ *
+ * @param[in] cb   Callback storing the data
+ * @param[in] priv Private data for cb
+ *
+ * @return ESP_OK if data was spilled, ESP_ERR_NOT_FOUND if the buffer is below the spill level,
+ *         error returned by cb otherwise.
+ */
+esp_err_t rtc_store_critical_data_spill(rtc_store_spill_cb_t cb, void *priv);
+
+/**
+ * @brief Hand over all non critical data to cb and release it, if the buffer is filled beyond the spill level
+ *
+ * @param[in] cb   Callback storing the data
+ * @param[in] priv Private data for cb
+ *
+ * @return ESP_OK if data was spilled, ESP_ERR_NOT_FOUND if the buffer is below the spill level,
+ *         error returned by cb otherwise.
+ */
+esp_err_t rtc_store_non_critical_data_spill(rtc_store_spill_cb_t cb, void *priv);
+
 /**
  * @brief Initializes the RTC storage
  *
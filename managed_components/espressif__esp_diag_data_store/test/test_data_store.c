@@ -20,7 +20,9 @@
 #include <rtc_store.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 #include <esp_random.h>
+#include <esp_system.h>
 
 #define TAG              "diag_data_store_UT"
 #define NVS_KEY_B1_CHARS "b1_chars"
@@ -187,6 +189,177 @@ TEST_CASE("data store wrapped_read write_till_exact_full", "[data-store]")
     nvs_flash_deinit();
 }
 
+TEST_CASE("data store wrapped_peek release_zero release_all", "[data-store]")
+{
+    int len = 0;
+    uint32_t count = 15;
+    char char_list[count];
+    esp_diag_data_store_span_t spans[2];
+
+    /* diag data store init */
+    init_nvs_flash();
+    assert(rtc_store_init() == ESP_OK);
+
+    // move the read offset close to the end, so that the records wrap around
+    memset(data, 0, CONFIG_RTC_STORE_CRITICAL_DATA_SIZE);
+    rtc_store_critical_data_write(data, CONFIG_RTC_STORE_CRITICAL_DATA_SIZE - 4);
+    len = rtc_store_critical_data_read(data, READ_DATA_SIZE);
+    TEST_ASSERT(rtc_store_critical_data_release(len) == ESP_OK);
+
+    /* Write critical data: wrap-around peek test */
+    write_random_critical_data(count, char_list);
+
+    /* Peek critical data, join the spans and validate */
+    len = rtc_store_critical_data_peek(spans);
+    TEST_ASSERT((len - count) == (count * sizeof(test_data_t)));
+    TEST_ASSERT((spans[1].len > 0) && (spans[0].len + spans[1].len == len));
+    memcpy(data, spans[0].data, spans[0].len);
+    memcpy(data + spans[0].len, spans[1].data, spans[1].len);
+    validate_critical_data(data, len, count, char_list);
+
+    /* Releasing zero bytes keeps the data */
+    TEST_ASSERT(rtc_store_critical_data_release(0) == ESP_OK);
+    TEST_ASSERT(rtc_store_critical_data_peek(spans) == len);
+
+    /* Release all data */
+    TEST_ASSERT(rtc_store_critical_data_release(len) == ESP_OK);
+    TEST_ASSERT(rtc_store_critical_data_peek(spans) == 0);
+
+    /* data store deinit */
+    rtc_store_deinit();
+    nvs_flash_deinit();
+}
+
+TEST_CASE("data store peek release_partial write peek release_all", "[data-store]")
+{
+    int len = 0;
+    uint32_t count = 10;
+    char char_list[count];
+    size_t record_size = sizeof(test_data_t) + 1;
+    esp_diag_data_store_span_t spans[2];
+
+    /* diag data store init */
+    init_nvs_flash();
+    assert(rtc_store_init() == ESP_OK);
+
+    write_random_critical_data(count, char_list);
+    len = rtc_store_critical_data_peek(spans);
+    TEST_ASSERT(len == count * record_size);
+
+    /* Release the first record, the rest stays peeked and is returned again by the next peek */
+    TEST_ASSERT(rtc_store_critical_data_release_partial(record_size) == ESP_OK);
+    TEST_ASSERT(rtc_store_critical_data_peek(spans) == len - record_size);
+    memcpy(data, spans[0].data, spans[0].len);
+    memcpy(data + spans[0].len, spans[1].data, spans[1].len);
+    validate_critical_data(data, len - record_size, count - 1, char_list + 1);
+
+    /* Data written meanwhile follows the data still peeked */
+    write_random_critical_data(count, char_list);
+    TEST_ASSERT(rtc_store_critical_data_peek(spans) == (2 * count - 1) * record_size);
+
+    /* Release all data */
+    TEST_ASSERT(rtc_store_critical_data_release((2 * count - 1) * record_size) == ESP_OK);
+    TEST_ASSERT(rtc_store_critical_data_peek(spans) == 0);
+
+    /* data store deinit */
+    rtc_store_deinit();
+    nvs_flash_deinit();
+}
+
+#if CONFIG_RTC_STORE_NON_CRITICAL_LEND_PERCENT && CONFIG_RTC_STORE_NON_CRITICAL_DROP_NEW
+TEST_CASE("data store critical borrows idle non_critical space", "[data-store]")
+{
+    int len = 0;
+    uint32_t count = 0;
+    test_data_t record;
+    esp_diag_data_store_span_t spans[2];
+
+    /* diag data store init */
+    init_nvs_flash();
+    assert(rtc_store_init() == ESP_OK);
+
+    /* Non-critical store is empty, critical data can go beyond its quota */
+    record.len = sizeof(record.buf);
+    while (count < READ_DATA_SIZE / (sizeof(record) + 1)) {
+        record.alphabet = 'a' + (count % 26);
+        memset(record.buf, record.alphabet, record.len);
+        if (rtc_store_critical_data_write(&record, sizeof(record)) != ESP_OK) {
+            break;
+        }
+        count++;
+    }
+    TEST_ASSERT(count * (sizeof(record) + 1) > CONFIG_RTC_STORE_CRITICAL_DATA_SIZE);
+
+    /* Borrowed space holds the data in order */
+    len = rtc_store_critical_data_read(data, READ_DATA_SIZE);
+    TEST_ASSERT(len == count * (sizeof(record) + 1));
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(&record, data + i * (sizeof(record) + 1) + 1, sizeof(record)); // skip meta_idx byte
+        TEST_ASSERT(record.alphabet == 'a' + (i % 26));
+    }
+    TEST_ASSERT(rtc_store_critical_data_release(len) == ESP_OK);
+
+    /* Drained non-critical store takes its space back */
+    TEST_ASSERT(rtc_store_non_critical_data_peek(spans) == 0);
+    TEST_ASSERT(rtc_store_non_critical_data_release(0) == ESP_OK);
+    count = 0;
+    memset(data, 0, 16);
+    while (rtc_store_non_critical_data_write("test", data, 16) == ESP_OK) {
+        count++;
+    }
+    TEST_ASSERT(count == (CONFIG_RTC_STORE_DATA_SIZE - CONFIG_RTC_STORE_CRITICAL_DATA_SIZE) /
+                (1 + sizeof(rtc_store_non_critical_data_hdr_t) + 16));
+    len = rtc_store_non_critical_data_read(data, READ_DATA_SIZE);
+    TEST_ASSERT(rtc_store_non_critical_data_release(len) == ESP_OK);
+
+    /* data store deinit */
+    rtc_store_deinit();
+    nvs_flash_deinit();
+}
+#endif
+
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+TEST_CASE("data store non_critical overwrite mixed_records", "[data-store]")
+{
+    int len = 0, off = 0;
+    uint8_t last = 0;
+    uint8_t record[64];
+    rtc_store_non_critical_data_hdr_t header;
+
+    /* diag data store init */
+    init_nvs_flash();
+    assert(rtc_store_init() == ESP_OK);
+
+    /* Write records of random length until the oldest ones are overwritten many times */
+    for (uint32_t i = 0; i < 1000; i++) {
+        size_t rec_len = 1 + (esp_random() % sizeof(record));
+        last = 'a' + (i % 26);
+        memset(record, last, rec_len);
+        TEST_ASSERT(rtc_store_non_critical_data_write("test", record, rec_len) == ESP_OK);
+    }
+
+    /* Only whole records are left and the newest one is the last */
+    len = rtc_store_non_critical_data_read(data, READ_DATA_SIZE);
+    TEST_ASSERT(len > 0);
+    while (off < len) {
+        memcpy(&header, data + off + 1, sizeof(header)); // skip meta_idx byte
+        off += 1 + sizeof(header);
+        TEST_ASSERT(header.len > 0 && off + header.len <= len);
+        for (uint32_t j = 1; j < header.len; j++) {
+            TEST_ASSERT(data[off + j] == data[off]);
+        }
+        off += header.len;
+    }
+    TEST_ASSERT(off == len);
+    TEST_ASSERT(data[len - 1] == last);
+    TEST_ASSERT(rtc_store_non_critical_data_release(len) == ESP_OK);
+
+    /* data store deinit */
+    rtc_store_deinit();
+    nvs_flash_deinit();
+}
+#endif
+
 TEST_CASE("data store write read release_zero read release_zero release_all", "[data-store]")
 {
     size_t len = 0;
@@ -221,6 +394,310 @@ TEST_CASE("data store write read release_zero read release_zero release_all", "[
     nvs_flash_deinit();
 }
 
+#define WRITER_COUNT    2
+#define WRITER_RECORDS  200
+
+typedef struct {
+    uint16_t id;                /* Records of the writer are filled with 'A' + id */
+    SemaphoreHandle_t done;
+} writer_arg_t;
+
+/* Writes numbered records, retrying while the store is full until the reader catches up */
+static void critical_writer_task(void *arg)
+{
+    writer_arg_t *writer = (writer_arg_t *) arg;
+    test_data_t record;
+    uint16_t seq = 0;
+
+    while (seq < WRITER_RECORDS) {
+        record.alphabet = (writer->id << 12) | seq;
+        record.len = sizeof(record.buf);
+        memset(record.buf, 'A' + writer->id, record.len);
+        if (rtc_store_critical_data_write(&record, sizeof(record)) == ESP_OK) {
+            seq++;
+        } else {
+            vTaskDelay(1);
+        }
+    }
+    xSemaphoreGive(writer->done);
+    vTaskDelete(NULL);
+}
+
+TEST_CASE("data store two writers against a reader", "[data-store]")
+{
+    int len = 0;
+    uint32_t finished = 0;
+    uint16_t next_seq[WRITER_COUNT] = { 0 };
+    size_t record_size = sizeof(test_data_t) + 1;
+    writer_arg_t writers[WRITER_COUNT];
+    test_data_t record;
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(WRITER_COUNT, 0);
+    TEST_ASSERT(done != NULL);
+
+    /* diag data store init */
+    init_nvs_flash();
+    assert(rtc_store_init() == ESP_OK);
+    TEST_ASSERT(rtc_store_discard_data() == ESP_OK);
+
+    for (uint16_t i = 0; i < WRITER_COUNT; i++) {
+        writers[i].id = i;
+        writers[i].done = done;
+        TEST_ASSERT(xTaskCreate(critical_writer_task, "writer", 3072, &writers[i],
+                                uxTaskPriorityGet(NULL), NULL) == pdPASS);
+    }
+
+    /* Records are whole and each writer's records come in the order they were written,
+     * none is lost. Data committed before a writer finished is read once it has reported.
+     */
+    while (true) {
+        if (xSemaphoreTake(done, 0) == pdTRUE) {
+            finished++;
+        }
+        len = rtc_store_critical_data_read(data, READ_DATA_SIZE);
+        TEST_ASSERT(len >= 0 && len % record_size == 0);
+        for (int off = 0; off < len; off += record_size) {
+            memcpy(&record, data + off + 1, sizeof(record)); // skip meta_idx byte
+            uint16_t id = record.alphabet >> 12;
+            TEST_ASSERT(id < WRITER_COUNT);
+            TEST_ASSERT((record.alphabet & 0xfff) == next_seq[id]);
+            TEST_ASSERT(record.len == sizeof(record.buf));
+            for (uint32_t j = 0; j < sizeof(record.buf); j++) {
+                TEST_ASSERT(record.buf[j] == 'A' + id);
+            }
+            next_seq[id]++;
+        }
+        TEST_ASSERT(rtc_store_critical_data_release(len) == ESP_OK);
+        if (finished == WRITER_COUNT && len == 0) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+    for (uint16_t i = 0; i < WRITER_COUNT; i++) {
+        TEST_ASSERT(next_seq[i] == WRITER_RECORDS);
+    }
+    vSemaphoreDelete(done);
+
+    /* data store deinit */
+    rtc_store_deinit();
+    nvs_flash_deinit();
+}
+
+#if CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW
+#define SPILL_WRITE_RETRIES 100
+
+TEST_CASE("data store flash spill drains oldest first", "[data-store]")
+{
+    int len = 0;
+    size_t total = 0;
+    uint16_t count = 0, next = 0;
+    size_t record_size = sizeof(test_data_t) + 1;
+    test_data_t record;
+
+    /* Spill is triggered by the store events, which need the default event loop */
+    esp_err_t loop_err = esp_event_loop_create_default();
+    TEST_ASSERT(loop_err == ESP_OK || loop_err == ESP_ERR_INVALID_STATE);
+
+    /* diag data store init */
+    init_nvs_flash();
+    assert(esp_diag_data_store_init() == ESP_OK);
+    TEST_ASSERT(esp_diag_data_discard_data() == ESP_OK);
+
+    /* More than the whole RTC store can hold, even with critical data borrowing space,
+     * and few enough spills that the flash ring keeps them all.
+     */
+    while (total <= READ_DATA_SIZE) {
+        record.alphabet = count;
+        record.len = sizeof(record.buf);
+        memset(record.buf, 'a' + count % 26, record.len);
+        int retries = 0;
+        while (esp_diag_data_store_critical_write(&record, sizeof(record)) != ESP_OK) {
+            TEST_ASSERT(++retries < SPILL_WRITE_RETRIES);
+            vTaskDelay(pdMS_TO_TICKS(50)); // let the spill task move data to flash
+        }
+        total += record_size;
+        count++;
+    }
+
+    /* Flash pages come first and oldest first, then RTC memory, so records come back in the order
+     * they were written. Starting at the first record shows data went through flash.
+     */
+    while ((len = esp_diag_data_store_critical_read(data, READ_DATA_SIZE)) > 0) {
+        TEST_ASSERT(len % record_size == 0);
+        for (int off = 0; off < len; off += record_size) {
+            memcpy(&record, data + off + 1, sizeof(record)); // skip meta_idx byte
+            TEST_ASSERT(record.alphabet == next);
+            TEST_ASSERT(record.len == sizeof(record.buf));
+            TEST_ASSERT(record.buf[0] == 'a' + next % 26);
+            next++;
+        }
+        TEST_ASSERT(esp_diag_data_store_critical_release(len) == ESP_OK);
+    }
+    TEST_ASSERT(len == 0);
+    TEST_ASSERT(next == count);
+
+    /* data store deinit */
+    esp_diag_data_store_deinit();
+    nvs_flash_deinit();
+    if (loop_err == ESP_OK) {
+        esp_event_loop_delete_default();
+    }
+}
+#endif /* CONFIG_DIAG_DATA_STORE_FLASH_OVERFLOW */
+
+/* esp_reset_reason() is wrapped at link time, see CMakeLists.txt, so that rtc_store_init()
+ * can be run as after a reset of the given reason
+ */
+static bool s_fake_reset;
+static esp_reset_reason_t s_fake_reset_reason;
+
+esp_reset_reason_t __real_esp_reset_reason(void);
+
+esp_reset_reason_t __wrap_esp_reset_reason(void)
+{
+    if (s_fake_reset) {
+        return s_fake_reset_reason;
+    }
+    return __real_esp_reset_reason();
+}
+
+#if CONFIG_DIAG_DATA_STORE_RTC && CONFIG_RTC_STORE_PAGE_CRC
+#define SALVAGE_RECORDS     40
+#define SALVAGE_PAGE_SIZE   256     /* Data covered by one page CRC of the store */
+#define SALVAGE_DAMAGE_OFF  (SALVAGE_PAGE_SIZE + 50)
+#define SALVAGE_NC_LEN      23      /* Non critical record is 32 bytes with its meta_idx and header */
+
+static void rtc_store_reinit(esp_reset_reason_t reason)
+{
+    s_fake_reset = true;
+    s_fake_reset_reason = reason;
+    rtc_store_deinit();
+    TEST_ASSERT(rtc_store_init() == ESP_OK);
+}
+
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+static void write_indexed_non_critical_data(uint8_t first, uint32_t records)
+{
+    uint8_t record[SALVAGE_NC_LEN];
+    for (uint32_t i = 0; i < records; i++) {
+        uint8_t idx = first + i;
+        record[0] = idx;
+        memset(record + 1, 'a' + idx % 26, sizeof(record) - 1);
+        TEST_ASSERT(rtc_store_non_critical_data_write("test", record, sizeof(record)) == ESP_OK);
+    }
+}
+
+/* Records are whole and in order, returns the number of gaps in their indices */
+static uint32_t validate_indexed_non_critical_data(int len, uint8_t *first, uint8_t *last)
+{
+    rtc_store_non_critical_data_hdr_t header;
+    uint32_t gaps = 0;
+    int off = 0;
+    while (off < len) {
+        memcpy(&header, data + off + 1, sizeof(header)); // skip meta_idx byte
+        off += 1 + sizeof(header);
+        TEST_ASSERT(header.len == SALVAGE_NC_LEN && off + header.len <= len);
+        uint8_t idx = data[off];
+        if (off == 1 + sizeof(header)) {
+            *first = idx;
+        } else if (idx != (uint8_t) (*last + 1)) {
+            gaps++;
+        }
+        for (uint32_t j = 1; j < header.len; j++) {
+            TEST_ASSERT(data[off + j] == 'a' + idx % 26);
+        }
+        *last = idx;
+        off += header.len;
+    }
+    TEST_ASSERT(off == len);
+    return gaps;
+}
+#endif
+
+TEST_CASE("data store salvage after brownout", "[data-store]")
+{
+    int len = 0;
+    uint32_t gaps = 0;
+    int32_t prev = -1;
+    size_t record_size = sizeof(test_data_t) + 1;
+    size_t max_lost = SALVAGE_PAGE_SIZE / record_size + 2;
+    test_data_t record;
+    esp_diag_data_store_span_t spans[2];
+
+    /* Start from an empty store, its data begins at the start of the buffer */
+    init_nvs_flash();
+    s_fake_reset = true;
+    s_fake_reset_reason = ESP_RST_POWERON;
+    assert(rtc_store_init() == ESP_OK);
+
+    for (uint16_t i = 0; i < SALVAGE_RECORDS; i++) {
+        record.alphabet = i;
+        record.len = sizeof(record.buf);
+        memset(record.buf, 'a' + i % 26, record.len);
+        TEST_ASSERT(rtc_store_critical_data_write(&record, sizeof(record)) == ESP_OK);
+    }
+    /* Damage the second page, as a brownout during a write could */
+    len = rtc_store_critical_data_peek(spans);
+    TEST_ASSERT(len == SALVAGE_RECORDS * record_size && spans[0].len == len);
+    ((uint8_t *) spans[0].data)[SALVAGE_DAMAGE_OFF] ^= 0xff;
+    TEST_ASSERT(rtc_store_critical_data_release(0) == ESP_OK);
+
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+    uint8_t first = 0, last = 0;
+    size_t nc_record_size = 1 + sizeof(rtc_store_non_critical_data_hdr_t) + SALVAGE_NC_LEN;
+    write_indexed_non_critical_data(0, SALVAGE_RECORDS);
+    len = rtc_store_non_critical_data_peek(spans);
+    TEST_ASSERT(len == SALVAGE_RECORDS * nc_record_size && spans[0].len == len);
+    ((uint8_t *) spans[0].data)[SALVAGE_DAMAGE_OFF] ^= 0xff;
+    TEST_ASSERT(rtc_store_non_critical_data_release(0) == ESP_OK);
+#endif
+
+    rtc_store_reinit(ESP_RST_BROWNOUT);
+
+    /* Records touching the damaged page are dropped, the ones before and after it are kept whole */
+    len = rtc_store_critical_data_read(data, READ_DATA_SIZE);
+    TEST_ASSERT(len > 0 && len % record_size == 0 && len < SALVAGE_RECORDS * record_size);
+    TEST_ASSERT(SALVAGE_RECORDS - len / record_size <= max_lost);
+    for (int off = 0; off < len; off += record_size) {
+        memcpy(&record, data + off + 1, sizeof(record)); // skip meta_idx byte
+        TEST_ASSERT(record.alphabet > prev && record.alphabet != SALVAGE_DAMAGE_OFF / record_size);
+        TEST_ASSERT(record.len == sizeof(record.buf));
+        for (uint32_t j = 0; j < sizeof(record.buf); j++) {
+            TEST_ASSERT(record.buf[j] == 'a' + record.alphabet % 26);
+        }
+        if (prev >= 0 && record.alphabet != prev + 1) {
+            gaps++;
+        }
+        prev = record.alphabet;
+    }
+    TEST_ASSERT(gaps == 1 && prev == SALVAGE_RECORDS - 1);
+    TEST_ASSERT(rtc_store_critical_data_release(len) == ESP_OK);
+
+#if CONFIG_RTC_STORE_OVERWRITE_NON_CRITICAL_DATA
+    /* Same for non critical data, and the index of its records is rebuilt instead of discarding them */
+    len = rtc_store_non_critical_data_read(data, READ_DATA_SIZE);
+    TEST_ASSERT(len > 0 && len % nc_record_size == 0 && len < SALVAGE_RECORDS * nc_record_size);
+    TEST_ASSERT(SALVAGE_RECORDS - len / nc_record_size <= SALVAGE_PAGE_SIZE / nc_record_size + 2);
+    TEST_ASSERT(validate_indexed_non_critical_data(len, &first, &last) == 1);
+    TEST_ASSERT(first == 0 && last == SALVAGE_RECORDS - 1);
+    TEST_ASSERT(rtc_store_non_critical_data_release(0) == ESP_OK);
+
+    /* Overwriting the oldest records goes through the rebuilt index, it drops whole records only */
+    uint32_t more = READ_DATA_SIZE / nc_record_size;
+    write_indexed_non_critical_data(SALVAGE_RECORDS, more);
+    len = rtc_store_non_critical_data_read(data, READ_DATA_SIZE);
+    TEST_ASSERT(len > 0);
+    TEST_ASSERT(validate_indexed_non_critical_data(len, &first, &last) == 0);
+    TEST_ASSERT(last == (uint8_t) (SALVAGE_RECORDS + more - 1));
+    TEST_ASSERT(rtc_store_non_critical_data_release(len) == ESP_OK);
+#endif
+
+    /* data store deinit */
+    s_fake_reset = false;
+    rtc_store_deinit();
+    nvs_flash_deinit();
+}
+#endif /* CONFIG_DIAG_DATA_STORE_RTC && CONFIG_RTC_STORE_PAGE_CRC */
+
 static char *nvs_read_chars(size_t *len, uint32_t bank)
 {
     nvs_handle_t handle;
@@ -37,6 +37,22 @@ typedef enum {
     ESP_DIAG_LOG_TYPE_EVENT   = 1 << 2,   /*!< Diagnostics log type event */
 } esp_diag_log_type_t;
 
+/**
+ * @brief Set in the type of a log record which summarizes logs held back by rate limiting
+ *
+ * The record carries the type, tag, pc and format of the call site and the timestamp of
+ * the last held back log. Its msg_args hold an \ref esp_diag_log_repeat_t instead of arguments.
+ */
+#define ESP_DIAG_LOG_TYPE_REPEAT_FLAG   (1 << 7)
+
+/**
+ * @brief Logs of a call site held back by rate limiting
+ */
+typedef struct {
+    uint32_t count;             /*!< Number of logs held back */
+    uint64_t first_timestamp;   /*!< Timestamp of the first of those logs */
+} esp_diag_log_repeat_t;
+
 /**
  * @brief Log argument data types
  */
@@ -103,8 +119,15 @@ typedef enum {
     ESP_DIAG_DATA_TYPE_STR,      /*!< Data type string */
     ESP_DIAG_DATA_TYPE_IPv4,     /*!< Data type IPv4 address */
     ESP_DIAG_DATA_TYPE_MAC,      /*!< Data type MAC address */
+    ESP_DIAG_DATA_TYPE_SUMMARY,  /*!< Count, min, max and sum of the values observed in a window */
+    ESP_DIAG_DATA_TYPE_HISTOGRAM, /*!< Summary plus per bucket counts of the values observed in a window */
 } esp_diag_data_type_t;
 
+/**
+ * @brief Maximum number of buckets of a histogram, i.e. number of bucket bounds plus one
+ */
+#define ESP_DIAG_HISTOGRAM_MAX_BUCKETS      8
+
 /**
  * @brief Diagnostics log data structure
  */
@@ -148,6 +171,9 @@ typedef struct {
     char name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];   /*!< Task name */
     uint32_t state;                                 /*!< Task state */
     uint32_t high_watermark;                        /*!< Task high watermark */
+#if CONFIG_DIAG_ENABLE_CPU_METRICS
+    float cpu_percent;                              /*!< CPU usage in the last CPU metrics window, negative if unknown */
+#endif /* CONFIG_DIAG_ENABLE_CPU_METRICS */
 #ifndef CONFIG_IDF_TARGET_ARCH_RISCV
     esp_diag_task_bt_t bt_info;                     /*!< Backtrace of the task */
 #endif /* !CONFIG_IDF_TARGET_ARCH_RISCV */
@@ -184,6 +210,53 @@ typedef struct {
     } value;
 } esp_diag_str_data_pt_t;
 
+/**
+ * @brief Marker bit in the first byte of compact data point records
+ *
+ * Compact records are variable length and laid out as [tag][key id][ts][value]:
+ *  - tag:    1 byte, ESP_DIAG_DATA_PT_COMPACT | (type << 4) | data_type
+ *  - key id: 2 bytes little endian, CRC16 of the key of the metrics or variable, never 0
+ *  - ts:     zigzag LEB128, microseconds relative to \ref esp_diag_timestamp_offset_get()
+ *  - value:  bool 1 byte, int zigzag LEB128, uint LEB128, float and IPv4 4 bytes,
+ *            MAC 6 bytes, string 1 byte length followed by the characters,
+ *            summary LEB128 window and count followed by zigzag LEB128 min, max and sum,
+ *            histogram is a summary followed by 1 byte bucket count and LEB128 bucket counts
+ */
+#define ESP_DIAG_DATA_PT_COMPACT            0x80
+
+/**
+ * @brief Maximum size of a compact data point record
+ */
+#define ESP_DIAG_DATA_PT_COMPACT_MAX_SZ     (1 + 2 + 10 + 30 + 1 + 5 * ESP_DIAG_HISTOGRAM_MAX_BUCKETS)
+
+/**
+ * @brief Unpacked form of a compact data point record
+ */
+typedef struct {
+    uint16_t type;       /*!< Metrics or Variable */
+    uint16_t data_type;  /*!< Data type */
+    uint16_t key_id;     /*!< Key id of the metrics or variable, see \ref ESP_DIAG_DATA_PT_COMPACT */
+    int64_t ts_rel;      /*!< Timestamp relative to the offset at the time of recording */
+    union {
+        bool b;          /*!< Value for boolean data type */
+        int32_t i;       /*!< Value for integer data type */
+        uint32_t u;      /*!< Value for unsigned integer data type */
+        float f;         /*!< Value for float data type */
+        uint32_t ipv4;   /*!< Value for the IPv4 address */
+        uint8_t mac[6];  /*!< Value for the MAC address */
+        char str[32];    /*!< Value for string data type */
+        struct {
+            uint32_t window_ms;     /*!< Length of the aggregation window */
+            uint32_t count;         /*!< Number of values observed */
+            int32_t min;            /*!< Smallest value observed */
+            int32_t max;            /*!< Largest value observed */
+            int64_t sum;            /*!< Sum of the values observed */
+            uint8_t bucket_count;   /*!< Number of valid entries in buckets, histogram only */
+            uint32_t buckets[ESP_DIAG_HISTOGRAM_MAX_BUCKETS]; /*!< Per bucket counts, histogram only */
+        } agg;           /*!< Value for summary and histogram data types */
+    } value;
+} esp_diag_compact_data_pt_t;
+
 /**
  * @brief Initialize diagnostics log hook
  *
@@ -208,6 +281,17 @@ void esp_diag_log_hook_enable(uint32_t type);
  */
 void esp_diag_log_hook_disable(uint32_t type);
 
+/**
+ * @brief Record logs which were held back by call site rate limiting
+ *
+ * Repeats of a log are counted once a call site reached CONFIG_DIAG_LOG_RATE_LIMIT_BURST logs
+ * in the current window, a summary record is written before the next log from that site. This
+ * writes the summary for every call site with pending repeats instead.
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_log_flush_repeats(void);
+
 /**
  * @brief Add diagnostics event
  *
@@ -254,6 +338,36 @@ esp_err_t esp_diag_device_info_get(esp_diag_device_info_t *device_info);
  */
 uint64_t esp_diag_timestamp_get(void);
 
+/**
+ * @brief Get the offset between \ref esp_diag_timestamp_get() and the time since boot
+ *
+ * Compact data points store timestamps relative to this offset, it changes when the time is synchronized.
+ *
+ * @return offset in microseconds
+ */
+int64_t esp_diag_timestamp_offset_get(void);
+
+/**
+ * @brief Pack a data point into the compact record format
+ *
+ * @param[out] buf    Buffer of at least \ref ESP_DIAG_DATA_PT_COMPACT_MAX_SZ bytes
+ * @param[in]  pt     Data point to pack
+ *
+ * @return Length of the record, 0 on invalid data type
+ */
+size_t esp_diag_compact_data_pt_pack(uint8_t *buf, const esp_diag_compact_data_pt_t *pt);
+
+/**
+ * @brief Unpack a compact data point record
+ *
+ * @param[in]  buf    Record
+ * @param[in]  len    Length of the record
+ * @param[out] pt     Unpacked data point
+ *
+ * @return ESP_OK if successful, ESP_ERR_INVALID_SIZE if the record is truncated or malformed.
+ */
+esp_err_t esp_diag_compact_data_pt_unpack(const uint8_t *buf, size_t len, esp_diag_compact_data_pt_t *pt);
+
 /**
  * @brief Get backtrace and some more details of all tasks in system
  *
@@ -276,6 +390,87 @@ uint32_t esp_diag_task_snapshot_get(esp_diag_task_info_t *tasks, size_t size);
  */
 void esp_diag_task_snapshot_dump(void);
 
+#if CONFIG_DIAG_ENABLE_TASK_SNAPSHOT
+/**
+ * @brief Cause of a retained task snapshot
+ */
+typedef enum {
+    ESP_DIAG_TASK_SNAPSHOT_MANUAL,      /*!< Captured by calling esp_diag_task_snapshot_capture() */
+    ESP_DIAG_TASK_SNAPSHOT_TASK_WDT,    /*!< Captured on task watchdog timeout */
+    ESP_DIAG_TASK_SNAPSHOT_PANIC,       /*!< Captured in the panic handler */
+} esp_diag_task_snapshot_reason_t;
+
+/**
+ * @brief Task entry of the retained task snapshot
+ */
+typedef struct {
+    char name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];   /*!< Task name */
+    uint32_t state;                                 /*!< Task state */
+    uint32_t stack_size;                            /*!< Stack size in bytes, 0 if unknown */
+    uint32_t free_stack;                            /*!< Minimum free stack in bytes */
+    esp_diag_task_bt_t bt_info;                     /*!< Backtrace, only the saved PC and return address on RISC-V.
+                                                         Empty for running tasks */
+} esp_diag_task_snapshot_entry_t;
+
+/**
+ * @brief Retained task snapshot, kept in RTC memory
+ */
+typedef struct {
+    uint32_t magic;                                 /*!< Validity marker */
+    uint32_t reason;                                /*!< Cause of the capture, \ref esp_diag_task_snapshot_reason_t */
+    uint64_t uptime;                                /*!< Time since boot at capture in microseconds */
+    uint32_t task_count;                            /*!< Number of tasks in system at capture */
+    uint32_t count;                                 /*!< Number of valid entries */
+    esp_diag_task_snapshot_entry_t entries[CONFIG_DIAG_TASK_SNAPSHOT_TASKS]; /*!< Tasks with highest stack pressure first */
+} esp_diag_task_snapshot_t;
+
+/**
+ * @brief Capture the tasks with highest stack pressure into the retained snapshot
+ *
+ * Tasks are ranked by the stack in use at their last context switch rather than by their
+ * stack high water mark, which would scan the unused stack of every task with interrupts masked.
+ * A task whose stack peaked earlier and has since unwound can be left out. Minimum free stack
+ * is read for the tasks kept in the snapshot and orders them.
+ *
+ * Captured automatically on task watchdog timeout (CONFIG_DIAG_TASK_SNAPSHOT_ON_TASK_WDT)
+ * and in the panic handler (CONFIG_DIAG_TASK_SNAPSHOT_ON_PANIC).
+ *
+ * Nothing is allocated, this can be called from interrupts, watchdog and panic paths.
+ * The previous snapshot is overwritten.
+ *
+ * @param[in] reason Cause of the capture
+ */
+void esp_diag_task_snapshot_capture(esp_diag_task_snapshot_reason_t reason);
+
+/**
+ * @brief Get the retained task snapshot
+ *
+ * The snapshot survives software and watchdog resets. It is returned in place,
+ * it stays valid until the next capture or \ref esp_diag_task_snapshot_clear().
+ *
+ * @return Snapshot, NULL if there is none
+ */
+const esp_diag_task_snapshot_t *esp_diag_task_snapshot_last(void);
+
+/**
+ * @brief Discard the retained task snapshot, e.g. once it is reported
+ */
+void esp_diag_task_snapshot_clear(void);
+#endif /* CONFIG_DIAG_ENABLE_TASK_SNAPSHOT */
+
+/* RTC memory retained across resets by diagnostics, for checking the total against the RTC memory size */
+#if CONFIG_DIAG_ENABLE_STACK_METRICS
+#define ESP_DIAG_STACK_RTC_SIZE     (8 + CONFIG_DIAG_STACK_METRICS_MAX_TASKS * (CONFIG_FREERTOS_MAX_TASK_NAME_LEN + 8))
+#else
+#define ESP_DIAG_STACK_RTC_SIZE     0
+#endif
+#if CONFIG_DIAG_ENABLE_TASK_SNAPSHOT
+#define ESP_DIAG_SNAPSHOT_RTC_SIZE  sizeof(esp_diag_task_snapshot_t)
+#else
+#define ESP_DIAG_SNAPSHOT_RTC_SIZE  0
+#endif
+#define ESP_DIAG_RTC_MEM_SIZE       (ESP_DIAG_STACK_RTC_SIZE + ESP_DIAG_SNAPSHOT_RTC_SIZE)
+
 /**
  * @brief Get CRC of diagnostics metadata
  *
@@ -33,6 +33,13 @@ typedef struct {
     void *cb_arg;                         /*!< User data to pass in callback function */
 } esp_diag_metrics_config_t;
 
+/**
+ * @brief Handle of a registered metrics, \ref ESP_DIAG_METRICS_HANDLE_INVALID if not registered
+ */
+typedef uint16_t esp_diag_metrics_handle_t;
+
+#define ESP_DIAG_METRICS_HANDLE_INVALID    0    /*!< Handle which does not refer to any metrics */
+
 /**
  * @brief Structure for diagnostics metrics metadata
  */
@@ -43,8 +50,26 @@ typedef struct {
     const char *path;          /*!< Hierarchical path for the key, must be separated by '.' for more than one level,
                                     eg: "wifi", "heap.internal", "heap.external" */
     esp_diag_data_type_t type; /*!< Data type of metrics */
+    const int32_t *bounds;     /*!< Upper bounds of histogram buckets, NULL for other data types */
+    uint8_t bounds_count;      /*!< Number of entries in bounds */
+    uint16_t key_id;           /*!< Key id of the data points, derived from key */
 } esp_diag_metrics_meta_t;
 
+/**
+ * @brief Configuration of an aggregated metrics
+ *
+ * Values observed with \ref esp_diag_metrics_observe() are accumulated in RAM
+ * and a single data point is recorded per window.
+ * A value v is counted in the first bucket i for which v <= bounds[i],
+ * values larger than the last bound are counted in the last bucket.
+ */
+typedef struct {
+    uint32_t window_sec;       /*!< Length of the reporting window, 0 for CONFIG_DIAG_METRICS_AGGREGATE_WINDOW */
+    const int32_t *bounds;     /*!< Ascending upper bounds of histogram buckets, NULL to only keep a summary.
+                                    Must stay valid for as long as the metrics is registered */
+    uint8_t bounds_count;      /*!< Number of entries in bounds, at most ESP_DIAG_HISTOGRAM_MAX_BUCKETS - 1 */
+} esp_diag_metrics_agg_config_t;
+
 /**
  * @brief Initialize the diagnostics metrics
  *
@@ -78,6 +103,68 @@ esp_err_t esp_diag_metrics_register(const char *tag,
                                     const char *path,
                                     esp_diag_data_type_t type);
 
+/**
+ * @brief Register a metrics and get a handle for it
+ *
+ * Data points added through the handle based APIs, e.g. \ref esp_diag_metrics_add_uint_h(),
+ * skip the key lookup.
+ *
+ * @param[in]  tag    Tag of metrics
+ * @param[in]  key    Unique key for the metrics
+ * @param[in]  label  Label for the metrics
+ * @param[in]  path   Hierarchical path for key, must be separated by '.' for more than one level
+ * @param[in]  type   Data type of metrics
+ * @param[out] handle Handle of the registered metrics
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_register_h(const char *tag,
+                                      const char *key,
+                                      const char *label,
+                                      const char *path,
+                                      esp_diag_data_type_t type,
+                                      esp_diag_metrics_handle_t *handle);
+
+/**
+ * @brief Register an aggregated metrics and get a handle for it
+ *
+ * Data type of the metrics is \ref ESP_DIAG_DATA_TYPE_HISTOGRAM if bounds are set in config,
+ * \ref ESP_DIAG_DATA_TYPE_SUMMARY otherwise.
+ *
+ * @param[in]  tag    Tag of metrics
+ * @param[in]  key    Unique key for the metrics
+ * @param[in]  label  Label for the metrics
+ * @param[in]  path   Hierarchical path for key, must be separated by '.' for more than one level
+ * @param[in]  config Aggregation config
+ * @param[out] handle Handle of the registered metrics
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_register_aggregate(const char *tag,
+                                              const char *key,
+                                              const char *label,
+                                              const char *path,
+                                              const esp_diag_metrics_agg_config_t *config,
+                                              esp_diag_metrics_handle_t *handle);
+
+/**
+ * @brief Get the key of a registered metrics from its handle
+ *
+ * @param[in] handle Handle of the metrics
+ *
+ * @return key if handle refers to a registered metrics, NULL otherwise.
+ */
+const char *esp_diag_metrics_key_get(esp_diag_metrics_handle_t handle);
+
+/**
+ * @brief Get the key of a registered metrics from the key id of its data points
+ *
+ * @param[in] key_id Key id of the data point
+ *
+ * @return key if key_id refers to a registered metrics, NULL otherwise.
+ */
+const char *esp_diag_metrics_key_get_by_id(uint16_t key_id);
+
 /**
  * @brief Unregister a diagnostics metrics
  *
@@ -100,6 +187,9 @@ esp_err_t esp_diag_metrics_unregister_all(void);
  * @param[out] len Length of the metrics meta data array
  *
  * @return array Array of metrics meta data
+ *
+ * @note Entries stay at the same index for as long as they are registered, so the array
+ *       may have unused entries in between. Those have key set to NULL and must be skipped.
  */
 const esp_diag_metrics_meta_t *esp_diag_metrics_meta_get_all(uint32_t *len);
 
@@ -195,6 +285,123 @@ esp_err_t esp_diag_metrics_add_mac(const char *key, uint8_t *mac);
  */
 esp_err_t esp_diag_metrics_add_str(const char *key, const char *str);
 
+/**
+ * @brief Add metrics to storage using its handle
+ *
+ * @param[in] data_type Data type of metrics \ref esp_diag_data_type_t
+ * @param[in] handle    Handle of metrics
+ * @param[in] val       Value of metrics
+ * @param[in] val_sz    Size of val
+ * @param[in] ts        Timestamp in microseconds, this should be the value at the time of data gathering
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_add_h(esp_diag_data_type_t data_type,
+                                 esp_diag_metrics_handle_t handle, const void *val,
+                                 size_t val_sz, uint64_t ts);
+
+/**
+ * @brief Add the metrics of data type boolean using its handle
+ *
+ * @param[in] handle Handle of the metrics
+ * @param[in] b      Value of the metrics
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_add_bool_h(esp_diag_metrics_handle_t handle, bool b);
+
+/**
+ * @brief Add the metrics of data type integer using its handle
+ *
+ * @param[in] handle Handle of the metrics
+ * @param[in] i      Value of the metrics
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_add_int_h(esp_diag_metrics_handle_t handle, int32_t i);
+
+/**
+ * @brief Add the metrics of data type unsigned integer using its handle
+ *
+ * @param[in] handle Handle of the metrics
+ * @param[in] u      Value of the metrics
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_add_uint_h(esp_diag_metrics_handle_t handle, uint32_t u);
+
+/**
+ * @brief Add the metrics of data type float using its handle
+ *
+ * @param[in] handle Handle of the metrics
+ * @param[in] f      Value of the metrics
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_add_float_h(esp_diag_metrics_handle_t handle, float f);
+
+/**
+ * @brief Add the IPv4 address metrics using its handle
+ *
+ * @param[in] handle Handle of the metrics
+ * @param[in] ip     IPv4 address
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_add_ipv4_h(esp_diag_metrics_handle_t handle, uint32_t ip);
+
+/**
+ * @brief Add the MAC address metrics using its handle
+ *
+ * @param[in] handle Handle of the metrics
+ * @param[in] mac    Array of length 6 i.e 6 octets of mac address
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_add_mac_h(esp_diag_metrics_handle_t handle, uint8_t *mac);
+
+/**
+ * @brief Add the metrics of data type string using its handle
+ *
+ * @param[in] handle Handle of the metrics
+ * @param[in] str    Value of the metrics
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_add_str_h(esp_diag_metrics_handle_t handle, const char *str);
+
+/**
+ * @brief Observe a value of an aggregated metrics
+ *
+ * Only updates the aggregate in RAM. The data point of a window is recorded by the first
+ * value observed after the window has elapsed, or by a periodic check if no value follows.
+ *
+ * @param[in] handle Handle of the metrics returned by \ref esp_diag_metrics_register_aggregate()
+ * @param[in] value  Observed value
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_observe(esp_diag_metrics_handle_t handle, int32_t value);
+
+/**
+ * @brief Record the data points of all aggregated metrics which have observed values
+ *
+ * Windows are closed early, e.g. this can be called before a planned restart.
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_aggregate_flush(void);
+
+/**
+ * @brief Record the data points of aggregated metrics whose window has elapsed
+ *
+ * Called periodically and before reading the data store for reporting, so a window is
+ * recorded even if no value is observed after it.
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_metrics_aggregate_flush_expired(void);
+
 #endif /* CONFIG_DIAG_ENABLE_METRICS */
 
 #ifdef __cplusplus
@@ -21,6 +21,10 @@ extern "C"
  *
  * Default periodic interval is 30 seconds and can be changed with esp_diag_heap_metrics_reset_interval().
  *
+ * With CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN, free heap and largest free block are checked every 5 seconds.
+ * Metrics are recorded only when either crosses its threshold, together with the minimum free heap seen since
+ * the previous record. CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS also checks free heap on every allocation.
+ *
  * @return ESP_OK if successful, appropriate error code otherwise.
  */
 esp_err_t esp_diag_heap_metrics_init(void);
@@ -51,6 +55,18 @@ void esp_diag_heap_metrics_reset_interval(uint32_t period);
  */
 esp_err_t esp_diag_heap_metrics_dump(void);
 
+#if CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN
+/**
+ * @brief Set the thresholds for recording heap metrics
+ *
+ * Defaults are CONFIG_DIAG_HEAP_METRICS_FREE_THRESHOLD and CONFIG_DIAG_HEAP_METRICS_LFB_THRESHOLD.
+ *
+ * @param[in] free Free internal heap threshold in bytes
+ * @param[in] lfb Largest free internal block threshold in bytes
+ */
+void esp_diag_heap_metrics_set_thresholds(uint32_t free, uint32_t lfb);
+#endif /* CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN */
+
 #endif /* CONFIG_DIAG_ENABLE_HEAP_METRICS */
 
 #if CONFIG_DIAG_ENABLE_WIFI_METRICS
@@ -93,6 +109,104 @@ void esp_diag_wifi_metrics_reset_interval(uint32_t period);
 
 #endif /* CONFIG_DIAG_ENABLE_WIFI_METRICS */
 
+#if CONFIG_DIAG_ENABLE_STACK_METRICS
+
+/**
+ * @brief Initialize the task stack metrics
+ *
+ * Stack high water mark of every task is sampled periodically. Lifetime minimum of free stack for each task
+ * is kept in RTC memory so it survives software resets, and is reported as a metric with the task name as key
+ * whenever it goes down.
+ *
+ * Default periodic interval is 30 seconds and can be changed with esp_diag_stack_metrics_reset_interval().
+ *
+ * @note Unlike heap and wifi metrics this is not started by ESP Insights, the application calls it once at boot
+ *       so that stack usage is tracked before Insights is up. Minima are exported once metrics are initialized.
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_stack_metrics_init(void);
+
+/**
+ * @brief Deinitialize the task stack metrics
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_stack_metrics_deinit(void);
+
+/**
+ * @brief Reset the periodic interval
+ *
+ * By default, stack metrics are collected every 30 seconds, this function can be used to change the interval.
+ * If the interval is set to 0, stack metrics collection disabled.
+ *
+ * @param[in] period Period interval in seconds
+ */
+void esp_diag_stack_metrics_reset_interval(uint32_t period);
+
+/**
+ * @brief Samples the stack usage of all tasks and reports the changed minimums.
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_stack_metrics_dump(void);
+
+/**
+ * @brief Prints the stack sizing report to the console.
+ *
+ * For every task, report contains the stack size, lifetime minimum free stack, used stack and
+ * the recommended stack size i.e. used stack plus CONFIG_DIAG_STACK_METRICS_MARGIN_PERCENT margin.
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_stack_metrics_report(void);
+
+#endif /* CONFIG_DIAG_ENABLE_STACK_METRICS */
+
+#if CONFIG_DIAG_ENABLE_CPU_METRICS
+
+/**
+ * @brief Initialize the CPU metrics
+ *
+ * FreeRTOS run time counters of all tasks are sampled periodically and the CPU usage of each task is computed
+ * over the window between two samples. Overall CPU load is reported with key "cpu_load", and the busiest
+ * CONFIG_DIAG_CPU_METRICS_TOP_N tasks are reported with "cpu_" followed by the task name as key.
+ * CPU usage of every task in the last window is also filled in by esp_diag_task_snapshot_get().
+ *
+ * Default periodic interval is 60 seconds and can be changed with esp_diag_cpu_metrics_reset_interval().
+ *
+ * @note ESP Insights does not start the CPU metrics, the application calls this once at boot.
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_cpu_metrics_init(void);
+
+/**
+ * @brief Deinitialize the CPU metrics
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_cpu_metrics_deinit(void);
+
+/**
+ * @brief Reset the periodic interval
+ *
+ * By default, CPU metrics are collected every 60 seconds, this function can be used to change the interval.
+ * If the interval is set to 0, CPU metrics collection disabled.
+ *
+ * @param[in] period Period interval in seconds
+ */
+void esp_diag_cpu_metrics_reset_interval(uint32_t period);
+
+/**
+ * @brief Closes the current window and reports the CPU metrics.
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ */
+esp_err_t esp_diag_cpu_metrics_dump(void);
+
+#endif /* CONFIG_DIAG_ENABLE_CPU_METRICS */
+
 #ifdef __cplusplus
 }
 #endif
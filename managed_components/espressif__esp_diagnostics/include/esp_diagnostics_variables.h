@@ -45,6 +45,7 @@ typedef struct {
     const char *path;          /*!< Hierarchical path for the key, must be separated by '.' for more than one level,
                                     eg: "wifi", "heap.internal", "heap.external" */
     esp_diag_data_type_t type; /*!< Data type of variables */
+    uint16_t key_id;           /*!< Key id of the data points, derived from key */
 } esp_diag_variable_meta_t;
 
 /**
@@ -102,17 +103,56 @@ esp_err_t esp_diag_variable_unregister_all(void);
  * @param[out] len Length of the variables  meta data array
  *
  * @return array Array of variables meta data
+ *
+ * @note Entries stay at the same index for as long as they are registered, so the array
+ *       may have unused entries in between. Those have key set to NULL and must be skipped.
  */
 const esp_diag_variable_meta_t *esp_diag_variable_meta_get_all(uint32_t *len);
 
+/**
+ * @brief Get the key of a registered variable from the key id of its data points
+ *
+ * @param[in] key_id Key id of the data point
+ *
+ * @return key if key_id refers to a registered variable, NULL otherwise.
+ */
+const char *esp_diag_variable_key_get(uint16_t key_id);
+
 /**
  * @brief Print metadata for all variables
  */
 void esp_diag_variable_meta_print_all(void);
 
+/**
+ * @brief Write variables which changed since the last flush, or whose upload failed, to storage
+ *
+ * This is meant to be called right before the stored data is sent. All variables which have
+ * a value are written if full is set or if CONFIG_DIAG_VARIABLES_SNAPSHOT_INTERVAL elapsed
+ * since the last full snapshot.
+ *
+ * @param[in] full Write all variables, e.g. to resync after the receiver lost its state
+ *
+ * @return ESP_OK if successful, appropriate error code otherwise.
+ *         Variables which failed to be written are retried on the next flush.
+ */
+esp_err_t esp_diag_variables_flush(bool full);
+
+/**
+ * @brief Report the outcome of uploading the variables written by the previous flushes
+ *
+ * Variables stay changed until their upload is acknowledged. If the upload failed, the
+ * variables written since the last call are written again by the next \ref esp_diag_variables_flush().
+ *
+ * @param[in] acked true if all the stored data was uploaded and acknowledged, false if some of it was lost
+ */
+void esp_diag_variables_upload_done(bool acked);
+
 /**
  * @brief Add variable to storage
  *
+ * Only the last value of a variable is kept, it is written to storage by \ref esp_diag_variables_flush().
+ * Setting a variable to its current value does not change it.
+ *
  * @param[in] data_type Data type of variable \ref esp_diag_data_type_t
  * @param[in] key       Key of variable
  * @param[in] val       Value of variable
@@ -0,0 +1,293 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+
+#include <esp_rmaker_work_queue.h>
+#include <esp_diagnostics.h>
+#include <esp_diagnostics_metrics.h>
+#include <esp_diagnostics_system_metrics.h>
+#include "esp_diagnostics_internal.h"
+
+#define LOG_TAG            "cpu_metrics"
+#define METRICS_TAG        "cpu"
+#define PATH_CPU           "Task.CPU"
+#define KEY_LOAD           "cpu_load"
+#define KEY_PREFIX         "cpu_"
+
+#define DEFAULT_POLLING_INTERVAL 60 /* 60 seconds */
+#define CPU_MAX_TASKS            CONFIG_DIAG_CPU_METRICS_MAX_TASKS
+#define CPU_TOP_N                CONFIG_DIAG_CPU_METRICS_TOP_N
+
+typedef struct {
+    char key[sizeof(KEY_PREFIX) - 1 + CONFIG_FREERTOS_MAX_TASK_NAME_LEN];  /* Metrics key, task name follows the prefix */
+    UBaseType_t task_number;
+    uint32_t run_time;          /* Run time counter at the last sample */
+    uint32_t delta;             /* Run time in the last window */
+    bool seen;                  /* Task was running at the last sample */
+    bool idle;                  /* Idle task, reported as part of the load */
+} cpu_entry_t;
+
+typedef struct {
+    uint16_t idx;
+    uint32_t delta;
+} cpu_rank_t;
+
+typedef struct {
+    bool init;
+    bool sampled;               /* First sample taken, following ones have a window */
+    TimerHandle_t handle;
+    uint32_t total;             /* Run time clock at the last sample */
+    uint32_t window;            /* Run time clock delta of the last window, all cores */
+    uint32_t idle;              /* Run time of the idle tasks in the last window */
+    uint32_t count;
+    cpu_entry_t entries[CPU_MAX_TASKS];
+} cpu_diag_priv_data_t;
+
+static cpu_diag_priv_data_t s_priv_data;
+static portMUX_TYPE s_cpu_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static cpu_entry_t *entry_get(const char *name)
+{
+    uint32_t i;
+    for (i = 0; i < s_priv_data.count; i++) {
+        if (strncmp(s_priv_data.entries[i].key + sizeof(KEY_PREFIX) - 1, name, CONFIG_FREERTOS_MAX_TASK_NAME_LEN) == 0) {
+            return &s_priv_data.entries[i];
+        }
+    }
+    /* Entries are not reused, their keys may be registered as metrics */
+    if (s_priv_data.count >= CPU_MAX_TASKS) {
+        return NULL;
+    }
+    /* Task number is left 0, which no task has, so the first sample does not count as a window */
+    cpu_entry_t *entry = &s_priv_data.entries[s_priv_data.count++];
+    memcpy(entry->key, KEY_PREFIX, sizeof(KEY_PREFIX) - 1);
+    strlcpy(entry->key + sizeof(KEY_PREFIX) - 1, name, CONFIG_FREERTOS_MAX_TASK_NAME_LEN);
+    return entry;
+}
+
+static void cpu_sample(void)
+{
+    uint32_t i, total;
+    UBaseType_t count = uxTaskGetNumberOfTasks() + 2; /* Room for tasks created meanwhile */
+    TaskStatus_t *status = malloc(count * sizeof(TaskStatus_t));
+    if (!status) {
+        return;
+    }
+    count = uxTaskGetSystemState(status, count, &total);
+    if (count == 0) {
+        free(status);
+        return;
+    }
+
+    portENTER_CRITICAL(&s_cpu_lock);
+    bool has_window = s_priv_data.sampled;
+    s_priv_data.window = (total - s_priv_data.total) * portNUM_PROCESSORS;
+    s_priv_data.total = total;
+    s_priv_data.idle = 0;
+    s_priv_data.sampled = true;
+    for (i = 0; i < s_priv_data.count; i++) {
+        s_priv_data.entries[i].seen = false;
+        s_priv_data.entries[i].delta = 0;
+    }
+    for (i = 0; i < count; i++) {
+        cpu_entry_t *entry = entry_get(status[i].pcTaskName);
+        if (!entry) {
+            continue;
+        }
+        /* Task with the same name recreated, its counter started over */
+        if (has_window && entry->task_number == status[i].xTaskNumber) {
+            entry->delta = status[i].ulRunTimeCounter - entry->run_time;
+        } else {
+            entry->delta = 0;
+        }
+        entry->task_number = status[i].xTaskNumber;
+        entry->run_time = status[i].ulRunTimeCounter;
+        entry->seen = true;
+        /* Idle tasks are named IDLE, or IDLE0 and IDLE1 on dual core targets */
+        entry->idle = status[i].uxCurrentPriority == tskIDLE_PRIORITY && strncmp(status[i].pcTaskName, "IDLE", 4) == 0;
+        if (entry->idle) {
+            s_priv_data.idle += entry->delta;
+        }
+    }
+    if (!has_window) {
+        s_priv_data.window = 0;
+    }
+    portEXIT_CRITICAL(&s_cpu_lock);
+    free(status);
+}
+
+/* Tasks other than idle seen in the last window, busiest first */
+static uint32_t cpu_rank(cpu_rank_t *rank, uint32_t max)
+{
+    uint32_t i, j, n = 0;
+    portENTER_CRITICAL(&s_cpu_lock);
+    for (i = 0; i < s_priv_data.count; i++) {
+        if (!s_priv_data.entries[i].seen || s_priv_data.entries[i].idle) {
+            continue;
+        }
+        rank[n].idx = i;
+        rank[n].delta = s_priv_data.entries[i].delta;
+        n++;
+    }
+    portEXIT_CRITICAL(&s_cpu_lock);
+
+    for (i = 1; i < n; i++) {
+        cpu_rank_t tmp = rank[i];
+        for (j = i; j > 0 && rank[j - 1].delta < tmp.delta; j--) {
+            rank[j] = rank[j - 1];
+        }
+        rank[j] = tmp;
+    }
+    return n < max ? n : max;
+}
+
+static float cpu_percent(uint32_t delta, uint32_t window)
+{
+    return window ? ((float)delta * 100) / window : 0;
+}
+
+static bool metric_registered(const char *key)
+{
+    uint32_t len, i;
+    const esp_diag_metrics_meta_t *meta = esp_diag_metrics_meta_get_all(&len);
+    for (i = 0; meta && i < len; i++) {
+        if (meta[i].key && strcmp(meta[i].key, key) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void cpu_export(void)
+{
+    uint32_t i, n, window, idle;
+    cpu_rank_t rank[CPU_MAX_TASKS];
+
+    portENTER_CRITICAL(&s_cpu_lock);
+    window = s_priv_data.window;
+    idle = s_priv_data.idle;
+    portEXIT_CRITICAL(&s_cpu_lock);
+    if (!window) {
+        return;
+    }
+    if (metric_registered(KEY_LOAD)
+            || esp_diag_metrics_register(METRICS_TAG, KEY_LOAD, "CPU load (%)", PATH_CPU,
+                                         ESP_DIAG_DATA_TYPE_FLOAT) == ESP_OK) {
+        esp_diag_metrics_add_float(KEY_LOAD, 100 - cpu_percent(idle, window));
+    }
+
+    n = cpu_rank(rank, CPU_TOP_N);
+    for (i = 0; i < n; i++) {
+        const char *key = s_priv_data.entries[rank[i].idx].key;
+        /* Tasks are created at runtime, register them as they show up in the top list */
+        if (!metric_registered(key)
+                && esp_diag_metrics_register(METRICS_TAG, key, "CPU usage (%)", PATH_CPU,
+                                             ESP_DIAG_DATA_TYPE_FLOAT) != ESP_OK) {
+            continue;
+        }
+        esp_diag_metrics_add_float(key, cpu_percent(rank[i].delta, window));
+    }
+}
+
+float esp_diag_cpu_percent_get(const char *name)
+{
+    uint32_t i;
+    float percent = -1;
+    if (!s_priv_data.init || !name) {
+        return percent;
+    }
+    portENTER_CRITICAL(&s_cpu_lock);
+    for (i = 0; i < s_priv_data.count; i++) {
+        const cpu_entry_t *entry = &s_priv_data.entries[i];
+        if (entry->seen && s_priv_data.window
+                && strncmp(entry->key + sizeof(KEY_PREFIX) - 1, name, CONFIG_FREERTOS_MAX_TASK_NAME_LEN) == 0) {
+            percent = cpu_percent(entry->delta, s_priv_data.window);
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_cpu_lock);
+    return percent;
+}
+
+esp_err_t esp_diag_cpu_metrics_dump(void)
+{
+    if (!s_priv_data.init) {
+        ESP_LOGW(LOG_TAG, "CPU metrics not initialized");
+        return ESP_ERR_INVALID_STATE;
+    }
+    cpu_sample();
+    cpu_export();
+    return ESP_OK;
+}
+
+static void cpu_metrics_export_cb(void *arg)
+{
+    cpu_export();
+}
+
+static void cpu_timer_cb(TimerHandle_t handle)
+{
+    /* Sampling closes the window, exporting goes through the store and is deferred to the work queue */
+    cpu_sample();
+    uint32_t len;
+    if (esp_diag_metrics_meta_get_all(&len)) {
+        esp_rmaker_work_queue_add_task(cpu_metrics_export_cb, NULL);
+    }
+}
+
+esp_err_t esp_diag_cpu_metrics_init(void)
+{
+    if (s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_priv_data.handle = xTimerCreate("cpu_metrics", SEC2TICKS(DEFAULT_POLLING_INTERVAL),
+                                      pdTRUE, NULL, cpu_timer_cb);
+    if (s_priv_data.handle) {
+        xTimerStart(s_priv_data.handle, 0);
+    }
+    s_priv_data.init = true;
+
+    // Start the first window
+    cpu_sample();
+
+    return ESP_OK;
+}
+
+esp_err_t esp_diag_cpu_metrics_deinit(void)
+{
+    uint32_t i;
+    if (!s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    /* Try to delete timer with 10 ticks wait time */
+    if (xTimerDelete(s_priv_data.handle, 10) == pdFALSE) {
+        ESP_LOGW(LOG_TAG, "Failed to delete cpu metric timer");
+    }
+    esp_diag_metrics_unregister(KEY_LOAD);
+    for (i = 0; i < s_priv_data.count; i++) {
+        esp_diag_metrics_unregister(s_priv_data.entries[i].key);
+    }
+    memset(&s_priv_data, 0, sizeof(s_priv_data));
+    return ESP_OK;
+}
+
+void esp_diag_cpu_metrics_reset_interval(uint32_t period)
+{
+    if (!s_priv_data.init) {
+        return;
+    }
+    if (period == 0) {
+        xTimerStop(s_priv_data.handle, 0);
+        return;
+    }
+    xTimerChangePeriod(s_priv_data.handle, SEC2TICKS(period), 0);
+}
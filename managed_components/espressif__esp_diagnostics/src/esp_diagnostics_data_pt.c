@@ -0,0 +1,220 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <esp_diagnostics.h>
+
+#define TAG_TYPE_SHIFT      4
+#define TAG_TYPE_MASK       0x07
+#define TAG_DATA_TYPE_MASK  0x0f
+#define MAX_STR_LEN         (sizeof(((esp_diag_compact_data_pt_t *)0)->value.str) - 1)
+
+static size_t varint_put(uint8_t *buf, uint64_t val)
+{
+    size_t n = 0;
+    while (val >= 0x80) {
+        buf[n++] = (uint8_t)val | 0x80;
+        val >>= 7;
+    }
+    buf[n++] = (uint8_t)val;
+    return n;
+}
+
+static size_t varint_get(const uint8_t *buf, size_t len, uint64_t *val)
+{
+    size_t n = 0;
+    uint32_t shift = 0;
+    *val = 0;
+    while (n < len && shift < 64) {
+        uint8_t b = buf[n++];
+        *val |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return n;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+static inline uint64_t zigzag_encode(int64_t val)
+{
+    return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t val)
+{
+    return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+static size_t agg_pack(uint8_t *buf, const esp_diag_compact_data_pt_t *pt)
+{
+    size_t n = 0;
+    uint8_t i;
+    n += varint_put(buf + n, pt->value.agg.window_ms);
+    n += varint_put(buf + n, pt->value.agg.count);
+    n += varint_put(buf + n, zigzag_encode(pt->value.agg.min));
+    n += varint_put(buf + n, zigzag_encode(pt->value.agg.max));
+    n += varint_put(buf + n, zigzag_encode(pt->value.agg.sum));
+    if (pt->data_type == ESP_DIAG_DATA_TYPE_HISTOGRAM) {
+        uint8_t count = pt->value.agg.bucket_count;
+        if (count > ESP_DIAG_HISTOGRAM_MAX_BUCKETS) {
+            count = ESP_DIAG_HISTOGRAM_MAX_BUCKETS;
+        }
+        buf[n++] = count;
+        for (i = 0; i < count; i++) {
+            n += varint_put(buf + n, pt->value.agg.buckets[i]);
+        }
+    }
+    return n;
+}
+
+static size_t agg_unpack(const uint8_t *buf, size_t len, esp_diag_compact_data_pt_t *pt)
+{
+    size_t n = 0, used;
+    uint64_t val[5];
+    uint8_t i;
+    for (i = 0; i < 5; i++) {
+        if (!(used = varint_get(buf + n, len - n, &val[i]))) {
+            return 0;
+        }
+        n += used;
+    }
+    pt->value.agg.window_ms = (uint32_t)val[0];
+    pt->value.agg.count = (uint32_t)val[1];
+    pt->value.agg.min = (int32_t)zigzag_decode(val[2]);
+    pt->value.agg.max = (int32_t)zigzag_decode(val[3]);
+    pt->value.agg.sum = zigzag_decode(val[4]);
+    if (pt->data_type == ESP_DIAG_DATA_TYPE_HISTOGRAM) {
+        if (n + 1 > len || buf[n] > ESP_DIAG_HISTOGRAM_MAX_BUCKETS) {
+            return 0;
+        }
+        pt->value.agg.bucket_count = buf[n++];
+        for (i = 0; i < pt->value.agg.bucket_count; i++) {
+            if (!(used = varint_get(buf + n, len - n, &val[0]))) {
+                return 0;
+            }
+            pt->value.agg.buckets[i] = (uint32_t)val[0];
+            n += used;
+        }
+    }
+    return n;
+}
+
+size_t esp_diag_compact_data_pt_pack(uint8_t *buf, const esp_diag_compact_data_pt_t *pt)
+{
+    size_t n = 0;
+    buf[n++] = ESP_DIAG_DATA_PT_COMPACT | ((pt->type & TAG_TYPE_MASK) << TAG_TYPE_SHIFT)
+               | (pt->data_type & TAG_DATA_TYPE_MASK);
+    buf[n++] = pt->key_id & 0xff;
+    buf[n++] = pt->key_id >> 8;
+    n += varint_put(buf + n, zigzag_encode(pt->ts_rel));
+
+    switch (pt->data_type) {
+        case ESP_DIAG_DATA_TYPE_BOOL:
+            buf[n++] = pt->value.b ? 1 : 0;
+            break;
+        case ESP_DIAG_DATA_TYPE_INT:
+            n += varint_put(buf + n, zigzag_encode(pt->value.i));
+            break;
+        case ESP_DIAG_DATA_TYPE_UINT:
+            n += varint_put(buf + n, pt->value.u);
+            break;
+        case ESP_DIAG_DATA_TYPE_FLOAT:
+        case ESP_DIAG_DATA_TYPE_IPv4:
+            memcpy(buf + n, &pt->value, 4);
+            n += 4;
+            break;
+        case ESP_DIAG_DATA_TYPE_MAC:
+            memcpy(buf + n, pt->value.mac, sizeof(pt->value.mac));
+            n += sizeof(pt->value.mac);
+            break;
+        case ESP_DIAG_DATA_TYPE_STR: {
+            size_t len = strnlen(pt->value.str, MAX_STR_LEN);
+            buf[n++] = len;
+            memcpy(buf + n, pt->value.str, len);
+            n += len;
+            break;
+        }
+        case ESP_DIAG_DATA_TYPE_SUMMARY:
+        case ESP_DIAG_DATA_TYPE_HISTOGRAM:
+            n += agg_pack(buf + n, pt);
+            break;
+        default:
+            return 0;
+    }
+    return n;
+}
+
+esp_err_t esp_diag_compact_data_pt_unpack(const uint8_t *buf, size_t len, esp_diag_compact_data_pt_t *pt)
+{
+    size_t n = 0, used;
+    uint64_t val;
+
+    if (!buf || !pt || len < 4 || !(buf[0] & ESP_DIAG_DATA_PT_COMPACT)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memset(pt, 0, sizeof(*pt));
+    pt->type = (buf[0] >> TAG_TYPE_SHIFT) & TAG_TYPE_MASK;
+    pt->data_type = buf[0] & TAG_DATA_TYPE_MASK;
+    n++;
+
+    pt->key_id = buf[n] | (buf[n + 1] << 8);
+    n += 2;
+    if (!(used = varint_get(buf + n, len - n, &val))) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pt->ts_rel = zigzag_decode(val);
+    n += used;
+
+    switch (pt->data_type) {
+        case ESP_DIAG_DATA_TYPE_BOOL:
+            if (n + 1 > len) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            pt->value.b = buf[n];
+            break;
+        case ESP_DIAG_DATA_TYPE_INT:
+            if (!varint_get(buf + n, len - n, &val)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            pt->value.i = (int32_t)zigzag_decode(val);
+            break;
+        case ESP_DIAG_DATA_TYPE_UINT:
+            if (!varint_get(buf + n, len - n, &val)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            pt->value.u = (uint32_t)val;
+            break;
+        case ESP_DIAG_DATA_TYPE_FLOAT:
+        case ESP_DIAG_DATA_TYPE_IPv4:
+            if (n + 4 > len) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            memcpy(&pt->value, buf + n, 4);
+            break;
+        case ESP_DIAG_DATA_TYPE_MAC:
+            if (n + sizeof(pt->value.mac) > len) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            memcpy(pt->value.mac, buf + n, sizeof(pt->value.mac));
+            break;
+        case ESP_DIAG_DATA_TYPE_STR:
+            if (n + 1 > len || buf[n] > MAX_STR_LEN || n + 1 + buf[n] > len) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            memcpy(pt->value.str, buf + n + 1, buf[n]);
+            break;
+        case ESP_DIAG_DATA_TYPE_SUMMARY:
+        case ESP_DIAG_DATA_TYPE_HISTOGRAM:
+            if (!agg_unpack(buf + n, len - n, pt)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            break;
+        default:
+            return ESP_ERR_INVALID_SIZE;
+    }
+    return ESP_OK;
+}
@@ -5,6 +5,7 @@
  */
 
 #include <string.h>
+#include <esp_attr.h>
 #include <esp_heap_caps.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/timers.h>
@@ -13,6 +14,13 @@
 #include <esp_diagnostics.h>
 #include <esp_diagnostics_metrics.h>
 #include "esp_diagnostics_internal.h"
+#if CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include <esp_memory_utils.h>
+#else
+#include <soc/soc_memory_layout.h>
+#endif
+#endif /* CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS */
 
 #define LOG_TAG            "heap_metrics"
 #define METRICS_TAG        "heap"
@@ -21,6 +29,7 @@
 #define KEY_FREE           "free"
 #define KEY_MIN_FREE       "min_free_ever"
 #define KEY_LFB            "lfb"
+#define KEY_WINDOW_MIN     "min_free"
 #ifdef CONFIG_ESP32_SPIRAM_SUPPORT
 #define KEY_EXT_FREE       "ext_free"
 #define KEY_EXT_LFB        "ext_lfb"
@@ -30,14 +39,98 @@
 #define PATH_HEAP_INTERNAL "heap.internal"
 #define PATH_HEAP_EXTERNAL "heap.external"
 
+#if CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN
+/* Only checks the thresholds, nothing is recorded unless one was crossed */
+#define DEFAULT_POLLING_INTERVAL 5  /* 5 seconds */
+/* Low state is left once the value is this much above the threshold */
+#define THRESHOLD_HYSTERESIS(t)  ((t) / 8)
+#else
 #define DEFAULT_POLLING_INTERVAL 30 /* 30 seconds */
+#endif
 
 typedef struct {
     bool init;
     TimerHandle_t handle;
+    esp_diag_metrics_handle_t h_alloc_fail;
+    esp_diag_metrics_handle_t h_free;
+    esp_diag_metrics_handle_t h_lfb;
+    esp_diag_metrics_handle_t h_min_free;
+    uint32_t min_free;          /* Last recorded minimum, it only goes down */
+#if CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN
+    esp_diag_metrics_handle_t h_window_min;
+    uint32_t free_threshold;
+    uint32_t lfb_threshold;
+    uint32_t window_min;        /* Minimum free heap since the last report */
+#if CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS
+    uint32_t free_est;          /* Free heap at the last read less the allocations since */
+#endif
+    bool free_low;
+    bool lfb_low;
+    bool report_pending;        /* Free heap crossed its threshold */
+#endif /* CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN */
+#ifdef CONFIG_ESP32_SPIRAM_SUPPORT
+    esp_diag_metrics_handle_t h_ext_free;
+    esp_diag_metrics_handle_t h_ext_lfb;
+    esp_diag_metrics_handle_t h_ext_min_free;
+    uint32_t ext_min_free;
+#endif /* CONFIG_ESP32_SPIRAM_SUPPORT */
 } heap_diag_priv_data_t;
 
 static heap_diag_priv_data_t s_priv_data;
+#if CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN
+static portMUX_TYPE s_heap_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/* Returns true if the value went below the threshold or recovered from it */
+FORCE_INLINE_ATTR bool threshold_crossed(uint32_t value, uint32_t threshold, bool *low)
+{
+    if (!*low && value < threshold) {
+        *low = true;
+        return true;
+    }
+    if (*low && value >= threshold + THRESHOLD_HYSTERESIS(threshold)) {
+        *low = false;
+        return true;
+    }
+    return false;
+}
+
+/* Called with s_heap_lock held */
+FORCE_INLINE_ATTR void heap_free_check(uint32_t free)
+{
+    if (free < s_priv_data.window_min) {
+        s_priv_data.window_min = free;
+    }
+    if (threshold_crossed(free, s_priv_data.free_threshold, &s_priv_data.free_low)) {
+        s_priv_data.report_pending = true;
+    }
+}
+
+#if CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS
+/* Called by the heap after every allocation, possibly with the cache disabled.
+ * Frees do not pass their size, so the estimate only goes down and is used as a hint.
+ * Free heap is read to confirm a crossing before it is recorded, the heap functions
+ * are in IRAM and the heap lock is no longer held when the hook runs.
+ */
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    if (!s_priv_data.init || !ptr || !esp_ptr_internal(ptr)) {
+        return;
+    }
+    portENTER_CRITICAL_SAFE(&s_heap_lock);
+    s_priv_data.free_est = s_priv_data.free_est > size ? s_priv_data.free_est - size : 0;
+    bool confirm = !s_priv_data.free_low && s_priv_data.free_est < s_priv_data.free_threshold;
+    portEXIT_CRITICAL_SAFE(&s_heap_lock);
+    if (!confirm) {
+        return;
+    }
+    uint32_t free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    portENTER_CRITICAL_SAFE(&s_heap_lock);
+    s_priv_data.free_est = free;
+    heap_free_check(free);
+    portEXIT_CRITICAL_SAFE(&s_heap_lock);
+}
+#endif /* CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS */
+#endif /* CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN */
 
 esp_err_t esp_diag_heap_metrics_dump(void)
 {
@@ -49,12 +142,33 @@ esp_err_t esp_diag_heap_metrics_dump(void)
     uint32_t lfb = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
     uint32_t min_free_ever = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL);
 
-    RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint(KEY_FREE, free), ESP_LOG_WARN, LOG_TAG,
+#if CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN
+    portENTER_CRITICAL_SAFE(&s_heap_lock);
+    uint32_t window_min = s_priv_data.window_min < free ? s_priv_data.window_min : free;
+    s_priv_data.window_min = free;
+#if CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS
+    s_priv_data.free_est = free;
+#endif
+    s_priv_data.report_pending = false;
+    portEXIT_CRITICAL_SAFE(&s_heap_lock);
+
+    RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint_h(s_priv_data.h_free, free), ESP_LOG_WARN, LOG_TAG,
                         "Failed to add heap metric key:" KEY_FREE);
-    RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint(KEY_LFB, lfb), ESP_LOG_WARN, LOG_TAG,
+    RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint_h(s_priv_data.h_lfb, lfb), ESP_LOG_WARN, LOG_TAG,
                         "Failed to add heap metric key:" KEY_LFB);
-    RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint(KEY_MIN_FREE, min_free_ever), ESP_LOG_WARN, LOG_TAG,
-                        "Failed to add heap metric key:" KEY_MIN_FREE);
+    RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint_h(s_priv_data.h_window_min, window_min), ESP_LOG_WARN, LOG_TAG,
+                        "Failed to add heap metric key:" KEY_WINDOW_MIN);
+#else
+    RET_ON_ERR_WITH_LOG(esp_diag_metrics_observe(s_priv_data.h_free, free), ESP_LOG_WARN, LOG_TAG,
+                        "Failed to add heap metric key:" KEY_FREE);
+    RET_ON_ERR_WITH_LOG(esp_diag_metrics_observe(s_priv_data.h_lfb, lfb), ESP_LOG_WARN, LOG_TAG,
+                        "Failed to add heap metric key:" KEY_LFB);
+#endif /* CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN */
+    if (min_free_ever != s_priv_data.min_free) {
+        RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint_h(s_priv_data.h_min_free, min_free_ever), ESP_LOG_WARN, LOG_TAG,
+                            "Failed to add heap metric key:" KEY_MIN_FREE);
+        s_priv_data.min_free = min_free_ever;
+    }
 
     ESP_LOGI(LOG_TAG, KEY_FREE ":0x%" PRIx32 " " KEY_LFB ":0x%" PRIx32 " " KEY_MIN_FREE ":0x%" PRIx32, free, lfb, min_free_ever);
 #ifdef CONFIG_ESP32_SPIRAM_SUPPORT
@@ -62,12 +176,15 @@ esp_err_t esp_diag_heap_metrics_dump(void)
     lfb = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
     min_free_ever = heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM);
 
-    RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint(KEY_EXT_FREE, free), ESP_LOG_WARN, LOG_TAG,
+    RET_ON_ERR_WITH_LOG(esp_diag_metrics_observe(s_priv_data.h_ext_free, free), ESP_LOG_WARN, LOG_TAG,
                         "Failed to add heap metric key:" KEY_EXT_FREE);
-    RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint(KEY_EXT_LFB, lfb), ESP_LOG_WARN, LOG_TAG,
+    RET_ON_ERR_WITH_LOG(esp_diag_metrics_observe(s_priv_data.h_ext_lfb, lfb), ESP_LOG_WARN, LOG_TAG,
                         "Failed to add heap metric key:" KEY_EXT_LFB);
-    RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint(KEY_EXT_MIN_FREE, min_free_ever), ESP_LOG_WARN, LOG_TAG,
-                        "Failed to add heap metric key:" KEY_EXT_MIN_FREE);
+    if (min_free_ever != s_priv_data.ext_min_free) {
+        RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_uint_h(s_priv_data.h_ext_min_free, min_free_ever), ESP_LOG_WARN, LOG_TAG,
+                            "Failed to add heap metric key:" KEY_EXT_MIN_FREE);
+        s_priv_data.ext_min_free = min_free_ever;
+    }
 
     ESP_LOGI(LOG_TAG, KEY_EXT_FREE ":0x%" PRIx32 " " KEY_EXT_LFB ":0x%" PRIx32 " " KEY_EXT_MIN_FREE ":0x%" PRIx32, free, lfb, min_free_ever);
 #endif /* CONFIG_ESP32_SPIRAM_SUPPORT */
@@ -79,22 +196,53 @@ static void heap_metrics_dump_cb(void *arg)
     esp_diag_heap_metrics_dump();
 }
 
+#if CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN
+static void heap_timer_cb(TimerHandle_t handle)
+{
+    uint32_t free = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    uint32_t lfb = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+    portENTER_CRITICAL_SAFE(&s_heap_lock);
+#if CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS
+    s_priv_data.free_est = free;
+#endif
+    heap_free_check(free);
+    bool report = threshold_crossed(lfb, s_priv_data.lfb_threshold, &s_priv_data.lfb_low)
+                  || s_priv_data.report_pending;
+    portEXIT_CRITICAL_SAFE(&s_heap_lock);
+    if (report) {
+        esp_rmaker_work_queue_add_task(heap_metrics_dump_cb, NULL);
+    }
+}
+
+void esp_diag_heap_metrics_set_thresholds(uint32_t free, uint32_t lfb)
+{
+    portENTER_CRITICAL_SAFE(&s_heap_lock);
+    s_priv_data.free_threshold = free;
+    s_priv_data.lfb_threshold = lfb;
+    portEXIT_CRITICAL_SAFE(&s_heap_lock);
+}
+#else
 static void heap_timer_cb(TimerHandle_t handle)
 {
     esp_rmaker_work_queue_add_task(heap_metrics_dump_cb, NULL);
 }
+#endif /* CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN */
 
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 2, 0)
 static void alloc_failed_hook(size_t size, uint32_t caps, const char *func)
 {
     esp_diag_heap_metrics_dump();
-    esp_diag_metrics_add_uint(KEY_ALLOC_FAIL, size);
+    esp_diag_metrics_add_uint_h(s_priv_data.h_alloc_fail, size);
     ESP_DIAG_EVENT(METRICS_TAG, KEY_ALLOC_FAIL " size:0x%x func:%s", size, func);
 }
 #endif
 
 esp_err_t esp_diag_heap_metrics_init(void)
 {
+#if !CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN || defined(CONFIG_ESP32_SPIRAM_SUPPORT)
+    /* Free heap and largest free block are sampled often, record one summary per window */
+    const esp_diag_metrics_agg_config_t agg_config = { 0 };
+#endif
     if (s_priv_data.init) {
         return ESP_ERR_INVALID_STATE;
     }
@@ -103,19 +251,33 @@ esp_err_t esp_diag_heap_metrics_init(void)
     if (err != ESP_OK) {
         return err;
     }
-    esp_diag_metrics_register(METRICS_TAG, KEY_ALLOC_FAIL, "Malloc fail", METRICS_TAG, ESP_DIAG_DATA_TYPE_UINT);
+    esp_diag_metrics_register_h(METRICS_TAG, KEY_ALLOC_FAIL, "Malloc fail", METRICS_TAG, ESP_DIAG_DATA_TYPE_UINT, &s_priv_data.h_alloc_fail);
 #endif
 
 #ifdef CONFIG_ESP32_SPIRAM_SUPPORT
-    esp_diag_metrics_register(METRICS_TAG, KEY_EXT_FREE, "External free heap", PATH_HEAP_EXTERNAL, ESP_DIAG_DATA_TYPE_UINT);
-    esp_diag_metrics_register(METRICS_TAG, KEY_EXT_LFB, "External largest free block", PATH_HEAP_EXTERNAL, ESP_DIAG_DATA_TYPE_UINT);
-    esp_diag_metrics_register(METRICS_TAG, KEY_EXT_MIN_FREE, "External minimum free size", PATH_HEAP_EXTERNAL, ESP_DIAG_DATA_TYPE_UINT);
+    esp_diag_metrics_register_aggregate(METRICS_TAG, KEY_EXT_FREE, "External free heap", PATH_HEAP_EXTERNAL, &agg_config, &s_priv_data.h_ext_free);
+    esp_diag_metrics_register_aggregate(METRICS_TAG, KEY_EXT_LFB, "External largest free block", PATH_HEAP_EXTERNAL, &agg_config, &s_priv_data.h_ext_lfb);
+    esp_diag_metrics_register_h(METRICS_TAG, KEY_EXT_MIN_FREE, "External minimum free size", PATH_HEAP_EXTERNAL, ESP_DIAG_DATA_TYPE_UINT, &s_priv_data.h_ext_min_free);
 
 #endif /* CONFIG_ESP32_SPIRAM_SUPPORT */
 
-    esp_diag_metrics_register(METRICS_TAG, KEY_FREE, "Free heap", PATH_HEAP_INTERNAL, ESP_DIAG_DATA_TYPE_UINT);
-    esp_diag_metrics_register(METRICS_TAG, KEY_LFB, "Largest free block", PATH_HEAP_INTERNAL, ESP_DIAG_DATA_TYPE_UINT);
-    esp_diag_metrics_register(METRICS_TAG, KEY_MIN_FREE, "Minimum free size", PATH_HEAP_INTERNAL, ESP_DIAG_DATA_TYPE_UINT);
+#if CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN
+    /* Recorded only when a threshold is crossed, along with the lowest free heap seen since the last record */
+    esp_diag_metrics_register_h(METRICS_TAG, KEY_FREE, "Free heap", PATH_HEAP_INTERNAL, ESP_DIAG_DATA_TYPE_UINT, &s_priv_data.h_free);
+    esp_diag_metrics_register_h(METRICS_TAG, KEY_LFB, "Largest free block", PATH_HEAP_INTERNAL, ESP_DIAG_DATA_TYPE_UINT, &s_priv_data.h_lfb);
+    esp_diag_metrics_register_h(METRICS_TAG, KEY_WINDOW_MIN, "Minimum free size since last record", PATH_HEAP_INTERNAL, ESP_DIAG_DATA_TYPE_UINT, &s_priv_data.h_window_min);
+    if (!s_priv_data.free_threshold && !s_priv_data.lfb_threshold) {
+        esp_diag_heap_metrics_set_thresholds(CONFIG_DIAG_HEAP_METRICS_FREE_THRESHOLD, CONFIG_DIAG_HEAP_METRICS_LFB_THRESHOLD);
+    }
+    s_priv_data.window_min = UINT32_MAX;
+#if CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS
+    s_priv_data.free_est = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+#endif
+#else
+    esp_diag_metrics_register_aggregate(METRICS_TAG, KEY_FREE, "Free heap", PATH_HEAP_INTERNAL, &agg_config, &s_priv_data.h_free);
+    esp_diag_metrics_register_aggregate(METRICS_TAG, KEY_LFB, "Largest free block", PATH_HEAP_INTERNAL, &agg_config, &s_priv_data.h_lfb);
+#endif /* CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN */
+    esp_diag_metrics_register_h(METRICS_TAG, KEY_MIN_FREE, "Minimum free size", PATH_HEAP_INTERNAL, ESP_DIAG_DATA_TYPE_UINT, &s_priv_data.h_min_free);
 
     s_priv_data.handle = xTimerCreate("heap_metrics", SEC2TICKS(DEFAULT_POLLING_INTERVAL),
                                       pdTRUE, NULL, heap_timer_cb);
@@ -150,6 +312,13 @@ esp_err_t esp_diag_heap_metrics_deinit(void)
     esp_diag_metrics_unregister(KEY_FREE);
     esp_diag_metrics_unregister(KEY_LFB);
     esp_diag_metrics_unregister(KEY_MIN_FREE);
+#if CONFIG_DIAG_HEAP_METRICS_EVENT_DRIVEN
+    esp_diag_metrics_unregister(KEY_WINDOW_MIN);
+#endif
+#if CONFIG_DIAG_HEAP_METRICS_ALLOC_HOOKS
+    /* Allocation hook keeps running, stop it before clearing the state */
+    s_priv_data.init = false;
+#endif
     memset(&s_priv_data, 0, sizeof(s_priv_data));
     return ESP_OK;
 }
@@ -20,6 +20,20 @@ extern "C" {
 
 #define SEC2TICKS(s) ((s * 1000) / portTICK_PERIOD_MS)
 
+/* Key id of compact data points, derived from the key so it is the same on every boot */
+uint16_t esp_diag_key_id_get(const char *key);
+
+/* Called when metrics or variables are registered or unregistered */
+void esp_diag_meta_crc_invalidate(void);
+
+/* Backtrace from the frame saved on the stack of a task that is not running */
+void esp_diag_task_bt_get(esp_diag_task_bt_t *bt_info, void *frame);
+
+#if CONFIG_DIAG_ENABLE_CPU_METRICS
+/* CPU usage of the task in the last window, negative if the task was not seen */
+float esp_diag_cpu_percent_get(const char *name);
+#endif /* CONFIG_DIAG_ENABLE_CPU_METRICS */
+
 #ifdef __cplusplus
 }
 #endif
@@ -10,6 +10,7 @@
 #include "esp_diagnostics.h"
 #include "soc/soc_memory_layout.h"
 #include "esp_idf_version.h"
+#include "esp_timer.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
@@ -28,9 +29,80 @@
 
 #define IS_LOG_TYPE_ENABLED(type) (s_priv_data.init && (type & s_priv_data.enabled_log_type))
 
+/* Repeats held back before a log, written as a summary record ahead of it */
+typedef struct {
+    uint32_t count;
+    uint64_t first_ts;
+    uint64_t last_ts;
+} log_repeat_t;
+
+#if CONFIG_DIAG_LOG_RATE_LIMIT
+#define SITE_COUNT              CONFIG_DIAG_LOG_RATE_LIMIT_SITES
+#define SITE_WINDOW_US          ((uint64_t)CONFIG_DIAG_LOG_RATE_LIMIT_WINDOW * 1000000)
+#define SITE_BURST              CONFIG_DIAG_LOG_RATE_LIMIT_BURST
+
+typedef struct {
+    uint32_t pc;
+    const char *format;         /* NULL if the entry is unused */
+    uint8_t type;
+    char tag[16];
+    uint64_t window_start;      /* esp_timer time */
+    uint32_t recorded;          /* Logs recorded in the current window */
+    uint32_t suppressed;        /* Logs counted since the last record */
+    uint64_t first_ts;          /* Timestamp of the first suppressed log */
+    uint64_t last_ts;           /* Timestamp of the last suppressed log */
+} log_site_t;
+
+static log_site_t s_sites[SITE_COUNT];
+static portMUX_TYPE s_site_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif /* CONFIG_DIAG_LOG_RATE_LIMIT */
+
+#if CONFIG_DIAG_LOG_DEFERRED_CAPTURE
+#define DEFERRED_SLOTS          CONFIG_DIAG_LOG_DEFERRED_SLOTS
+#define DEFERRED_ARGS_SIZE      (CONFIG_DIAG_LOG_DEFERRED_ARG_WORDS * 4)
+#define DEFERRED_TASK_STACK     3072
+#define DEFERRED_TASK_PRIORITY  3
+/* Slot being filled is not processed, retry a bit later */
+#define DEFERRED_RETRY_TICKS    pdMS_TO_TICKS(10)
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_WRITING,
+    SLOT_READY,
+} deferred_slot_state_t;
+
+typedef struct {
+    volatile uint8_t state;                 /* deferred_slot_state_t */
+    uint8_t type;                           /* esp_diag_log_type_t */
+    uint8_t args_off;                       /* Offset of the first argument in args */
+    uint8_t args_len;                       /* Bytes of argument words copied */
+    uint32_t pc;
+    uint64_t timestamp;
+    log_repeat_t repeat;
+    const char *format;
+    char tag[16];
+    char task_name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];
+    /* Raw argument words, same alignment modulo 8 as at the call site for va_arg() of 64-bit types */
+    uint64_t args[(DEFERRED_ARGS_SIZE + 8 + 7) / 8];
+} deferred_log_t;
+
+/* Filled by all contexts on one core, emptied by the background task */
+typedef struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    deferred_log_t slots[DEFERRED_SLOTS];
+} deferred_ring_t;
+
+static deferred_ring_t s_rings[portNUM_PROCESSORS];
+#endif /* CONFIG_DIAG_LOG_DEFERRED_CAPTURE */
+
 typedef struct {
     uint32_t enabled_log_type;
     esp_diag_log_config_t config;
+#if CONFIG_DIAG_LOG_DEFERRED_CAPTURE
+    TaskHandle_t deferred_task;
+    volatile uint32_t deferred_dropped;
+#endif /* CONFIG_DIAG_LOG_DEFERRED_CAPTURE */
     bool init;
 } log_hook_priv_data_t;
 
@@ -64,24 +136,64 @@ static esp_err_t append_arg(uint8_t *args, uint8_t *out_size, uint8_t max_len,
     return ESP_OK;
 }
 
-static void get_tlv_from_ap(esp_diag_log_data_t *log, const char *format, va_list ap)
+/* How a conversion is read from the va_list and stored as TLV, see arg_append() */
+typedef enum {
+    FMT_ARG_INT,            /* int as ARG_TYPE_INT */
+    FMT_ARG_CHAR,           /* int as ARG_TYPE_CHAR */
+    FMT_ARG_SHORT,          /* int as ARG_TYPE_SHORT */
+    FMT_ARG_LONG,           /* long as ARG_TYPE_L */
+    FMT_ARG_LLONG,          /* long long as ARG_TYPE_LL */
+    FMT_ARG_INTMAX,         /* intmax_t as ARG_TYPE_INTMAX */
+    FMT_ARG_PTRDIFF,        /* ptrdiff_t as ARG_TYPE_PTRDIFF */
+    FMT_ARG_UINT,           /* unsigned int as ARG_TYPE_UINT */
+    FMT_ARG_UCHAR,          /* unsigned int as ARG_TYPE_UCHAR */
+    FMT_ARG_USHORT,         /* unsigned int as ARG_TYPE_USHORT */
+    FMT_ARG_ULONG,          /* unsigned long as ARG_TYPE_UL */
+    FMT_ARG_ULONG_ULL,      /* unsigned long as ARG_TYPE_ULL, %O and %U */
+    FMT_ARG_ULLONG,         /* unsigned long long as ARG_TYPE_ULL */
+    FMT_ARG_UINTMAX,        /* uintmax_t as ARG_TYPE_UINTMAX */
+    FMT_ARG_SIZE,           /* size_t as ARG_TYPE_SIZE */
+    FMT_ARG_DOUBLE,         /* double as ARG_TYPE_DOUBLE */
+    FMT_ARG_LDOUBLE,        /* long double as ARG_TYPE_LDOUBLE */
+    FMT_ARG_STR,            /* char * as ARG_TYPE_STR */
+    FMT_ARG_SKIP,           /* int which is not stored, %n and unsupported specifiers */
+    FMT_ARG_END,            /* end of format string */
+} fmt_arg_t;
+
+#define FMT_CACHE_SIZE      CONFIG_DIAG_LOG_FORMAT_CACHE_SIZE
+#define FMT_DESC_MAX_ARGS   12
+
+/* Arguments of a format string, formats live in rodata so this is computed once per format */
+typedef struct {
+    const char *format;             /* NULL if the entry is unused */
+    uint16_t resume;                /* Offset to continue parsing at if the format has more arguments, else 0 */
+    uint8_t count;
+    uint8_t args[FMT_DESC_MAX_ARGS];  /* fmt_arg_t */
+} fmt_desc_t;
+
+#if FMT_CACHE_SIZE
+static fmt_desc_t s_fmt_cache[FMT_CACHE_SIZE];
+static portMUX_TYPE s_fmt_lock = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+/* Parses up to and including the next conversion of the format string, returns how to read its argument.
+ * There can be flags, field width digits, precision digits, modifiers, specifiers
+ * modifier tells the size of the field eg: hh, h, l, ll
+ * specifier tells whether it is signed, unsigned, double, string, pointer, etc.
+ * Following parsing is done by considering printf manual (man 3 printf)
+ */
+static fmt_arg_t fmt_next_arg(const char **format)
 {
-    const char *p = NULL;
-    uint8_t len, out_size = 0;
-    uint8_t arg_max_len = sizeof(log->msg_args);
-    esp_err_t err = ESP_OK;
-    esp_diag_arg_value_t arg_val;
+    const char *p = *format;
     modifiers_t mf;
 
-    /* there can be flags, field width digits, precision digits, modifiers, specifiers
-     * modifier tells the size of the field eg: hh, h, l, ll
-     * specifier tells whether it is signed, unsigned, double, string, pointer, etc.
-     * Following parsing is done by considering printf manual (man 3 printf)
-     */
-    for (p = format; *p; p++) {
+    while (*p) {
+        if (*p++ != '%') {
+            continue;
+        }
+        /* "%%" prints a percent sign and takes no argument */
         if (*p == '%') {
             p++;
-        } else {
             continue;
         }
         /* skip zero or more flags */
@@ -100,105 +212,58 @@ static void get_tlv_from_ap(esp_diag_log_data_t *log, const char *format, va_lis
             }
         }
         /* An optional length modifier, that specifies the size of the argument */
-        len = 0;
         mf = MOD_NONE;
         while (*p) {
-            bool _default = false;
-            switch (*p) {
-                case 'h':
-                    if (mf == MOD_h) {
-                        mf = MOD_hh;
-                        len = sizeof(char);
-                    } else {
-                        mf = MOD_h;
-                        len = sizeof(short);
-                    }
-                    break;
-                case 'l':
-                    if (mf == MOD_l) {
-                        mf = MOD_ll;
-                        len = sizeof(long long);
-                    } else {
-                        mf = MOD_l;
-                        len = sizeof(long);
-                    }
-                    break;
-                case 'j':
-                    mf = MOD_j;
-                    len = sizeof(intmax_t);
-                    break;
-                case 't':
-                    mf = MOD_t;
-                    len = sizeof(ptrdiff_t);
-                    break;
-                case 'z':
-                    mf = MOD_z;
-                    len = sizeof(size_t);
-                    break;
-                case 'L':
-                    mf = MOD_L;
-                    len = sizeof(long double);
-                    break;
-                default:
-                    _default = true;
-                    break;
-            }
-            if (_default) {
+            if (*p == 'h') {
+                mf = (mf == MOD_h) ? MOD_hh : MOD_h;
+            } else if (*p == 'l') {
+                mf = (mf == MOD_l) ? MOD_ll : MOD_l;
+            } else if (*p == 'j') {
+                mf = MOD_j;
+            } else if (*p == 't') {
+                mf = MOD_t;
+            } else if (*p == 'z') {
+                mf = MOD_z;
+            } else if (*p == 'L') {
+                mf = MOD_L;
+            } else {
                 break;
             }
             p++;
         }
+        if (!*p) {
+            break;
+        }
         /* specifier, character that specifies the type of conversion to be applied */
-        memset(&arg_val, 0, sizeof(arg_val));
+        *format = p + 1;
         switch (*p) {
             case 'D': /* equivalent to ld */
-                arg_val.l = va_arg(ap, long);
-                err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_L, sizeof(long), &arg_val.l);
-                break;
+                return FMT_ARG_LONG;
             case 'd':
             case 'i':
                 switch (mf) {
                     case MOD_NONE: /* none, no modifier found */
                     case MOD_z: /* singed integer of size size_t */
-                        arg_val.i = va_arg(ap, int);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_INT, sizeof(int), &arg_val.i);
-                        break;
+                        return FMT_ARG_INT;
                     case MOD_hh: /* char */
-                        arg_val.c = va_arg(ap, int);    /* char is promoted to int */
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_CHAR, len, &arg_val.c);
-                        break;
+                        return FMT_ARG_CHAR;
                     case MOD_h: /* short */
-                        arg_val.s = va_arg(ap, int);    /* short is promoted to int */
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_SHORT, len, &arg_val.s);
-                        break;
+                        return FMT_ARG_SHORT;
                     case MOD_l: /* long */
-                        arg_val.l = va_arg(ap, long);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_L, len, &arg_val.l);
-                        break;
-                        break;
+                        return FMT_ARG_LONG;
                     case MOD_ll: /* long long */
-                        arg_val.ll = va_arg(ap, long long);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_LL, len, &arg_val.ll);
-                        break;
-                    case MOD_j:
-                        /* intmax_t */
-                        arg_val.imx = va_arg(ap, intmax_t);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_INTMAX, len, &arg_val.imx);
-                        break;
-                    case MOD_t:
-                        /* ptrdiff_t */
-                        arg_val.ptrdiff = va_arg(ap, ptrdiff_t);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_PTRDIFF, len, &arg_val.ptrdiff);
-                        break;
+                        return FMT_ARG_LLONG;
+                    case MOD_j: /* intmax_t */
+                        return FMT_ARG_INTMAX;
+                    case MOD_t: /* ptrdiff_t */
+                        return FMT_ARG_PTRDIFF;
                     default:
                         break;
                 }
                 break;
             case 'O':   /* equivalent to lo */
             case 'U':   /* equivalent to lu */
-                arg_val.ul = va_arg(ap, unsigned long);
-                err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_ULL, sizeof(unsigned long), &arg_val.ul);
-                break;
+                return FMT_ARG_ULONG_ULL;
             case 'o':
             case 'u':
             case 'x':
@@ -207,34 +272,19 @@ static void get_tlv_from_ap(esp_diag_log_data_t *log, const char *format, va_lis
                 switch (mf) {
                     case MOD_NONE:  /* none, no modifier found */
                     case MOD_t:     /* unsigned type of size ptrdiff_t */
-                        len = sizeof(unsigned int);
-                        arg_val.u = va_arg(ap, unsigned int);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_UINT, len, &arg_val.u);
-                        break;
+                        return FMT_ARG_UINT;
                     case MOD_hh:    /* unsinged char */
-                        arg_val.uc = va_arg(ap, unsigned int);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_UCHAR, len, &arg_val.uc);
-                        break;
+                        return FMT_ARG_UCHAR;
                     case MOD_h: /* unsigned short */
-                        arg_val.us = va_arg(ap, unsigned int);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_USHORT, len, &arg_val.us);
-                        break;
+                        return FMT_ARG_USHORT;
                     case MOD_l: /* unsigned long */
-                        arg_val.ul = va_arg(ap, unsigned long);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_UL, len, &arg_val.ul);
-                        break;
+                        return FMT_ARG_ULONG;
                     case MOD_ll: /* unsigned long long */
-                        arg_val.ull = va_arg(ap, unsigned long long);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_ULL, len, &arg_val.ull);
-                        break;
+                        return FMT_ARG_ULLONG;
                     case MOD_j: /* uintmax_t */
-                        arg_val.umx = va_arg(ap, uintmax_t);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_UINTMAX, len, &arg_val.umx);
-                        break;
+                        return FMT_ARG_UINTMAX;
                     case MOD_z: /* size_t */
-                        arg_val.sz = va_arg(ap, size_t);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_SIZE, len, &arg_val.sz);
-                        break;
+                        return FMT_ARG_SIZE;
                     default:
                         break;
                 }
@@ -250,43 +300,279 @@ static void get_tlv_from_ap(esp_diag_log_data_t *log, const char *format, va_lis
                 switch (mf) {
                     case MOD_NONE: /* double */
                     case MOD_l:    /* double */
-                        len = sizeof(double);
-                        arg_val.d = va_arg(ap, double);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_DOUBLE, len, &arg_val.d);
-                        break;
+                        return FMT_ARG_DOUBLE;
                     case MOD_L: /* long double */
-                        arg_val.ld = va_arg(ap, long double);
-                        err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_LDOUBLE, len, &arg_val.ld);
-                        break;
+                        return FMT_ARG_LDOUBLE;
                     default:
                         break;
                 }
                 break;
             case 'c': /* char */
-                arg_val.c = va_arg(ap, int);
-                err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_CHAR, sizeof(char), &arg_val.c);
-                break;
+                return FMT_ARG_CHAR;
             case 's': /* array of chars */
-                arg_val.str = va_arg(ap, char *);
-                if (arg_val.str) {
-                    len = strlen(arg_val.str);
-                } else {
-                    len = 0;
-                }
-                err = append_arg(log->msg_args, &out_size, arg_max_len, ARG_TYPE_STR, len, arg_val.str);
-                break;
-            case 'n': /* %n outputs the number of bytes printed till that point, so will skip it */
-                va_arg(ap, int);
-                break;
+                return FMT_ARG_STR;
             default:
-                /* since we do not know the size or type of argument so, consuming the unsupported format specifier as integer. */
-                va_arg(ap, int);
-                break;
+                /* %n outputs the number of bytes printed till that point, so will skip it.
+                 * For others we do not know the size or type of argument so, consuming it as integer.
+                 */
+                return FMT_ARG_SKIP;
+        }
+        /* Modifier not valid for the specifier, nothing is read */
+        p = *format;
+    }
+    *format = p;
+    return FMT_ARG_END;
+}
+
+static void fmt_desc_build(const char *format, fmt_desc_t *desc)
+{
+    const char *p = format, *prev;
+    fmt_arg_t arg;
+
+    desc->format = format;
+    desc->count = 0;
+    desc->resume = 0;
+    while (true) {
+        prev = p;
+        if ((arg = fmt_next_arg(&p)) == FMT_ARG_END) {
+            break;
+        }
+        if (desc->count == FMT_DESC_MAX_ARGS) {
+            /* Rest is parsed on every use, such arguments rarely fit in the log buffer anyway */
+            desc->resume = (prev - format) <= UINT16_MAX ? (prev - format) : 0;
+            break;
+        }
+        desc->args[desc->count++] = arg;
+    }
+}
+
+static void fmt_desc_get(const char *format, fmt_desc_t *desc)
+{
+#if FMT_CACHE_SIZE
+    /* A format in RAM can be rewritten at the same address, only formats in flash are cached */
+    if (!esp_ptr_in_drom(format)) {
+        fmt_desc_build(format, desc);
+        return;
+    }
+    /* Strings are not necessarily word aligned, mix in the higher address bits */
+    uint32_t idx = (((uint32_t)(uintptr_t)format * 2654435761u) >> 16) % FMT_CACHE_SIZE;
+
+    portENTER_CRITICAL_SAFE(&s_fmt_lock);
+    bool hit = (s_fmt_cache[idx].format == format);
+    if (hit) {
+        *desc = s_fmt_cache[idx];
+    }
+    portEXIT_CRITICAL_SAFE(&s_fmt_lock);
+    if (hit) {
+        return;
+    }
+    fmt_desc_build(format, desc);
+    portENTER_CRITICAL_SAFE(&s_fmt_lock);
+    s_fmt_cache[idx] = *desc;
+    portEXIT_CRITICAL_SAFE(&s_fmt_lock);
+#else
+    fmt_desc_build(format, desc);
+#endif
+}
+
+#if CONFIG_DIAG_LOG_DEFERRED_CAPTURE
+/* Bytes an argument takes in the va_list on RISC-V, 64-bit types start 8-byte aligned.
+ * long double is passed by reference and may be gone once the log is processed, it ends the capture.
+ */
+static size_t deferred_arg_size(fmt_arg_t arg)
+{
+    switch (arg) {
+        case FMT_ARG_LLONG:
+        case FMT_ARG_INTMAX:
+        case FMT_ARG_ULLONG:
+        case FMT_ARG_UINTMAX:
+        case FMT_ARG_DOUBLE:
+            return sizeof(uint64_t);
+        case FMT_ARG_LDOUBLE:
+        case FMT_ARG_END:
+            return 0;
+        default:
+            return sizeof(uint32_t);
+    }
+}
+
+/* Returns the end of the argument starting at or after cur, NULL if it does not end before args_end */
+static const uint8_t *deferred_arg_end(const uint8_t *cur, fmt_arg_t arg, const uint8_t *args_end)
+{
+    size_t size = deferred_arg_size(arg);
+    if (size == sizeof(uint64_t)) {
+        cur = (const uint8_t *)(((uintptr_t)cur + 7) & ~7);
+    }
+    if (!size || cur + size > args_end) {
+        return NULL;
+    }
+    return cur + size;
+}
+
+/* va_list is a plain pointer to the argument words on RISC-V */
+static inline bool deferred_arg_fits(va_list ap, fmt_arg_t arg, const uint8_t *args_end)
+{
+    const uint8_t *cur;
+    memcpy(&cur, &ap, sizeof(cur));
+    return deferred_arg_end(cur, arg, args_end) != NULL;
+}
+
+/* Bytes of the argument words the format consumes, up to max. Nothing past the caller's
+ * arguments is read, their frame may end right after them.
+ */
+static size_t deferred_args_size(const char *format, const uint8_t *args, size_t max)
+{
+    fmt_desc_t desc;
+    const uint8_t *cur = args, *end;
+    uint8_t i;
+
+    fmt_desc_get(format, &desc);
+    for (i = 0; i < desc.count; i++) {
+        if (!(end = deferred_arg_end(cur, desc.args[i], args + max))) {
+            return cur - args;
+        }
+        cur = end;
+    }
+    if (desc.resume) {
+        const char *p = format + desc.resume;
+        while ((end = deferred_arg_end(cur, fmt_next_arg(&p), args + max))) {
+            cur = end;
+        }
+    }
+    return cur - args;
+}
+#endif /* CONFIG_DIAG_LOG_DEFERRED_CAPTURE */
+
+/* Reads one argument and appends it to the log, returns false once no more arguments can be stored */
+static bool arg_append(esp_diag_log_data_t *log, uint8_t *out_size, fmt_arg_t arg,
+                       va_list *ap, const uint8_t *args_end)
+{
+    uint8_t arg_max_len = sizeof(log->msg_args);
+    esp_diag_arg_value_t arg_val;
+    esp_err_t err = ESP_OK;
+
+#if CONFIG_DIAG_LOG_DEFERRED_CAPTURE
+    if (args_end && !deferred_arg_fits(*ap, arg, args_end)) {
+        return false;
+    }
+#endif /* CONFIG_DIAG_LOG_DEFERRED_CAPTURE */
+    memset(&arg_val, 0, sizeof(arg_val));
+    switch (arg) {
+        case FMT_ARG_INT:
+            arg_val.i = va_arg(*ap, int);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_INT, sizeof(int), &arg_val.i);
+            break;
+        case FMT_ARG_CHAR:
+            arg_val.c = va_arg(*ap, int);    /* char is promoted to int */
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_CHAR, sizeof(char), &arg_val.c);
+            break;
+        case FMT_ARG_SHORT:
+            arg_val.s = va_arg(*ap, int);    /* short is promoted to int */
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_SHORT, sizeof(short), &arg_val.s);
+            break;
+        case FMT_ARG_LONG:
+            arg_val.l = va_arg(*ap, long);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_L, sizeof(long), &arg_val.l);
+            break;
+        case FMT_ARG_LLONG:
+            arg_val.ll = va_arg(*ap, long long);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_LL, sizeof(long long), &arg_val.ll);
+            break;
+        case FMT_ARG_INTMAX:
+            arg_val.imx = va_arg(*ap, intmax_t);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_INTMAX, sizeof(intmax_t), &arg_val.imx);
+            break;
+        case FMT_ARG_PTRDIFF:
+            arg_val.ptrdiff = va_arg(*ap, ptrdiff_t);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_PTRDIFF, sizeof(ptrdiff_t), &arg_val.ptrdiff);
+            break;
+        case FMT_ARG_UINT:
+            arg_val.u = va_arg(*ap, unsigned int);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_UINT, sizeof(unsigned int), &arg_val.u);
+            break;
+        case FMT_ARG_UCHAR:
+            arg_val.uc = va_arg(*ap, unsigned int);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_UCHAR, sizeof(unsigned char), &arg_val.uc);
+            break;
+        case FMT_ARG_USHORT:
+            arg_val.us = va_arg(*ap, unsigned int);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_USHORT, sizeof(unsigned short), &arg_val.us);
+            break;
+        case FMT_ARG_ULONG:
+            arg_val.ul = va_arg(*ap, unsigned long);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_UL, sizeof(unsigned long), &arg_val.ul);
+            break;
+        case FMT_ARG_ULONG_ULL:
+            arg_val.ul = va_arg(*ap, unsigned long);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_ULL, sizeof(unsigned long), &arg_val.ul);
+            break;
+        case FMT_ARG_ULLONG:
+            arg_val.ull = va_arg(*ap, unsigned long long);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_ULL, sizeof(unsigned long long), &arg_val.ull);
+            break;
+        case FMT_ARG_UINTMAX:
+            arg_val.umx = va_arg(*ap, uintmax_t);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_UINTMAX, sizeof(uintmax_t), &arg_val.umx);
+            break;
+        case FMT_ARG_SIZE:
+            arg_val.sz = va_arg(*ap, size_t);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_SIZE, sizeof(size_t), &arg_val.sz);
+            break;
+        case FMT_ARG_DOUBLE:
+            arg_val.d = va_arg(*ap, double);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_DOUBLE, sizeof(double), &arg_val.d);
+            break;
+        case FMT_ARG_LDOUBLE:
+            arg_val.ld = va_arg(*ap, long double);
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_LDOUBLE, sizeof(long double), &arg_val.ld);
+            break;
+        case FMT_ARG_STR: {
+            uint8_t len = 0;
+            arg_val.str = va_arg(*ap, char *);
+#if CONFIG_DIAG_LOG_DEFERRED_CAPTURE
+            /* Only strings in flash are certain to still be there when a deferred log is processed */
+            if (args_end && !esp_ptr_in_drom(arg_val.str)) {
+                arg_val.str = NULL;
+            }
+#endif /* CONFIG_DIAG_LOG_DEFERRED_CAPTURE */
+            if (arg_val.str) {
+                len = strlen(arg_val.str);
+            }
+            err = append_arg(log->msg_args, out_size, arg_max_len, ARG_TYPE_STR, len, arg_val.str);
+            break;
         }
-        if (err != ESP_OK) {
+        default:
+            va_arg(*ap, int);
             break;
+    }
+    return err == ESP_OK;
+}
+
+/* args_end is set for deferred logs, arguments are then read from a copy which ends there */
+static void get_tlv_from_ap(esp_diag_log_data_t *log, const char *format, va_list ap, const uint8_t *args_end)
+{
+    fmt_desc_t desc;
+    uint8_t i, out_size = 0;
+    va_list args;
+
+    fmt_desc_get(format, &desc);
+    va_copy(args, ap);
+    for (i = 0; i < desc.count; i++) {
+        if (!arg_append(log, &out_size, desc.args[i], &args, args_end)) {
+            goto done;
         }
     }
+    if (desc.resume) {
+        const char *p = format + desc.resume;
+        fmt_arg_t arg;
+        while ((arg = fmt_next_arg(&p)) != FMT_ARG_END) {
+            if (!arg_append(log, &out_size, arg, &args, args_end)) {
+                break;
+            }
+        }
+    }
+done:
+    va_end(args);
     log->msg_args_len = out_size;
 }
 #endif /* CONFIG_DIAG_LOG_MSG_ARG_FORMAT_TLV */
@@ -299,42 +585,282 @@ static esp_err_t write_data(void *data, size_t len)
     return ESP_FAIL;
 }
 
-static esp_err_t diag_log_add(esp_diag_log_type_t type, uint32_t pc, const char *tag, const char *format, va_list args)
+static char *current_task_name(void)
+{
+#if ESP_IDF_VERSION_MAJOR == 4 && ESP_IDF_VERSION_MINOR < 3
+    return pcTaskGetTaskName(NULL);
+#else
+    return pcTaskGetName(NULL);
+#endif
+}
+
+/* Record logs of a call site held back by rate limiting, their arguments are not known */
+static esp_err_t log_repeat_write(esp_diag_log_type_t type, uint32_t pc, const char *tag, const char *format,
+                                  const log_repeat_t *repeat)
+{
+    esp_diag_log_data_t log;
+    esp_diag_log_repeat_t summary = {
+        .count = repeat->count,
+        .first_timestamp = repeat->first_ts,
+    };
+    memset(&log, 0, sizeof(log));
+    log.type = type | ESP_DIAG_LOG_TYPE_REPEAT_FLAG;
+    log.pc = pc;
+    log.timestamp = repeat->last_ts;
+    strlcpy(log.tag, tag, sizeof(log.tag));
+    log.msg_ptr = (void *)format;
+    memcpy(log.msg_args, &summary, sizeof(summary));
+    log.msg_args_len = sizeof(summary);
+    return write_data(&log, sizeof(log));
+}
+
+static esp_err_t diag_log_add_now(esp_diag_log_type_t type, uint32_t pc, uint64_t ts, const log_repeat_t *repeat,
+                                  const char *tag, const char *format, va_list args)
 {
     esp_diag_log_data_t log;
     va_list ap;
     char *task_name = NULL;
 
-    if (!IS_LOG_TYPE_ENABLED(type)) {
-        return ESP_ERR_NOT_FOUND;
+    if (repeat->count) {
+        log_repeat_write(type, pc, tag, format, repeat);
     }
-
     memset(&log, 0, sizeof(log));
     log.type = type;
     log.pc = pc;
     va_copy(ap, args);
-    log.timestamp = esp_diag_timestamp_get();
+    log.timestamp = ts;
     strlcpy(log.tag, tag, sizeof(log.tag));
     log.msg_ptr = (void *)format;
     log.msg_args_len = sizeof(log.msg_args);
 #ifdef CONFIG_DIAG_LOG_MSG_ARG_FORMAT_TLV
-    get_tlv_from_ap(&log, format, ap);
+    get_tlv_from_ap(&log, format, ap, NULL);
 #else
     vsnprintf((char *)log.msg_args, log.msg_args_len, format, ap);
     log.msg_args_len = strlen((char *)log.msg_args);
 #endif
     va_end(ap);
-#if ESP_IDF_VERSION_MAJOR == 4 && ESP_IDF_VERSION_MINOR < 3
-    task_name = pcTaskGetTaskName(NULL);
-#else
-    task_name = pcTaskGetName(NULL);
-#endif
+    task_name = current_task_name();
     if (task_name) {
         strlcpy(log.task_name, task_name, sizeof(log.task_name));
     }
     return write_data(&log, sizeof(log));
 }
 
+#if CONFIG_DIAG_LOG_DEFERRED_CAPTURE
+static esp_err_t deferred_log_capture(esp_diag_log_type_t type, uint32_t pc, uint64_t ts, const log_repeat_t *repeat,
+                                      const char *tag, const char *format, va_list args)
+{
+    /* Ring is per core, masking interrupts is enough to reserve a slot */
+    uint32_t irq_state = portSET_INTERRUPT_MASK_FROM_ISR();
+    deferred_ring_t *ring = &s_rings[xPortGetCoreID()];
+    deferred_log_t *slot = &ring->slots[ring->head % DEFERRED_SLOTS];
+    bool was_empty = (ring->head == ring->tail);
+    if (slot->state != SLOT_FREE) {
+        portCLEAR_INTERRUPT_MASK_FROM_ISR(irq_state);
+        s_priv_data.deferred_dropped++;
+        return ESP_ERR_NO_MEM;
+    }
+    slot->state = SLOT_WRITING;
+    ring->head++;
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(irq_state);
+
+    uintptr_t src;
+    memcpy(&src, &args, sizeof(src));
+    slot->type = type;
+    slot->pc = pc;
+    slot->timestamp = ts;
+    slot->repeat = *repeat;
+    strlcpy(slot->tag, tag, sizeof(slot->tag));
+    slot->format = format;
+    slot->args_off = src & 7;
+    slot->args_len = deferred_args_size(format, (const uint8_t *)src, DEFERRED_ARGS_SIZE);
+    memcpy((uint8_t *)slot->args + slot->args_off, (const void *)src, slot->args_len);
+    char *task_name = current_task_name();
+    slot->task_name[0] = '\0';
+    if (task_name) {
+        strlcpy(slot->task_name, task_name, sizeof(slot->task_name));
+    }
+    slot->state = SLOT_READY;
+
+    if (was_empty) {
+        if (xPortInIsrContext()) {
+            vTaskNotifyGiveFromISR(s_priv_data.deferred_task, NULL);
+        } else {
+            xTaskNotifyGive(s_priv_data.deferred_task);
+        }
+    }
+    return ESP_OK;
+}
+
+static void deferred_log_process(deferred_log_t *slot)
+{
+    esp_diag_log_data_t log;
+    va_list ap;
+    const uint8_t *args = (const uint8_t *)slot->args + slot->args_off;
+
+    if (slot->repeat.count) {
+        log_repeat_write(slot->type, slot->pc, slot->tag, slot->format, &slot->repeat);
+    }
+    memset(&log, 0, sizeof(log));
+    log.type = slot->type;
+    log.pc = slot->pc;
+    log.timestamp = slot->timestamp;
+    strlcpy(log.tag, slot->tag, sizeof(log.tag));
+    log.msg_ptr = (void *)slot->format;
+    memcpy(&ap, &args, sizeof(ap));
+    get_tlv_from_ap(&log, slot->format, ap, args + slot->args_len);
+    strlcpy(log.task_name, slot->task_name, sizeof(log.task_name));
+    write_data(&log, sizeof(log));
+}
+
+static void deferred_log_task(void *arg)
+{
+    uint32_t i, dropped_reported = 0;
+    TickType_t wait = portMAX_DELAY;
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, wait);
+        wait = portMAX_DELAY;
+        for (i = 0; i < portNUM_PROCESSORS; i++) {
+            deferred_ring_t *ring = &s_rings[i];
+            while (ring->tail != ring->head) {
+                deferred_log_t *slot = &ring->slots[ring->tail % DEFERRED_SLOTS];
+                if (slot->state != SLOT_READY) {
+                    wait = DEFERRED_RETRY_TICKS;
+                    break;
+                }
+                deferred_log_process(slot);
+                slot->state = SLOT_FREE;
+                ring->tail++;
+            }
+        }
+        uint32_t dropped = s_priv_data.deferred_dropped;
+        if (dropped != dropped_reported) {
+            esp_diag_log_event("diag", "deferred logs dropped:%" PRIu32, dropped - dropped_reported);
+            dropped_reported = dropped;
+        }
+    }
+}
+#endif /* CONFIG_DIAG_LOG_DEFERRED_CAPTURE */
+
+#if CONFIG_DIAG_LOG_RATE_LIMIT
+static esp_err_t log_site_repeats_write(const log_site_t *site)
+{
+    log_repeat_t repeat = {
+        .count = site->suppressed,
+        .first_ts = site->first_ts,
+        .last_ts = site->last_ts,
+    };
+    return log_repeat_write(site->type, site->pc, site->tag, site->format, &repeat);
+}
+
+/* Returns false if the log is to be counted only. Repeats held back in the window
+ * which just ended are returned in repeat, they are recorded ahead of the log.
+ */
+static bool log_site_check(esp_diag_log_type_t type, uint32_t pc, const char *tag, const char *format,
+                           uint64_t ts, log_repeat_t *repeat)
+{
+    uint32_t i;
+    log_site_t *site = NULL, *victim = &s_sites[0];
+    log_site_t evicted = { 0 };
+    uint64_t now = esp_timer_get_time();
+    bool record = true;
+
+    portENTER_CRITICAL_SAFE(&s_site_lock);
+    for (i = 0; i < SITE_COUNT; i++) {
+        if (s_sites[i].format == format && s_sites[i].pc == pc) {
+            site = &s_sites[i];
+            break;
+        }
+        if (victim->format && (!s_sites[i].format || s_sites[i].window_start < victim->window_start)) {
+            victim = &s_sites[i];
+        }
+    }
+    if (!site) {
+        if (victim->format && victim->suppressed) {
+            evicted = *victim;
+        }
+        site = victim;
+        site->pc = pc;
+        site->format = format;
+        site->type = type;
+        strlcpy(site->tag, tag, sizeof(site->tag));
+        site->window_start = now;
+        site->recorded = 1;
+        site->suppressed = 0;
+    } else if (now - site->window_start >= SITE_WINDOW_US) {
+        if (site->suppressed) {
+            repeat->count = site->suppressed;
+            repeat->first_ts = site->first_ts;
+            repeat->last_ts = site->last_ts;
+        }
+        site->window_start = now;
+        site->recorded = 1;
+        site->suppressed = 0;
+    } else if (site->recorded < SITE_BURST) {
+        site->recorded++;
+    } else {
+        if (!site->suppressed) {
+            site->first_ts = ts;
+        }
+        site->suppressed++;
+        site->last_ts = ts;
+        record = false;
+    }
+    portEXIT_CRITICAL_SAFE(&s_site_lock);
+
+    if (evicted.suppressed) {
+        log_site_repeats_write(&evicted);
+    }
+    return record;
+}
+#endif /* CONFIG_DIAG_LOG_RATE_LIMIT */
+
+esp_err_t esp_diag_log_flush_repeats(void)
+{
+    esp_err_t ret = ESP_OK;
+#if CONFIG_DIAG_LOG_RATE_LIMIT
+    uint32_t i;
+    log_site_t site;
+    if (!s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (i = 0; i < SITE_COUNT; i++) {
+        portENTER_CRITICAL_SAFE(&s_site_lock);
+        site = s_sites[i];
+        s_sites[i].suppressed = 0;
+        portEXIT_CRITICAL_SAFE(&s_site_lock);
+        if (site.format && site.suppressed) {
+            esp_err_t err = log_site_repeats_write(&site);
+            if (err != ESP_OK) {
+                ret = err;
+            }
+        }
+    }
+#endif /* CONFIG_DIAG_LOG_RATE_LIMIT */
+    return ret;
+}
+
+static esp_err_t diag_log_add(esp_diag_log_type_t type, uint32_t pc, const char *tag, const char *format, va_list args)
+{
+    log_repeat_t repeat = { 0 };
+    if (!IS_LOG_TYPE_ENABLED(type)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    uint64_t ts = esp_diag_timestamp_get();
+#if CONFIG_DIAG_LOG_RATE_LIMIT
+    if (!log_site_check(type, pc, tag, format, ts, &repeat)) {
+        return ESP_OK;
+    }
+#endif /* CONFIG_DIAG_LOG_RATE_LIMIT */
+#if CONFIG_DIAG_LOG_DEFERRED_CAPTURE
+    /* Logs of the background task itself, e.g. from the store, are added directly */
+    if (s_priv_data.deferred_task && xTaskGetCurrentTaskHandle() != s_priv_data.deferred_task) {
+        return deferred_log_capture(type, pc, ts, &repeat, tag, format, args);
+    }
+#endif /* CONFIG_DIAG_LOG_DEFERRED_CAPTURE */
+    return diag_log_add_now(type, pc, ts, &repeat, tag, format, args);
+}
+
 /**
  * If error logs are enabled via menuconfig, irrespective of if error logs are disabled
  * using `esp_log_level_set()`, error logs are still reported to Insights cloud
@@ -395,6 +921,13 @@ esp_err_t esp_diag_log_hook_init(esp_diag_log_config_t *config)
         return ESP_FAIL;
     }
     memcpy(&s_priv_data.config, config, sizeof(esp_diag_log_config_t));
+#if CONFIG_DIAG_LOG_DEFERRED_CAPTURE
+    if (xTaskCreate(deferred_log_task, "diag_log", DEFERRED_TASK_STACK, NULL,
+                    DEFERRED_TASK_PRIORITY, &s_priv_data.deferred_task) != pdPASS) {
+        /* Logs are still recorded, in the context of the caller */
+        s_priv_data.deferred_task = NULL;
+    }
+#endif /* CONFIG_DIAG_LOG_DEFERRED_CAPTURE */
     s_priv_data.init = true;
     return ESP_OK;
 }
@@ -8,25 +8,60 @@
 #include <string.h>
 #include <stdbool.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
+#include <esp_rmaker_work_queue.h>
 #include <esp_diagnostics.h>
 #include <esp_diagnostics_metrics.h>
+#include "esp_diagnostics_internal.h"
 
 #define TAG "DIAG_METRICS"
 #define DIAG_METRICS_MAX_COUNT   CONFIG_DIAG_METRICS_MAX_COUNT
+#define DIAG_METRICS_MAX_AGGREGATES CONFIG_DIAG_METRICS_MAX_AGGREGATES
+#define DEFAULT_AGGREGATE_WINDOW CONFIG_DIAG_METRICS_AGGREGATE_WINDOW
+
+/* Handles carry the slot plus one in the low byte and the generation of the slot above it */
+#define HANDLE_SLOT(h)          (((h) & 0xff) - 1)
+#define HANDLE_GEN(h)           ((h) >> 8)
 
 /* Max supported string lenth */
-#define MAX_STR_LEN             (sizeof(((esp_diag_str_data_pt_t *)0)->value.str) - 1)
-#define MAX_METRICS_WRITE_SZ     sizeof(esp_diag_data_pt_t)
-#define MAX_STR_METRICS_WRITE_SZ sizeof(esp_diag_str_data_pt_t)
+#define MAX_STR_LEN             (sizeof(((esp_diag_compact_data_pt_t *)0)->value.str) - 1)
+#define MAX_VALUE_SZ            sizeof(((esp_diag_compact_data_pt_t *)0)->value)
+
+/* Current window of an aggregated metrics */
+typedef struct {
+    esp_diag_metrics_handle_t handle;   /* ESP_DIAG_METRICS_HANDLE_INVALID if unused */
+    uint64_t window_us;
+    uint64_t start_us;                  /* esp_timer time of the first value in the window */
+    uint64_t start_ts;                  /* Timestamp of the first value in the window */
+    uint32_t count;
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+    uint32_t buckets[ESP_DIAG_HISTOGRAM_MAX_BUCKETS];
+} metrics_agg_t;
 
 typedef struct {
     size_t metrics_count;
     esp_diag_metrics_meta_t metrics[DIAG_METRICS_MAX_COUNT];
+    uint8_t agg_idx[DIAG_METRICS_MAX_COUNT];    /* Index into aggs plus one, 0 if not aggregated */
+    metrics_agg_t aggs[DIAG_METRICS_MAX_AGGREGATES];
+    /* Closes windows of aggregates which stopped observing values, created with the first aggregate */
+    TimerHandle_t agg_timer;
+    uint32_t agg_timer_sec;
     esp_diag_metrics_config_t config;
     bool init;
 } metrics_priv_data_t;
 
 static metrics_priv_data_t s_priv_data;
+/* Bumped whenever a slot is freed so stale handles do not resolve to the next metrics in it */
+static uint8_t s_slot_gen[DIAG_METRICS_MAX_COUNT];
+/* Values may be observed from several tasks and event handlers */
+static portMUX_TYPE s_agg_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_err_t metrics_data_pt_write(const esp_diag_metrics_meta_t *metrics,
+                                       esp_diag_compact_data_pt_t *data, uint64_t ts);
 
 static const esp_diag_metrics_meta_t *esp_diag_metrics_meta_get(const char *key)
 {
@@ -47,9 +82,41 @@ static bool key_present(const char *key)
     return (esp_diag_metrics_meta_get(key) != NULL);
 }
 
-esp_err_t esp_diag_metrics_register(const char *tag, const char *key,
-                                   const char *label, const char *path,
-                                   esp_diag_data_type_t type)
+static const esp_diag_metrics_meta_t *esp_diag_metrics_meta_get_by_id(uint16_t key_id)
+{
+    uint32_t i;
+    for (i = 0; i < s_priv_data.metrics_count; i++) {
+        if (s_priv_data.metrics[i].key && s_priv_data.metrics[i].key_id == key_id) {
+            return &s_priv_data.metrics[i];
+        }
+    }
+    return NULL;
+}
+
+static esp_diag_metrics_handle_t handle_get(uint32_t slot)
+{
+    return (s_slot_gen[slot] << 8) | (slot + 1);
+}
+
+/* Find a slot for new metrics, slots freed by unregister are reused first */
+static int metrics_free_slot_get(void)
+{
+    uint32_t i;
+    for (i = 0; i < s_priv_data.metrics_count; i++) {
+        if (!s_priv_data.metrics[i].key) {
+            return i;
+        }
+    }
+    if (s_priv_data.metrics_count < DIAG_METRICS_MAX_COUNT) {
+        return s_priv_data.metrics_count;
+    }
+    return -1;
+}
+
+esp_err_t esp_diag_metrics_register_h(const char *tag, const char *key,
+                                      const char *label, const char *path,
+                                      esp_diag_data_type_t type,
+                                      esp_diag_metrics_handle_t *handle)
 {
     if (!tag || !key || !label || !path) {
         ESP_LOGE(TAG, "Failed to register metrics, tag, key, lable, or path is NULL");
@@ -58,20 +125,164 @@ esp_err_t esp_diag_metrics_register(const char *tag, const char *key,
     if (!s_priv_data.init) {
         return ESP_ERR_INVALID_STATE;
     }
-    if (s_priv_data.metrics_count >= DIAG_METRICS_MAX_COUNT) {
-        ESP_LOGE(TAG, "No space left for more metrics");
-        return ESP_ERR_NO_MEM;
-    }
     if (key_present(key)) {
         ESP_LOGE(TAG, "Metrics key:%s exists", key);
         return ESP_FAIL;
     }
-    s_priv_data.metrics[s_priv_data.metrics_count].tag = tag;
-    s_priv_data.metrics[s_priv_data.metrics_count].key = key;
-    s_priv_data.metrics[s_priv_data.metrics_count].label = label;
-    s_priv_data.metrics[s_priv_data.metrics_count].path = path;
-    s_priv_data.metrics[s_priv_data.metrics_count].type = type;
-    s_priv_data.metrics_count++;
+    /* Data points only carry the key id, it must tell the metrics apart */
+    uint16_t key_id = esp_diag_key_id_get(key);
+    const esp_diag_metrics_meta_t *other = esp_diag_metrics_meta_get_by_id(key_id);
+    if (other) {
+        ESP_LOGE(TAG, "Metrics key:%s collides with key:%s, rename one of them", key, other->key);
+        return ESP_FAIL;
+    }
+    int slot = metrics_free_slot_get();
+    if (slot < 0) {
+        ESP_LOGE(TAG, "No space left for more metrics");
+        return ESP_ERR_NO_MEM;
+    }
+    s_priv_data.metrics[slot].key_id = key_id;
+    s_priv_data.metrics[slot].tag = tag;
+    s_priv_data.metrics[slot].key = key;
+    s_priv_data.metrics[slot].label = label;
+    s_priv_data.metrics[slot].path = path;
+    s_priv_data.metrics[slot].type = type;
+    if (slot == s_priv_data.metrics_count) {
+        s_priv_data.metrics_count++;
+    }
+    esp_diag_meta_crc_invalidate();
+    if (handle) {
+        *handle = handle_get(slot);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_diag_metrics_register(const char *tag, const char *key,
+                                   const char *label, const char *path,
+                                   esp_diag_data_type_t type)
+{
+    return esp_diag_metrics_register_h(tag, key, label, path, type, NULL);
+}
+
+/* Close the window of an aggregate, caller must hold s_agg_lock */
+static bool metrics_agg_take(metrics_agg_t *agg, const esp_diag_metrics_meta_t *metrics,
+                             uint64_t now, esp_diag_compact_data_pt_t *data, uint64_t *ts)
+{
+    if (!agg->count) {
+        return false;
+    }
+    memset(&data->value, 0, sizeof(data->value));
+    data->data_type = metrics->type;
+    data->value.agg.window_ms = (now - agg->start_us) / 1000;
+    data->value.agg.count = agg->count;
+    data->value.agg.min = agg->min;
+    data->value.agg.max = agg->max;
+    data->value.agg.sum = agg->sum;
+    if (metrics->type == ESP_DIAG_DATA_TYPE_HISTOGRAM) {
+        data->value.agg.bucket_count = metrics->bounds_count + 1;
+        memcpy(data->value.agg.buckets, agg->buckets, sizeof(agg->buckets));
+    }
+    *ts = agg->start_ts;
+    agg->count = 0;
+    memset(agg->buckets, 0, sizeof(agg->buckets));
+    return true;
+}
+
+/* Record the pending window of the aggregate at slot, if any, and free the aggregate */
+static void metrics_agg_release(uint32_t slot)
+{
+    if (!s_priv_data.agg_idx[slot]) {
+        return;
+    }
+    metrics_agg_t *agg = &s_priv_data.aggs[s_priv_data.agg_idx[slot] - 1];
+    esp_diag_compact_data_pt_t data;
+    uint64_t ts;
+    portENTER_CRITICAL(&s_agg_lock);
+    bool taken = metrics_agg_take(agg, &s_priv_data.metrics[slot], esp_timer_get_time(), &data, &ts);
+    agg->handle = ESP_DIAG_METRICS_HANDLE_INVALID;
+    s_priv_data.agg_idx[slot] = 0;
+    portEXIT_CRITICAL(&s_agg_lock);
+    if (taken) {
+        metrics_data_pt_write(&s_priv_data.metrics[slot], &data, ts);
+    }
+}
+
+static void metrics_agg_flush_cb(void *arg)
+{
+    esp_diag_metrics_aggregate_flush_expired();
+}
+
+static void metrics_agg_timer_cb(TimerHandle_t handle)
+{
+    /* Writing goes through the store, defer it to the work queue */
+    esp_rmaker_work_queue_add_task(metrics_agg_flush_cb, NULL);
+}
+
+/* Check at least twice per window so a window is recorded within half a window of its end */
+static void metrics_agg_timer_update(uint32_t window_sec)
+{
+    uint32_t period = window_sec / 2 ? window_sec / 2 : 1;
+    if (s_priv_data.agg_timer && period >= s_priv_data.agg_timer_sec) {
+        return;
+    }
+    if (!s_priv_data.agg_timer) {
+        s_priv_data.agg_timer = xTimerCreate("metrics_agg", SEC2TICKS(period), pdTRUE, NULL, metrics_agg_timer_cb);
+        if (!s_priv_data.agg_timer) {
+            ESP_LOGW(TAG, "Failed to create aggregate timer, windows are closed by new values only");
+            return;
+        }
+        xTimerStart(s_priv_data.agg_timer, 0);
+    } else {
+        xTimerChangePeriod(s_priv_data.agg_timer, SEC2TICKS(period), 0);
+    }
+    s_priv_data.agg_timer_sec = period;
+}
+
+esp_err_t esp_diag_metrics_register_aggregate(const char *tag, const char *key,
+                                              const char *label, const char *path,
+                                              const esp_diag_metrics_agg_config_t *config,
+                                              esp_diag_metrics_handle_t *handle)
+{
+    uint32_t i;
+    esp_diag_metrics_handle_t h;
+    if (!config || (config->bounds_count && !config->bounds)
+            || config->bounds_count >= ESP_DIAG_HISTOGRAM_MAX_BUCKETS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (i = 1; i < config->bounds_count; i++) {
+        if (config->bounds[i] <= config->bounds[i - 1]) {
+            ESP_LOGE(TAG, "Histogram bounds of %s must be ascending", key ? key : "");
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    for (i = 0; i < DIAG_METRICS_MAX_AGGREGATES; i++) {
+        if (s_priv_data.aggs[i].handle == ESP_DIAG_METRICS_HANDLE_INVALID) {
+            break;
+        }
+    }
+    if (i == DIAG_METRICS_MAX_AGGREGATES) {
+        ESP_LOGE(TAG, "No space left for more aggregated metrics");
+        return ESP_ERR_NO_MEM;
+    }
+    esp_diag_data_type_t type = config->bounds_count ? ESP_DIAG_DATA_TYPE_HISTOGRAM : ESP_DIAG_DATA_TYPE_SUMMARY;
+    esp_err_t err = esp_diag_metrics_register_h(tag, key, label, path, type, &h);
+    if (err != ESP_OK) {
+        return err;
+    }
+    s_priv_data.metrics[HANDLE_SLOT(h)].bounds = config->bounds_count ? config->bounds : NULL;
+    s_priv_data.metrics[HANDLE_SLOT(h)].bounds_count = config->bounds_count;
+    esp_diag_meta_crc_invalidate();
+
+    metrics_agg_t *agg = &s_priv_data.aggs[i];
+    memset(agg, 0, sizeof(*agg));
+    uint32_t window_sec = config->window_sec ? config->window_sec : DEFAULT_AGGREGATE_WINDOW;
+    agg->window_us = (uint64_t)window_sec * 1000000;
+    agg->handle = h;
+    s_priv_data.agg_idx[HANDLE_SLOT(h)] = i + 1;
+    metrics_agg_timer_update(window_sec);
+    if (handle) {
+        *handle = h;
+    }
     return ESP_OK;
 }
 
@@ -87,9 +298,14 @@ esp_err_t esp_diag_metrics_unregister(const char *key)
         }
     }
     if (i < s_priv_data.metrics_count) {
-        s_priv_data.metrics[i] = s_priv_data.metrics[s_priv_data.metrics_count - 1];
-        memset(&s_priv_data.metrics[s_priv_data.metrics_count - 1], 0, sizeof(esp_diag_metrics_meta_t));
-        s_priv_data.metrics_count--;
+        metrics_agg_release(i);
+        /* Do not move other entries, their handles are indices into this array */
+        memset(&s_priv_data.metrics[i], 0, sizeof(esp_diag_metrics_meta_t));
+        s_slot_gen[i]++;
+        while (s_priv_data.metrics_count && !s_priv_data.metrics[s_priv_data.metrics_count - 1].key) {
+            s_priv_data.metrics_count--;
+        }
+        esp_diag_meta_crc_invalidate();
         return ESP_OK;
     }
     return ESP_ERR_NOT_FOUND;
@@ -97,14 +313,45 @@ esp_err_t esp_diag_metrics_unregister(const char *key)
 
 esp_err_t esp_diag_metrics_unregister_all(void)
 {
+    uint32_t i;
     if (!s_priv_data.init) {
         return ESP_ERR_INVALID_STATE;
     }
+    esp_diag_metrics_aggregate_flush();
+    for (i = 0; i < s_priv_data.metrics_count; i++) {
+        s_slot_gen[i]++;
+    }
     memset(&s_priv_data.metrics, 0, sizeof(s_priv_data.metrics));
+    memset(&s_priv_data.agg_idx, 0, sizeof(s_priv_data.agg_idx));
+    memset(&s_priv_data.aggs, 0, sizeof(s_priv_data.aggs));
     s_priv_data.metrics_count = 0;
+    esp_diag_meta_crc_invalidate();
     return ESP_OK;
 }
 
+static const esp_diag_metrics_meta_t *esp_diag_metrics_meta_get_by_handle(esp_diag_metrics_handle_t handle)
+{
+    uint32_t slot = HANDLE_SLOT(handle);
+    if (handle == ESP_DIAG_METRICS_HANDLE_INVALID || slot >= s_priv_data.metrics_count
+            || HANDLE_GEN(handle) != s_slot_gen[slot]) {
+        return NULL;
+    }
+    const esp_diag_metrics_meta_t *metrics = &s_priv_data.metrics[slot];
+    return metrics->key ? metrics : NULL;
+}
+
+const char *esp_diag_metrics_key_get(esp_diag_metrics_handle_t handle)
+{
+    const esp_diag_metrics_meta_t *metrics = esp_diag_metrics_meta_get_by_handle(handle);
+    return metrics ? metrics->key : NULL;
+}
+
+const char *esp_diag_metrics_key_get_by_id(uint16_t key_id)
+{
+    const esp_diag_metrics_meta_t *metrics = esp_diag_metrics_meta_get_by_id(key_id);
+    return metrics ? metrics->key : NULL;
+}
+
 const esp_diag_metrics_meta_t *esp_diag_metrics_meta_get_all(uint32_t *len)
 {
     if (!s_priv_data.init) {
@@ -123,6 +370,9 @@ void esp_diag_metrics_meta_print_all(void)
     if (meta) {
         ESP_LOGI(TAG, "Tag\tKey\tLabel\tPath\tData type\n");
         for (i = 0; i < len; i++) {
+            if (!meta[i].key) {
+                continue;
+            }
             ESP_LOGI(TAG, "%s\t%s\t%s\t%s\t%d\n", meta[i].tag, meta[i].key, meta[i].label, meta[i].path, meta[i].type);
         }
     }
@@ -146,10 +396,51 @@ esp_err_t esp_diag_metrics_deinit(void)
     if (!s_priv_data.init) {
         return ESP_ERR_INVALID_STATE;
     }
+    /* Try to delete timer with 10 ticks wait time */
+    if (s_priv_data.agg_timer && xTimerDelete(s_priv_data.agg_timer, 10) == pdFALSE) {
+        ESP_LOGW(TAG, "Failed to delete aggregate timer");
+    }
+    esp_diag_metrics_aggregate_flush();
+    /* Handles held across deinit and init must not resolve to the metrics registered next */
+    for (uint32_t i = 0; i < s_priv_data.metrics_count; i++) {
+        s_slot_gen[i]++;
+    }
     memset(&s_priv_data, 0, sizeof(s_priv_data));
+    esp_diag_meta_crc_invalidate();
     return ESP_OK;
 }
 
+/* Data points are stored as compact records, the key is referred to by its key id */
+static esp_err_t metrics_data_pt_write(const esp_diag_metrics_meta_t *metrics,
+                                       esp_diag_compact_data_pt_t *data, uint64_t ts)
+{
+    uint8_t buf[ESP_DIAG_DATA_PT_COMPACT_MAX_SZ];
+    data->type = ESP_DIAG_DATA_PT_METRICS;
+    data->key_id = metrics->key_id;
+    data->ts_rel = (int64_t)ts - esp_diag_timestamp_offset_get();
+    size_t len = esp_diag_compact_data_pt_pack(buf, data);
+
+    if (len && s_priv_data.config.write_cb) {
+        return s_priv_data.config.write_cb(metrics->tag, buf, len, s_priv_data.config.cb_arg);
+    }
+    return ESP_OK;
+}
+
+static esp_err_t metrics_write(const esp_diag_metrics_meta_t *metrics, esp_diag_data_type_t data_type,
+                               const void *val, size_t val_sz, uint64_t ts)
+{
+    /* Aggregated metrics only take values through esp_diag_metrics_observe() */
+    if (metrics->type != data_type || data_type >= ESP_DIAG_DATA_TYPE_SUMMARY) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_diag_compact_data_pt_t data;
+    memset(&data.value, 0, sizeof(data.value));
+    data.data_type = data_type;
+    memcpy(&data.value, val, val_sz < MAX_VALUE_SZ ? val_sz : MAX_VALUE_SZ);
+    return metrics_data_pt_write(metrics, &data, ts);
+}
+
 esp_err_t esp_diag_metrics_add(esp_diag_data_type_t data_type,
                                const char *key, const void *val,
                                size_t val_sz, uint64_t ts)
@@ -165,26 +456,25 @@ esp_err_t esp_diag_metrics_add(esp_diag_data_type_t data_type,
     if (!metrics) {
         return ESP_ERR_NOT_FOUND;
     }
-    if (metrics->type != data_type) {
+    return metrics_write(metrics, data_type, val, val_sz, ts);
+}
+
+esp_err_t esp_diag_metrics_add_h(esp_diag_data_type_t data_type,
+                                 esp_diag_metrics_handle_t handle, const void *val,
+                                 size_t val_sz, uint64_t ts)
+{
+    if (!val) {
         return ESP_ERR_INVALID_ARG;
     }
-    size_t write_sz = MAX_METRICS_WRITE_SZ;
-    if (metrics->type == ESP_DIAG_DATA_TYPE_STR) {
-        write_sz = MAX_STR_METRICS_WRITE_SZ;
+    if (!s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
     }
 
-    esp_diag_str_data_pt_t data;
-    memset(&data, 0, sizeof(data));
-    data.type = ESP_DIAG_DATA_PT_METRICS;
-    data.data_type = data_type;
-    strlcpy(data.key, key, sizeof(data.key));
-    data.ts = ts;
-    memcpy(&data.value, val, val_sz);
-
-    if (s_priv_data.config.write_cb) {
-        return s_priv_data.config.write_cb(metrics->tag, &data, write_sz, s_priv_data.config.cb_arg);
+    const esp_diag_metrics_meta_t *metrics = esp_diag_metrics_meta_get_by_handle(handle);
+    if (!metrics) {
+        return ESP_ERR_NOT_FOUND;
     }
-    return ESP_OK;
+    return metrics_write(metrics, data_type, val, val_sz, ts);
 }
 
 esp_err_t esp_diag_metrics_add_bool(const char *key, bool b)
@@ -219,5 +509,136 @@ esp_err_t esp_diag_metrics_add_mac(const char *key, uint8_t *mac)
 
 esp_err_t esp_diag_metrics_add_str(const char *key, const char *str)
 {
-    return esp_diag_metrics_add(ESP_DIAG_DATA_TYPE_STR, key, str, strlen(str), esp_diag_timestamp_get());
+    return esp_diag_metrics_add(ESP_DIAG_DATA_TYPE_STR, key, str, strnlen(str, MAX_STR_LEN), esp_diag_timestamp_get());
+}
+
+esp_err_t esp_diag_metrics_add_bool_h(esp_diag_metrics_handle_t handle, bool b)
+{
+    return esp_diag_metrics_add_h(ESP_DIAG_DATA_TYPE_BOOL, handle, &b, sizeof(b), esp_diag_timestamp_get());
+}
+
+esp_err_t esp_diag_metrics_add_int_h(esp_diag_metrics_handle_t handle, int32_t i)
+{
+    return esp_diag_metrics_add_h(ESP_DIAG_DATA_TYPE_INT, handle, &i, sizeof(i), esp_diag_timestamp_get());
+}
+
+esp_err_t esp_diag_metrics_add_uint_h(esp_diag_metrics_handle_t handle, uint32_t u)
+{
+    return esp_diag_metrics_add_h(ESP_DIAG_DATA_TYPE_UINT, handle, &u, sizeof(u), esp_diag_timestamp_get());
+}
+
+esp_err_t esp_diag_metrics_add_float_h(esp_diag_metrics_handle_t handle, float f)
+{
+    return esp_diag_metrics_add_h(ESP_DIAG_DATA_TYPE_FLOAT, handle, &f, sizeof(f), esp_diag_timestamp_get());
+}
+
+esp_err_t esp_diag_metrics_add_ipv4_h(esp_diag_metrics_handle_t handle, uint32_t ip)
+{
+    return esp_diag_metrics_add_h(ESP_DIAG_DATA_TYPE_IPv4, handle, &ip, sizeof(ip), esp_diag_timestamp_get());
+}
+
+esp_err_t esp_diag_metrics_add_mac_h(esp_diag_metrics_handle_t handle, uint8_t *mac)
+{
+    return esp_diag_metrics_add_h(ESP_DIAG_DATA_TYPE_MAC, handle, mac, 6, esp_diag_timestamp_get());
+}
+
+esp_err_t esp_diag_metrics_add_str_h(esp_diag_metrics_handle_t handle, const char *str)
+{
+    return esp_diag_metrics_add_h(ESP_DIAG_DATA_TYPE_STR, handle, str, strnlen(str, MAX_STR_LEN), esp_diag_timestamp_get());
+}
+
+esp_err_t esp_diag_metrics_observe(esp_diag_metrics_handle_t handle, int32_t value)
+{
+    uint32_t i;
+    esp_diag_compact_data_pt_t data;
+    uint64_t window_ts;
+    bool closed = false;
+
+    if (!s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    const esp_diag_metrics_meta_t *metrics = esp_diag_metrics_meta_get_by_handle(handle);
+    if (!metrics || !s_priv_data.agg_idx[HANDLE_SLOT(handle)]) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    metrics_agg_t *agg = &s_priv_data.aggs[s_priv_data.agg_idx[HANDLE_SLOT(handle)] - 1];
+    uint64_t ts = esp_diag_timestamp_get();
+    uint64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_agg_lock);
+    if (agg->count && now - agg->start_us >= agg->window_us) {
+        closed = metrics_agg_take(agg, metrics, now, &data, &window_ts);
+    }
+    if (!agg->count) {
+        agg->start_us = now;
+        agg->start_ts = ts;
+        agg->min = value;
+        agg->max = value;
+        agg->sum = 0;
+    }
+    agg->count++;
+    agg->sum += value;
+    if (value < agg->min) {
+        agg->min = value;
+    }
+    if (value > agg->max) {
+        agg->max = value;
+    }
+    if (metrics->bounds_count) {
+        i = 0;
+        while (i < metrics->bounds_count && value > metrics->bounds[i]) {
+            i++;
+        }
+        agg->buckets[i]++;
+    }
+    portEXIT_CRITICAL(&s_agg_lock);
+
+    if (closed) {
+        return metrics_data_pt_write(metrics, &data, window_ts);
+    }
+    return ESP_OK;
+}
+
+/* Record the windows of all aggregates with observed values, or only of those whose window elapsed */
+static esp_err_t metrics_agg_flush(bool expired_only)
+{
+    uint32_t i;
+    esp_diag_compact_data_pt_t data;
+    uint64_t ts;
+    esp_err_t ret = ESP_OK;
+
+    if (!s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (i = 0; i < DIAG_METRICS_MAX_AGGREGATES; i++) {
+        metrics_agg_t *agg = &s_priv_data.aggs[i];
+        if (agg->handle == ESP_DIAG_METRICS_HANDLE_INVALID) {
+            continue;
+        }
+        const esp_diag_metrics_meta_t *metrics = &s_priv_data.metrics[HANDLE_SLOT(agg->handle)];
+        bool taken = false;
+        uint64_t now = esp_timer_get_time();
+        portENTER_CRITICAL(&s_agg_lock);
+        if (!expired_only || now - agg->start_us >= agg->window_us) {
+            taken = metrics_agg_take(agg, metrics, now, &data, &ts);
+        }
+        portEXIT_CRITICAL(&s_agg_lock);
+        if (taken) {
+            esp_err_t err = metrics_data_pt_write(metrics, &data, ts);
+            if (err != ESP_OK) {
+                ret = err;
+            }
+        }
+    }
+    return ret;
+}
+
+esp_err_t esp_diag_metrics_aggregate_flush(void)
+{
+    return metrics_agg_flush(false);
+}
+
+esp_err_t esp_diag_metrics_aggregate_flush_expired(void)
+{
+    return metrics_agg_flush(true);
 }
@@ -0,0 +1,308 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <esp_log.h>
+#include <esp_attr.h>
+#include <esp_bit_defs.h>
+#include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+#include <freertos/semphr.h>
+#include <freertos/task_snapshot.h>
+
+#include <esp_rmaker_work_queue.h>
+#include <esp_diagnostics.h>
+#include <esp_diagnostics_metrics.h>
+#include <esp_diagnostics_system_metrics.h>
+#include "esp_diagnostics_internal.h"
+
+#define LOG_TAG            "stack_metrics"
+#define METRICS_TAG        "stack"
+#define PATH_STACK         "Task.Stack"
+
+#define DEFAULT_POLLING_INTERVAL 30 /* 30 seconds */
+#define STACK_MAX_TASKS          CONFIG_DIAG_STACK_METRICS_MAX_TASKS
+#define STACK_MARGIN_PERCENT     CONFIG_DIAG_STACK_METRICS_MARGIN_PERCENT
+#define STACK_SIZE_ALIGN         256
+
+#define STACK_RTC_MAGIC          0x53544b31 /* "STK1" */
+
+typedef struct {
+    char name[CONFIG_FREERTOS_MAX_TASK_NAME_LEN];   /* Also used as metrics key */
+    uint32_t stack_size;                            /* Stack size in bytes, 0 if unknown */
+    uint32_t min_free;                              /* Lifetime minimum of free stack in bytes */
+} stack_entry_t;
+
+/* Kept in RTC memory, lifetime minima survive software and watchdog resets */
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+    stack_entry_t entries[STACK_MAX_TASKS];
+} stack_rtc_data_t;
+
+typedef struct {
+    bool init;
+    TimerHandle_t handle;
+    /* Sampling and export run from the timer task, the work queue and the console */
+    SemaphoreHandle_t lock;
+    /* Bitmap of entries whose minimum went down since the last export, guarded by lock */
+    uint32_t changed[(STACK_MAX_TASKS + 31) / 32];
+    TaskSnapshot_t snapshots[STACK_MAX_TASKS];
+    /* Names copied with the scheduler suspended, a deleted task's TCB is freed once it resumes */
+    char names[STACK_MAX_TASKS][CONFIG_FREERTOS_MAX_TASK_NAME_LEN];
+} stack_diag_priv_data_t;
+
+_Static_assert(sizeof(stack_rtc_data_t) == ESP_DIAG_STACK_RTC_SIZE, "ESP_DIAG_STACK_RTC_SIZE does not match");
+
+static RTC_NOINIT_ATTR stack_rtc_data_t s_rtc_data;
+static stack_diag_priv_data_t s_priv_data;
+
+static void rtc_data_init(void)
+{
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (s_rtc_data.magic != STACK_RTC_MAGIC || s_rtc_data.count > STACK_MAX_TASKS
+            || reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT || reason == ESP_RST_UNKNOWN) {
+        memset(&s_rtc_data, 0, sizeof(s_rtc_data));
+        s_rtc_data.magic = STACK_RTC_MAGIC;
+    }
+}
+
+static stack_entry_t *entry_get(const char *name, uint32_t stack_size)
+{
+    uint32_t i;
+    for (i = 0; i < s_rtc_data.count; i++) {
+        if (strncmp(s_rtc_data.entries[i].name, name, sizeof(s_rtc_data.entries[i].name)) == 0) {
+            /* Stack size changed, probably a firmware update, old minimum does not apply */
+            if (stack_size && s_rtc_data.entries[i].stack_size != stack_size) {
+                s_rtc_data.entries[i].stack_size = stack_size;
+                s_rtc_data.entries[i].min_free = UINT32_MAX;
+            }
+            return &s_rtc_data.entries[i];
+        }
+    }
+    if (s_rtc_data.count >= STACK_MAX_TASKS) {
+        return NULL;
+    }
+    stack_entry_t *entry = &s_rtc_data.entries[s_rtc_data.count++];
+    strlcpy(entry->name, name, sizeof(entry->name));
+    entry->stack_size = stack_size;
+    entry->min_free = UINT32_MAX;
+    return entry;
+}
+
+/* Called with lock held */
+static void stack_sample(void)
+{
+    uint32_t i;
+    size_t tcb_size; /* unused */
+    uint32_t free_bytes[STACK_MAX_TASKS];
+    uint32_t stack_size[STACK_MAX_TASKS];
+
+    /* Task lists must not change while taking the snapshot */
+    vTaskSuspendAll();
+    uint32_t count = uxTaskGetSnapshotAll(s_priv_data.snapshots, STACK_MAX_TASKS, &tcb_size);
+    for (i = 0; i < count; i++) {
+        TaskHandle_t handle = (TaskHandle_t)s_priv_data.snapshots[i].pxTCB;
+        uint8_t *start = (uint8_t *)pxTaskGetStackStart(handle);
+        uint8_t *end = (uint8_t *)s_priv_data.snapshots[i].pxEndOfStack;
+        stack_size[i] = (start && end > start) ? (end - start) + sizeof(StackType_t) : 0;
+        free_bytes[i] = uxTaskGetStackHighWaterMark(handle) * sizeof(StackType_t);
+        const char *name = pcTaskGetName(handle);
+        strlcpy(s_priv_data.names[i], name ? name : "", sizeof(s_priv_data.names[i]));
+    }
+    xTaskResumeAll();
+
+    for (i = 0; i < count; i++) {
+        const char *name = s_priv_data.names[i];
+        if (!*name) {
+            continue;
+        }
+        stack_entry_t *entry = entry_get(name, stack_size[i]);
+        if (entry && free_bytes[i] < entry->min_free) {
+            uint32_t idx = entry - s_rtc_data.entries;
+            entry->min_free = free_bytes[i];
+            s_priv_data.changed[idx / 32] |= BIT(idx % 32);
+        }
+    }
+}
+
+static bool metric_registered(const char *key)
+{
+    uint32_t len, i;
+    const esp_diag_metrics_meta_t *meta = esp_diag_metrics_meta_get_all(&len);
+    for (i = 0; meta && i < len; i++) {
+        if (meta[i].key && strcmp(meta[i].key, key) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Called with lock held */
+static void stack_export(void)
+{
+    uint32_t i;
+    for (i = 0; i < s_rtc_data.count; i++) {
+        if (!(s_priv_data.changed[i / 32] & BIT(i % 32))) {
+            continue;
+        }
+        stack_entry_t *entry = &s_rtc_data.entries[i];
+        /* Tasks are created at runtime, register them as they show up */
+        if (!metric_registered(entry->name)
+                && esp_diag_metrics_register(METRICS_TAG, entry->name, "Minimum free stack",
+                                             PATH_STACK, ESP_DIAG_DATA_TYPE_UINT) != ESP_OK) {
+            continue;
+        }
+        if (esp_diag_metrics_add_uint(entry->name, entry->min_free) == ESP_OK) {
+            s_priv_data.changed[i / 32] &= ~BIT(i % 32);
+        }
+    }
+}
+
+static uint32_t recommended_size(const stack_entry_t *entry)
+{
+    uint32_t used = entry->stack_size - entry->min_free;
+    uint32_t size = used + (used * STACK_MARGIN_PERCENT) / 100;
+    size = (size + STACK_SIZE_ALIGN - 1) & ~(STACK_SIZE_ALIGN - 1);
+    return size < entry->stack_size ? size : entry->stack_size;
+}
+
+esp_err_t esp_diag_stack_metrics_dump(void)
+{
+    if (!s_priv_data.init) {
+        ESP_LOGW(LOG_TAG, "Stack metrics not initialized");
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+    stack_sample();
+    stack_export();
+    xSemaphoreGive(s_priv_data.lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_diag_stack_metrics_report(void)
+{
+    uint32_t i;
+    uint32_t total_savings = 0;
+    if (!s_priv_data.init) {
+        ESP_LOGW(LOG_TAG, "Stack metrics not initialized");
+        return ESP_ERR_INVALID_STATE;
+    }
+    ESP_LOGI(LOG_TAG, "%-16s %8s %8s %8s %8s", "task", "size", "min_free", "used", "recomm");
+    xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+    for (i = 0; i < s_rtc_data.count; i++) {
+        const stack_entry_t *entry = &s_rtc_data.entries[i];
+        if (entry->min_free == UINT32_MAX) {
+            continue;
+        }
+        if (entry->stack_size == 0 || entry->min_free > entry->stack_size) {
+            ESP_LOGI(LOG_TAG, "%-16s %8s %8" PRIu32 " %8s %8s", entry->name, "?", entry->min_free, "?", "?");
+            continue;
+        }
+        uint32_t recomm = recommended_size(entry);
+        total_savings += entry->stack_size - recomm;
+        ESP_LOGI(LOG_TAG, "%-16s %8" PRIu32 " %8" PRIu32 " %8" PRIu32 " %8" PRIu32, entry->name,
+                 entry->stack_size, entry->min_free, entry->stack_size - entry->min_free, recomm);
+    }
+    xSemaphoreGive(s_priv_data.lock);
+    ESP_LOGI(LOG_TAG, "Margin:%d%% Potential savings:%" PRIu32 " bytes", STACK_MARGIN_PERCENT, total_savings);
+    return ESP_OK;
+}
+
+static void stack_metrics_export_cb(void *arg)
+{
+    xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+    stack_export();
+    xSemaphoreGive(s_priv_data.lock);
+}
+
+/* Called with lock held */
+static bool export_pending(void)
+{
+    uint32_t i, len;
+    /* Nothing to export to if metrics are not initialized, report is still available */
+    if (!esp_diag_metrics_meta_get_all(&len)) {
+        return false;
+    }
+    for (i = 0; i < sizeof(s_priv_data.changed) / sizeof(s_priv_data.changed[0]); i++) {
+        if (s_priv_data.changed[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void stack_timer_cb(TimerHandle_t handle)
+{
+    /* Sampling only touches static memory, it is cheap enough for the timer task.
+     * Exporting goes through the store and is deferred to the work queue.
+     */
+    xSemaphoreTake(s_priv_data.lock, portMAX_DELAY);
+    stack_sample();
+    bool pending = export_pending();
+    xSemaphoreGive(s_priv_data.lock);
+    if (pending) {
+        esp_rmaker_work_queue_add_task(stack_metrics_export_cb, NULL);
+    }
+}
+
+esp_err_t esp_diag_stack_metrics_init(void)
+{
+    if (s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_priv_data.lock = xSemaphoreCreateMutex();
+    if (!s_priv_data.lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    rtc_data_init();
+    /* Minima retained from previous boot have not been reported yet */
+    memset(s_priv_data.changed, 0xff, sizeof(s_priv_data.changed));
+
+    s_priv_data.handle = xTimerCreate("stack_metrics", SEC2TICKS(DEFAULT_POLLING_INTERVAL),
+                                      pdTRUE, NULL, stack_timer_cb);
+    if (s_priv_data.handle) {
+        xTimerStart(s_priv_data.handle, 0);
+    }
+    s_priv_data.init = true;
+
+    // Dump metrics for the first time
+    esp_diag_stack_metrics_dump();
+
+    return ESP_OK;
+}
+
+esp_err_t esp_diag_stack_metrics_deinit(void)
+{
+    uint32_t i;
+    if (!s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    /* Try to delete timer with 10 ticks wait time */
+    if (xTimerDelete(s_priv_data.handle, 10) == pdFALSE) {
+        ESP_LOGW(LOG_TAG, "Failed to delete stack metric timer");
+    }
+    for (i = 0; i < s_rtc_data.count; i++) {
+        esp_diag_metrics_unregister(s_rtc_data.entries[i].name);
+    }
+    vSemaphoreDelete(s_priv_data.lock);
+    memset(&s_priv_data, 0, sizeof(s_priv_data));
+    return ESP_OK;
+}
+
+void esp_diag_stack_metrics_reset_interval(uint32_t period)
+{
+    if (!s_priv_data.init) {
+        return;
+    }
+    if (period == 0) {
+        xTimerStop(s_priv_data.handle, 0);
+        return;
+    }
+    xTimerChangePeriod(s_priv_data.handle, SEC2TICKS(period), 0);
+}
@@ -0,0 +1,200 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2022 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/task_snapshot.h>
+#if !CONFIG_FREERTOS_UNICORE
+#include <esp_cpu.h>
+#endif
+#if CONFIG_DIAG_TASK_SNAPSHOT_ON_PANIC
+#include <esp_private/panic_internal.h>
+#include <esp_private/cache_utils.h>
+#endif
+
+#include <esp_diagnostics.h>
+#include "esp_diagnostics_internal.h"
+
+#define SNAPSHOT_TASKS          CONFIG_DIAG_TASK_SNAPSHOT_TASKS
+#define SNAPSHOT_MAX_TASKS      CONFIG_DIAG_TASK_SNAPSHOT_MAX_TASKS
+
+#define SNAPSHOT_RTC_MAGIC      0x54534e31 /* "TSN1" */
+
+typedef struct {
+    uint16_t idx;               /* Index in the scan array */
+    uint16_t pressure;          /* Used stack in per mille of the stack size */
+    uint32_t free_stack;
+    uint32_t stack_size;
+} snapshot_rank_t;
+
+typedef struct {
+    bool captured;              /* Captured in this boot */
+    bool in_panic;              /* Set once the panic handler is entered */
+    /* Scratch space of the capture, nothing is allocated on crash and watchdog paths */
+    TaskSnapshot_t tasks[SNAPSHOT_MAX_TASKS];
+    snapshot_rank_t rank[SNAPSHOT_TASKS];
+} snapshot_priv_data_t;
+
+/* Kept in RTC memory, read after a software or watchdog reset and encoded from here */
+static RTC_NOINIT_ATTR esp_diag_task_snapshot_t s_rtc_snapshot;
+static snapshot_priv_data_t s_priv_data;
+
+static uint16_t stack_pressure(uint32_t free_stack, uint32_t stack_size)
+{
+    if (stack_size == 0 || free_stack >= stack_size) {
+        return 0;
+    }
+    return ((stack_size - free_stack) * 1000) / stack_size;
+}
+
+/* Keeps the SNAPSHOT_TASKS tasks with highest stack pressure, highest first */
+static uint32_t rank_insert(uint32_t n, const snapshot_rank_t *item)
+{
+    uint32_t i;
+    if (n == SNAPSHOT_TASKS) {
+        if (item->pressure <= s_priv_data.rank[n - 1].pressure) {
+            return n;
+        }
+        n--;
+    }
+    for (i = n; i > 0 && s_priv_data.rank[i - 1].pressure < item->pressure; i--) {
+        s_priv_data.rank[i] = s_priv_data.rank[i - 1];
+    }
+    s_priv_data.rank[i] = *item;
+    return n + 1;
+}
+
+static void entry_fill(esp_diag_task_snapshot_entry_t *entry, const TaskSnapshot_t *task, const snapshot_rank_t *rank)
+{
+    TaskHandle_t handle = (TaskHandle_t)task->pxTCB;
+    const char *name = pcTaskGetName(handle);
+
+    memset(entry, 0, sizeof(*entry));
+    if (name) {
+        strlcpy(entry->name, name, sizeof(entry->name));
+    }
+    entry->state = eTaskGetState(handle);
+    entry->stack_size = rank->stack_size;
+    entry->free_stack = rank->free_stack;
+    /* Saved frame of a running task is stale, leave its backtrace empty */
+    if (entry->state != eRunning) {
+        esp_diag_task_bt_get(&entry->bt_info, task->pxTopOfStack);
+    }
+}
+
+void esp_diag_task_snapshot_capture(esp_diag_task_snapshot_reason_t reason)
+{
+    uint32_t i, n = 0;
+    size_t tcb_size; /* unused */
+
+    unsigned irq_state = portSET_INTERRUPT_MASK_FROM_ISR();
+#if !CONFIG_FREERTOS_UNICORE
+    int other_cpu = xPortGetCoreID() ? 0 : 1;
+    esp_cpu_stall(other_cpu);
+#endif
+
+    /* Interrupts are masked, tasks are ranked by their saved stack pointer which is cheap to read.
+     * The high water mark scans the unused stack, it is read only for the tasks which are kept.
+     */
+    uint32_t count = uxTaskGetSnapshotAll(s_priv_data.tasks, SNAPSHOT_MAX_TASKS, &tcb_size);
+    for (i = 0; i < count; i++) {
+        uint8_t *start = (uint8_t *)pxTaskGetStackStart((TaskHandle_t)s_priv_data.tasks[i].pxTCB);
+        uint8_t *end = (uint8_t *)s_priv_data.tasks[i].pxEndOfStack;
+        uint8_t *top = (uint8_t *)s_priv_data.tasks[i].pxTopOfStack;
+        snapshot_rank_t item = {
+            .idx = i,
+            .free_stack = (start && top > start && top <= end) ? top - start : 0,
+            .stack_size = (start && end > start) ? (end - start) + sizeof(StackType_t) : 0,
+        };
+        item.pressure = stack_pressure(item.free_stack, item.stack_size);
+        n = rank_insert(n, &item);
+    }
+    for (i = 0; i < n; i++) {
+        snapshot_rank_t item = s_priv_data.rank[i];
+        item.free_stack = uxTaskGetStackHighWaterMark((TaskHandle_t)s_priv_data.tasks[item.idx].pxTCB)
+                          * sizeof(StackType_t);
+        item.pressure = stack_pressure(item.free_stack, item.stack_size);
+        /* Entries after i are still ranked by the stack pointer, re-sort the ones before */
+        uint32_t j;
+        for (j = i; j > 0 && s_priv_data.rank[j - 1].pressure < item.pressure; j--) {
+            s_priv_data.rank[j] = s_priv_data.rank[j - 1];
+        }
+        s_priv_data.rank[j] = item;
+    }
+
+    /* Entries are written one at a time and counted after they are complete,
+     * a reset in the middle of the capture still leaves the ones before valid.
+     */
+    s_rtc_snapshot.magic = SNAPSHOT_RTC_MAGIC;
+    s_rtc_snapshot.count = 0;
+    s_rtc_snapshot.reason = reason;
+    s_rtc_snapshot.uptime = esp_timer_get_time();
+    s_rtc_snapshot.task_count = uxTaskGetNumberOfTasks();
+    for (i = 0; i < n; i++) {
+        entry_fill(&s_rtc_snapshot.entries[i], &s_priv_data.tasks[s_priv_data.rank[i].idx], &s_priv_data.rank[i]);
+        s_rtc_snapshot.count = i + 1;
+    }
+    s_priv_data.captured = true;
+
+#if !CONFIG_FREERTOS_UNICORE
+    esp_cpu_unstall(other_cpu);
+#endif
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(irq_state);
+}
+
+const esp_diag_task_snapshot_t *esp_diag_task_snapshot_last(void)
+{
+    if (s_rtc_snapshot.magic != SNAPSHOT_RTC_MAGIC || s_rtc_snapshot.count > SNAPSHOT_TASKS) {
+        return NULL;
+    }
+    /* RTC memory content is random after power on, unless captured since */
+    if (!s_priv_data.captured) {
+        esp_reset_reason_t reason = esp_reset_reason();
+        if (reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT || reason == ESP_RST_UNKNOWN) {
+            esp_diag_task_snapshot_clear();
+            return NULL;
+        }
+    }
+    return &s_rtc_snapshot;
+}
+
+void esp_diag_task_snapshot_clear(void)
+{
+    s_rtc_snapshot.magic = 0;
+    s_rtc_snapshot.count = 0;
+}
+
+#if CONFIG_DIAG_TASK_SNAPSHOT_ON_TASK_WDT
+/* Weak in ESP-IDF, called from the task watchdog interrupt on timeout */
+void esp_task_wdt_isr_user_handler(void)
+{
+    esp_diag_task_snapshot_capture(ESP_DIAG_TASK_SNAPSHOT_TASK_WDT);
+}
+#endif /* CONFIG_DIAG_TASK_SNAPSHOT_ON_TASK_WDT */
+
+#if CONFIG_DIAG_TASK_SNAPSHOT_ON_PANIC
+/* esp_panic_handler() is wrapped with --wrap=esp_panic_handler, see CMakeLists.txt */
+void __real_esp_panic_handler(panic_info_t *info);
+
+void IRAM_ATTR __wrap_esp_panic_handler(panic_info_t *info)
+{
+    /* The capture runs from flash, skip it if the panic came with the cache disabled
+     * or from inside the capture itself. A task watchdog panic keeps the snapshot
+     * taken by the watchdog interrupt, it shows the tasks before the panic.
+     */
+    if (!s_priv_data.in_panic && spi_flash_cache_enabled()) {
+        s_priv_data.in_panic = true;
+        if (!(s_priv_data.captured && s_rtc_snapshot.reason == ESP_DIAG_TASK_SNAPSHOT_TASK_WDT)) {
+            esp_diag_task_snapshot_capture(ESP_DIAG_TASK_SNAPSHOT_PANIC);
+        }
+    }
+    __real_esp_panic_handler(info);
+}
+#endif /* CONFIG_DIAG_TASK_SNAPSHOT_ON_PANIC */
@@ -11,6 +11,7 @@
 #include "esp_log.h"
 #include "sys/time.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include <esp_crc.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -18,6 +19,7 @@
 #include "esp_debug_helpers.h"
 #include "esp_diagnostics_metrics.h"
 #include "esp_diagnostics_variables.h"
+#include "esp_diagnostics_internal.h"
 
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
 #include "esp_chip_info.h"
@@ -26,10 +28,12 @@
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0)
 #include <esp_rom_crc.h>
 #define ESP_CRC32_LE(crc, buf, len) esp_rom_crc32_le(crc, buf, len)
+#define ESP_CRC16_LE(crc, buf, len) esp_rom_crc16_le(crc, buf, len)
 #define TASK_GET_NAME(handle) pcTaskGetName(handle)
 #else
 #include <esp_crc.h>
 #define ESP_CRC32_LE(crc, buf, len) esp_crc32_le(crc, buf, len)
+#define ESP_CRC16_LE(crc, buf, len) esp_crc16_le(crc, buf, len)
 #define TASK_GET_NAME(handle) pcTaskGetTaskName(handle)
 #endif
 
@@ -66,6 +70,10 @@
 #endif
 #endif
 
+#if CONFIG_IDF_TARGET_ARCH_RISCV
+#include "riscv/rvruntime-frames.h"
+#endif
+
 esp_err_t esp_diag_device_info_get(esp_diag_device_info_t *device_info)
 {
     esp_chip_info_t chip;
@@ -102,9 +110,15 @@ uint64_t esp_diag_timestamp_get(void)
     }
 }
 
+int64_t esp_diag_timestamp_offset_get(void)
+{
+    return (int64_t)esp_diag_timestamp_get() - esp_timer_get_time();
+}
+
 #ifndef CONFIG_IDF_TARGET_ARCH_RISCV
-static void diag_task_get_bt(esp_diag_task_bt_t *bt_info, XtExcFrame *stack)
+void esp_diag_task_bt_get(esp_diag_task_bt_t *bt_info, void *frame)
 {
+    XtExcFrame *stack = (XtExcFrame *)frame;
     esp_backtrace_frame_t frame = {
         .pc = stack->pc,
         .sp = stack->a1,
@@ -127,6 +141,16 @@ static void diag_task_get_bt(esp_diag_task_bt_t *bt_info, XtExcFrame *stack)
     bt_info->depth = i;
     bt_info->corrupted = corrupted;
 }
+#else
+void esp_diag_task_bt_get(esp_diag_task_bt_t *bt_info, void *frame)
+{
+    /* Frames can not be unwound without frame pointers, keep the saved PC and return address */
+    RvExcFrame *stack = (RvExcFrame *)frame;
+    bt_info->bt[0] = stack->mepc;
+    bt_info->bt[1] = stack->ra;
+    bt_info->depth = 2;
+    bt_info->corrupted = !esp_ptr_executable((void *)stack->mepc);
+}
 #endif /* !CONFIG_IDF_TARGET_ARCH_RISCV */
 
 uint32_t esp_diag_task_snapshot_get(esp_diag_task_info_t *tasks, size_t size)
@@ -134,23 +158,24 @@ uint32_t esp_diag_task_snapshot_get(esp_diag_task_info_t *tasks, size_t size)
     if (!tasks || !size) {
         return 0;
     }
+    /* Allocate before disabling interrupts, room for a few tasks created meanwhile */
+    uint32_t i = 0;
+    uint32_t task_count = uxTaskGetNumberOfTasks() + 2;
+    TaskSnapshot_t *snapshots = calloc(task_count, sizeof(TaskSnapshot_t));
+    if (!snapshots) {
+        return 0;
+    }
+
     unsigned irq_state = DISABLE_INTERRUPTS();
 #if !CONFIG_FREERTOS_UNICORE
     int other_cpu = xPortGetCoreID() ? 0 : 1;
     esp_cpu_stall(other_cpu);
 #endif
 
-    uint32_t i = 0;
-    uint32_t task_count = uxTaskGetNumberOfTasks();
-    TaskSnapshot_t *snapshots = calloc(task_count, sizeof(TaskSnapshot_t));
-    if (!snapshots) {
-        return 0;
-    }
     size_t tcb_size; /* unused */
     uint32_t count = uxTaskGetSnapshotAll(snapshots, task_count, &tcb_size);
-    if (count == 0) {
-        free(snapshots);
-        return 0;
+    if (count > size) {
+        count = size;
     }
     for (i = 0; i < count; i++) {
         TaskHandle_t handle = (TaskHandle_t)snapshots[i].pxTCB;
@@ -161,15 +186,21 @@ uint32_t esp_diag_task_snapshot_get(esp_diag_task_info_t *tasks, size_t size)
         tasks[i].state = eTaskGetState(handle);
         tasks[i].high_watermark = uxTaskGetStackHighWaterMark(handle);
 #ifndef CONFIG_IDF_TARGET_ARCH_RISCV
-        diag_task_get_bt(&tasks[i].bt_info, (XtExcFrame *)snapshots[i].pxTopOfStack);
+        esp_diag_task_bt_get(&tasks[i].bt_info, snapshots[i].pxTopOfStack);
 #endif /* !CONFIG_IDF_TARGET_ARCH_RISCV */
     }
-    free(snapshots);
 
 #if !CONFIG_FREERTOS_UNICORE
     esp_cpu_unstall(other_cpu);
 #endif
     ENABLE_INTERRUPTS(irq_state);
+    free(snapshots);
+#if CONFIG_DIAG_ENABLE_CPU_METRICS
+    uint32_t j;
+    for (j = 0; j < i; j++) {
+        tasks[j].cpu_percent = esp_diag_cpu_percent_get(tasks[j].name);
+    }
+#endif /* CONFIG_DIAG_ENABLE_CPU_METRICS */
     return i;
 }
 
@@ -307,33 +338,63 @@ void esp_diag_task_snapshot_dump(void)
 
 uint32_t esp_diag_data_size_get_crc(void)
 {
-    size_t diag_data_size = sizeof(esp_diag_data_pt_t) + sizeof(esp_diag_str_data_pt_t) + sizeof(esp_diag_log_data_t);
+    /* Max size of compact records changes with their layout, stored data is dropped then */
+    size_t diag_data_size = sizeof(esp_diag_data_pt_t) + sizeof(esp_diag_str_data_pt_t) + sizeof(esp_diag_log_data_t)
+                            + sizeof(esp_diag_compact_data_pt_t) + ESP_DIAG_DATA_PT_COMPACT_MAX_SZ;
     uint32_t crc = 0;
     crc = esp_crc32_le(crc, (const unsigned char *)&diag_data_size, sizeof(diag_data_size));
     return crc;
 }
 
-uint32_t esp_diag_meta_crc_get(void)
+/* Meta CRC is checked on every data point write, recompute only after registrations change */
+static struct {
+    bool valid;
+    uint32_t crc;
+} s_meta_crc;
+
+void esp_diag_meta_crc_invalidate(void)
 {
-    uint32_t crc = 0;
+    s_meta_crc.valid = false;
+}
+
+uint16_t esp_diag_key_id_get(const char *key)
+{
+    uint16_t id = ESP_CRC16_LE(0, (const uint8_t *)key, strlen(key));
+    /* 0 is never a valid key id */
+    return id ? id : 1;
+}
+
+static uint32_t meta_crc_compute(void)
+{
+    /* Entries are registered lazily and in any order, per entry CRCs are summed so the
+     * result only depends on what is registered, not on the order or the slots used.
+     */
+    uint32_t sum = 0;
+    uint32_t crc;
     const esp_app_desc_t *app_desc;
 #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
     app_desc = esp_app_get_description();
 #else
     app_desc = esp_ota_get_app_description();
 #endif
-    crc = ESP_CRC32_LE(crc, (const uint8_t *) app_desc->app_elf_sha256, sizeof(app_desc->app_elf_sha256));
 #if CONFIG_DIAG_ENABLE_METRICS
     uint32_t metrics_len = 0;
     const esp_diag_metrics_meta_t *metrics = esp_diag_metrics_meta_get_all(&metrics_len);
     if (metrics) {
         uint32_t i;
         for (i = 0; i < metrics_len; i++) {
-            crc = ESP_CRC32_LE(crc, (const uint8_t *)metrics[i].tag, strlen(metrics[i].tag));
+            if (!metrics[i].key) {
+                continue;
+            }
+            crc = ESP_CRC32_LE(0, (const uint8_t *)metrics[i].tag, strlen(metrics[i].tag));
             crc = ESP_CRC32_LE(crc, (const uint8_t *)metrics[i].key, strlen(metrics[i].key));
             crc = ESP_CRC32_LE(crc, (const uint8_t *)metrics[i].label, strlen(metrics[i].label));
             crc = ESP_CRC32_LE(crc, (const uint8_t *)metrics[i].path, strlen(metrics[i].path));
             crc = ESP_CRC32_LE(crc, (const uint8_t *)&metrics[i].type, sizeof(metrics[i].type));
+            if (metrics[i].bounds) {
+                crc = ESP_CRC32_LE(crc, (const uint8_t *)metrics[i].bounds, metrics[i].bounds_count * sizeof(int32_t));
+            }
+            sum += crc;
         }
     }
 #endif /* CONFIG_DIAG_ENABLE_METRICS */
@@ -344,13 +405,28 @@ uint32_t esp_diag_meta_crc_get(void)
     if (variables) {
         uint32_t i;
         for (i = 0; i < variables_len; i++) {
-            crc = ESP_CRC32_LE(crc, (const uint8_t *)variables[i].tag, strlen(variables[i].tag));
+            if (!variables[i].key) {
+                continue;
+            }
+            /* Seeded differently so a variable and a metrics with the same meta do not sum the same */
+            crc = ESP_CRC32_LE(1, (const uint8_t *)variables[i].tag, strlen(variables[i].tag));
             crc = ESP_CRC32_LE(crc, (const uint8_t *)variables[i].key, strlen(variables[i].key));
             crc = ESP_CRC32_LE(crc, (const uint8_t *)variables[i].label, strlen(variables[i].label));
             crc = ESP_CRC32_LE(crc, (const uint8_t *)variables[i].path, strlen(variables[i].path));
             crc = ESP_CRC32_LE(crc, (const uint8_t *)&variables[i].type, sizeof(variables[i].type));
+            sum += crc;
         }
     }
 #endif /* CONFIG_DIAG_ENABLE_VARIABLES */
-    return crc;
+    crc = ESP_CRC32_LE(0, (const uint8_t *) app_desc->app_elf_sha256, sizeof(app_desc->app_elf_sha256));
+    return ESP_CRC32_LE(crc, (const uint8_t *)&sum, sizeof(sum));
+}
+
+uint32_t esp_diag_meta_crc_get(void)
+{
+    if (!s_meta_crc.valid) {
+        s_meta_crc.valid = true;
+        s_meta_crc.crc = meta_crc_compute();
+    }
+    return s_meta_crc.crc;
 }
@@ -8,25 +8,45 @@
 #include <string.h>
 #include <stdbool.h>
 #include <esp_log.h>
+#include <esp_bit_defs.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
 #include <esp_diagnostics.h>
 #include <esp_diagnostics_variables.h>
+#include "esp_diagnostics_internal.h"
 
 #define TAG "DIAG_VARIABLES"
 #define DIAG_VARIABLES_MAX_COUNT   CONFIG_DIAG_VARIABLES_MAX_COUNT
+#define SNAPSHOT_INTERVAL_US       ((uint64_t)CONFIG_DIAG_VARIABLES_SNAPSHOT_INTERVAL * 1000000)
 
 /* Max supported string lenth */
-#define MAX_STR_LEN         (sizeof(((esp_diag_str_data_pt_t *)0)->value.str) - 1)
-#define MAX_VARIABLES_WRITE_SZ     sizeof(esp_diag_data_pt_t)
-#define MAX_STR_VARIABLES_WRITE_SZ sizeof(esp_diag_str_data_pt_t)
+#define MAX_STR_LEN         (sizeof(((esp_diag_compact_data_pt_t *)0)->value.str) - 1)
+/* Largest value of a variable, aggregated data types are only supported for metrics */
+#define MAX_VALUE_SZ        sizeof(((esp_diag_compact_data_pt_t *)0)->value.str)
+
+/* Last value of a variable */
+typedef struct {
+    bool valid;
+    uint64_t ts;                    /* Timestamp of the last change */
+    uint8_t value[MAX_VALUE_SZ];    /* Zero padded so values can be compared with memcmp() */
+} variable_value_t;
 
 typedef struct {
     size_t variables_count;
     esp_diag_variable_meta_t variables[DIAG_VARIABLES_MAX_COUNT];
+    variable_value_t values[DIAG_VARIABLES_MAX_COUNT];
+    /* Variables whose value changed since they were last written to storage */
+    uint32_t dirty[(DIAG_VARIABLES_MAX_COUNT + 31) / 32];
+    /* Variables written to storage whose upload is not acknowledged yet */
+    uint32_t unacked[(DIAG_VARIABLES_MAX_COUNT + 31) / 32];
+    uint64_t snapshot_time;         /* esp_timer time of the last full snapshot */
     esp_diag_variable_config_t config;
     bool init;
 } variables_priv_data_t;
 
 static variables_priv_data_t s_priv_data;
+/* Variables are set from event handlers and flushed from the sending task */
+static portMUX_TYPE s_value_lock = portMUX_INITIALIZER_UNLOCKED;
 
 static const esp_diag_variable_meta_t *esp_diag_variable_meta_get(const char *key)
 {
@@ -47,6 +67,32 @@ static bool key_present(const char *key)
     return (esp_diag_variable_meta_get(key) != NULL);
 }
 
+static const esp_diag_variable_meta_t *esp_diag_variable_meta_get_by_id(uint16_t key_id)
+{
+    uint32_t i;
+    for (i = 0; i < s_priv_data.variables_count; i++) {
+        if (s_priv_data.variables[i].key && s_priv_data.variables[i].key_id == key_id) {
+            return &s_priv_data.variables[i];
+        }
+    }
+    return NULL;
+}
+
+/* Find a slot for new variable, slots freed by unregister are reused first */
+static int variable_free_slot_get(void)
+{
+    uint32_t i;
+    for (i = 0; i < s_priv_data.variables_count; i++) {
+        if (!s_priv_data.variables[i].key) {
+            return i;
+        }
+    }
+    if (s_priv_data.variables_count < DIAG_VARIABLES_MAX_COUNT) {
+        return s_priv_data.variables_count;
+    }
+    return -1;
+}
+
 esp_err_t esp_diag_variable_register(const char *tag, const char *key,
                                      const char *label, const char *path,
                                      esp_diag_data_type_t type)
@@ -55,23 +101,43 @@ esp_err_t esp_diag_variable_register(const char *tag, const char *key,
         ESP_LOGE(TAG, "Failed to register variable, tag, key, lable, or path is NULL");
         return ESP_ERR_INVALID_ARG;
     }
+    if (type >= ESP_DIAG_DATA_TYPE_SUMMARY) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
     if (!s_priv_data.init) {
         return ESP_ERR_INVALID_STATE;
     }
-    if (s_priv_data.variables_count >= DIAG_VARIABLES_MAX_COUNT) {
-        ESP_LOGE(TAG, "No space left for more variable");
-        return ESP_ERR_NO_MEM;
-    }
     if (key_present(key)) {
         ESP_LOGE(TAG, "Param-val key:%s exists", key);
         return ESP_FAIL;
     }
-    s_priv_data.variables[s_priv_data.variables_count].tag = tag;
-    s_priv_data.variables[s_priv_data.variables_count].key = key;
-    s_priv_data.variables[s_priv_data.variables_count].label = label;
-    s_priv_data.variables[s_priv_data.variables_count].path = path;
-    s_priv_data.variables[s_priv_data.variables_count].type = type;
-    s_priv_data.variables_count++;
+    /* Data points only carry the key id, it must tell the variables apart */
+    uint16_t key_id = esp_diag_key_id_get(key);
+    const esp_diag_variable_meta_t *other = esp_diag_variable_meta_get_by_id(key_id);
+    if (other) {
+        ESP_LOGE(TAG, "Param-val key:%s collides with key:%s, rename one of them", key, other->key);
+        return ESP_FAIL;
+    }
+    int slot = variable_free_slot_get();
+    if (slot < 0) {
+        ESP_LOGE(TAG, "No space left for more variable");
+        return ESP_ERR_NO_MEM;
+    }
+    s_priv_data.variables[slot].key_id = key_id;
+    s_priv_data.variables[slot].tag = tag;
+    s_priv_data.variables[slot].key = key;
+    s_priv_data.variables[slot].label = label;
+    s_priv_data.variables[slot].path = path;
+    s_priv_data.variables[slot].type = type;
+    portENTER_CRITICAL(&s_value_lock);
+    s_priv_data.values[slot].valid = false;
+    s_priv_data.dirty[slot / 32] &= ~BIT(slot % 32);
+    s_priv_data.unacked[slot / 32] &= ~BIT(slot % 32);
+    portEXIT_CRITICAL(&s_value_lock);
+    if (slot == s_priv_data.variables_count) {
+        s_priv_data.variables_count++;
+    }
+    esp_diag_meta_crc_invalidate();
     return ESP_OK;
 }
 
@@ -90,9 +156,17 @@ esp_err_t esp_diag_variable_unregister(const char *key)
         }
     }
     if (i < s_priv_data.variables_count) {
-        s_priv_data.variables[i] = s_priv_data.variables[s_priv_data.variables_count - 1];
-        memset(&s_priv_data.variables[s_priv_data.variables_count - 1], 0, sizeof(esp_diag_variable_meta_t));
-        s_priv_data.variables_count--;
+        /* Do not move other entries, their values and dirty bits are kept by index */
+        memset(&s_priv_data.variables[i], 0, sizeof(esp_diag_variable_meta_t));
+        portENTER_CRITICAL(&s_value_lock);
+        s_priv_data.values[i].valid = false;
+        s_priv_data.dirty[i / 32] &= ~BIT(i % 32);
+        s_priv_data.unacked[i / 32] &= ~BIT(i % 32);
+        portEXIT_CRITICAL(&s_value_lock);
+        while (s_priv_data.variables_count && !s_priv_data.variables[s_priv_data.variables_count - 1].key) {
+            s_priv_data.variables_count--;
+        }
+        esp_diag_meta_crc_invalidate();
         return ESP_OK;
     }
     return ESP_ERR_NOT_FOUND;
@@ -104,10 +178,22 @@ esp_err_t esp_diag_variable_unregister_all(void)
         return ESP_ERR_INVALID_STATE;
     }
     memset(&s_priv_data.variables, 0, sizeof(s_priv_data.variables));
+    portENTER_CRITICAL(&s_value_lock);
+    memset(&s_priv_data.values, 0, sizeof(s_priv_data.values));
+    memset(&s_priv_data.dirty, 0, sizeof(s_priv_data.dirty));
+    memset(&s_priv_data.unacked, 0, sizeof(s_priv_data.unacked));
+    portEXIT_CRITICAL(&s_value_lock);
     s_priv_data.variables_count = 0;
+    esp_diag_meta_crc_invalidate();
     return ESP_OK;
 }
 
+const char *esp_diag_variable_key_get(uint16_t key_id)
+{
+    const esp_diag_variable_meta_t *variable = esp_diag_variable_meta_get_by_id(key_id);
+    return variable ? variable->key : NULL;
+}
+
 const esp_diag_variable_meta_t *esp_diag_variable_meta_get_all(uint32_t *len)
 {
     if (!s_priv_data.init) {
@@ -126,6 +212,9 @@ void esp_diag_variable_meta_print_all(void)
     if (meta) {
         ESP_LOGI(TAG, "Tag\tKey\tLabel\tPath\tData type\n");
         for (i = 0; i < len; i++) {
+            if (!meta[i].key) {
+                continue;
+            }
             ESP_LOGI(TAG, "%s\t%s\t%s\t%s\t%d\n", meta[i].tag, meta[i].key, meta[i].label, meta[i].path, meta[i].type);
         }
     }
@@ -140,6 +229,7 @@ esp_err_t esp_diag_variable_init(esp_diag_variable_config_t *config)
         return ESP_ERR_INVALID_STATE;
     }
     memcpy(&s_priv_data.config, config, sizeof(s_priv_data.config));
+    s_priv_data.snapshot_time = esp_timer_get_time();
     s_priv_data.init = true;
     return ESP_OK;
 }
@@ -150,6 +240,7 @@ esp_err_t esp_diag_variables_deinit(void)
         return ESP_ERR_INVALID_STATE;
     }
     memset(&s_priv_data, 0, sizeof(s_priv_data));
+    esp_diag_meta_crc_invalidate();
     return ESP_OK;
 }
 
@@ -171,25 +262,92 @@ esp_err_t esp_diag_variable_add(esp_diag_data_type_t data_type,
     if (variable->type != data_type) {
         return ESP_ERR_INVALID_ARG;
     }
-    size_t write_sz = MAX_VARIABLES_WRITE_SZ;
-    if (variable->type == ESP_DIAG_DATA_TYPE_STR) {
-        write_sz = MAX_STR_VARIABLES_WRITE_SZ;
-    }
 
-    esp_diag_str_data_pt_t data;
-    memset(&data, 0, sizeof(data));
-    data.type = ESP_DIAG_DATA_PT_VARIABLE;
-    data.data_type = data_type;
-    strlcpy(data.key, key, sizeof(data.key));
-    data.ts = ts;
-    memcpy(&data.value, val, val_sz);
+    uint8_t value[MAX_VALUE_SZ] = { 0 };
+    memcpy(value, val, val_sz < MAX_VALUE_SZ ? val_sz : MAX_VALUE_SZ);
+    uint32_t idx = variable - s_priv_data.variables;
+    variable_value_t *cache = &s_priv_data.values[idx];
 
-    if (s_priv_data.config.write_cb) {
-        return s_priv_data.config.write_cb(variable->tag, &data, write_sz, s_priv_data.config.cb_arg);
+    portENTER_CRITICAL(&s_value_lock);
+    if (!cache->valid || memcmp(cache->value, value, sizeof(value)) != 0) {
+        memcpy(cache->value, value, sizeof(value));
+        cache->ts = ts;
+        cache->valid = true;
+        s_priv_data.dirty[idx / 32] |= BIT(idx % 32);
     }
+    portEXIT_CRITICAL(&s_value_lock);
     return ESP_OK;
 }
 
+esp_err_t esp_diag_variables_flush(bool full)
+{
+    uint32_t i;
+    uint8_t buf[ESP_DIAG_DATA_PT_COMPACT_MAX_SZ];
+    esp_diag_compact_data_pt_t data;
+    esp_err_t ret = ESP_OK;
+
+    if (!s_priv_data.init) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint64_t now = esp_timer_get_time();
+    if (SNAPSHOT_INTERVAL_US && now - s_priv_data.snapshot_time >= SNAPSHOT_INTERVAL_US) {
+        full = true;
+    }
+    for (i = 0; i < s_priv_data.variables_count; i++) {
+        const esp_diag_variable_meta_t *variable = &s_priv_data.variables[i];
+        variable_value_t *cache = &s_priv_data.values[i];
+        uint64_t ts;
+
+        portENTER_CRITICAL(&s_value_lock);
+        if (!variable->key || !cache->valid || (!full && !(s_priv_data.dirty[i / 32] & BIT(i % 32)))) {
+            portEXIT_CRITICAL(&s_value_lock);
+            continue;
+        }
+        memset(&data.value, 0, sizeof(data.value));
+        memcpy(&data.value, cache->value, sizeof(cache->value));
+        ts = cache->ts;
+        s_priv_data.dirty[i / 32] &= ~BIT(i % 32);
+        portEXIT_CRITICAL(&s_value_lock);
+
+        /* Data points are stored as compact records, the key is referred to by its key id */
+        data.type = ESP_DIAG_DATA_PT_VARIABLE;
+        data.data_type = variable->type;
+        data.key_id = variable->key_id;
+        data.ts_rel = (int64_t)ts - esp_diag_timestamp_offset_get();
+        size_t len = esp_diag_compact_data_pt_pack(buf, &data);
+        if (!len) {
+            continue;
+        }
+        esp_err_t err = s_priv_data.config.write_cb(variable->tag, buf, len, s_priv_data.config.cb_arg);
+        portENTER_CRITICAL(&s_value_lock);
+        if (err != ESP_OK) {
+            s_priv_data.dirty[i / 32] |= BIT(i % 32);
+            ret = err;
+        } else {
+            s_priv_data.unacked[i / 32] |= BIT(i % 32);
+        }
+        portEXIT_CRITICAL(&s_value_lock);
+    }
+    if (full && ret == ESP_OK) {
+        s_priv_data.snapshot_time = now;
+    }
+    return ret;
+}
+
+void esp_diag_variables_upload_done(bool acked)
+{
+    uint32_t i;
+    portENTER_CRITICAL(&s_value_lock);
+    for (i = 0; i < sizeof(s_priv_data.unacked) / sizeof(s_priv_data.unacked[0]); i++) {
+        /* Records of a failed upload are gone from storage, write them again on the next flush */
+        if (!acked) {
+            s_priv_data.dirty[i] |= s_priv_data.unacked[i];
+        }
+        s_priv_data.unacked[i] = 0;
+    }
+    portEXIT_CRITICAL(&s_value_lock);
+}
+
 esp_err_t esp_diag_variable_add_bool(const char *key, bool b)
 {
     return esp_diag_variable_add(ESP_DIAG_DATA_TYPE_BOOL, key, &b, sizeof(b), esp_diag_timestamp_get());
@@ -222,5 +380,5 @@ esp_err_t esp_diag_variable_add_mac(const char *key, uint8_t *mac)
 
 esp_err_t esp_diag_variable_add_str(const char *key, const char *str)
 {
-    return esp_diag_variable_add(ESP_DIAG_DATA_TYPE_STR, key, str, strlen(str), esp_diag_timestamp_get());
+    return esp_diag_variable_add(ESP_DIAG_DATA_TYPE_STR, key, str, strnlen(str, MAX_STR_LEN), esp_diag_timestamp_get());
 }
@@ -26,12 +26,16 @@
 /* start reporting minimum ever rssi when rssi reaches -50 dbm */
 #define WIFI_RSSI_THRESHOLD      -50
 
+/* Upper bounds of the RSSI histogram buckets in dBm */
+static const int32_t s_rssi_bounds[] = { -90, -80, -70, -60, -50 };
+
 typedef struct {
     bool init;
     bool wifi_connected;
     bool status_sent;
     uint32_t period;
     TimerHandle_t handle;
+    esp_diag_metrics_handle_t h_rssi;
     int32_t prev_rssi;
     int32_t min_rssi;
 } wifi_diag_priv_data_t;
@@ -105,10 +109,9 @@ esp_err_t esp_diag_wifi_metrics_dump(void)
     int32_t rssi = get_rssi();
     if (rssi != 1) {
         update_min_rssi(rssi);
-        RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_int(KEY_RSSI, rssi), ESP_LOG_WARN, LOG_TAG,
+        /* Minimum is recorded by update_min_rssi() when it changes */
+        RET_ON_ERR_WITH_LOG(esp_diag_metrics_observe(s_priv_data.h_rssi, rssi), ESP_LOG_WARN, LOG_TAG,
                             "Failed to add Wi-Fi metrics key:" KEY_RSSI);
-        RET_ON_ERR_WITH_LOG(esp_diag_metrics_add_int(KEY_MIN_RSSI, s_priv_data.min_rssi), ESP_LOG_WARN, LOG_TAG,
-                            "Failed to add Wi-Fi metrics key:" KEY_MIN_RSSI);
         s_priv_data.prev_rssi = rssi;
         ESP_LOGI(LOG_TAG, "%s:%" PRIi32 " %s:%" PRIi32, KEY_RSSI, rssi, KEY_MIN_RSSI, s_priv_data.min_rssi);
     }
@@ -147,7 +150,11 @@ esp_err_t esp_diag_wifi_metrics_init(void)
         ESP_LOGW(LOG_TAG, "Failed to set rssi threshold value");
     }
 #endif
-    esp_diag_metrics_register(METRICS_TAG, KEY_RSSI, "Wi-Fi RSSI", PATH_WIFI_STATION, ESP_DIAG_DATA_TYPE_INT);
+    const esp_diag_metrics_agg_config_t rssi_config = {
+        .bounds = s_rssi_bounds,
+        .bounds_count = sizeof(s_rssi_bounds) / sizeof(s_rssi_bounds[0]),
+    };
+    esp_diag_metrics_register_aggregate(METRICS_TAG, KEY_RSSI, "Wi-Fi RSSI", PATH_WIFI_STATION, &rssi_config, &s_priv_data.h_rssi);
     esp_diag_metrics_register(METRICS_TAG, KEY_MIN_RSSI, "Minimum ever Wi-Fi RSSI", PATH_WIFI_STATION, ESP_DIAG_DATA_TYPE_INT);
     esp_diag_metrics_register(METRICS_TAG, KEY_STATUS, "Wi-Fi connect status", PATH_WIFI_STATION, ESP_DIAG_DATA_TYPE_BOOL);
 
@@ -0,0 +1,171 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_cpu.h>
+#include <unity.h>
+#include <esp_diagnostics.h>
+
+#define TAG                 "diag_log_hook_UT"
+#define BENCH_ITERATIONS    200
+
+/* Formats as they show up in Wi-Fi and Matter logs */
+#define WIFI_DISCONNECT_FMT "wifi disconnected, reason:%d rssi:%d"
+#define WIFI_RETRY_FMT      "connected to %s, channel:%u, %d%% retries"
+#define MATTER_SESSION_FMT  "Secure session %u established, peer 0x%016" PRIX64 " fabric %u"
+#define MATTER_LITERAL_FMT  "Commissioning 100%%d done, window %s"
+
+static esp_diag_log_data_t s_log;
+static uint32_t s_log_count;
+
+static esp_err_t log_write_cb(void *data, size_t len, void *priv_data)
+{
+    TEST_ASSERT_EQUAL(sizeof(s_log), len);
+    memcpy(&s_log, data, len);
+    s_log_count++;
+    return ESP_OK;
+}
+
+static void log_hook_setup(void)
+{
+    static bool init;
+    if (!init) {
+        esp_diag_log_config_t config = {
+            .write_cb = log_write_cb,
+        };
+        TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_hook_init(&config));
+        init = true;
+    }
+    esp_diag_log_hook_enable(ESP_DIAG_LOG_TYPE_EVENT);
+    memset(&s_log, 0, sizeof(s_log));
+    s_log_count = 0;
+}
+
+/* Returns the value of argument idx of the last log after checking its type and length */
+static const uint8_t *log_arg_get(uint8_t idx, uint8_t type, uint8_t len)
+{
+    uint8_t off = 0;
+    while (idx--) {
+        TEST_ASSERT_LESS_THAN(s_log.msg_args_len, off + 1);
+        off += 2 + s_log.msg_args[off + 1];
+    }
+    TEST_ASSERT_LESS_OR_EQUAL(s_log.msg_args_len, off + 2 + len);
+    TEST_ASSERT_EQUAL(type, s_log.msg_args[off]);
+    TEST_ASSERT_EQUAL(len, s_log.msg_args[off + 1]);
+    return &s_log.msg_args[off + 2];
+}
+
+static int log_arg_int(uint8_t idx)
+{
+    int val;
+    memcpy(&val, log_arg_get(idx, ARG_TYPE_INT, sizeof(val)), sizeof(val));
+    return val;
+}
+
+static unsigned int log_arg_uint(uint8_t idx)
+{
+    unsigned int val;
+    memcpy(&val, log_arg_get(idx, ARG_TYPE_UINT, sizeof(val)), sizeof(val));
+    return val;
+}
+
+/* Strings are stored without the terminating null */
+static void check_log_arg_str(uint8_t idx, const char *str)
+{
+    TEST_ASSERT_EQUAL_MEMORY(str, log_arg_get(idx, ARG_TYPE_STR, strlen(str)), strlen(str));
+}
+
+static void check_wifi_retry_log(const char *ssid, unsigned int channel, int retries)
+{
+    check_log_arg_str(0, ssid);
+    TEST_ASSERT_EQUAL(channel, log_arg_uint(1));
+    TEST_ASSERT_EQUAL(retries, log_arg_int(2));
+}
+
+TEST_CASE("log format with %% does not consume an argument", "[esp_diag_log_hook]")
+{
+    log_hook_setup();
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_event(TAG, WIFI_RETRY_FMT, "home-ap", 6, 40));
+    TEST_ASSERT_EQUAL(1, s_log_count);
+    check_wifi_retry_log("home-ap", 6, 40);
+    TEST_ASSERT_EQUAL(3 * 2 + strlen("home-ap") + 2 * sizeof(int), s_log.msg_args_len);
+
+    /* "%%d" is a literal "%d" */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_event(TAG, MATTER_LITERAL_FMT, "closed"));
+    check_log_arg_str(0, "closed");
+    TEST_ASSERT_EQUAL(2 + strlen("closed"), s_log.msg_args_len);
+}
+
+TEST_CASE("log format cache hit reads arguments of later logs", "[esp_diag_log_hook]")
+{
+    uint64_t peer;
+    log_hook_setup();
+
+    /* First log parses the format, the rest take its arguments from the cache */
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_event(TAG, WIFI_DISCONNECT_FMT, 201 + i, -80 + i));
+        TEST_ASSERT_EQUAL(201 + i, log_arg_int(0));
+        TEST_ASSERT_EQUAL(-80 + i, log_arg_int(1));
+
+        TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_event(TAG, MATTER_SESSION_FMT, 7 + i,
+                                                     (uint64_t)0x1122334455667788ULL + i, 1));
+        TEST_ASSERT_EQUAL(7 + i, log_arg_uint(0));
+        memcpy(&peer, log_arg_get(1, ARG_TYPE_ULL, sizeof(peer)), sizeof(peer));
+        TEST_ASSERT_TRUE(peer == 0x1122334455667788ULL + i);
+        TEST_ASSERT_EQUAL(1, log_arg_uint(2));
+
+        TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_event(TAG, WIFI_RETRY_FMT, "home-ap", 1 + i, 10 * i));
+        check_wifi_retry_log("home-ap", 1 + i, 10 * i);
+    }
+    TEST_ASSERT_EQUAL(9, s_log_count);
+}
+
+TEST_CASE("log format cache does not keep formats in RAM", "[esp_diag_log_hook]")
+{
+    static char fmt[sizeof(WIFI_RETRY_FMT)];
+    log_hook_setup();
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_event(TAG, WIFI_RETRY_FMT, "home-ap", 11, 5));
+    /* Same text at another address, then other text at that address */
+    strcpy(fmt, WIFI_RETRY_FMT);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_event(TAG, fmt, "office", 1, 0));
+    check_wifi_retry_log("office", 1, 0);
+    strcpy(fmt, WIFI_DISCONNECT_FMT);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_event(TAG, fmt, 15, -60));
+    TEST_ASSERT_EQUAL(15, log_arg_int(0));
+    TEST_ASSERT_EQUAL(-60, log_arg_int(1));
+    TEST_ASSERT_EQUAL(2 * (2 + sizeof(int)), s_log.msg_args_len);
+}
+
+TEST_CASE("log format cache benchmark", "[esp_diag_log_hook]")
+{
+    /* Formats in RAM are not cached, every log of the miss run parses its format */
+    static char fmt_buf[BENCH_ITERATIONS + sizeof(MATTER_SESSION_FMT)];
+    uint32_t miss_cycles = 0, hit_cycles = 0, start;
+    log_hook_setup();
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_log_event(TAG, MATTER_SESSION_FMT, 1, (uint64_t)2, 3));
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        start = esp_cpu_get_cycle_count();
+        esp_diag_log_event(TAG, MATTER_SESSION_FMT, i, (uint64_t)0x1122334455667788ULL, 1);
+        hit_cycles += esp_cpu_get_cycle_count() - start;
+
+        strcpy(&fmt_buf[i], MATTER_SESSION_FMT);
+        start = esp_cpu_get_cycle_count();
+        esp_diag_log_event(TAG, &fmt_buf[i], i, (uint64_t)0x1122334455667788ULL, 1);
+        miss_cycles += esp_cpu_get_cycle_count() - start;
+    }
+    TEST_ASSERT_EQUAL(2 * BENCH_ITERATIONS + 1, s_log_count);
+    ESP_LOGI(TAG, "cycles per log, format parsed:%" PRIu32 " format cached:%" PRIu32,
+             miss_cycles / BENCH_ITERATIONS, hit_cycles / BENCH_ITERATIONS);
+#if CONFIG_DIAG_LOG_FORMAT_CACHE_SIZE
+    TEST_ASSERT_LESS_THAN(miss_cycles, hit_cycles);
+#endif
+}
@@ -0,0 +1,50 @@
+/*
+ * SPDX-FileCopyrightText: 2024 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <esp_err.h>
+#include <unity.h>
+#include <esp_diagnostics_metrics.h>
+
+#if CONFIG_DIAG_ENABLE_METRICS
+
+static uint32_t s_write_count;
+
+static esp_err_t metrics_write_cb(const char *tag, void *data, size_t len, void *cb_arg)
+{
+    s_write_count++;
+    return ESP_OK;
+}
+
+TEST_CASE("metrics handle held across deinit and init is rejected", "[esp_diag_metrics]")
+{
+    esp_diag_metrics_config_t config = {
+        .write_cb = metrics_write_cb,
+    };
+    esp_diag_metrics_handle_t old_handle, new_handle;
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_metrics_init(&config));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_metrics_register_h("dht", "dht_reads", "Sensor reads", "Sensor.DHT22",
+                                                          ESP_DIAG_DATA_TYPE_UINT, &old_handle));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_metrics_deinit());
+
+    /* The new metrics takes the slot of the old one */
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_metrics_init(&config));
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_metrics_register_h("heap", "free", "Free heap", "Heap.Internal",
+                                                          ESP_DIAG_DATA_TYPE_UINT, &new_handle));
+    TEST_ASSERT_NOT_EQUAL(old_handle, new_handle);
+    TEST_ASSERT_NULL(esp_diag_metrics_key_get(old_handle));
+    TEST_ASSERT_EQUAL_STRING("free", esp_diag_metrics_key_get(new_handle));
+
+    s_write_count = 0;
+    TEST_ASSERT_NOT_EQUAL(ESP_OK, esp_diag_metrics_add_uint_h(old_handle, 1));
+    TEST_ASSERT_EQUAL(0, s_write_count);
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_metrics_add_uint_h(new_handle, 1));
+    TEST_ASSERT_EQUAL(1, s_write_count);
+
+    TEST_ASSERT_EQUAL(ESP_OK, esp_diag_metrics_deinit());
+}
+
+#endif /* CONFIG_DIAG_ENABLE_METRICS */
@@ -65,6 +65,35 @@ typedef struct {
     int msg_id;             /*!< Message id */
 } esp_insights_transport_event_data_t;
 
+/**
+ * @brief Reason for the reporting interval chosen by the periodic reporting logic
+ */
+typedef enum {
+    /** Nothing was sent in the last interval, the interval is doubled. */
+    ESP_INSIGHTS_SCHED_IDLE,
+    /** Data was sent and none is left behind, the interval is doubled. */
+    ESP_INSIGHTS_SCHED_STEADY,
+    /** Data is left in the data store, the interval is halved. */
+    ESP_INSIGHTS_SCHED_BACKLOG,
+    /** The data store crossed its reporting watermark, the minimum interval is used. */
+    ESP_INSIGHTS_SCHED_STORE_LOW_MEM,
+    /** Data is left in the data store but the Wi-Fi signal is weak, the interval is kept instead of halved. */
+    ESP_INSIGHTS_SCHED_WEAK_LINK,
+    /** The uplink byte budget is used up, the maximum interval is used. */
+    ESP_INSIGHTS_SCHED_BUDGET,
+} esp_insights_sched_reason_t;
+
+/**
+ * @brief Last decision of the periodic reporting logic
+ */
+typedef struct {
+    uint32_t interval_sec;              /*!< Interval until the next report */
+    esp_insights_sched_reason_t reason; /*!< Why this interval was chosen */
+    int8_t rssi;                        /*!< RSSI of the AP when the interval was chosen, 0 if not connected */
+    uint32_t budget_bytes;              /*!< Uplink bytes left in the budget, UINT32_MAX if there is no budget */
+    uint32_t low_mem_events;            /*!< Data store watermark events since insights was enabled */
+} esp_insights_sched_stats_t;
+
 /**
  * @brief Insights transport init callback prototype
  *
@@ -178,6 +207,16 @@ void esp_insights_transport_unregister(void);
  */
 esp_err_t esp_insights_send_data(void);
 
+/**
+ * @brief Get the last decision of the periodic reporting logic.
+ *
+ * @param[out] stats Interval until the next report and why it was chosen.
+ *
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if stats is NULL,
+ *         ESP_ERR_INVALID_STATE if insights is not enabled
+ */
+esp_err_t esp_insights_get_sched_stats(esp_insights_sched_stats_t *stats);
+
 /**
  * @brief Enable ESP Insights except transport.
  * 
@@ -0,0 +1,94 @@
+# Decodes insights messages on the host, for tests of the message compression.
+# A message is its data type (1 byte), payload length (2 bytes, little endian) and payload.
+# Bit 7 of the data type marks a compressed payload: uncompressed length (2 bytes) followed by
+# LZSS data in the heatshrink format, 8 bit window and 4 bit length.
+#
+# Usage: insights_decompress.py <message file> [<output file>]
+# Writes the message with its payload decompressed, or the payload only with --payload.
+
+import sys
+import struct
+import argparse
+
+CONTENT_ENCODING_LZSS = 0x80
+WINDOW_BITS = 8
+LENGTH_BITS = 4
+
+
+def lzss_decompress(data):
+    out = bytearray()
+    bits = 0
+    nbits = 0
+    pos = 0
+
+    def get_bits(count):
+        nonlocal bits, nbits, pos
+        while nbits < count:
+            if pos == len(data):
+                return None
+            bits = (bits << 8) | data[pos]
+            pos += 1
+            nbits += 8
+        nbits -= count
+        value = (bits >> nbits) & ((1 << count) - 1)
+        bits &= (1 << nbits) - 1
+        return value
+
+    while True:
+        tag = get_bits(1)
+        if tag is None:
+            break
+        if tag:
+            literal = get_bits(8)
+            if literal is None:
+                break
+            out.append(literal)
+        else:
+            offset = get_bits(WINDOW_BITS)
+            count = get_bits(LENGTH_BITS) if offset is not None else None
+            if count is None:
+                break
+            offset += 1
+            if offset > len(out):
+                raise ValueError('back reference before the start of the data')
+            for _ in range(count + 1):
+                out.append(out[-offset])
+    return bytes(out)
+
+
+def decode_message(msg):
+    if len(msg) < 3:
+        raise ValueError('message too short')
+    data_type = msg[0]
+    (length,) = struct.unpack_from('<H', msg, 1)
+    payload = msg[3:3 + length]
+    if len(payload) != length:
+        raise ValueError('message truncated')
+    if data_type & CONTENT_ENCODING_LZSS:
+        (orig_len,) = struct.unpack_from('<H', payload, 0)
+        payload = lzss_decompress(payload[2:])
+        if len(payload) != orig_len:
+            raise ValueError('decompressed %d bytes, expected %d' % (len(payload), orig_len))
+        data_type &= ~CONTENT_ENCODING_LZSS
+    return data_type, payload
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decompress an insights message')
+    parser.add_argument('message', help='file holding the message')
+    parser.add_argument('output', nargs='?', help='output file, stdout if not given')
+    parser.add_argument('--payload', action='store_true', help='write the CBOR payload only')
+    args = parser.parse_args()
+
+    with open(args.message, 'rb') as f:
+        data_type, payload = decode_message(f.read())
+    out = payload if args.payload else bytes([data_type]) + struct.pack('<H', len(payload)) + payload
+    if args.output:
+        with open(args.output, 'wb') as f:
+            f.write(out)
+    else:
+        sys.stdout.buffer.write(out)
+
+
+if __name__ == '__main__':
+    main()
@@ -33,6 +33,9 @@
 #include <esp_insights_internal.h>
 
 #include "esp_insights_client_data.h"
+#ifdef CONFIG_DIAG_DATA_STORE_RTC
+#include <rtc_store.h>
+#endif
 #include "esp_insights_encoder.h"
 #include "esp_insights_cbor_decoder.h"
 
@@ -41,6 +44,9 @@
 #include <esp_mac.h>
 #endif
 
+/* Trace points compile to nothing unless CONFIG_EVENT_TRACE_ENABLE is set */
+#include <event_trace.h>
+
 #define INSIGHTS_DEBUG_ENABLED      CONFIG_ESP_INSIGHTS_DEBUG_ENABLED
 #define APP_ELF_SHA256_LEN          (CONFIG_APP_RETRIEVE_LEN_ELF_SHA + 1)
 
@@ -51,8 +57,24 @@
 #define CLOUD_REPORTING_PERIOD_MIN_SEC    CONFIG_ESP_INSIGHTS_CLOUD_POST_MIN_INTERVAL_SEC
 #define CLOUD_REPORTING_PERIOD_MAX_SEC    CONFIG_ESP_INSIGHTS_CLOUD_POST_MAX_INTERVAL_SEC
 #define CLOUD_REPORTING_TIMEOUT_TICKS     ((30 * 1000) / portTICK_PERIOD_MS)
+#define DRAIN_BUDGET_BYTES                CONFIG_ESP_INSIGHTS_DRAIN_BUDGET_BYTES
+#define DRAIN_BUDGET_TICKS                pdMS_TO_TICKS(CONFIG_ESP_INSIGHTS_DRAIN_BUDGET_MS)
+#define DATA_SEND_WINDOW                  CONFIG_ESP_INSIGHTS_DATA_SEND_WINDOW
+#define UPLINK_BUDGET_BYTES               CONFIG_ESP_INSIGHTS_UPLINK_BUDGET_BYTES_PER_HOUR
+#define UPLINK_BUDGET_PERIOD_MS           (60 * 60 * 1000)
+#define WEAK_LINK_RSSI                    CONFIG_ESP_INSIGHTS_WEAK_LINK_RSSI
 
 #ifdef CONFIG_DIAG_DATA_STORE_RTC
+/* RTC memory is 8K, ESP-IDF keeps the reset reason hint, sleep state and the bootloader's
+ * retained memory there as well. The linker only reports an overflow of the whole region,
+ * this names the parts which can be configured.
+ */
+#define RTC_MEM_SIZE            (1024 * 8)
+#define RTC_MEM_IDF_RESERVED    512
+_Static_assert(RTC_STORE_RTC_MEM_SIZE + ESP_DIAG_RTC_MEM_SIZE <= RTC_MEM_SIZE - RTC_MEM_IDF_RESERVED,
+               "RTC store, stack metrics and task snapshot do not fit in RTC memory, lower CONFIG_RTC_STORE_DATA_SIZE, "
+               "CONFIG_DIAG_STACK_METRICS_MAX_TASKS or CONFIG_DIAG_TASK_SNAPSHOT_TASKS");
+
 #if CONFIG_RTC_STORE_DATA_SIZE > (1024 * 4)
 #define INSIGHTS_DATA_MAX_SIZE  (CONFIG_RTC_STORE_DATA_SIZE - 1024)
 #else
@@ -63,11 +85,17 @@
 #define INSIGHTS_DATA_MAX_SIZE (1024 * 6)
 #endif
 
-#define INSIGHTS_READ_BUF_SIZE  (1024)  // read this much data from data store in one go
+#define INSIGHTS_READ_BUF_SIZE  (1024)  // encode this much data from data store in one go
 
 #define SEND_INSIGHTS_META (CONFIG_DIAG_ENABLE_METRICS || CONFIG_DIAG_ENABLE_VARIABLES)
 #define KEY_LOG_WR_FAIL    "log_wr_fail"
 
+#define METRICS_TAG_INSIGHTS "insights"
+#define KEY_RPT_INTERVAL     "rpt_interval"
+#define KEY_RPT_REASON       "rpt_reason"
+#define KEY_UPLINK_BUDGET    "uplink_budget"
+#define PATH_INSIGHTS_REPORT "insights.report"
+
 #define DIAG_DATA_STORE_CRC_KEY "rtc_buf_sha"
 #define INSIGHTS_NVS_NAMESPACE "storage"
 
@@ -82,14 +110,39 @@ typedef struct esp_insights_entry {
     void *priv_data;
 } esp_insights_entry_t;
 
+/* Data message in flight, it covers critical data [start, end) of the stream of data sent */
+typedef struct {
+    int msg_id;
+    uint32_t start;
+    uint32_t end;
+    bool acked;
+} insights_data_msg_t;
+
 typedef struct {
     uint8_t *scratch_buf;
-    uint8_t *read_buf;      // buffer to hold data read from RTC buf
-    int data_msg_id;
-    uint32_t data_msg_len;
+    insights_data_msg_t data_msgs[DATA_SEND_WINDOW]; /* data messages in flight, oldest first */
+    uint8_t data_msg_first;
+    uint8_t data_msg_count;
+    uint32_t data_sent_end;     /* end of the critical data sent, data up to it is peeked or released */
+    uint32_t data_released_end; /* end of the critical data released from the data store */
+    bool drain_waiting;         /* the drain waits for an acknowledgement to send the next message */
     SemaphoreHandle_t data_lock;
     char app_sha256[APP_ELF_SHA256_LEN];
     bool data_sent;
+    bool data_more;         /* the data message in flight did not take all the data in the store */
+    bool data_backlog;      /* the last drain stopped on its budget with data left in the store */
+    uint32_t drain_bytes;   /* bytes sent back to back in this reporting period */
+    TickType_t drain_start; /* when the reporting period started sending */
+    uint32_t low_mem_events;    /* data store watermark events since the last reporting decision */
+    uint32_t budget_bytes;      /* uplink bytes left in the budget */
+    TickType_t budget_tick;     /* when the budget was last refilled */
+    esp_insights_sched_stats_t sched;   /* last reporting decision */
+    bool sched_changed;         /* the reporting decision changed since it was last recorded in metrics */
+#if CONFIG_DIAG_ENABLE_METRICS
+    esp_diag_metrics_handle_t h_rpt_interval;
+    esp_diag_metrics_handle_t h_rpt_reason;
+    esp_diag_metrics_handle_t h_uplink_budget;
+#endif /* CONFIG_DIAG_ENABLE_METRICS */
 #if SEND_INSIGHTS_META
     bool meta_msg_pending;
     uint32_t meta_msg_id;
@@ -130,11 +183,46 @@ static bool is_insights_active(void)
     return wifi_connected && s_insights_data.enabled;
 }
 
+/* Adds the bytes earned since the last refill to the uplink budget and returns the bytes left,
+ * called with data_lock held
+ */
+static uint32_t insights_uplink_budget_refill(void)
+{
+    if (UPLINK_BUDGET_BYTES == 0) {
+        return UINT32_MAX;
+    }
+    TickType_t now = xTaskGetTickCount();
+    uint64_t earned = (uint64_t)pdTICKS_TO_MS(now - s_insights_data.budget_tick) * UPLINK_BUDGET_BYTES / UPLINK_BUDGET_PERIOD_MS;
+    /* Keep the last refill time until a whole byte is earned, frequent calls would earn nothing otherwise */
+    if (earned) {
+        s_insights_data.budget_tick = now;
+        earned += s_insights_data.budget_bytes;
+        s_insights_data.budget_bytes = (earned > UPLINK_BUDGET_BYTES) ? UPLINK_BUDGET_BYTES : (uint32_t)earned;
+    }
+    return s_insights_data.budget_bytes;
+}
+
+/* Takes the bytes sent from the uplink budget, called with data_lock held */
+static void insights_uplink_budget_spend(size_t len)
+{
+    if (UPLINK_BUDGET_BYTES == 0) {
+        return;
+    }
+    uint32_t left = insights_uplink_budget_refill();
+    s_insights_data.budget_bytes = (len < left) ? (left - len) : 0;
+}
+
 /* This executes in the context of timer task.
  *
  * There is a dynamic logic to decide the next instance when the insights
- * data will be reported. Depending on whether data was sent or not during
- * the previous timeout, we double or halve the time period.
+ * data will be reported, the first of these that applies decides:
+ * - The uplink byte budget is used up: CLOUD_REPORTING_PERIOD_MAX_SEC until it refills.
+ * - The data store crossed its reporting watermark: CLOUD_REPORTING_PERIOD_MIN_SEC,
+ *   so that it is emptied before it overflows.
+ * - A backlog is left in the data store: the period is halved, or kept if the
+ *   Wi-Fi signal is weak so that reports are not made more often over a poor link.
+ *   Messages keep their size, INSIGHTS_READ_BUF_SIZE bounds the data in each.
+ * - Otherwise the period is doubled, whether data was sent or not.
  * This ensures that data generally gets reported quick enough,
  * but if there's very frequent data being generated, it wont result
  * into too frquent publishes.
@@ -144,29 +232,65 @@ static bool is_insights_active(void)
 static void esp_insights_common_cb(TimerHandle_t handle)
 {
     esp_insights_entry_t *entry = (esp_insights_entry_t *)pvTimerGetTimerID(handle);
+    wifi_ap_record_t ap_info;
+    int8_t rssi = 0;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+        rssi = ap_info.rssi;
+    }
     /* Check if any data was sent during the previous time out */
     xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
     bool l_data_sent = s_insights_data.data_sent;
+    bool l_data_backlog = s_insights_data.data_backlog;
+    uint32_t l_low_mem_events = s_insights_data.low_mem_events;
+    uint32_t l_budget_bytes = insights_uplink_budget_refill();
     s_insights_data.data_sent = false;
+    s_insights_data.low_mem_events = 0;
     xSemaphoreGive(s_insights_data.data_lock);
 
     if (entry) {
         if (is_insights_active() == true) {
             esp_rmaker_work_queue_add_task(entry->work_fn, entry->priv_data);
         }
-        /* If data was sent during previous timer interval, double the period */
-        if (l_data_sent) {
-            entry->cur_seconds <<= 1; /* Double the period */
-            if (entry->cur_seconds > entry->max_seconds) {
-                entry->cur_seconds = entry->max_seconds;
+        uint32_t cur_seconds = entry->cur_seconds;
+        esp_insights_sched_reason_t reason;
+        if (l_budget_bytes == 0) {
+            reason = ESP_INSIGHTS_SCHED_BUDGET;
+            cur_seconds = entry->max_seconds;
+        } else if (l_low_mem_events) {
+            reason = ESP_INSIGHTS_SCHED_STORE_LOW_MEM;
+            cur_seconds = entry->min_seconds;
+        } else if (l_data_backlog) {
+            if (rssi != 0 && rssi < WEAK_LINK_RSSI) {
+                reason = ESP_INSIGHTS_SCHED_WEAK_LINK;
+            } else {
+                reason = ESP_INSIGHTS_SCHED_BACKLOG;
+                cur_seconds >>= 1; /* Halve the period */
             }
         } else {
-            /* If no data was sent during previous timer interval, halve the period */
-            entry->cur_seconds >>= 1; /* Halve the period */
-            if (entry->cur_seconds < entry->min_seconds) {
-                entry->cur_seconds = entry->min_seconds;
-            }
+            reason = l_data_sent ? ESP_INSIGHTS_SCHED_STEADY : ESP_INSIGHTS_SCHED_IDLE;
+            cur_seconds <<= 1; /* Double the period */
         }
+        if (cur_seconds > entry->max_seconds) {
+            cur_seconds = entry->max_seconds;
+        } else if (cur_seconds < entry->min_seconds) {
+            cur_seconds = entry->min_seconds;
+        }
+        entry->cur_seconds = cur_seconds;
+
+        xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+        esp_insights_sched_stats_t *sched = &s_insights_data.sched;
+        if (sched->interval_sec != cur_seconds || sched->reason != reason) {
+            s_insights_data.sched_changed = true;
+        }
+        sched->interval_sec = cur_seconds;
+        sched->reason = reason;
+        sched->rssi = rssi;
+        sched->budget_bytes = l_budget_bytes;
+        sched->low_mem_events += l_low_mem_events;
+        xSemaphoreGive(s_insights_data.data_lock);
+#if INSIGHTS_DEBUG_ENABLED
+        ESP_LOGI(TAG, "Next report in %" PRIu32 " seconds, reason %d, rssi %d", cur_seconds, reason, rssi);
+#endif
         xTimerChangePeriod(handle, (entry->cur_seconds * 1000)/ portTICK_PERIOD_MS, 100);
         xTimerStart(handle, 0);
     }
@@ -233,9 +357,147 @@ static esp_err_t esp_insights_register_periodic_handler(esp_rmaker_work_fn_t wor
     return ret;
 }
 
+static void send_insights_data(void);
+#if CONFIG_DIAG_ENABLE_METRICS
+static void insights_sched_metrics_add(void);
+#endif /* CONFIG_DIAG_ENABLE_METRICS */
+
+/* Returns true if the drain may send another message, called with data_lock held */
+static bool insights_drain_budget_left(void)
+{
+    if (s_insights_data.drain_bytes >= DRAIN_BUDGET_BYTES ||
+            (xTaskGetTickCount() - s_insights_data.drain_start) >= DRAIN_BUDGET_TICKS ||
+            insights_uplink_budget_refill() == 0) {
+        s_insights_data.data_backlog = true;
+        return false;
+    }
+    return true;
+}
+
+/* Decides whether the next message of a backlog is sent right away, called with data_lock held */
+static bool insights_drain_continue(void)
+{
+    bool more = s_insights_data.data_more;
+    s_insights_data.data_more = false;
+    if (!more) {
+        s_insights_data.data_backlog = false;
+        return false;
+    }
+    return insights_drain_budget_left();
+}
+
+static void insights_drain_handler(void *priv_data)
+{
+    if (is_insights_active() == false) {
+        xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+        s_insights_data.data_send_inprogress = false;
+        xSemaphoreGive(s_insights_data.data_lock);
+        return;
+    }
+    send_insights_data();
+}
+
+/* Queues the next message of a backlog, data_send_inprogress stays set until the drain ends */
+static void insights_drain_next(void)
+{
+    if (esp_rmaker_work_queue_add_task(insights_drain_handler, NULL) != ESP_OK) {
+        xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+        s_insights_data.data_send_inprogress = false;
+        xSemaphoreGive(s_insights_data.data_lock);
+    }
+}
+
+/* Variables are only stored when they change. Their records are acknowledged once nothing is
+ * left to send and no message is in flight, a lost message has them written again.
+ * Called with data_lock held.
+ */
+static void insights_variables_upload_done(bool acked)
+{
+#if CONFIG_DIAG_ENABLE_VARIABLES
+    if (!acked) {
+        esp_diag_variables_upload_done(false);
+    } else if (!s_insights_data.data_send_inprogress && !s_insights_data.data_msg_count
+               && !s_insights_data.data_more) {
+        esp_diag_variables_upload_done(true);
+    }
+#endif /* CONFIG_DIAG_ENABLE_VARIABLES */
+}
+
+/* Gives up the peeked data when no data message is in flight, keeps it peeked otherwise.
+ * Called with data_lock held.
+ */
+static void insights_critical_release(size_t len)
+{
+    if (s_insights_data.data_msg_count) {
+        esp_diag_data_store_critical_release_partial(len);
+    } else {
+        esp_diag_data_store_critical_release(len);
+    }
+}
+
+/* Adds a sent data message to the window, called with data_lock held */
+static void insights_window_push(int msg_id, size_t critical_len)
+{
+    uint8_t idx = (s_insights_data.data_msg_first + s_insights_data.data_msg_count) % DATA_SEND_WINDOW;
+    insights_data_msg_t *msg = &s_insights_data.data_msgs[idx];
+    msg->msg_id = msg_id;
+    msg->start = s_insights_data.data_sent_end;
+    msg->end = msg->start + critical_len;
+    msg->acked = (msg_id == 0);
+    s_insights_data.data_sent_end = msg->end;
+    s_insights_data.data_msg_count++;
+}
+
+/* Returns the data message in flight with msg_id, called with data_lock held */
+static insights_data_msg_t *insights_window_find(int msg_id)
+{
+    for (uint8_t i = 0; i < s_insights_data.data_msg_count; i++) {
+        insights_data_msg_t *msg = &s_insights_data.data_msgs[(s_insights_data.data_msg_first + i) % DATA_SEND_WINDOW];
+        if (msg->msg_id == msg_id) {
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+/* Releases the data of the acknowledged messages at the start of the window, in order.
+ * A message acknowledged out of order waits for the ones before it. Called with data_lock held.
+ */
+static void insights_window_release(void)
+{
+    uint32_t end = s_insights_data.data_released_end;
+    bool popped = false;
+    while (s_insights_data.data_msg_count &&
+            s_insights_data.data_msgs[s_insights_data.data_msg_first].acked) {
+        end = s_insights_data.data_msgs[s_insights_data.data_msg_first].end;
+        s_insights_data.data_msg_first = (s_insights_data.data_msg_first + 1) % DATA_SEND_WINDOW;
+        s_insights_data.data_msg_count--;
+        popped = true;
+    }
+    if (popped) {
+        insights_critical_release(end - s_insights_data.data_released_end);
+        s_insights_data.data_released_end = end;
+    }
+    if (s_insights_data.data_msg_count == 0) {
+        xTimerStop(s_insights_data.data_send_timer, portMAX_DELAY);
+    }
+}
+
+/* Gives up the messages in flight, their data is sent again. Called with data_lock held. */
+static void insights_window_reset(void)
+{
+    s_insights_data.data_msg_count = 0;
+    s_insights_data.data_sent_end = s_insights_data.data_released_end;
+    s_insights_data.drain_waiting = false;
+    esp_diag_data_store_critical_release(0);
+    insights_variables_upload_done(false);
+}
+
 static void data_send_timeout_cb(TimerHandle_t handle)
 {
     xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+    /* Give up the peeked data, it is sent again with the next message */
+    insights_window_reset();
     s_insights_data.data_send_inprogress = false;
     if (s_insights_data.boot_msg_id > 0) {
         s_insights_data.boot_msg_id = -1;
@@ -257,14 +519,24 @@ static void insights_event_handler(void* arg, esp_event_base_t event_base,
             ESP_LOGI(TAG, "Data send success, msg_id:%d.", data ? data->msg_id : 0);
 #endif
             if (data && data->msg_id) {
+                bool drain_next = false;
                 xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
-                if (xTimerIsTimerActive(s_insights_data.data_send_timer) == pdTRUE) {
-                    xTimerStop(s_insights_data.data_send_timer, portMAX_DELAY);
-                }
-                if (data->msg_id == s_insights_data.data_msg_id) {
-                    esp_diag_data_store_critical_release(s_insights_data.data_msg_len);
+                insights_data_msg_t *msg = insights_window_find(data->msg_id);
+                if (msg) {
+                    /* Each message releases its own chunk once the ones before it are acknowledged */
+                    msg->acked = true;
+                    insights_window_release();
+                    if (s_insights_data.data_msg_count) {
+                        xTimerReset(s_insights_data.data_send_timer, portMAX_DELAY);
+                    }
                     s_insights_data.data_sent = true;
-                    s_insights_data.data_send_inprogress = false;
+                    /* A drain waiting for a free slot in the window goes on */
+                    if (s_insights_data.drain_waiting) {
+                        s_insights_data.drain_waiting = false;
+                        drain_next = insights_drain_budget_left();
+                        s_insights_data.data_send_inprogress = drain_next;
+                    }
+                    insights_variables_upload_done(true);
 #if SEND_INSIGHTS_META
                 } else if (s_insights_data.meta_msg_pending && data->msg_id == s_insights_data.meta_msg_id) {
                     esp_insights_meta_nvs_crc_set(s_insights_data.meta_crc);
@@ -275,17 +547,25 @@ static void insights_event_handler(void* arg, esp_event_base_t event_base,
 #if CONFIG_ESP_INSIGHTS_COREDUMP_ENABLE
                     esp_core_dump_image_erase();
 #endif // CONFIG_ESP_INSIGHTS_COREDUMP_ENABLE
+#if CONFIG_DIAG_ENABLE_TASK_SNAPSHOT
+                    esp_diag_task_snapshot_clear();
+#endif /* CONFIG_DIAG_ENABLE_TASK_SNAPSHOT */
                     s_insights_data.boot_msg_id = 0;
                 }
                 xSemaphoreGive(s_insights_data.data_lock);
+                if (drain_next) {
+                    insights_drain_next();
+                }
             }
             break;
         case INSIGHTS_EVENT_TRANSPORT_SEND_FAILED:
             xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
-            if (xTimerIsTimerActive(s_insights_data.data_send_timer) == pdTRUE) {
+            /* Data after a lost message cannot be released in order, all of it is sent again */
+            if (data && insights_window_find(data->msg_id)) {
                 xTimerStop(s_insights_data.data_send_timer, portMAX_DELAY);
+                insights_window_reset();
+                s_insights_data.data_send_inprogress = false;
             }
-            s_insights_data.data_send_inprogress = false;
             if (s_insights_data.boot_msg_id > 0 && data->msg_id == s_insights_data.boot_msg_id) {
                 s_insights_data.boot_msg_id = -1;
             }
@@ -334,15 +614,26 @@ static void send_boottime_data(void)
 #if INSIGHTS_DEBUG_ENABLED
     ESP_LOGI(TAG, "Sending boottime data of length: %d", len);
     insights_dbg_dump(s_insights_data.scratch_buf, len);
+#endif
+#if CONFIG_ESP_INSIGHTS_COMPRESSION
+    len = esp_insights_encode_compress(s_insights_data.scratch_buf, INSIGHTS_DATA_MAX_SIZE, len);
 #endif
     int msg_id = esp_insights_transport_data_send(s_insights_data.scratch_buf, len);
     s_insights_data.boot_msg_id = msg_id;
+    if (msg_id >= 0) {
+        xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+        insights_uplink_budget_spend(len);
+        xSemaphoreGive(s_insights_data.data_lock);
+    }
     if (msg_id > 0) {
         return;
     } else if (msg_id == 0) {
 #if CONFIG_ESP_INSIGHTS_COREDUMP_ENABLE
         esp_core_dump_image_erase();
 #endif // CONFIG_ESP_INSIGHTS_COREDUMP_ENABLE
+#if CONFIG_DIAG_ENABLE_TASK_SNAPSHOT
+        esp_diag_task_snapshot_clear();
+#endif /* CONFIG_DIAG_ENABLE_TASK_SNAPSHOT */
     } else {
 #if INSIGHTS_DEBUG_ENABLED
         ESP_LOGI(TAG, "boottime_data message send failed");
@@ -381,8 +672,16 @@ static void send_insights_meta(void)
 #if INSIGHTS_DEBUG_ENABLED
     ESP_LOGI(TAG, "Insights meta data length %d", len);
     insights_dbg_dump(s_insights_data.scratch_buf, len);
+#endif
+#if CONFIG_ESP_INSIGHTS_COMPRESSION
+    len = esp_insights_encode_compress(s_insights_data.scratch_buf, INSIGHTS_DATA_MAX_SIZE, len);
 #endif
     int msg_id = esp_insights_transport_data_send(s_insights_data.scratch_buf, len);
+    if (msg_id >= 0) {
+        xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+        insights_uplink_budget_spend(len);
+        xSemaphoreGive(s_insights_data.data_lock);
+    }
     if (msg_id > 0) {
         xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
         s_insights_data.meta_msg_pending = true;
@@ -407,15 +706,52 @@ static void send_insights_meta(void)
  * In short, there is the possibility of data duplication, so cloud should be able to handle it.
  */
 
+/* Trims the peeked spans to the data encoded in one message */
+static void data_store_spans_limit(esp_diag_data_store_span_t spans[2], size_t max)
+{
+    if (spans[0].len >= max) {
+        spans[0].len = max;
+        spans[1].len = 0;
+    } else if (spans[0].len + spans[1].len > max) {
+        spans[1].len = max - spans[0].len;
+    }
+}
+
+/* Skips the peeked data covered by the messages in flight */
+static void data_store_spans_skip(esp_diag_data_store_span_t spans[2], size_t skip)
+{
+    if (skip >= spans[0].len) {
+        skip -= spans[0].len;
+        spans[0] = spans[1];
+        spans[1].len = 0;
+    }
+    if (skip > spans[0].len) {
+        skip = spans[0].len;
+    }
+    spans[0].data += skip;
+    spans[0].len -= skip;
+}
+
 /* This encodes and sends insights data */
 static void send_insights_data(void)
 {
     uint16_t len = 0;
-    size_t critical_data_size = 0;
-    size_t non_critical_data_size = 0;
+    int critical_data_size = 0;
+    int non_critical_data_size = 0;
     size_t critical_consumed = 0;
     size_t non_critical_consumed = 0;
+    esp_diag_data_store_span_t spans[2];
 
+    xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+    if (s_insights_data.data_msg_count == DATA_SEND_WINDOW) {
+        /* Window is full, an acknowledgement resumes the drain */
+        s_insights_data.drain_waiting = true;
+        xSemaphoreGive(s_insights_data.data_lock);
+        return;
+    }
+    xSemaphoreGive(s_insights_data.data_lock);
+
+    EVENT_TRACE_BEGIN(EVENT_TRACE_ID_INSIGHTS_SEND, 0, 0);
     memset(s_insights_data.scratch_buf, 0, INSIGHTS_DATA_MAX_SIZE);
 
 #if CONFIG_DIAG_ENABLE_VARIABLES
@@ -424,47 +760,104 @@ static void send_insights_data(void)
         prev_log_write_fail_cnt = s_insights_data.log_write_fail_cnt;
         esp_diag_variable_add_uint(KEY_LOG_WR_FAIL, prev_log_write_fail_cnt);
     }
+    /* Variables only keep their last value in RAM, write the changed ones before reading the store */
+    esp_diag_variables_flush(false);
 #endif /* CONFIG_DIAG_ENABLE_VARIABLES */
+#if CONFIG_DIAG_ENABLE_METRICS
+    /* Windows of aggregates which stopped observing values are otherwise only recorded by the timer */
+    esp_diag_metrics_aggregate_flush_expired();
+#endif /* CONFIG_DIAG_ENABLE_METRICS */
+    /* Repeats held back by the log rate limiter */
+    esp_diag_log_flush_repeats();
 
     esp_insights_encode_data_begin(s_insights_data.scratch_buf, INSIGHTS_DATA_MAX_SIZE);
 
-    critical_data_size = esp_diag_data_store_critical_read(s_insights_data.read_buf, INSIGHTS_READ_BUF_SIZE);
+    /* Records are encoded in place, critical ones stay peeked until the message is acknowledged.
+     * The data of the messages in flight is at the start of the peeked data, releases move it
+     * so it is measured under the lock.
+     */
+    xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+    critical_data_size = esp_diag_data_store_critical_peek(spans);
     if (critical_data_size > 0) {
-        critical_consumed = esp_insights_encode_critical_data(s_insights_data.read_buf, critical_data_size);
+        size_t in_flight = s_insights_data.data_sent_end - s_insights_data.data_released_end;
+        data_store_spans_skip(spans, in_flight);
+        critical_data_size = (critical_data_size > (int) in_flight) ? (critical_data_size - (int) in_flight) : 0;
+    }
+    xSemaphoreGive(s_insights_data.data_lock);
+    if (critical_data_size > 0) {
+        data_store_spans_limit(spans, INSIGHTS_READ_BUF_SIZE);
+        critical_consumed = esp_insights_encode_critical_data(spans);
     }
 
-    non_critical_data_size = esp_diag_data_store_non_critical_read(s_insights_data.read_buf, INSIGHTS_READ_BUF_SIZE);
+    non_critical_data_size = esp_diag_data_store_non_critical_peek(spans);
     if (non_critical_data_size > 0) {
-        non_critical_consumed = esp_insights_encode_non_critical_data(s_insights_data.read_buf, non_critical_data_size);
+        data_store_spans_limit(spans, INSIGHTS_READ_BUF_SIZE);
+        non_critical_consumed = esp_insights_encode_non_critical_data(spans);
         esp_diag_data_store_non_critical_release(non_critical_consumed);
     }
     len = esp_insights_encode_data_end(s_insights_data.scratch_buf);
     if (!critical_consumed && !non_critical_consumed) {
         len = 0; // just ignore the encoded data
     }
+    /* Data that did not fit this message is sent by the next one of the drain */
+    bool more = (critical_data_size > (int) critical_consumed) ||
+                (non_critical_data_size > (int) non_critical_consumed);
 
     if (len == 0) {
 #if INSIGHTS_DEBUG_ENABLED
         ESP_LOGI(TAG, "No data to send");
 #endif
+        EVENT_TRACE_END(EVENT_TRACE_ID_INSIGHTS_SEND, 0, 0);
+        xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+        insights_critical_release(0);
+        if (s_insights_data.data_msg_count) {
+            /* Data after the messages in flight may not be visible yet, go on once one is acknowledged */
+            s_insights_data.drain_waiting = true;
+            xSemaphoreGive(s_insights_data.data_lock);
+            return;
+        }
+        s_insights_data.data_backlog = false;
+        xSemaphoreGive(s_insights_data.data_lock);
         goto data_send_end;
     }
 #if INSIGHTS_DEBUG_ENABLED
     ESP_LOGI(TAG, "Sending data of length: %d", len);
     insights_dbg_dump(s_insights_data.scratch_buf, len);
+#endif
+#if CONFIG_ESP_INSIGHTS_COMPRESSION
+    len = esp_insights_encode_compress(s_insights_data.scratch_buf, INSIGHTS_DATA_MAX_SIZE, len);
 #endif
     int msg_id = esp_insights_transport_data_send(s_insights_data.scratch_buf, len);
-    if (msg_id > 0) {
+    EVENT_TRACE_END(EVENT_TRACE_ID_INSIGHTS_SEND, len, msg_id);
+    if (msg_id >= 0) {
+        /* Messages sent without acknowledgement (msg_id 0) are released as soon as the ones before them are */
         xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
-        s_insights_data.data_msg_len = critical_consumed;
-        s_insights_data.data_msg_id = msg_id;
-        xTimerReset(s_insights_data.data_send_timer, portMAX_DELAY);
+        insights_window_push(msg_id, critical_consumed);
+        if (msg_id == 0) {
+            insights_window_release();
+            s_insights_data.data_sent = true;
+        } else {
+            xTimerReset(s_insights_data.data_send_timer, portMAX_DELAY);
+        }
+        s_insights_data.data_more = more;
+        s_insights_data.drain_bytes += len;
+        insights_uplink_budget_spend(len);
+        bool drain_next = insights_drain_continue();
+        if (drain_next && s_insights_data.data_msg_count == DATA_SEND_WINDOW) {
+            s_insights_data.drain_waiting = true;
+            xSemaphoreGive(s_insights_data.data_lock);
+            return;
+        }
         xSemaphoreGive(s_insights_data.data_lock);
-        return;
-    } else if (msg_id == 0) {
-        esp_diag_data_store_critical_release(critical_consumed);
-        s_insights_data.data_sent = true;
+        if (drain_next) {
+            insights_drain_next();
+            return;
+        }
     } else {
+        xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+        insights_critical_release(0);
+        insights_variables_upload_done(false);
+        xSemaphoreGive(s_insights_data.data_lock);
 #if INSIGHTS_DEBUG_ENABLED
         ESP_LOGI(TAG, "insights_data message send failed");
 #endif
@@ -472,11 +865,16 @@ static void send_insights_data(void)
 data_send_end:
     xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
     s_insights_data.data_send_inprogress = false;
+    insights_variables_upload_done(true);
     xSemaphoreGive(s_insights_data.data_lock);
 }
 
 static void insights_periodic_handler(void *priv_data)
 {
+#if CONFIG_DIAG_ENABLE_METRICS
+    /* Recorded even when nothing is sent, the data store keeps it until it is reported */
+    insights_sched_metrics_add();
+#endif /* CONFIG_DIAG_ENABLE_METRICS */
     xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
     /* Return if wifi is disconnected */
     if (is_insights_active() == false) {
@@ -488,7 +886,16 @@ static void insights_periodic_handler(void *priv_data)
         xSemaphoreGive(s_insights_data.data_lock);
         return;
     }
+    /* Nothing is sent until the uplink budget refills, the data waits in the data store */
+    if (insights_uplink_budget_refill() == 0) {
+        xSemaphoreGive(s_insights_data.data_lock);
+        return;
+    }
     s_insights_data.data_send_inprogress = true;
+    /* Start a drain, messages are sent back to back while data is left and the budget allows */
+    s_insights_data.data_more = false;
+    s_insights_data.drain_bytes = 0;
+    s_insights_data.drain_start = xTaskGetTickCount();
     xSemaphoreGive(s_insights_data.data_lock);
 #if SEND_INSIGHTS_META
     if (insights_meta_changed()) {
@@ -501,6 +908,20 @@ static void insights_periodic_handler(void *priv_data)
     send_insights_data();
 }
 
+esp_err_t esp_insights_get_sched_stats(esp_insights_sched_stats_t *stats)
+{
+    if (!stats) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!s_insights_data.enabled) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+    *stats = s_insights_data.sched;
+    xSemaphoreGive(s_insights_data.data_lock);
+    return ESP_OK;
+}
+
 esp_err_t esp_insights_send_data(void)
 {
     if (is_insights_active() == true) {
@@ -525,6 +946,10 @@ static void data_store_event_handler(void* arg, esp_event_base_t event_base,
             ESP_LOGI(TAG, "ESP_DIAG_DATA_STORE_EVENT_%sCRITICAL_DATA_LOW_MEM",
                     event_id == ESP_DIAG_DATA_STORE_EVENT_CRITICAL_DATA_LOW_MEM ? "" : "NON_");
 #endif
+            /* The data store is filling up faster than it is reported, the next period is the shortest */
+            xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+            s_insights_data.low_mem_events++;
+            xSemaphoreGive(s_insights_data.data_lock);
             if (is_insights_active() == true) {
                 esp_rmaker_work_queue_add_task(insights_periodic_handler, NULL);
             }
@@ -560,9 +985,21 @@ static esp_err_t log_write_cb(void *data, size_t len, void *priv_data)
     return ret_val;
 }
 
+#if (CONFIG_DIAG_ENABLE_METRICS || CONFIG_DIAG_ENABLE_VARIABLES)
+/* Compact data points store timestamps relative to an offset, keep it in the
+ * meta header of this boot so that records can be decoded after a reset.
+ */
+static void data_pt_meta_hdr_update(void)
+{
+    rtc_store_meta_header_t *hdr = rtc_store_get_meta_record_current();
+    hdr->ts_offset = esp_diag_timestamp_offset_get();
+}
+#endif /* (CONFIG_DIAG_ENABLE_METRICS || CONFIG_DIAG_ENABLE_VARIABLES) */
+
 #if CONFIG_DIAG_ENABLE_METRICS
 static esp_err_t metrics_write_cb(const char *group, void *data, size_t len, void *cb_arg)
 {
+    data_pt_meta_hdr_update();
     esp_err_t ret_val = esp_diag_data_store_non_critical_write(group, data, len);
 #if INSIGHTS_DEBUG_ENABLED
     if (ret_val != ESP_OK) {
@@ -593,11 +1030,37 @@ static void metrics_init(void)
             ESP_LOGW(TAG, "Failed to initialize wifi metrics");
         }
 #endif /* CONFIG_DIAG_ENABLE_WIFI_METRICS */
+        esp_diag_metrics_register_h(METRICS_TAG_INSIGHTS, KEY_RPT_INTERVAL, "Reporting interval", PATH_INSIGHTS_REPORT,
+                                    ESP_DIAG_DATA_TYPE_UINT, &s_insights_data.h_rpt_interval);
+        esp_diag_metrics_register_h(METRICS_TAG_INSIGHTS, KEY_RPT_REASON, "Reporting interval reason", PATH_INSIGHTS_REPORT,
+                                    ESP_DIAG_DATA_TYPE_UINT, &s_insights_data.h_rpt_reason);
+        if (UPLINK_BUDGET_BYTES) {
+            esp_diag_metrics_register_h(METRICS_TAG_INSIGHTS, KEY_UPLINK_BUDGET, "Uplink budget left", PATH_INSIGHTS_REPORT,
+                                        ESP_DIAG_DATA_TYPE_UINT, &s_insights_data.h_uplink_budget);
+        }
         return;
     }
     ESP_LOGE(TAG, "Failed to initialize metrics.");
 }
 
+/* Records the reporting decision when it changed, runs in the work queue as recording writes to the data store */
+static void insights_sched_metrics_add(void)
+{
+    xSemaphoreTake(s_insights_data.data_lock, portMAX_DELAY);
+    bool changed = s_insights_data.sched_changed;
+    esp_insights_sched_stats_t sched = s_insights_data.sched;
+    s_insights_data.sched_changed = false;
+    xSemaphoreGive(s_insights_data.data_lock);
+    if (!changed) {
+        return;
+    }
+    esp_diag_metrics_add_uint_h(s_insights_data.h_rpt_interval, sched.interval_sec);
+    esp_diag_metrics_add_uint_h(s_insights_data.h_rpt_reason, sched.reason);
+    if (UPLINK_BUDGET_BYTES) {
+        esp_diag_metrics_add_uint_h(s_insights_data.h_uplink_budget, sched.budget_bytes);
+    }
+}
+
 static void metrics_deinit(void)
 {
 #if CONFIG_DIAG_ENABLE_HEAP_METRICS
@@ -613,6 +1076,7 @@ static void metrics_deinit(void)
 #if CONFIG_DIAG_ENABLE_VARIABLES
 static esp_err_t variables_write_cb(const char *group, void *data, size_t len, void *cb_arg)
 {
+    data_pt_meta_hdr_update();
     return esp_diag_data_store_non_critical_write(group, data, len);
 }
 
@@ -659,6 +1123,11 @@ void esp_insights_disable(void)
 #endif
     esp_diag_log_hook_disable(ESP_DIAG_LOG_TYPE_ERROR | ESP_DIAG_LOG_TYPE_WARNING | ESP_DIAG_LOG_TYPE_EVENT);
     esp_diag_data_store_deinit();
+    /* Messages in flight are forgotten, their data is sent again after the next enable */
+    s_insights_data.data_msg_count = 0;
+    s_insights_data.data_sent_end = s_insights_data.data_released_end = 0;
+    s_insights_data.drain_waiting = false;
+    s_insights_data.low_mem_events = 0;
     esp_event_handler_unregister(INSIGHTS_EVENT, ESP_EVENT_ANY_ID, insights_event_handler);
     esp_event_handler_unregister(ESP_DIAG_DATA_STORE_EVENT, ESP_EVENT_ANY_ID, data_store_event_handler);
     if (s_insights_data.data_lock) {
@@ -780,22 +1249,14 @@ esp_err_t esp_insights_enable(esp_insights_config_t *config)
     }
     if (config->alloc_ext_ram) {
         s_insights_data.scratch_buf = MEM_ALLOC_EXTRAM(INSIGHTS_DATA_MAX_SIZE);
-        s_insights_data.read_buf = MEM_ALLOC_EXTRAM(INSIGHTS_READ_BUF_SIZE);
     } else {
         s_insights_data.scratch_buf = malloc(INSIGHTS_DATA_MAX_SIZE);
-        s_insights_data.read_buf = malloc(INSIGHTS_READ_BUF_SIZE);
     }
     if (!s_insights_data.scratch_buf) {
         ESP_LOGE(TAG, "Failed to allocate memory for scratch buffer.");
         err = ESP_ERR_NO_MEM;
         goto enable_err;
     }
-    if (!s_insights_data.read_buf) {
-        ESP_LOGE(TAG, "Failed to allocate memory for read_buf");
-        free(s_insights_data.scratch_buf);
-        err = ESP_ERR_NO_MEM;
-        goto enable_err;
-    }
 
     /* Get sha256 */
     esp_diag_device_info_t device_info;
@@ -853,6 +1314,13 @@ esp_err_t esp_insights_enable(esp_insights_config_t *config)
 #endif /* CONFIG_DIAG_ENABLE_VARIABLES */
 
     s_insights_data.boot_msg_id = -1;
+    /* Start with a full uplink budget and the shortest period, the first decision is taken when it ends */
+    s_insights_data.budget_bytes = UPLINK_BUDGET_BYTES;
+    s_insights_data.budget_tick = xTaskGetTickCount();
+    memset(&s_insights_data.sched, 0, sizeof(s_insights_data.sched));
+    s_insights_data.sched.interval_sec = CLOUD_REPORTING_PERIOD_MIN_SEC;
+    s_insights_data.sched.budget_bytes = UPLINK_BUDGET_BYTES ? UPLINK_BUDGET_BYTES : UINT32_MAX;
+    s_insights_data.sched_changed = true;
     s_insights_data.data_send_timer = xTimerCreate("data_send_timer", CLOUD_REPORTING_TIMEOUT_TICKS,
                                                    pdFALSE, NULL, data_send_timeout_cb);
     if (!s_insights_data.data_send_timer) {
@@ -13,6 +13,7 @@
 // limitations under the License.
 
 #include <stdint.h>
+#include <string.h>
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -164,6 +165,56 @@ void esp_insights_cbor_encode_diag_crash(esp_core_dump_summary_t *summary)
 }
 #endif /* CONFIG_ESP_INSIGHTS_COREDUMP_ENABLE */
 
+#if CONFIG_DIAG_ENABLE_TASK_SNAPSHOT
+/* Encoded straight from the retained snapshot in RTC memory, nothing is copied */
+void esp_insights_cbor_encode_diag_task_snapshot(const esp_diag_task_snapshot_t *snapshot)
+{
+    uint32_t i, j;
+    CborEncoder snap_map, task_list, task_map, bt_list;
+
+    cbor_encode_text_stringz(&s_diag_data_map, "task_snap");
+    cbor_encoder_create_map(&s_diag_data_map, &snap_map, CborIndefiniteLength);
+    cbor_encode_text_stringz(&snap_map, "reason");
+    cbor_encode_uint(&snap_map, snapshot->reason);
+    cbor_encode_text_stringz(&snap_map, "uptime");
+    cbor_encode_uint(&snap_map, snapshot->uptime);
+    cbor_encode_text_stringz(&snap_map, "task_cnt");
+    cbor_encode_uint(&snap_map, snapshot->task_count);
+
+    cbor_encode_text_stringz(&snap_map, "tasks");
+    cbor_encoder_create_array(&snap_map, &task_list, snapshot->count);
+    for (i = 0; i < snapshot->count; i++) {
+        const esp_diag_task_snapshot_entry_t *entry = &snapshot->entries[i];
+        cbor_encoder_create_map(&task_list, &task_map, CborIndefiniteLength);
+        cbor_encode_text_stringz(&task_map, "name");
+        cbor_encode_text_string(&task_map, entry->name, strnlen(entry->name, sizeof(entry->name)));
+        cbor_encode_text_stringz(&task_map, "state");
+        cbor_encode_uint(&task_map, entry->state);
+        cbor_encode_text_stringz(&task_map, "stack");
+        cbor_encode_uint(&task_map, entry->stack_size);
+        cbor_encode_text_stringz(&task_map, "free");
+        cbor_encode_uint(&task_map, entry->free_stack);
+        if (entry->bt_info.depth) {
+            uint32_t depth = entry->bt_info.depth;
+            if (depth > sizeof(entry->bt_info.bt) / sizeof(entry->bt_info.bt[0])) {
+                depth = sizeof(entry->bt_info.bt) / sizeof(entry->bt_info.bt[0]);
+            }
+            cbor_encode_text_stringz(&task_map, "bt");
+            cbor_encoder_create_array(&task_map, &bt_list, depth);
+            for (j = 0; j < depth; j++) {
+                cbor_encode_uint(&bt_list, entry->bt_info.bt[j]);
+            }
+            cbor_encoder_close_container(&task_map, &bt_list);
+            cbor_encode_text_stringz(&task_map, "bt_corrupt");
+            cbor_encode_boolean(&task_map, entry->bt_info.corrupted);
+        }
+        cbor_encoder_close_container(&task_list, &task_map);
+    }
+    cbor_encoder_close_container(&snap_map, &task_list);
+    cbor_encoder_close_container(&s_diag_data_map, &snap_map);
+}
+#endif /* CONFIG_DIAG_ENABLE_TASK_SNAPSHOT */
+
 // use a scratch_pad to memcpy data before access
 // this avoids `potential` unaligned memory accesses as
 // data pointer we receive is not guaranteed to be word aligned
@@ -176,6 +227,62 @@ static union encode_scratch_buf {
     char sha_sum[2 * SHA_SIZE + 1];
 } enc_scratch_buf;
 
+#if (CONFIG_DIAG_ENABLE_METRICS || CONFIG_DIAG_ENABLE_VARIABLES)
+// data point continuing from the first span into the second one is copied here,
+// others are read in place
+static union {
+    uint8_t compact[ESP_DIAG_DATA_PT_COMPACT_MAX_SZ];
+    esp_diag_str_data_pt_t str_data_pt;
+    esp_diag_data_pt_t data_pt;
+} s_stitch_buf;
+#endif
+
+static inline size_t span_size(const esp_diag_data_store_span_t *spans)
+{
+    return spans[0].len + spans[1].len;
+}
+
+static inline uint8_t span_byte(const esp_diag_data_store_span_t *spans, size_t off)
+{
+    return off < spans[0].len ? spans[0].data[off] : spans[1].data[off - spans[0].len];
+}
+
+static void span_copy(const esp_diag_data_store_span_t *spans, size_t off, void *dst, size_t len)
+{
+    uint8_t *out = dst;
+    if (off < spans[0].len) {
+        size_t first = spans[0].len - off;
+        if (first > len) {
+            first = len;
+        }
+        memcpy(out, spans[0].data + off, first);
+        out += first;
+        off += first;
+        len -= first;
+    }
+    if (len) {
+        memcpy(out, spans[1].data + off - spans[0].len, len);
+    }
+}
+
+#if (CONFIG_DIAG_ENABLE_METRICS || CONFIG_DIAG_ENABLE_VARIABLES)
+/* Returns len bytes at off in place, or stitched into s_stitch_buf. NULL if they do not fit in it */
+static const uint8_t *span_get(const esp_diag_data_store_span_t *spans, size_t off, size_t len)
+{
+    if (off + len <= spans[0].len) {
+        return spans[0].data + off;
+    }
+    if (off >= spans[0].len) {
+        return spans[1].data + off - spans[0].len;
+    }
+    if (len > sizeof(s_stitch_buf)) {
+        return NULL;
+    }
+    span_copy(spans, off, &s_stitch_buf, len);
+    return s_stitch_buf.compact;
+}
+#endif
+
 static inline uint8_t to_hex_digit(unsigned val)
 {
     return (val < 10) ? ('0' + val) : ('a' + val - 10);
@@ -403,12 +510,12 @@ static void encode_msg_args(CborEncoder *element, uint8_t *args, uint8_t args_le
 #endif /* CONFIG_DIAG_LOG_MSG_ARG_FORMAT_TLV */
 }
 
-static void encode_log_element(CborEncoder *list, esp_diag_log_data_t *data)
+static void encode_log_element(CborEncoder *list, const esp_diag_data_store_span_t *spans, size_t off)
 {
     CborEncoder element;
     esp_diag_log_data_t *log = &enc_scratch_buf.log_data_pt;
-    // copy at aligned address to avoid potential alignment issue
-    memcpy(log, data, sizeof(esp_diag_log_data_t));
+    // copy at aligned address to avoid potential alignment issue, also joins a record split across spans
+    span_copy(spans, off, log, sizeof(esp_diag_log_data_t));
 
     cbor_encoder_create_map(list, &element, CborIndefiniteLength);
     cbor_encode_text_stringz(&element, "ts");
@@ -420,7 +527,18 @@ static void encode_log_element(CborEncoder *list, esp_diag_log_data_t *data)
     cbor_encode_text_stringz(&element, "ro");
     cbor_encode_uint(&element, (uint32_t)log->msg_ptr);
     cbor_encode_text_stringz(&element, "av");
-    encode_msg_args(&element, log->msg_args, log->msg_args_len);
+    if (log->type & ESP_DIAG_LOG_TYPE_REPEAT_FLAG) {
+        /* Summary of logs held back by rate limiting, their arguments are not known */
+        esp_diag_log_repeat_t repeat;
+        memcpy(&repeat, log->msg_args, sizeof(repeat));
+        encode_msg_args(&element, (uint8_t *)"", 0);
+        cbor_encode_text_stringz(&element, "rep");
+        cbor_encode_uint(&element, repeat.count);
+        cbor_encode_text_stringz(&element, "ts0");
+        cbor_encode_uint(&element, repeat.first_timestamp);
+    } else {
+        encode_msg_args(&element, log->msg_args, log->msg_args_len);
+    }
     if (strlen(log->task_name) > 0) {
         cbor_encode_text_stringz(&element, "task");
         cbor_encode_text_stringz(&element, log->task_name);
@@ -429,27 +547,26 @@ static void encode_log_element(CborEncoder *list, esp_diag_log_data_t *data)
 }
 
 static size_t encode_log_list(CborEncoder *map, esp_diag_log_type_t type,
-                              const char *key, const uint8_t *data, size_t size)
+                              const char *key, const esp_diag_data_store_span_t *spans)
 {
     int i = 0, len = 0;
     CborEncoder list;
-    esp_diag_log_data_t *log = NULL;
+    size_t size = span_size(spans);
     cbor_encode_text_stringz(map, key);
     cbor_encoder_create_array(map, &list, CborIndefiniteLength);
-    uint8_t meta_idx = data[0];
+    uint8_t meta_idx = span_byte(spans, 0);
     while (size > sizeof (esp_diag_log_data_t)) {
-        if (data[i] != meta_idx) {
+        if (span_byte(spans, i) != meta_idx) {
 #if INSIGHTS_DEBUG_ENABLED
             printf("%s: skip data for next iteration meta: %d, data[i]: %d, itr: %d\n",
-                    "insights_cbor_enocoder", meta_idx, data[i], i);
+                    "insights_cbor_enocoder", meta_idx, span_byte(spans, i), i);
 #endif
             break; // do not encode for next meta info
         }
         i += 1; // skip meta byte
         size -= 1;
-        if (data[i] == type) {
-            log = (esp_diag_log_data_t *)&data[i];
-            encode_log_element(&list, log);
+        if ((span_byte(spans, i) & ~ESP_DIAG_LOG_TYPE_REPEAT_FLAG) == type) {
+            encode_log_element(&list, spans, i);
         }
         len = sizeof(esp_diag_log_data_t);
         i += len;
@@ -462,18 +579,18 @@ static size_t encode_log_list(CborEncoder *map, esp_diag_log_type_t type,
 /* The TinyCBOR library does not support DOM (Document Object Model)-like API.
  * So, we need to traverse through the entire data to encode every type of log.
  */
-size_t esp_insights_cbor_encode_diag_logs(const uint8_t *data, size_t size)
+size_t esp_insights_cbor_encode_diag_logs(const esp_diag_data_store_span_t *spans)
 {
     CborEncoder log_map;
     cbor_encode_text_stringz(&s_diag_data_map, "traces");
     cbor_encoder_create_map(&s_diag_data_map, &log_map, CborIndefiniteLength);
     size_t consumed = 0, consumed_max = 0;
-    consumed_max = encode_log_list(&log_map, ESP_DIAG_LOG_TYPE_ERROR, "errors", data, size);
-    consumed = encode_log_list(&log_map, ESP_DIAG_LOG_TYPE_WARNING, "warnings", data, size);
+    consumed_max = encode_log_list(&log_map, ESP_DIAG_LOG_TYPE_ERROR, "errors", spans);
+    consumed = encode_log_list(&log_map, ESP_DIAG_LOG_TYPE_WARNING, "warnings", spans);
     if (consumed > consumed_max) {
         consumed_max = consumed;
     }
-    consumed = encode_log_list(&log_map, ESP_DIAG_LOG_TYPE_EVENT, "events", data, size);
+    consumed = encode_log_list(&log_map, ESP_DIAG_LOG_TYPE_EVENT, "events", spans);
     if (consumed > consumed_max) {
         consumed_max = consumed;
     }
@@ -483,15 +600,12 @@ size_t esp_insights_cbor_encode_diag_logs(const uint8_t *data, size_t size)
 
 #if (CONFIG_DIAG_ENABLE_METRICS || CONFIG_DIAG_ENABLE_VARIABLES)
 // {"n":<key>, "v": <value>, "t": <ts> }
-static void encode_str_data_pt(CborEncoder *array, const uint8_t *data)
+static void encode_str_data_pt_map(CborEncoder *array, const char *key, const esp_diag_str_data_pt_t *m_data)
 {
     CborEncoder map;
     cbor_encoder_create_map(array, &map, CborIndefiniteLength);
-    esp_diag_str_data_pt_t *m_data = &enc_scratch_buf.str_data_pt;
-    // copy at aligned address to avoid potential alignment issue
-    memcpy(m_data, data, sizeof(esp_diag_str_data_pt_t));
     cbor_encode_text_stringz(&map, "n");
-    cbor_encode_text_stringz(&map, m_data->key);
+    cbor_encode_text_stringz(&map, key);
     cbor_encode_text_stringz(&map, "v");
     cbor_encode_text_stringz(&map, m_data->value.str);
     cbor_encode_text_stringz(&map, "t");
@@ -500,16 +614,13 @@ static void encode_str_data_pt(CborEncoder *array, const uint8_t *data)
     cbor_encoder_close_container(array, &map);
 }
 
-static void encode_data_pt(CborEncoder *array, const uint8_t *data)
+static void encode_data_pt_map(CborEncoder *array, const char *key, const esp_diag_data_pt_t *m_data)
 {
     CborEncoder map;
     cbor_encoder_create_map(array, &map, CborIndefiniteLength);
-    esp_diag_data_pt_t *m_data = &enc_scratch_buf.data_pt;
-    // copy at aligned address to avoid potential alignment issue
-    memcpy(m_data, data, sizeof(esp_diag_data_pt_t));
 
     cbor_encode_text_stringz(&map, "n");
-    cbor_encode_text_stringz(&map, m_data->key);
+    cbor_encode_text_stringz(&map, key);
     cbor_encode_text_stringz(&map, "v");
     switch (m_data->data_type) {
         case ESP_DIAG_DATA_TYPE_BOOL:
@@ -543,36 +654,117 @@ static void encode_data_pt(CborEncoder *array, const uint8_t *data)
     cbor_encoder_close_container(array, &map);
 }
 
-static size_t encode_data_points(const uint8_t *data, size_t size, const char *key, uint16_t type)
+static const char *compact_key_get(uint16_t type, uint16_t key_id)
+{
+#if CONFIG_DIAG_ENABLE_METRICS
+    if (type == ESP_DIAG_DATA_PT_METRICS) {
+        return esp_diag_metrics_key_get_by_id(key_id);
+    }
+#endif /* CONFIG_DIAG_ENABLE_METRICS */
+#if CONFIG_DIAG_ENABLE_VARIABLES
+    if (type == ESP_DIAG_DATA_PT_VARIABLE) {
+        return esp_diag_variable_key_get(key_id);
+    }
+#endif /* CONFIG_DIAG_ENABLE_VARIABLES */
+    return NULL;
+}
+
+// {"n":<key>, "v": {"window":<ms>, "count":<n>, "min":<min>, "max":<max>, "sum":<sum>, "buckets":[...]}, "t": <ts> }
+static void encode_agg_data_pt_map(CborEncoder *array, const char *key,
+                                   const esp_diag_compact_data_pt_t *c_data, uint64_t ts)
+{
+    uint8_t i;
+    CborEncoder map, value_map, buckets;
+    cbor_encoder_create_map(array, &map, CborIndefiniteLength);
+    cbor_encode_text_stringz(&map, "n");
+    cbor_encode_text_stringz(&map, key);
+    cbor_encode_text_stringz(&map, "v");
+    cbor_encoder_create_map(&map, &value_map, CborIndefiniteLength);
+    cbor_encode_text_stringz(&value_map, "window");
+    cbor_encode_uint(&value_map, c_data->value.agg.window_ms);
+    cbor_encode_text_stringz(&value_map, "count");
+    cbor_encode_uint(&value_map, c_data->value.agg.count);
+    cbor_encode_text_stringz(&value_map, "min");
+    cbor_encode_int(&value_map, c_data->value.agg.min);
+    cbor_encode_text_stringz(&value_map, "max");
+    cbor_encode_int(&value_map, c_data->value.agg.max);
+    cbor_encode_text_stringz(&value_map, "sum");
+    cbor_encode_int(&value_map, c_data->value.agg.sum);
+    if (c_data->data_type == ESP_DIAG_DATA_TYPE_HISTOGRAM) {
+        cbor_encode_text_stringz(&value_map, "buckets");
+        cbor_encoder_create_array(&value_map, &buckets, c_data->value.agg.bucket_count);
+        for (i = 0; i < c_data->value.agg.bucket_count; i++) {
+            cbor_encode_uint(&buckets, c_data->value.agg.buckets[i]);
+        }
+        cbor_encoder_close_container(&value_map, &buckets);
+    }
+    cbor_encoder_close_container(&map, &value_map);
+    cbor_encode_text_stringz(&map, "t");
+    cbor_encode_uint(&map, ts);
+
+    cbor_encoder_close_container(array, &map);
+}
+
+static void encode_compact_data_pt(CborEncoder *array, const esp_diag_compact_data_pt_t *c_data,
+                                   const rtc_store_meta_header_t *hdr)
+{
+    const char *key = compact_key_get(c_data->type, c_data->key_id);
+    if (!key) {
+        return; // unregistered since the data point was recorded
+    }
+    uint64_t ts = hdr->ts_offset + c_data->ts_rel;
+    if (c_data->data_type == ESP_DIAG_DATA_TYPE_SUMMARY || c_data->data_type == ESP_DIAG_DATA_TYPE_HISTOGRAM) {
+        encode_agg_data_pt_map(array, key, c_data, ts);
+    } else if (c_data->data_type == ESP_DIAG_DATA_TYPE_STR) {
+        esp_diag_str_data_pt_t *m_data = &enc_scratch_buf.str_data_pt;
+        m_data->data_type = c_data->data_type;
+        m_data->ts = ts;
+        memcpy(m_data->value.str, c_data->value.str, sizeof(m_data->value.str));
+        encode_str_data_pt_map(array, key, m_data);
+    } else {
+        esp_diag_data_pt_t *m_data = &enc_scratch_buf.data_pt;
+        m_data->data_type = c_data->data_type;
+        m_data->ts = ts;
+        memcpy(&m_data->value, &c_data->value, sizeof(m_data->value));
+        encode_data_pt_map(array, key, m_data);
+    }
+}
+
+static size_t encode_data_points(const esp_diag_data_store_span_t *spans, const char *key, uint16_t type)
 {
     assert(key);
     size_t i = 0;
+    size_t size = span_size(spans);
     CborEncoder array;
     /* FIXME */
     rtc_store_non_critical_data_hdr_t header;
-    esp_diag_data_type_t data_type;
 
-    if (!data || (size <= sizeof(header))) {
-        printf("%s: Invalid arg! data %p, size %d. line %d\n",
-                "insights_cbor_enocoder", data, size, __LINE__);
+    if (!spans || (size <= sizeof(header))) {
+        printf("%s: Invalid arg! spans %p, size %d. line %d\n",
+                "insights_cbor_enocoder", spans, size, __LINE__);
         return 0;
     }
     cbor_encode_text_stringz(&s_diag_data_map, key);
     cbor_encoder_create_array(&s_diag_data_map, &array, CborIndefiniteLength);
 
-    uint8_t meta_idx = data[0];
+    uint8_t meta_idx = span_byte(spans, 0);
+    /* Key ids are derived from the keys, those recorded in an earlier boot resolve
+     * against the current registrations regardless of the order they were made in.
+     */
+    const rtc_store_meta_header_t *hdr = rtc_store_get_meta_record_by_index(meta_idx);
+    esp_diag_compact_data_pt_t c_data;
     while (size > sizeof(header)) { // if remaining
-        if (data[i] != meta_idx) {
+        if (span_byte(spans, i) != meta_idx) {
 #if INSIGHTS_DEBUG_ENABLED
             printf("%s: skip data for next iteration meta: %d, data[i]: %d, itr: %d\n",
-                    "insights_cbor_enocoder", meta_idx, data[i], i);
+                    "insights_cbor_enocoder", meta_idx, span_byte(spans, i), i);
 #endif
             break; // do not encode for next meta info
         }
         i += 1; // skip meta_idx byte
         size -= 1;
 
-        memcpy(&header, data + i, sizeof(header));
+        span_copy(spans, i, &header, sizeof(header));
         if (sizeof(header) + header.len > size) {
 #if INSIGHTS_DEBUG_ENABLED
             // partial record
@@ -590,21 +782,17 @@ static size_t encode_data_points(const uint8_t *data, size_t size, const char *k
             printf("%s: invalid record, header.dg %p, ptr_in_drom %d, header.len %d\n",
                    "insights_cbor_enocoder", header.dg, esp_ptr_in_drom(header.dg), header.len);
 
-            ESP_LOG_BUFFER_HEX_LEVEL("cbor_enc", data, size, ESP_LOG_INFO);
+            ESP_LOG_BUFFER_HEX_LEVEL("cbor_enc", spans[0].data, spans[0].len, ESP_LOG_INFO);
 #endif
             i -= 1;
             size += 1;
             break;
         }
-        uint32_t type_int;
-        memcpy(&type_int, &data[i + sizeof(header)], 4); // copy, (b'cos alignment!)
-        if ((type_int & 0xffff) == type) {
-            data_type = (type_int >> 16) & 0xffff;
-            if (data_type == ESP_DIAG_DATA_TYPE_STR && header.len == sizeof(esp_diag_str_data_pt_t)) {
-                encode_str_data_pt(&array, data + i + sizeof(header));
-            } else if (header.len == sizeof(esp_diag_data_pt_t)) {
-                encode_data_pt(&array, data + i + sizeof(header));
-            }
+        const uint8_t *record = span_get(spans, i + sizeof(header), header.len);
+        // records longer than any data point are skipped
+        if (record && hdr && esp_diag_compact_data_pt_unpack(record, header.len, &c_data) == ESP_OK
+                && c_data.type == type) {
+            encode_compact_data_pt(&array, &c_data, hdr);
         }
         size -= (sizeof(header) + header.len);
         i += (sizeof(header) + header.len);
@@ -615,16 +803,16 @@ static size_t encode_data_points(const uint8_t *data, size_t size, const char *k
 #endif /* (CONFIG_DIAG_ENABLE_METRICS || CONFIG_DIAG_ENABLE_VARIABLES) */
 
 #if CONFIG_DIAG_ENABLE_METRICS
-size_t esp_insights_cbor_encode_diag_metrics(const uint8_t *data, size_t size)
+size_t esp_insights_cbor_encode_diag_metrics(const esp_diag_data_store_span_t *spans)
 {
-    return encode_data_points(data, size, "metrics", ESP_DIAG_DATA_PT_METRICS);
+    return encode_data_points(spans, "metrics", ESP_DIAG_DATA_PT_METRICS);
 }
 #endif /* CONFIG_DIAG_ENABLE_METRICS */
 
 #if CONFIG_DIAG_ENABLE_VARIABLES
-size_t  esp_insights_cbor_encode_diag_variables(const uint8_t *data, size_t size)
+size_t  esp_insights_cbor_encode_diag_variables(const esp_diag_data_store_span_t *spans)
 {
-    return encode_data_points(data, size, "params", ESP_DIAG_DATA_PT_VARIABLE);
+    return encode_data_points(spans, "params", ESP_DIAG_DATA_PT_VARIABLE);
 }
 #endif /* CONFIG_DIAG_ENABLE_VARIABLES */
 
@@ -668,7 +856,8 @@ void esp_insights_cbor_encode_meta_data_end(void)
 #if CONFIG_DIAG_ENABLE_METRICS
 static void encode_metrics_meta_element(CborEncoder *map, const esp_diag_metrics_meta_t *metrics)
 {
-    CborEncoder id_map;
+    uint8_t i;
+    CborEncoder id_map, bounds;
     cbor_encode_text_stringz(map, metrics->key);
     cbor_encoder_create_map(map, &id_map, CborIndefiniteLength);
     cbor_encode_text_stringz(&id_map, "label");
@@ -677,6 +866,14 @@ static void encode_metrics_meta_element(CborEncoder *map, const esp_diag_metrics
     cbor_encode_text_stringz(&id_map, metrics->path);
     cbor_encode_text_stringz(&id_map, "data_type");
     cbor_encode_uint(&id_map, metrics->type);
+    if (metrics->bounds) {
+        cbor_encode_text_stringz(&id_map, "bounds");
+        cbor_encoder_create_array(&id_map, &bounds, metrics->bounds_count);
+        for (i = 0; i < metrics->bounds_count; i++) {
+            cbor_encode_int(&bounds, metrics->bounds[i]);
+        }
+        cbor_encoder_close_container(&id_map, &bounds);
+    }
     cbor_encoder_close_container(map, &id_map);
 }
 
@@ -690,6 +887,9 @@ void esp_insights_cbor_encode_meta_metrics(const esp_diag_metrics_meta_t *metric
     cbor_encode_text_stringz(&s_diag_meta_data_map, "metrics");
     cbor_encoder_create_map(&s_diag_meta_data_map, &map, CborIndefiniteLength);
     for (i = 0; i < metrics_len; i++) {
+        if (!metrics[i].key) {
+            continue;
+        }
         encode_metrics_meta_element(&map, (metrics + i));
     }
     cbor_encoder_close_container(&s_diag_meta_data_map, &map);
@@ -721,6 +921,9 @@ void esp_insights_cbor_encode_meta_variables(const esp_diag_variable_meta_t *var
     cbor_encode_text_stringz(&s_diag_meta_data_map, "params");
     cbor_encoder_create_map(&s_diag_meta_data_map, &map, CborIndefiniteLength);
     for (j = 0; j < variables_len; j++) {
+        if (!variables[j].key) {
+            continue;
+        }
         encode_variable_meta_element(&map, (variables + j));
     }
     cbor_encoder_close_container(&s_diag_meta_data_map, &map);
@@ -37,9 +37,13 @@ void esp_insights_cbor_encode_meta_nc_hdr(const rtc_store_meta_header_t *hdr);
 #if CONFIG_ESP_INSIGHTS_COREDUMP_ENABLE
 void esp_insights_cbor_encode_diag_crash(esp_core_dump_summary_t *summary);
 #endif /* CONFIG_ESP_INSIGHTS_COREDUMP_ENABLE */
-size_t esp_insights_cbor_encode_diag_logs(const uint8_t *data, size_t size);
-size_t esp_insights_cbor_encode_diag_metrics(const uint8_t *data, size_t size);
-size_t esp_insights_cbor_encode_diag_variables(const uint8_t *data, size_t size);
+#if CONFIG_DIAG_ENABLE_TASK_SNAPSHOT
+void esp_insights_cbor_encode_diag_task_snapshot(const esp_diag_task_snapshot_t *snapshot);
+#endif /* CONFIG_DIAG_ENABLE_TASK_SNAPSHOT */
+/* Below encode data store records in place, spans are as returned by the data store peek APIs */
+size_t esp_insights_cbor_encode_diag_logs(const esp_diag_data_store_span_t *spans);
+size_t esp_insights_cbor_encode_diag_metrics(const esp_diag_data_store_span_t *spans);
+size_t esp_insights_cbor_encode_diag_variables(const esp_diag_data_store_span_t *spans);
 void esp_insights_cbor_encode_diag_data_end(void);
 size_t esp_insights_cbor_encode_diag_end(void *data);
 
@@ -0,0 +1,97 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdbool.h>
+#include "esp_insights_compress.h"
+
+#define MAX_MATCH       (1 << ESP_INSIGHTS_COMPRESS_LENGTH_BITS)
+/* A back reference takes 13 bits and a literal 9, two bytes are worth a reference */
+#define MIN_MATCH       2
+
+typedef struct {
+    uint8_t *out;       // NULL when only the length is computed
+    size_t out_size;
+    size_t pos;
+    uint8_t byte;       // bits not written yet
+    uint8_t bits;
+    bool overflow;
+} bit_writer_t;
+
+static void put_bits(bit_writer_t *w, uint32_t value, uint8_t count)
+{
+    while (count--) {
+        w->byte = (w->byte << 1) | ((value >> count) & 1);
+        if (++w->bits == 8) {
+            if (w->out) {
+                if (w->pos < w->out_size) {
+                    w->out[w->pos] = w->byte;
+                } else {
+                    w->overflow = true;
+                }
+            }
+            w->pos++;
+            w->byte = 0;
+            w->bits = 0;
+        }
+    }
+}
+
+/* Longest match for the data at cur in the window before it, returns its length and offset */
+static size_t find_match(const uint8_t *in, size_t in_len, size_t cur, size_t *offset)
+{
+    size_t max_len = in_len - cur;
+    size_t start = (cur > ESP_INSIGHTS_COMPRESS_WINDOW_SIZE) ? (cur - ESP_INSIGHTS_COMPRESS_WINDOW_SIZE) : 0;
+    size_t best_len = 0;
+    if (max_len > MAX_MATCH) {
+        max_len = MAX_MATCH;
+    }
+    /* Nearest candidates first, matches may run into the data being matched */
+    for (size_t cand = cur; cand > start && best_len < max_len; ) {
+        cand--;
+        if (in[cand] != in[cur] || in[cand + best_len] != in[cur + best_len]) {
+            continue;
+        }
+        size_t len = 1;
+        while (len < max_len && in[cand + len] == in[cur + len]) {
+            len++;
+        }
+        if (len > best_len) {
+            best_len = len;
+            *offset = cur - cand;
+        }
+    }
+    return best_len;
+}
+
+size_t esp_insights_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size)
+{
+    bit_writer_t w = {
+        .out = out,
+        .out_size = out_size,
+    };
+    size_t cur = 0;
+    if (!in) {
+        return 0;
+    }
+    while (cur < in_len) {
+        size_t offset = 0;
+        size_t len = find_match(in, in_len, cur, &offset);
+        if (len >= MIN_MATCH) {
+            put_bits(&w, 0, 1);
+            put_bits(&w, offset - 1, ESP_INSIGHTS_COMPRESS_WINDOW_BITS);
+            put_bits(&w, len - 1, ESP_INSIGHTS_COMPRESS_LENGTH_BITS);
+            cur += len;
+        } else {
+            put_bits(&w, 1, 1);
+            put_bits(&w, in[cur], 8);
+            cur++;
+        }
+    }
+    if (w.bits) {
+        put_bits(&w, 0, 8 - w.bits);
+    }
+    return w.overflow ? 0 : w.pos;
+}
@@ -0,0 +1,50 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+/**
+ * @file esp_insights_compress.h
+ * @brief LZSS compression of insights messages
+ *
+ * The stream is the heatshrink format with a 256 byte window and 16 byte matches: bits are written
+ * MSB first, a 1 bit is followed by an 8 bit literal, a 0 bit by an 8 bit back reference offset - 1
+ * and a 4 bit match length - 1. The last byte is padded with 0 bits.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ESP_INSIGHTS_COMPRESS_WINDOW_BITS   8
+#define ESP_INSIGHTS_COMPRESS_LENGTH_BITS   4
+#define ESP_INSIGHTS_COMPRESS_WINDOW_SIZE   (1 << ESP_INSIGHTS_COMPRESS_WINDOW_BITS)
+
+/**
+ * @brief Space needed in front of the input to compress it in place
+ *
+ * Output written ahead of the input never reaches the input still needed as long as
+ * it starts this many bytes before it.
+ *
+ * @param in_len length of the input
+ * @return size_t bytes between the start of the output and the start of the input
+ */
+static inline size_t esp_insights_compress_slack(size_t in_len)
+{
+    return in_len / 8 + ESP_INSIGHTS_COMPRESS_WINDOW_SIZE + 2;
+}
+
+/**
+ * @brief Compresses data
+ *
+ * Output may overlap the input if it starts at least \ref esp_insights_compress_slack bytes before it.
+ *
+ * @param in        data to compress
+ * @param in_len    length of the data
+ * @param out       buffer for the compressed data, NULL to only compute its length
+ * @param out_size  size of the output buffer
+ * @return size_t length of the compressed data, 0 if it does not fit the output buffer
+ */
+size_t esp_insights_compress(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_size);
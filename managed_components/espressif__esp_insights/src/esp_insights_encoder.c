@@ -17,6 +17,7 @@
 #include <esp_diagnostics_variables.h>
 
 #include "esp_insights_cbor_encoder.h"
+#include "esp_insights_compress.h"
 
 #define INSIGHTS_VERSION_MAJOR           "1"
 #define INSIGHTS_VERSION_MINOR           "0"
@@ -31,6 +32,11 @@
 #define INSIGHTS_DATA_TYPE          0x02
 #define INSIGHTS_META_DATA_TYPE     0x03
 #define TLV_OFFSET                  3
+/* Set in the data type of a compressed message, its payload is the uncompressed length
+ * (2 bytes) followed by the compressed data
+ */
+#define INSIGHTS_CONTENT_ENCODING_LZSS  0x80
+#define COMPRESSED_OFFSET           (TLV_OFFSET + sizeof(uint16_t))
 
 static void esp_insights_encode_meta_data(void)
 {
@@ -108,15 +114,23 @@ void esp_insights_encode_boottime_data(void)
         ESP_LOGE(TAG, "Core dump stored in flash is corrupted");
     }
 #endif /* CONFIG_ESP_INSIGHTS_COREDUMP_ENABLE */
+
+    /* encode task snapshot retained from the previous boot */
+#if CONFIG_DIAG_ENABLE_TASK_SNAPSHOT
+    const esp_diag_task_snapshot_t *snapshot = esp_diag_task_snapshot_last();
+    if (snapshot) {
+        esp_insights_cbor_encode_diag_task_snapshot(snapshot);
+    }
+#endif /* CONFIG_DIAG_ENABLE_TASK_SNAPSHOT */
 }
 
-size_t esp_insights_encode_critical_data(const void *data, size_t data_size)
+size_t esp_insights_encode_critical_data(const esp_diag_data_store_span_t *spans)
 {
     size_t consumed = 0;
-    if (data) {
-        consumed = esp_insights_cbor_encode_diag_logs(data, data_size);
+    if (spans && spans[0].len) {
+        consumed = esp_insights_cbor_encode_diag_logs(spans);
         if (consumed) {
-            uint8_t meta_idx = ((uint8_t *) data)[0];
+            uint8_t meta_idx = spans[0].data[0];
             const rtc_store_meta_header_t *hdr = rtc_store_get_meta_record_by_index(meta_idx);
             if (hdr) {
                 esp_insights_cbor_encode_meta_c_hdr(hdr);
@@ -126,22 +140,22 @@ size_t esp_insights_encode_critical_data(const void *data, size_t data_size)
     return consumed;
 }
 
-size_t esp_insights_encode_non_critical_data(const void *data, size_t data_size)
+size_t esp_insights_encode_non_critical_data(const esp_diag_data_store_span_t *spans)
 {
     size_t consumed_max = 0;
-    if (data) {
+    if (spans && spans[0].len) {
 #if CONFIG_DIAG_ENABLE_METRICS
-        consumed_max = esp_insights_cbor_encode_diag_metrics(data, data_size);
+        consumed_max = esp_insights_cbor_encode_diag_metrics(spans);
 #endif /* CONFIG_DIAG_ENABLE_METRICS */
 #if CONFIG_DIAG_ENABLE_VARIABLES
-        size_t consumed = esp_insights_cbor_encode_diag_variables(data, data_size);
+        size_t consumed = esp_insights_cbor_encode_diag_variables(spans);
         if (consumed > consumed_max) {
             consumed_max = consumed;
         }
 #endif /* CONFIG_DIAG_ENABLE_VARIABLES */
 #if CONFIG_DIAG_ENABLE_METRICS || CONFIG_DIAG_ENABLE_VARIABLES
         if (consumed_max) {
-            uint8_t meta_idx = ((uint8_t *) data)[0];
+            uint8_t meta_idx = spans[0].data[0];
             const rtc_store_meta_header_t *hdr = rtc_store_get_meta_record_by_index(meta_idx);
             if (hdr) {
                 esp_insights_cbor_encode_meta_nc_hdr(hdr);
@@ -165,3 +179,27 @@ size_t esp_insights_encode_data_end(uint8_t *out_data)
     len += TLV_OFFSET;
     return len;
 }
+
+size_t esp_insights_encode_compress(uint8_t *out_data, size_t out_data_size, size_t len)
+{
+    if (!out_data || len <= TLV_OFFSET || (out_data[0] & INSIGHTS_CONTENT_ENCODING_LZSS)) {
+        return len;
+    }
+    uint16_t payload_len = len - TLV_OFFSET;
+    size_t compressed_len = esp_insights_compress(out_data + TLV_OFFSET, payload_len, NULL, 0);
+    /* Keep the message as is unless it shrinks and the buffer has room to compress it in place */
+    if (compressed_len + sizeof(uint16_t) >= payload_len ||
+            COMPRESSED_OFFSET + esp_insights_compress_slack(payload_len) + payload_len > out_data_size) {
+        return len;
+    }
+    uint8_t *in = out_data + out_data_size - payload_len;
+    memmove(in, out_data + TLV_OFFSET, payload_len);
+    compressed_len = esp_insights_compress(in, payload_len, out_data + COMPRESSED_OFFSET,
+                                           out_data_size - COMPRESSED_OFFSET);
+
+    uint16_t encoded_len = compressed_len + sizeof(uint16_t);
+    out_data[0] |= INSIGHTS_CONTENT_ENCODING_LZSS;    /* Content encoding flag in the data type - 1 byte */
+    memcpy(&out_data[1], &encoded_len, sizeof(encoded_len));    /* Data length - 2 bytes */
+    memcpy(&out_data[TLV_OFFSET], &payload_len, sizeof(payload_len));   /* Uncompressed length - 2 bytes */
+    return COMPRESSED_OFFSET + compressed_len;
+}
@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #pragma once
+#include <esp_diag_data_store.h>
 #if CONFIG_ESP_INSIGHTS_COREDUMP_ENABLE
 #include <esp_core_dump.h>
 #endif
@@ -22,22 +23,20 @@ esp_err_t esp_insights_encode_data_begin(uint8_t *out_data, size_t out_data_size
 void esp_insights_encode_boottime_data(void);
 
 /**
- * @brief encode critical data
+ * @brief encode critical data in place
  *
- * @param critical_data pointer to critical data
- * @param critical_data_size size of critical data
+ * @param spans critical data as returned by esp_diag_data_store_critical_peek()
  * @return size_t length of data consumed
  */
-size_t esp_insights_encode_critical_data(const void *critical_data, size_t critical_data_size);
+size_t esp_insights_encode_critical_data(const esp_diag_data_store_span_t *spans);
 
 /**
- * @brief encode non_critical data
+ * @brief encode non_critical data in place
  *
- * @param critical_data pointer to non_critical data
- * @param critical_data_size size of non_critical data
+ * @param spans non_critical data as returned by esp_diag_data_store_non_critical_peek()
  * @return size_t length of data consumed
  */
-size_t esp_insights_encode_non_critical_data(const void *non_critical_data, size_t non_critical_data_size);
+size_t esp_insights_encode_non_critical_data(const esp_diag_data_store_span_t *spans);
 
 /**
  * @brief finish encoding message
@@ -46,3 +45,15 @@ size_t esp_insights_encode_non_critical_data(const void *non_critical_data, size
  * @return size_t size of the data encoded
  */
 size_t esp_insights_encode_data_end(uint8_t *out_data);
+
+/**
+ * @brief compress an encoded message in place
+ *
+ * The message is kept as is if compressing it does not save any bytes.
+ *
+ * @param out_data encoded message, as returned by esp_insights_encode_data_end() or esp_insights_encode_meta()
+ * @param out_data_size size of the buffer holding the message
+ * @param len length of the message
+ * @return size_t length of the message after compression
+ */
+size_t esp_insights_encode_compress(uint8_t *out_data, size_t out_data_size, size_t len);
@@ -0,0 +1,92 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/* Host driver for test_compress.py, builds an insights message from a payload the way
+ * esp_insights_encode_compress() does: the payload is moved to the end of a buffer which is
+ * exactly as large as in-place compression needs, and compressed towards its start.
+ *
+ * Usage: compress_host [--force] <data type> <payload file> <message file>
+ * --force compresses even if the payload does not shrink, to check the slack of incompressible data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "esp_insights_compress.h"
+
+#define TLV_OFFSET                      3
+#define INSIGHTS_CONTENT_ENCODING_LZSS  0x80
+#define COMPRESSED_OFFSET               (TLV_OFFSET + sizeof(uint16_t))
+#define PAYLOAD_MAX_SIZE                UINT16_MAX
+
+static size_t file_read(const char *path, uint8_t *buf, size_t size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return SIZE_MAX;
+    }
+    size_t len = fread(buf, 1, size, f);
+    fclose(f);
+    return len;
+}
+
+/* Same layout as esp_insights_encode_compress(), returns the message length */
+static size_t message_encode(uint8_t *out_data, size_t out_data_size, uint8_t data_type,
+                             const uint8_t *payload, uint16_t payload_len, bool force)
+{
+    out_data[0] = data_type;
+    memcpy(&out_data[1], &payload_len, sizeof(payload_len));
+    size_t compressed_len = esp_insights_compress(payload, payload_len, NULL, 0);
+    if (!force && compressed_len + sizeof(uint16_t) >= payload_len) {
+        memcpy(out_data + TLV_OFFSET, payload, payload_len);
+        return TLV_OFFSET + payload_len;
+    }
+    uint8_t *in = out_data + out_data_size - payload_len;
+    memcpy(in, payload, payload_len);
+    size_t len = esp_insights_compress(in, payload_len, out_data + COMPRESSED_OFFSET,
+                                       out_data_size - COMPRESSED_OFFSET);
+    if (len != compressed_len) {
+        fprintf(stderr, "compressed %zu bytes in place, dry run said %zu\n", len, compressed_len);
+        return 0;
+    }
+    uint16_t encoded_len = compressed_len + sizeof(uint16_t);
+    out_data[0] |= INSIGHTS_CONTENT_ENCODING_LZSS;
+    memcpy(&out_data[1], &encoded_len, sizeof(encoded_len));
+    memcpy(&out_data[TLV_OFFSET], &payload_len, sizeof(payload_len));
+    return COMPRESSED_OFFSET + compressed_len;
+}
+
+int main(int argc, char **argv)
+{
+    bool force = argc > 1 && strcmp(argv[1], "--force") == 0;
+    if (argc != 4 + force) {
+        fprintf(stderr, "usage: %s [--force] <data type> <payload file> <message file>\n", argv[0]);
+        return 2;
+    }
+    argv += force;
+    static uint8_t payload[PAYLOAD_MAX_SIZE + 1];
+    size_t payload_len = file_read(argv[2], payload, sizeof(payload));
+    if (payload_len > PAYLOAD_MAX_SIZE) {
+        fprintf(stderr, "cannot read %s or it is longer than %d bytes\n", argv[2], PAYLOAD_MAX_SIZE);
+        return 1;
+    }
+    /* No more than in-place compression needs, the output must not overrun the input still to be read */
+    size_t out_data_size = COMPRESSED_OFFSET + esp_insights_compress_slack(payload_len) + payload_len;
+    uint8_t *out_data = malloc(out_data_size);
+    if (!out_data) {
+        return 1;
+    }
+    size_t len = message_encode(out_data, out_data_size, strtoul(argv[1], NULL, 0), payload, payload_len, force);
+    FILE *f = len ? fopen(argv[3], "wb") : NULL;
+    if (!f || fwrite(out_data, 1, len, f) != len) {
+        fprintf(stderr, "cannot write %s\n", argv[3]);
+        return 1;
+    }
+    fclose(f);
+    free(out_data);
+    return 0;
+}
@@ -0,0 +1,111 @@
+# Host test of the insights message compression: payloads are compressed by esp_insights_compress.c
+# through compress_host.c, and scripts/insights_decompress.py must give them back byte for byte.
+#
+# Usage: python3 test_compress.py
+# Needs a host C compiler, CC overrides the default cc.
+
+import os
+import sys
+import random
+import shutil
+import struct
+import tempfile
+import unittest
+import subprocess
+
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+COMPONENT_DIR = os.path.dirname(TEST_DIR)
+sys.path.insert(0, os.path.join(COMPONENT_DIR, 'scripts'))
+
+import insights_decompress  # noqa: E402
+
+DATA_TYPE = 0x02
+WINDOW_SIZE = 1 << insights_decompress.WINDOW_BITS
+
+
+def cbor_like_payload(records):
+    """Log records as the encoder writes them, the same keys and tags over and over"""
+    out = bytearray()
+    for i in range(records):
+        out += b'\xa5\x64type\x01\x63tag\x68wifi_sta\x63pc\x1a' + struct.pack('>I', 0x42000000 + i * 52)
+        out += b'\x64task\x64main\x63msg\x78\x1cwifi disconnected, reason:%d\x64args\x81' + bytes([i & 0x17])
+    return bytes(out)
+
+
+class TestCompressRoundTrip(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.tmp = tempfile.mkdtemp()
+        cls.tool = os.path.join(cls.tmp, 'compress_host')
+        cc = os.environ.get('CC', 'cc')
+        subprocess.check_call([cc, '-O2', '-Wall', '-Werror', '-I', os.path.join(COMPONENT_DIR, 'src'),
+                               os.path.join(TEST_DIR, 'compress_host.c'),
+                               os.path.join(COMPONENT_DIR, 'src', 'esp_insights_compress.c'),
+                               '-o', cls.tool])
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.tmp)
+
+    def encode(self, payload, force=False):
+        payload_file = os.path.join(self.tmp, 'payload')
+        message_file = os.path.join(self.tmp, 'message')
+        with open(payload_file, 'wb') as f:
+            f.write(payload)
+        args = [self.tool] + (['--force'] if force else []) + [str(DATA_TYPE), payload_file, message_file]
+        subprocess.check_call(args)
+        with open(message_file, 'rb') as f:
+            return f.read()
+
+    def round_trip(self, payload, force=False, compressed=True):
+        msg = self.encode(payload, force)
+        self.assertEqual(bool(msg[0] & insights_decompress.CONTENT_ENCODING_LZSS), compressed or force)
+        data_type, decoded = insights_decompress.decode_message(msg)
+        self.assertEqual(data_type, DATA_TYPE)
+        self.assertEqual(decoded, payload)
+        return msg
+
+    def test_cbor_records_shrink(self):
+        for records in (2, 8, 60):
+            payload = cbor_like_payload(records)
+            msg = self.round_trip(payload)
+            self.assertLess(len(msg), len(payload) * 3 // 4)
+
+    def test_repeats_at_the_window_edge(self):
+        block = random.Random(1).randbytes(WINDOW_SIZE)
+        # Repeats exactly one window back, one past the window and runs longer than a match
+        payload = block + block + bytes([0x55]) + block + bytes(40) + b'ab' * 30
+        self.round_trip(payload)
+
+    def test_constant_payloads(self):
+        # Three bytes take a literal and a reference, no shorter than the length field saves
+        self.round_trip(bytes([0xa5]) * 3, compressed=False)
+        for length in (17, 4700):
+            self.round_trip(bytes([0xa5]) * length)
+
+    def test_incompressible_payload_is_sent_as_is(self):
+        payload = random.Random(2).randbytes(1024)
+        msg = self.round_trip(payload, compressed=False)
+        self.assertEqual(msg[3:], payload)
+
+    def test_incompressible_payload_in_place(self):
+        # Random data grows by 1/8, the worst case for the output catching up with the input
+        rng = random.Random(3)
+        for length in (1, 2, 255, 256, 257, 1024, 4700):
+            self.round_trip(rng.randbytes(length), force=True)
+
+    def test_mixed_payloads_in_place(self):
+        rng = random.Random(4)
+        for _ in range(20):
+            payload = bytearray()
+            while len(payload) < 3000:
+                if rng.random() < 0.5:
+                    payload += rng.randbytes(rng.randrange(1, 64))
+                else:
+                    payload += cbor_like_payload(rng.randrange(1, 4))
+            self.round_trip(bytes(payload), force=True)
+
+
+if __name__ == '__main__':
+    unittest.main()
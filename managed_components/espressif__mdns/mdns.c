@@ -24,6 +24,8 @@
 #if CONFIG_MDNS_PREDEF_NETIF_STA || CONFIG_MDNS_PREDEF_NETIF_AP
 #include "esp_wifi.h"
 #endif
+/* Trace points compile to nothing unless CONFIG_EVENT_TRACE_ENABLE is set */
+#include "event_trace.h"
 
 #if ESP_IDF_VERSION <= ESP_IDF_VERSION_VAL(5, 1, 0)
 #define MDNS_ESP_WIFI_ENABLED CONFIG_SOC_WIFI_SUPPORTED
@@ -5217,9 +5219,13 @@ static void _mdns_service_task(void *pvParameters)
                 if (a && a->type == ACTION_TASK_STOP) {
                     break;
                 }
+                /* Action is freed while being executed, keep its type for the trace */
+                uint32_t action_type = a ? a->type : 0;
+                EVENT_TRACE_BEGIN(EVENT_TRACE_ID_MDNS_ACTION, action_type, 0);
                 MDNS_SERVICE_LOCK();
                 _mdns_execute_action(a);
                 MDNS_SERVICE_UNLOCK();
+                EVENT_TRACE_END(EVENT_TRACE_ID_MDNS_ACTION, action_type, 0);
             }
         } else {
             vTaskDelay(500 * portTICK_PERIOD_MS);
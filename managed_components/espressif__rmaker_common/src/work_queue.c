@@ -20,6 +20,9 @@
 
 #include <esp_rmaker_work_queue.h>
 
+/* Trace points compile to nothing unless CONFIG_EVENT_TRACE_ENABLE is set */
+#include <event_trace.h>
+
 #define ESP_RMAKER_TASK_QUEUE_SIZE           8
 #define ESP_RMAKER_TASK_STACK       CONFIG_ESP_RMAKER_WORK_QUEUE_TASK_STACK
 #define ESP_RMAKER_TASK_PRIORITY    CONFIG_ESP_RMAKER_WORK_QUEUE_TASK_PRIORITY
@@ -47,7 +50,9 @@ static void esp_rmaker_handle_work_queue(void)
     /* 2 sec delay to prevent spinning */
     BaseType_t ret = xQueueReceive(work_queue, &work_queue_entry, 2000 / portTICK_PERIOD_MS);
     while (ret == pdTRUE) {
+        EVENT_TRACE_BEGIN(EVENT_TRACE_ID_WORK_QUEUE, work_queue_entry.work_fn, 0);
         work_queue_entry.work_fn(work_queue_entry.priv_data);
+        EVENT_TRACE_END(EVENT_TRACE_ID_WORK_QUEUE, work_queue_entry.work_fn, 0);
         ret = xQueueReceive(work_queue, &work_queue_entry, 0);
     }
 }